@@ -0,0 +1,26 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Seconds on a clock that never goes back */
+static inline double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, seeded with anything but 0. Same seed, same numbers, on
+ * every machine: that's what makes generated trees comparable.
+ */
+static inline uint64_t bench_rand(uint64_t* s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545f4914f6cdd1dULL;
+}
+
+#endif
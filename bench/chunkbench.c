@@ -0,0 +1,86 @@
+/* Times the chunk store's inner loop on one core: content-defined cuts,
+ * SHA-256 of the chunks, and both as store_file() does them
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "fs/chunk.h"
+#include "sha256.h"
+
+static void usage(void);
+
+int main(int argc, char* argv[])
+{
+	unsigned long mb = 256;
+	char* end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+		case 'm':
+			errno = 0;
+			mb = strtoul(optarg, &end, 10);
+			if (errno || *end || mb == 0 || mb > 65536) {
+				usage();
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	/* Random data, so the cuts land around CDC_AVG as in real files */
+	size_t len = (size_t)(mb << 20);
+	unsigned char* buf = malloc(len);
+	if (!buf) {
+		perror("chunkbench");
+		return 1;
+	}
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	for (size_t i = 0; i < len; ++i)
+		buf[i] = (unsigned char)bench_rand(&seed);
+	double bytes = (double)len;
+	unsigned char digest[SHA256_LEN];
+	size_t nchunks = 0;
+
+	double t = bench_now();
+	for (size_t pos = 0; pos < len; ++nchunks)
+		pos += cdc_cut(buf + pos, len - pos);
+	t = bench_now() - t;
+	printf("cdc      %12.0f MB %10.3f s %12.2f GB/s %10zu chunks\n",
+	       bytes / 1e6, t, bytes / t / 1e9, nchunks);
+
+	t = bench_now();
+	for (size_t pos = 0; pos < len; pos += CDC_AVG) {
+		size_t n = len - pos < CDC_AVG ? len - pos : CDC_AVG;
+		sha256(buf + pos, n, digest);
+	}
+	t = bench_now() - t;
+	printf("sha256   %12.0f MB %10.3f s %12.2f GB/s\n", bytes / 1e6, t, bytes / t / 1e9);
+
+	t = bench_now();
+	for (size_t pos = 0, cut; pos < len; pos += cut) {
+		cut = cdc_cut(buf + pos, len - pos);
+		sha256(buf + pos, cut, digest);
+	}
+	t = bench_now() - t;
+	printf("chunk    %12.0f MB %10.3f s %12.2f GB/s\n", bytes / 1e6, t, bytes / t / 1e9);
+
+	free(buf);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: chunkbench [-m MB]\n"
+		"Cuts MB megabytes (default 256) of random data into chunks, hashes\n"
+		"chunks of the average size, then does both as the chunk store does\n");
+}
@@ -0,0 +1,165 @@
+/* Times the traversals and a full copy of a tree, end to end */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "bench.h"
+#include "fs.h"
+#include "hash.h"
+#include "status.h"
+
+/* One listing of the source */
+struct list {
+	struct hash_table* files;
+	struct arena mem;
+	struct dirtree tree;
+};
+
+static status_t list(struct list* l, const char* src, unsigned nthreads, unsigned need,
+		     double* secs);
+static void list_free(struct list* l);
+static status_t copy(const char* src, const char* dst, unsigned nthreads);
+static void usage(void);
+
+int main(int argc, char* argv[])
+{
+	unsigned long nthreads = 4;
+	char* end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			errno = 0;
+			nthreads = strtoul(optarg, &end, 10);
+			if (errno || *end || nthreads == 0 || nthreads > TRAVERSE_MAX_THREADS) {
+				usage();
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage();
+		return 1;
+	}
+
+	const char* src = argv[optind];
+	const char* dst = argv[optind + 1];
+	status_t ret;
+
+	/* Once to warm the caches up, the runs after that are timed. A first
+	 * backup lists the source with what the names tell (traverse), an
+	 * incremental one stats every file for its size and times (incr).
+	 */
+	unsigned counts[] = { 1, 1, (unsigned)nthreads };
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i) {
+		for (int incr = 0; incr < 2; ++incr) {
+			struct list l;
+			double secs;
+			unsigned need = (incr) ? TRAV_NEED_SIZE | TRAV_NEED_TIMES : 0;
+			ret = list(&l, src, counts[i], need, &secs);
+			if (ret.c != ST_OK)
+				goto err;
+			if (i > 0)
+				printf("%-8s -j %-3u %10zu files %10.3f s %12.0f files/s\n",
+				       (incr) ? "incr" : "traverse", counts[i],
+				       l.files->count, secs, (double)l.files->count / secs);
+			list_free(&l);
+		}
+	}
+
+	ret = copy(src, dst, (unsigned)nthreads);
+	if (ret.c != ST_OK)
+		goto err;
+	return 0;
+
+err:
+	sterr(ret);
+	status_free(ret);
+	return 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fsbench [-j N] SOURCE SCRATCH\n");
+}
+
+/* Lists `src' on `nthreads' threads, with the metadata in `need', see
+ * struct travopts.
+ */
+static status_t list(struct list* l, const char* src, unsigned nthreads, unsigned need,
+		     double* secs)
+{
+	struct travopts opts = {
+		.oflags = O_NOFOLLOW,
+		.nthreads = nthreads,
+		.need = need,
+	};
+
+	l->files = hash_create(4099, sizeof(struct kfile), hash, hcmpent);
+	if (!l->files)
+		return STATUS_E(ST_ERR_HASH_CRE, "Creating hash table", NULL);
+	if (dirtree_init(&l->tree) == -1) {
+		hash_destroy(l->files);
+		return STATUS_E(ST_ERR_MALLOC, "Creating directory tree", NULL);
+	}
+	arena_init(&l->mem);
+
+	double t = bench_now();
+	status_t ret = (nthreads > 1) ? ptraverse(src, &l->files, &l->mem, &l->tree, &opts)
+				      : traverse(src, &l->files, &l->mem, &l->tree, &opts);
+	*secs = bench_now() - t;
+	if (ret.c != ST_OK)
+		list_free(l);
+	return ret;
+}
+
+static void list_free(struct list* l)
+{
+	hash_destroy(l->files);
+	arena_free(&l->mem);
+	dirtree_free(&l->tree);
+}
+
+/* Copies `src' into `dst', which should not exist yet, as backup does a
+ * first time: the time covers the listing too, and large files are split
+ * on `nthreads' threads.
+ */
+static status_t copy(const char* src, const char* dst, unsigned nthreads)
+{
+	struct list l;
+	struct copier cp;
+	double secs;
+
+	double t = bench_now();
+	status_t ret = list(&l, src, nthreads, 0, &secs);
+	if (ret.c != ST_OK)
+		return ret;
+
+	ret = copier_init(&cp, &l.tree, src, dst, O_NOFOLLOW);
+	if (ret.c != ST_OK)
+		goto out_free;
+	cp.nsplit = nthreads;
+	ret = copy_tree(&cp, l.files);
+	secs = bench_now() - t;
+	if (ret.c == ST_OK)
+		printf("copy     -j %-3u %10" PRIuMAX " files %10.3f s %12.0f files/s"
+		       " %10.1f MB/s\n", nthreads, cp.stats.nfiles, secs,
+		       (double)cp.stats.nfiles / secs,
+		       (double)cp.stats.nbytes / 1e6 / secs);
+	copier_free(&cp);
+
+out_free:
+	list_free(&l);
+	return ret;
+}
@@ -0,0 +1,197 @@
+/* Generates a reproducible synthetic tree to benchmark against */
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/* Earlier files hard links may point at */
+#define RING 64
+
+struct shape {
+	unsigned fanout;	/* subdirectories per directory */
+	unsigned depth;		/* levels of subdirectories below the root */
+	unsigned nfiles;	/* entries per directory */
+	unsigned sizebits;	/* files are below 2^sizebits bytes */
+	unsigned links;		/* % of entries that are hard links */
+	unsigned symlinks;	/* % of entries that are symbolic links */
+};
+
+struct gen {
+	struct shape sh;
+	uint64_t seed;
+	uint64_t buf[8192];
+	char ring[RING][PATH_MAX];
+	unsigned nring;
+	uintmax_t ndirs, nfiles, nbytes, nlinks, nsymlinks;
+};
+
+static int gen_dir(struct gen* g, char* path, size_t len, unsigned depth);
+static int gen_file(struct gen* g, const char* path);
+static int parse(const char* s, unsigned max, unsigned* out);
+static void usage(void);
+
+int main(int argc, char* argv[])
+{
+	static struct gen g;
+	unsigned seed = 1, sizebits = 20;
+	int opt;
+
+	g.sh = (struct shape){ .fanout = 4, .depth = 3, .nfiles = 32,
+			       .links = 5, .symlinks = 2 };
+	while ((opt = getopt(argc, argv, "d:f:l:n:s:y:z:")) != -1) {
+		int r;
+		switch (opt) {
+		case 'd': r = parse(optarg, 16, &g.sh.depth); break;
+		case 'f': r = parse(optarg, 1024, &g.sh.fanout); break;
+		case 'l': r = parse(optarg, 100, &g.sh.links); break;
+		case 'n': r = parse(optarg, 1 << 20, &g.sh.nfiles); break;
+		case 's': r = parse(optarg, UINT_MAX, &seed); break;
+		case 'y': r = parse(optarg, 100, &g.sh.symlinks); break;
+		case 'z': r = parse(optarg, 40, &sizebits); break;
+		default: r = -1; break;
+		}
+		if (r == -1) {
+			usage();
+			return 1;
+		}
+	}
+	if (argc - optind != 1 || g.sh.links + g.sh.symlinks > 100) {
+		usage();
+		return 1;
+	}
+	g.sh.sizebits = sizebits;
+	g.seed = 0x9e3779b97f4a7c15ULL * ((uint64_t)seed + 1);
+
+	char path[PATH_MAX];
+	size_t len = strlen(argv[optind]);
+	if (len >= sizeof(path) - 1) {
+		fprintf(stderr, "gentree: path too long\n");
+		return 1;
+	}
+	memcpy(path, argv[optind], len + 1);
+
+	if (gen_dir(&g, path, len, 0) == -1) {
+		perror(path);
+		return 1;
+	}
+	printf("gentree: %" PRIuMAX " directories, %" PRIuMAX " files (%" PRIuMAX
+	       " bytes), %" PRIuMAX " hard links, %" PRIuMAX " symbolic links\n",
+	       g.ndirs, g.nfiles, g.nbytes, g.nlinks, g.nsymlinks);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: gentree [-s SEED] [-f FANOUT] [-d DEPTH] [-n FILES]\n"
+		"               [-z SIZEBITS] [-l LINK%%] [-y SYMLINK%%] DIRECTORY\n");
+}
+
+static int parse(const char* s, unsigned max, unsigned* out)
+{
+	char* end;
+	errno = 0;
+	unsigned long n = strtoul(s, &end, 10);
+	if (errno || *end || end == s || n > max)
+		return -1;
+	*out = (unsigned)n;
+	return 0;
+}
+
+/* Creates the directory `path' (of length `len', in a PATH_MAX buffer),
+ * its entries, and its subdirectories down to the configured depth.
+ * On failure, `path' names what couldn't be created.
+ */
+static int gen_dir(struct gen* g, char* path, size_t len, unsigned depth)
+{
+	if (mkdir(path, 0755) == -1 && errno != EEXIST)
+		return -1;
+	g->ndirs++;
+
+	for (unsigned i = 0; i < g->sh.nfiles; ++i) {
+		int n = snprintf(path + len, PATH_MAX - len, "/f%u", i);
+		if (n >= (int)(PATH_MAX - len)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		unsigned roll = (unsigned)(bench_rand(&g->seed) % 100);
+		if (roll < g->sh.links && g->nring) {
+			const char* to = g->ring[bench_rand(&g->seed) % g->nring];
+			if (link(to, path) == -1 && errno != EEXIST)
+				return -1;
+			g->nlinks++;
+		} else if (roll < g->sh.links + g->sh.symlinks) {
+			/* To the previous entry, or dangling, trees have those too */
+			char to[16] = "nowhere";
+			if (i > 0) snprintf(to, sizeof(to), "f%u", i - 1);
+			if (symlink(to, path) == -1 && errno != EEXIST)
+				return -1;
+			g->nsymlinks++;
+		} else {
+			if (gen_file(g, path) == -1)
+				return -1;
+			/* Once full, replace a random one */
+			size_t slot = (g->nring < RING) ? g->nring++
+							: bench_rand(&g->seed) % RING;
+			memcpy(g->ring[slot], path, len + (size_t)n + 1);
+		}
+	}
+
+	if (depth < g->sh.depth) {
+		for (unsigned i = 0; i < g->sh.fanout; ++i) {
+			int n = snprintf(path + len, PATH_MAX - len, "/d%u", i);
+			if (n >= (int)(PATH_MAX - len)) {
+				errno = ENAMETOOLONG;
+				return -1;
+			}
+			if (gen_dir(g, path, len + (size_t)n, depth + 1) == -1)
+				return -1;
+		}
+	}
+	path[len] = '\0';
+	return 0;
+}
+
+/* Sizes are roughly log-uniform: most files are small, and most bytes
+ * are in a few large ones, like in real trees.
+ */
+static int gen_file(struct gen* g, const char* path)
+{
+	unsigned bits = (unsigned)(bench_rand(&g->seed) % (g->sh.sizebits + 1));
+	uint64_t size = (bits) ? bench_rand(&g->seed) % ((uint64_t)1 << bits) : 0;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+
+	uint64_t left = size;
+	while (left > 0) {
+		size_t n = (left > sizeof(g->buf)) ? sizeof(g->buf) : (size_t)left;
+		for (size_t i = 0; i < (n + 7) / 8; ++i)
+			g->buf[i] = bench_rand(&g->seed);
+		ssize_t w = write(fd, g->buf, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return -1;
+		}
+		left -= (uint64_t)w;
+	}
+	if (close(fd) == -1)
+		return -1;
+
+	g->nfiles++;
+	g->nbytes += size;
+	return 0;
+}
@@ -0,0 +1,142 @@
+/* Times the hash table with the keys and functions the traversal uses */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "fs.h"
+#include "hash.h"
+
+/* What one table size measured */
+struct result {
+	double insert;		/* ns per insert, growing from empty */
+	double hit;		/* ns per lookup of a present key */
+	double miss;		/* ns per lookup of an absent key */
+	double rehash;		/* ms to rehash everything into twice the slots */
+};
+
+static int run(size_t n, struct kfile* keys, struct result* r);
+static void usage(void);
+
+int main(int argc, char* argv[])
+{
+	unsigned long maxexp = 7;
+	char* end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+		case 'm':
+			errno = 0;
+			maxexp = strtoul(optarg, &end, 10);
+			if (errno || *end || maxexp < 3 || maxexp > 9) {
+				usage();
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	size_t max = 1;
+	for (unsigned long i = 0; i < maxexp; ++i)
+		max *= 10;
+
+	/* Inode numbers mostly come in runs, like these */
+	struct kfile* keys = malloc(max * sizeof(struct kfile));
+	if (!keys) {
+		perror("hashbench");
+		return 1;
+	}
+	for (size_t i = 0; i < max; ++i) {
+		keys[i].st_dev = 2049;
+		keys[i].st_ino = i + 2;
+	}
+
+	printf("%12s %12s %12s %12s %12s\n", "entries", "insert ns", "hit ns",
+	       "miss ns", "rehash ms");
+	for (size_t n = 1000; n <= max; n *= 10) {
+		struct result r;
+		if (run(n, keys, &r) == -1) {
+			perror("hashbench");
+			free(keys);
+			return 1;
+		}
+		printf("%12zu %12.1f %12.1f %12.1f %12.2f\n", n, r.insert, r.hit,
+		       r.miss, r.rehash);
+		fflush(stdout);
+	}
+
+	free(keys);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: hashbench [-m MAXEXP]\n"
+		"Runs 10^3 up to 10^MAXEXP entries (default 7, at most 9)\n");
+}
+
+/* Small tables are run several times over, so every size takes long
+ * enough to be timed.
+ */
+static int run(size_t n, struct kfile* keys, struct result* r)
+{
+	size_t reps = (n < 1000000) ? 1000000 / n : 1;
+	void* volatile sink;
+	double t;
+
+	*r = (struct result){ 0 };
+	for (size_t rep = 0; rep < reps; ++rep) {
+		struct hash_table* ht = hash_create(16, sizeof(struct kfile), hash, hcmpent);
+		if (!ht)
+			return -1;
+
+		/* Like index_entry() does it */
+		t = bench_now();
+		for (size_t i = 0; i < n; ++i) {
+			errno = 0;
+			ht = hash_upsize(ht);
+			if (errno != 0 || hash_insert(ht, &keys[i], &keys[i]) < 0) {
+				hash_destroy(ht);
+				return -1;
+			}
+		}
+		r->insert += bench_now() - t;
+
+		t = bench_now();
+		for (size_t i = 0; i < n; ++i)
+			sink = hash_lookup(ht, &keys[i]);
+		r->hit += bench_now() - t;
+
+		struct kfile absent = { .st_dev = 2050 };
+		t = bench_now();
+		for (size_t i = 0; i < n; ++i) {
+			absent.st_ino = i + 2;
+			sink = hash_lookup(ht, &absent);
+		}
+		r->miss += bench_now() - t;
+
+		t = bench_now();
+		if (!hash_rehash(ht, ht->cur.size * 2)) {
+			hash_destroy(ht);
+			return -1;
+		}
+		r->rehash += bench_now() - t;
+
+		hash_destroy(ht);
+	}
+	(void)sink;
+
+	double ops = (double)n * (double)reps;
+	r->insert = r->insert * 1e9 / ops;
+	r->hit = r->hit * 1e9 / ops;
+	r->miss = r->miss * 1e9 / ops;
+	r->rehash = r->rehash * 1e3 / (double)reps;
+	return 0;
+}
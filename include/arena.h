@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>		/* size_t */
+
+/* Size of the chunks an arena carves allocations out of */
+#ifndef ARENA_CHUNK
+#define ARENA_CHUNK (1 << 20)
+#endif
+
+struct arena_chunk;
+
+/* A bump allocator: allocations are never freed one by one, the whole
+ * arena is released at once. Not thread safe, give every thread its own
+ * arena and merge them when they're done.
+ */
+struct arena {
+	struct arena_chunk* head;	/* chunk being carved, newest first */
+	char* pos;			/* next free byte in `head' */
+	char* end;			/* end of `head' */
+	size_t nchunks;
+};
+
+/* Where an arena was at, to undo the allocations made since */
+struct arena_mark {
+	struct arena_chunk* head;
+	char* pos;
+};
+
+void arena_init(struct arena* a);
+void* arena_alloc(struct arena* a, size_t size);
+char* arena_strdup(struct arena* a, const char* s);
+struct arena_mark arena_save(const struct arena* a);
+void arena_restore(struct arena* a, struct arena_mark m);
+void arena_merge(struct arena* dst, struct arena* src);
+void arena_free(struct arena* a);
+
+#endif
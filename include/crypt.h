@@ -0,0 +1,26 @@
+#ifndef CRYPT_H
+#define CRYPT_H
+
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint32_t, uint64_t */
+
+#define CRYPT_KEYLEN	32	/* bytes of a key */
+#define CRYPT_NONCELEN	12
+#define CRYPT_TAGLEN	16
+#define CRYPT_SALTLEN	16	/* see crypt_subkey() */
+
+void chacha20(const unsigned char key[CRYPT_KEYLEN],
+	      const unsigned char nonce[CRYPT_NONCELEN], uint32_t counter,
+	      const void* in, void* out, size_t len);
+void crypt_subkey(const unsigned char key[CRYPT_KEYLEN],
+		  const unsigned char salt[CRYPT_SALTLEN],
+		  unsigned char out[CRYPT_KEYLEN]);
+void crypt_seal(const unsigned char key[CRYPT_KEYLEN],
+		const unsigned char nonce[CRYPT_NONCELEN], void* buf, size_t len,
+		const void* ad, size_t adlen, unsigned char tag[CRYPT_TAGLEN]);
+int crypt_open(const unsigned char key[CRYPT_KEYLEN],
+	       const unsigned char nonce[CRYPT_NONCELEN], void* buf, size_t len,
+	       const void* ad, size_t adlen, const unsigned char tag[CRYPT_TAGLEN]);
+void crypt_wipe(void* buf, size_t len);
+
+#endif
@@ -1,16 +1,13 @@
 #ifndef FILE_H
 #define FILE_H
 
-#include <sys/stat.h>
-
-struct key {
-	st_dev st_dev;
-	st_ino st_ino;
-};
-
+/* A file known by the directory it's in, open, and its name there: what
+ * the *at() system calls take. The kernel only looks the name up, and
+ * the directory stays the same one even if it's renamed meanwhile.
+ */
 typedef struct {
 	int pfd; 		/* Parent fd */
-	char* name;		/* relative to pfd */
+	const char* name;	/* relative to pfd */
 } file_t;
 
 #endif
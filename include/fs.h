@@ -9,9 +9,22 @@
 #endif
 #ifndef FS__NOT_WANT_TRAVERSE
 #include "fs/traverse.h"
+#include "fs/deque.h"
 #endif
 #ifndef FS__NOT_WANT_HASH
 #include "fs/fs_hash.h"
+#include "fs/dirtree.h"
+#include "fs/fidx.h"
+#endif
+#ifndef FS__NOT_WANT_COPY
+#include "fs/dirfds.h"
+#include "fs/copy.h"
+#include "fs/sched.h"
+#include "fs/ucopy.h"
+#include "fs/chunk.h"
+#include "fs/stream.h"
+#include "fs/archive.h"
+#include "fs/verify.h"
 #endif
 
 
@@ -0,0 +1,197 @@
+#ifndef FS_ARCHIVE_H
+#define FS_ARCHIVE_H
+
+#include <sys/types.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crypt.h"
+#include "hash.h"
+#include "status.h"
+#include "fs/dirfds.h"
+#include "fs/dirtree.h"
+#include "fs/fs_hash.h"
+#include "fs/zpipe.h"
+
+/* Size of the buffer member data goes through on its way to the archive */
+#ifndef ARCH_BUFSZ
+#define ARCH_BUFSZ (1 << 20)
+#endif
+
+/* Compressed or encrypted archives cut member data into blocks of this
+ * size, each handled on its own
+ */
+#ifndef ARCH_BLOCK
+#define ARCH_BLOCK (256 * 1024)
+#endif
+
+#define ARCH_MAGIC	"BKPARC\0"	/* 8 bytes, with the NUL */
+#define ARCH_VERSION	4
+#define ARCH_ORDER	0x01020304	/* tells the byte order it was written in */
+#define ARCH_EMPTY	UINT32_MAX	/* free slot of the hash directory */
+
+#define ARCH_LZ		0x1		/* member data is compressed, see lz.h */
+#define ARCH_CRYPT	0x2		/* and encrypted, see crypt.h */
+#define ARCH_BLOCKED	(ARCH_LZ | ARCH_CRYPT)	/* cut into blocks */
+
+/* An archive holds a whole tree in one file, written front to back: the
+ * data of every member, one after the other, then an index to find them,
+ * and a fixed-size tail that says where the index is. Like the file
+ * index, see fs/fidx.h, the index is used straight from mmap, so every
+ * part of it is fixed-size, aligned, and in the byte order of the
+ * machine that wrote it:
+ *
+ *	struct arch_hdr
+ *	member data		regular files' contents, symbolic links'
+ *				targets, back to back
+ *	uint64_t		nblocks + 1, 8-byte aligned: where each block
+ *				starts, then where the last one ends, for
+ *				ARCH_BLOCKED archives only
+ *	struct arch_rec		nrec of them, 8-byte aligned
+ *	uint32_t		nslots: the hash directory, record numbers
+ *				by path hash, linear probing
+ *	char			strlen bytes of NUL-terminated paths
+ *	struct arch_tail	at the very end, 8-byte aligned
+ *
+ * Every name of a file with several hard links has a record, all of
+ * them pointing to the same data.
+ *
+ * With ARCH_BLOCKED, member data is cut into blocks of hdr.blocksz
+ * bytes, each stored as a struct arch_block followed by its clen bytes.
+ * Its sum is checked once it's read back, so a damaged block shows even
+ * without ARCH_CRYPT.
+ * Records still give offsets in the archive as it would be uncompressed,
+ * so block (off - sizeof(struct arch_hdr)) / blocksz holds `off'.
+ *
+ * With ARCH_CRYPT, each block's clen bytes are encrypted, and followed by
+ * a CRYPT_TAGLEN bytes tag, see fs/zpipe.h for the nonce. The key is
+ * crypt_subkey() of the one given and hdr.salt, and hdr.check is the
+ * start of its keystream for an all-ones nonce, to tell a wrong key from
+ * a damaged block. The index is encrypted too: everything from blkoff up
+ * to the tail is sealed as one, with a nonce of 4 0xff bytes then zeros,
+ * which no block has, and the tail as associated data, its tag zeroed.
+ * Only the tail is left in clear, and any change to it or the index shows.
+ */
+struct arch_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint32_t flags;		/* ARCH_* */
+	uint32_t blocksz;	/* with ARCH_BLOCKED */
+	unsigned char salt[CRYPT_SALTLEN];	/* with ARCH_CRYPT */
+	unsigned char check[16];
+};
+
+struct arch_block {
+	uint32_t ulen;		/* its size uncompressed */
+	uint32_t clen;		/* stored as is if equal to ulen */
+	uint64_t sum;		/* xxh3() of its ulen bytes, see xxh3.h */
+};
+
+struct arch_rec {
+	uint64_t off;		/* of the data, from the start of the archive */
+	uint64_t size;		/* of the data */
+	int64_t mtime;		/* in ns */
+	uint64_t path;		/* offset in the path strings */
+	uint32_t mode;
+	uint32_t hash;		/* of the path, see archive_hash() */
+};
+
+struct arch_tail {
+	uint64_t nrec;
+	uint64_t nslots;	/* a power of two, more than nrec */
+	uint64_t recoff;	/* offsets from the start of the archive */
+	uint64_t slotoff;
+	uint64_t stroff;
+	uint64_t strlen;
+	uint64_t blkoff;	/* with ARCH_BLOCKED */
+	uint64_t nblocks;
+	unsigned char tag[CRYPT_TAGLEN];	/* of the index, with ARCH_CRYPT */
+	char magic[8];		/* last, so a truncated archive shows */
+};
+
+struct archive_stats {
+	uintmax_t nfiles;	/* regular files archived */
+	uintmax_t ndirs;	/* directories */
+	uintmax_t nsymlinks;	/* symbolic links */
+	uintmax_t nlinks;	/* extra hard links */
+	uintmax_t nbytes;	/* bytes of member data */
+	uintmax_t nzbytes;	/* what they took once compressed */
+};
+
+/* Writes an archive, see archive_init() */
+struct archiver {
+	const struct dirtree* tree;	/* directories of the files archived */
+	int srcfd;		/* source root */
+	int oflags;		/* flags given to open */
+	struct dirfds dirs;	/* source directories, see fs/dirfds.h */
+	int fd;			/* the archive, under a temporary name */
+	char* dst;		/* the archive's name */
+	char* tmp;		/* its name until it's complete */
+	char* buf;		/* data not written yet */
+	size_t len;
+	size_t bufsz;
+	uint64_t off;		/* archive size so far, buf included, as
+				 * if uncompressed */
+	uint64_t pos;		/* what was actually written */
+
+	/* Compression and encryption, see ARCH_BLOCKED */
+	int zip;		/* member data still goes through `z' */
+	int crypt;		/* ARCH_CRYPT */
+	int sealing;		/* buf holds the index, until it's sealed */
+	unsigned char key[CRYPT_KEYLEN];	/* with ARCH_CRYPT */
+	struct zpipe z;
+	uint64_t* blocks;	/* where each block starts */
+	size_t nblocks;
+	size_t blkcap;
+
+	/* Records so far, and the entries they're for: their paths are
+	 * only written at the end, rebuilt from `tree'.
+	 */
+	struct arch_rec* recs;
+	const struct file** who;
+	size_t nrec;
+	size_t cap;
+	uint64_t strlen;
+
+	struct archive_stats stats;
+	char* path;		/* of the entry being archived, for its record */
+	size_t pathcap;		/* grown to fit, see entry_path() */
+};
+
+/* An archive opened read-only */
+struct archive {
+	void* map;
+	size_t len;
+	const struct arch_hdr* hdr;
+	const struct arch_tail* tail;
+	const struct arch_rec* recs;
+	const uint32_t* slots;
+	const char* strs;
+	const uint64_t* blocks;
+
+	unsigned char key[CRYPT_KEYLEN];	/* with ARCH_CRYPT */
+	char* index;		/* decrypted, from tail->blkoff on */
+
+	/* The last block read */
+	char* block;
+	char* clear;		/* decrypted, but still compressed */
+	size_t blklen;
+	uint64_t cached;	/* its number, UINT64_MAX for none */
+};
+
+status_t archive_init(struct archiver* ar, const struct dirtree* tree,
+		      const char* src, const char* dst, int oflags,
+		      unsigned zthreads, int zflags, const unsigned char* key);
+void archive_free(struct archiver* ar);
+status_t archive_tree(struct archiver* ar, struct hash_table* files);
+
+status_t archive_open(struct archive* a, const char* path, const unsigned char* key);
+void archive_close(struct archive* a);
+const struct arch_rec* archive_find(const struct archive* a, const char* path);
+ssize_t archive_read(struct archive* a, const struct arch_rec* r, uint64_t pos,
+		     char* buf, size_t len);
+uint32_t archive_hash(const char* path);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef FS_CHUNK_H
+#define FS_CHUNK_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "hash.h"
+#include "sha256.h"
+#include "status.h"
+#include "fs/dirfds.h"
+#include "fs/dirtree.h"
+#include "fs/fs_hash.h"
+
+/* Chunk sizes: content-defined cut points are only looked for between
+ * CDC_MIN and CDC_MAX, and land around CDC_AVG on average.
+ */
+#ifndef CDC_MIN
+#define CDC_MIN (2 * 1024)
+#endif
+#ifndef CDC_AVG
+#define CDC_AVG (8 * 1024)
+#endif
+#ifndef CDC_MAX
+#define CDC_MAX (64 * 1024)
+#endif
+
+/* Size of the buffer files are chunked from, several chunks at a time */
+#ifndef STORE_BUFSZ
+#define STORE_BUFSZ (1 << 20)
+#endif
+
+/* Under the store root: chunks/ holds them, and manifests/ has a list of
+ * the files for every run, named after when it ended (in UTC).
+ */
+#define STORE_CHUNKS	"chunks"
+#define STORE_MANIFESTS	"manifests"
+
+/* One chunk of a file, by the SHA-256 of its contents */
+struct chunkref {
+	unsigned char digest[SHA256_LEN];
+	uint32_t len;
+};
+
+/* What a file was cut into, in order */
+struct chunklist {
+	size_t n;
+	struct chunkref refs[];
+};
+
+struct store_stats {
+	uintmax_t nfiles;	/* regular files chunked */
+	uintmax_t nbytes;	/* bytes read from them */
+	uintmax_t nchunks;	/* chunks cut */
+	uintmax_t nstored;	/* new chunks written */
+	uintmax_t nstbytes;	/* bytes of new chunks written */
+};
+
+/* A content-addressed chunk store: chunks/ab/cdef... holds the chunk
+ * whose SHA-256 is abcdef..., so each one is stored once, however many
+ * files or runs it shows up in.
+ */
+struct chunkstore {
+	const struct dirtree* tree;	/* directories of the files stored */
+	struct arena* mem;		/* chunk lists and digests */
+	int srcfd;			/* source root */
+	int rootfd;			/* store root */
+	int chunkfd;			/* its chunks/ directory */
+	int oflags;			/* flags given to open */
+	struct dirfds dirs;		/* source directories, see fs/dirfds.h */
+	struct hash_table* seen;	/* digests known to be stored */
+	unsigned char* buf;		/* STORE_BUFSZ bytes */
+	struct chunkref* refs;		/* chunks of the file being stored */
+	size_t nrefs, caprefs;
+	struct store_stats stats;
+	char manifest[64];		/* of this run, under the store root */
+};
+
+size_t cdc_cut(const unsigned char* p, size_t n);
+status_t store_init(struct chunkstore* cs, const struct dirtree* tree, struct arena* mem,
+		    const char* src, const char* dst, int oflags);
+void store_free(struct chunkstore* cs);
+status_t store_file(struct chunkstore* cs, struct file* f);
+status_t store_tree(struct chunkstore* cs, struct hash_table* files);
+status_t store_extract(const char* manifest, const char* member, FILE* out);
+
+#endif
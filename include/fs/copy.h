@@ -0,0 +1,82 @@
+#ifndef FS_COPY_H
+#define FS_COPY_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "status.h"
+#include "fs/dirfds.h"
+#include "fs/dirtree.h"
+#include "fs/fidx.h"
+#include "fs/fs_hash.h"
+#include "fs/journal.h"
+
+/* Size of the buffer used by the read/write fallback */
+#ifndef COPY_BUFSZ
+#define COPY_BUFSZ (1 << 20)
+#endif
+
+/* Largest request handed to copy_file_range/sendfile at once */
+#ifndef COPY_CHUNK
+#define COPY_CHUNK (1 << 30)
+#endif
+
+/* Smallest file copy_split() cuts into ranges, and their size: a
+ * multiple of any block size
+ */
+#ifndef COPY_SPLIT_MIN
+#define COPY_SPLIT_MIN ((off_t)128 << 20)
+#endif
+#ifndef COPY_RANGE
+#define COPY_RANGE ((off_t)16 << 20)
+#endif
+
+/* Smallest file worth looking for holes in */
+#ifndef COPY_SPARSE_MIN
+#define COPY_SPARSE_MIN (64 * 1024)
+#endif
+
+struct copy_stats {
+	uintmax_t nfiles;	/* regular files copied */
+	uintmax_t ndirs;	/* directories created */
+	uintmax_t nsymlinks;	/* symbolic links recreated */
+	uintmax_t nlinks;	/* extra hard links recreated */
+	uintmax_t nbytes;	/* bytes of file data moved */
+	uintmax_t nholes;	/* bytes of holes skipped in sparse files */
+	uintmax_t nunchanged;	/* skipped, unchanged since the last run */
+	uintmax_t nresumed;	/* skipped, copied by the interrupted run */
+};
+
+struct copier {
+	const struct dirtree* tree;	/* directories of the files copied */
+	const struct fidx* prev;	/* what the last run copied, or NULL */
+	struct journal* journal;	/* what this run copied, or NULL */
+	int srcfd;		/* source root */
+	int dstfd;		/* destination root */
+	struct dirfds dirs;	/* directories open below them */
+	int oflags;		/* flags given to open */
+	int no_cfr;		/* copy_file_range is unavailable */
+	int no_sendfile;	/* sendfile is unavailable */
+	int disk_order;		/* copy_tree() reads in disk order, see fs/sched.h */
+	unsigned nsplit;	/* threads copying a large file, see copy_split() */
+	unsigned* spare;	/* extra ones copiers share, or NULL for no cap */
+	int uring;		/* copy_tree() batches small files, see fs/ucopy.h */
+	char* buf;		/* read/write fallback buffer, lazily allocated */
+	struct copy_stats stats;
+	char path[PATH_MAX];	/* of the entry scheduled, see fs/sched.h */
+};
+
+status_t copier_init(struct copier* cp, const struct dirtree* tree,
+		     const char* src, const char* dst, int oflags);
+void copier_free(struct copier* cp);
+status_t copy_data(struct copier* cp, int in, int out, off_t size);
+status_t copy_range(struct copier* cp, int in, int out, off_t len);
+status_t copy_split(struct copier* cp, int in, int out, off_t size);
+status_t copy_entry(struct copier* cp, const struct kfile* k, struct file* f);
+int copy_skip(struct copier* cp, const struct kfile* k, const struct file* f);
+status_t copy_tree(struct copier* cp, struct hash_table* files);
+status_t copy_tree_links(struct copier* cp, struct hash_table* files);
+status_t copy_tree_modes(struct copier* cp, struct hash_table* files);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef FS_DENTS_H
+#define FS_DENTS_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the buffer directory entries are read into */
+#ifndef DENTS_BUFSZ
+#define DENTS_BUFSZ (64 * 1024)
+#endif
+
+/* What dent_stat() must fill in. The file type, st_dev and st_ino are
+ * always there.
+ */
+#define DENT_NEED_MODE	0x1	/* permission bits */
+#define DENT_NEED_SIZE	0x2	/* st_size */
+#define DENT_NEED_TIMES	0x4	/* st_mtim and st_ctim */
+#define DENT_NEED_NLINK	0x8	/* st_nlink */
+
+/* One directory entry, valid until the next dents_next() call */
+struct dent {
+	const char* name;
+	uintmax_t ino;		/* inode number */
+	mode_t type;		/* S_IFMT bits, 0 if the filesystem didn't say */
+};
+
+/* A directory reader. On Linux it calls getdents64 straight into `buf',
+ * elsewhere it falls back to readdir.
+ */
+struct dents {
+	int fd;			/* the directory, -1 if none attached */
+	char* buf;
+	size_t bufsz;
+	size_t pos;		/* next entry in buf */
+	size_t len;		/* bytes of entries in buf */
+	off_t off;		/* where reading goes on, while parked */
+#ifndef __linux__
+	DIR* dir;
+#endif
+};
+
+int dents_init(struct dents* ds, size_t bufsz);
+int dents_open(struct dents* ds, int fd);
+int dents_next(struct dents* ds, struct dent* e);
+void dents_close(struct dents* ds);
+int dents_park(struct dents* ds);
+int dents_resume(struct dents* ds, int fd);
+void dents_free(struct dents* ds);
+int dent_stat(int dfd, const char* name, int flags, unsigned need, struct stat* sb);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef FS_DEQUE_H
+#define FS_DEQUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef DEQUE_INITSZ
+#define DEQUE_INITSZ 64
+#endif
+
+/* A double-ended queue of directories waiting to be searched, by their
+ * dirtree node.
+ * The owning worker pushes and pops at the bottom (depth-first, the
+ * directory it just found is likely still cached), idle workers steal
+ * from the top, where the oldest and usually biggest subtrees are.
+ */
+struct deque {
+	pthread_mutex_t lock;
+	uint32_t* items;	/* ring buffer of directory nodes */
+	size_t cap;		/* always a power of two */
+	size_t top;		/* index of the oldest item */
+	size_t n;		/* this many items */
+};
+
+int deque_init(struct deque* q);
+void deque_destroy(struct deque* q);
+int deque_push(struct deque* q, uint32_t node);
+uint32_t deque_pop(struct deque* q);
+uint32_t deque_steal(struct deque* q);
+
+#endif
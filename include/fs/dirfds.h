@@ -0,0 +1,56 @@
+#ifndef FS_DIRFDS_H
+#define FS_DIRFDS_H
+
+#include <stdint.h>
+
+#include "file.h"
+#include "fs/dirtree.h"
+#include "fs/fs_hash.h"
+
+/* Directories a struct dirfds keeps open, on each side */
+#ifndef DIRFDS_SIZE
+#define DIRFDS_SIZE 16
+#endif
+
+/* A directory of the tree, open in the source and in its copy */
+struct dirfd {
+	uint32_t node;		/* dirtree node, DIRTREE_NONE if unused */
+	int src;		/* -1 if not open */
+	int dst;
+};
+
+/* Descriptors of the last directories files were copied from and to,
+ * so that a file is opened by its name in its directory, not by its
+ * whole path from the roots, see dirfds_at().
+ *
+ * A directory missing from the cache is opened relative to its parent,
+ * itself looked up the same way: one name per system call, and none at
+ * all for the next files of the same directory. On the destination side,
+ * missing directories are created on the way, with mkdirat(), unless
+ * `nocreate' is set: they're ENOENT then, as in the source.
+ *
+ * The cache is direct-mapped by node: it pays off when files come
+ * directory by directory, see sched_build().
+ */
+struct dirfds {
+	const struct dirtree* tree;
+	int srcfd;		/* source root, not owned */
+	int dstfd;		/* destination root, not owned */
+	int oflags;		/* flags given to open, for the source */
+	int nocreate;		/* the destination is only read */
+	uintmax_t* ndirs;	/* counts directories created, or NULL */
+	struct dirfd dirs[DIRFDS_SIZE];
+	unsigned size;		/* of `dirs', in use */
+	int keep;		/* handed out, not to be closed yet */
+	int stale;		/* `keep', once dropped from the cache */
+};
+
+void dirfds_init(struct dirfds* d, const struct dirtree* tree, int srcfd, int dstfd,
+		 int oflags);
+void dirfds_limit(struct dirfds* d, unsigned size);
+void dirfds_flush(struct dirfds* d);
+unsigned dirfds_shed(struct dirfds* d, uint32_t node);
+int dirfds_at(struct dirfds* d, const struct file* f, file_t* src, file_t* dst);
+int dirfds_open(struct dirfds* d, uint32_t node);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef FS_DIRTREE_H
+#define FS_DIRTREE_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs/fs_hash.h"
+
+/* Nodes per chunk, and most chunks a tree can have */
+#ifndef DIRTREE_CHUNK
+#define DIRTREE_CHUNK 4096
+#endif
+#ifndef DIRTREE_MAXCHUNKS
+#define DIRTREE_MAXCHUNKS (1 << 16)
+#endif
+
+#define DIRTREE_ROOT 0			/* the root of the traversal */
+#define DIRTREE_NONE UINT32_MAX		/* no node */
+
+/* A directory, known by its name and its parent */
+struct dnode {
+	const char* name;	/* never owned, "" for the root */
+	uint32_t parent;	/* DIRTREE_NONE for the root */
+	uint32_t filter;	/* set of steps live in it, see fs/filter.h */
+};
+
+/* Every directory a traversal found. Files only keep the index of their
+ * directory and their own name, and full paths are rebuilt on demand, so
+ * a prefix shared by many files is stored once.
+ *
+ * Nodes are stored in fixed-size chunks, and never move: adding a node
+ * takes the lock, reading one doesn't. A node may be read by any thread
+ * that got its index from the thread that added it.
+ */
+struct dirtree {
+	pthread_mutex_t lock;		/* guards adding nodes */
+	struct dnode** chunks;		/* DIRTREE_MAXCHUNKS of them */
+	size_t n;			/* nodes */
+};
+
+int dirtree_init(struct dirtree* t);
+void dirtree_free(struct dirtree* t);
+uint32_t dirtree_add(struct dirtree* t, uint32_t parent, const char* name,
+		     uint32_t filter);
+uint32_t dirtree_filter(const struct dirtree* t, uint32_t node);
+const struct dnode* dirtree_node(const struct dirtree* t, uint32_t node);
+ssize_t dirtree_path(const struct dirtree* t, uint32_t node, char* buf, size_t size);
+char* dirtree_strdup(const struct dirtree* t, uint32_t node);
+ssize_t file_path(const struct dirtree* t, const struct file* f, char* buf, size_t size);
+size_t file_path_len(const struct dirtree* t, const struct file* f);
+char* file_strdup(const struct dirtree* t, const struct file* f);
+int file_path_is(const struct dirtree* t, const struct file* f, const char* path);
+int file_has_path(const struct dirtree* t, const struct file* f, const char* path);
+
+#endif
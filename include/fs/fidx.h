@@ -0,0 +1,74 @@
+#ifndef FS_FIDX_H
+#define FS_FIDX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "status.h"
+#include "fs/dirtree.h"
+#include "fs/fs_hash.h"
+
+/* Name of the index in the destination, unless told otherwise */
+#ifndef FIDX_NAME
+#define FIDX_NAME ".backup-index"
+#endif
+
+#define FIDX_MAGIC	"BKPIDX\0"	/* 8 bytes, with the NUL */
+#define FIDX_VERSION	1
+#define FIDX_ORDER	0x01020304	/* tells the byte order it was written in */
+#define FIDX_EMPTY	UINT32_MAX	/* free slot of the hash directory */
+
+/* The file index remembers what the previous run copied, so the next one
+ * can skip what didn't change. It is used straight from mmap, so every
+ * part is fixed-size, aligned, and in the byte order of the machine that
+ * wrote it:
+ *
+ *	struct fidx_hdr
+ *	struct fidx_rec		nrec of them
+ *	uint32_t		nslots: the hash directory, record numbers
+ *				by (st_dev, st_ino), linear probing
+ *	char			strlen bytes of NUL-terminated paths
+ */
+struct fidx_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint64_t nrec;
+	uint64_t nslots;	/* a power of two, more than nrec */
+	uint64_t recoff;	/* offsets from the start of the file */
+	uint64_t slotoff;
+	uint64_t stroff;
+	uint64_t strlen;
+};
+
+struct fidx_rec {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime;		/* in ns */
+	int64_t ctime;		/* in ns */
+	uint64_t path;		/* offset in the path strings */
+	uint32_t mode;
+	uint32_t pad;
+};
+
+/* An index opened read-only */
+struct fidx {
+	void* map;
+	size_t len;
+	const struct fidx_hdr* hdr;
+	const struct fidx_rec* recs;
+	const uint32_t* slots;
+	const char* strs;
+};
+
+status_t fidx_open(struct fidx* idx, const char* path);
+void fidx_close(struct fidx* idx);
+const struct fidx_rec* fidx_find(const struct fidx* idx, const struct kfile* k);
+int fidx_unchanged(const struct fidx* idx, const struct kfile* k,
+		   const struct file* f, const struct dirtree* tree);
+status_t fidx_write(const char* path, struct hash_table* files,
+		    const struct dirtree* tree);
+
+#endif
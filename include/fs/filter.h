@@ -0,0 +1,104 @@
+#ifndef FS_FILTER_H
+#define FS_FILTER_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Live sets per chunk, and most chunks a filter can have, see
+ * struct filter_sets
+ */
+#ifndef FILTER_SET_CHUNK
+#define FILTER_SET_CHUNK 1024
+#endif
+#ifndef FILTER_SET_MAXCHUNKS
+#define FILTER_SET_MAXCHUNKS 1024
+#endif
+
+/* What filter_test() says of an entry */
+#define FILTER_SKIP	0
+#define FILTER_KEEP	1
+#define FILTER_UNSURE	(-1)	/* it depends on the type, stat it first */
+#define FILTER_ERROR	(-2)	/* out of memory, errno is set */
+
+enum filter_kind {
+	STEP_LITERAL,		/* the name itself */
+	STEP_PREFIX,		/* "text*" */
+	STEP_SUFFIX,		/* "*text" */
+	STEP_ANY,		/* "*" */
+	STEP_DEEP,		/* "**": any number of directories */
+	STEP_GLOB		/* anything else, through fnmatch() */
+};
+
+/* One path component of a rule */
+struct filter_step {
+	enum filter_kind kind;
+	char* text;		/* the pattern, or its fixed part */
+	size_t len;		/* of `text' */
+};
+
+struct filter_rule {
+	int include;		/* keeps what it matches, instead of skipping it */
+	int dironly;		/* only matches directories */
+	int anchored;		/* matched from the root, component by component */
+	unsigned first;		/* its steps, in filter.steps if anchored */
+	unsigned nsteps;
+	struct filter_step step; /* the only one, if not anchored */
+};
+
+/* Every set of live steps met so far, by number: set 0 is the root's.
+ * Each takes `nwords' words, bit i of the set being bit i % 32 of word
+ * i / 32, and is stored once, however many directories have it.
+ *
+ * Sets are stored in fixed-size chunks, and never move: adding one takes
+ * the lock, reading one doesn't, like the nodes of a struct dirtree.
+ */
+struct filter_sets {
+	pthread_mutex_t lock;		/* guards adding sets */
+	uint32_t* chunks[FILTER_SET_MAXCHUNKS];
+	uint32_t n;			/* sets */
+	size_t nwords;			/* of a set */
+	uint32_t* index;		/* set numbers by hash, linear probing */
+	size_t nindex;			/* a power of two, at least twice n */
+};
+
+/* Include and exclude rules, like gitignore's, matched against every
+ * entry by name before it's stat'ed: the last rule that matches decides,
+ * entries no rule matches are kept, and a directory skipped is never
+ * opened, so nothing under it is seen.
+ *
+ * A rule with no slash but maybe a trailing one matches names anywhere
+ * in the tree. Others are anchored at the root, and matched one path
+ * component at a time: their steps make a nondeterministic automaton.
+ * The set of steps live in a directory is kept with it in the dirtree,
+ * by its number in `sets', see dirtree_filter(): bit i set means step i
+ * may match names in it. A trailing slash only matches directories, a
+ * leading `!' makes a rule include, and `**' stands for any number of
+ * directories.
+ *
+ * filter_test() adds the sets it finds to `sets' even through a const
+ * filter, and may be called by several threads at once. Rules can't be
+ * added once a traversal uses the filter.
+ */
+struct filter {
+	struct filter_rule* rules;
+	size_t nrules;
+	size_t cap;
+	struct filter_step* steps;
+	unsigned nsteps;
+	unsigned capsteps;
+	uint32_t* deep;		/* steps that are "**", capsteps bits */
+	uint32_t* last;		/* steps that end a rule */
+	struct filter_sets* sets;
+};
+
+void filter_init(struct filter* f);
+void filter_free(struct filter* f);
+int filter_add(struct filter* f, const char* pattern, int include);
+int filter_load(struct filter* f, const char* path);
+uint32_t filter_root(const struct filter* f);
+int filter_test(const struct filter* f, uint32_t live, const char* name, mode_t type,
+		uint32_t* sub);
+
+#endif
@@ -5,21 +5,48 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "arena.h"
+
 /* key for our hash table that stores each file */
 struct kfile {
 	uintmax_t st_dev;	/* file device number */
 	uintmax_t st_ino;	/* file inode number */
 };
 
+struct chunklist;
+
+/* size of a file the traversal didn't stat */
+#define FILE_SIZE_UNKNOWN ((off_t)-1)
+
+/* A struct timespec, in nanoseconds */
+#define TS_NSEC(ts) ((int64_t)(ts).tv_sec * 1000000000 + (int64_t)(ts).tv_nsec)
+
+/* Keys, values and names all live in the arena given to the traversal,
+ * and are released with it. The path of a file is its directory's path,
+ * see fs/dirtree.h, and its name: file_path() puts them together.
+ *
+ * A file with several hard links is in the table once, under the first
+ * name found; the others hang off `links', each with its own dir and
+ * name, and only their dir, name and links fields are meaningful.
+ */
 struct file {
-	char* path;		/* relative to source */
+	const char* name;	/* base name */
+	off_t size;		/* file size, or FILE_SIZE_UNKNOWN */
+	int64_t mtime;		/* modification time in ns, 0 if unknown */
+	int64_t ctime;		/* change time in ns, 0 if unknown */
 	mode_t mode; 		/* file mode */
-	off_t size;		/* file size */
+	uint32_t dir;		/* dirtree node of its directory */
+	int done;		/* copied, or its copy found unchanged */
+	struct chunklist* chunks; /* set by the chunk store, see fs/chunk.h */
+	struct file* links;	/* other names of the same file, NULL if none */
 };
 
-int free_hent(const void* key, void* value, void* user_data);
 uintmax_t hash(const void* key);
 int hcmpent(const void* a, const void* b);
-struct kfile* hcrekey(struct stat* sb);
-void* hcreval(const char* path, mode_t st_mode, off_t st_size);
+struct kfile* hcrekey(struct arena* mem, const struct stat* sb);
+struct file* hcreval(struct arena* mem, uint32_t dir, const char* name,
+		     const struct stat* sb);
+void hcfill(struct file* val, uint32_t dir, const char* name,
+	    const struct stat* sb);
+void hcstat(struct file* val, const struct stat* sb);
 #endif
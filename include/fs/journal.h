@@ -0,0 +1,87 @@
+#ifndef FS_JOURNAL_H
+#define FS_JOURNAL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "hash.h"
+#include "status.h"
+#include "fs/dirtree.h"
+#include "fs/fs_hash.h"
+
+/* Name of the journal in the destination */
+#ifndef JOURNAL_NAME
+#define JOURNAL_NAME ".backup-journal"
+#endif
+
+/* Records buffered before they're made durable, at most... */
+#ifndef JOURNAL_BATCH
+#define JOURNAL_BATCH 4096
+#endif
+/* ...and for that long, in seconds */
+#ifndef JOURNAL_PERIOD
+#define JOURNAL_PERIOD 2
+#endif
+
+#define JOURNAL_BUFSZ	(1 << 20)
+#define JOURNAL_MAGIC	"BKPJNL\0"	/* 8 bytes, with the NUL */
+#define JOURNAL_VERSION	1
+#define JOURNAL_ORDER	0x01020304
+
+/* The journal lists the entries a run has copied so far, so that an
+ * interrupted run can be carried on instead of started over. It is only
+ * ever appended to:
+ *
+ *	struct journal_hdr
+ *	struct journal_rec, then its `len' bytes of path, for every entry
+ *
+ * Records are buffered, and written in batches: the destination is
+ * synced first, so a record never reaches the disk before the data it
+ * vouches for. Every record has a checksum, and whatever follows the
+ * first bad one, torn by a crash, is dropped when resuming.
+ */
+struct journal_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+};
+
+struct journal_rec {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime;		/* in ns */
+	int64_t ctime;		/* in ns */
+	uint32_t mode;
+	uint32_t len;		/* of the path that follows, without a NUL */
+	uint32_t sum;		/* FNV-1a of the record, with sum at 0, and path */
+	uint32_t pad;
+};
+
+struct journal {
+	char* path;
+	int fd;
+	pthread_mutex_t lock;	/* guards the buffer, copy threads share it */
+	char* buf;		/* records not written yet */
+	size_t len;
+	unsigned pending;	/* records in buf */
+	int64_t synced;		/* when buf was last written, in s */
+
+	/* What the interrupted run copied, by (st_dev, st_ino), NULL unless
+	 * resuming. Lookups write to a table that's still growing, so it's
+	 * done growing once opened: copy threads then look it up at once.
+	 */
+	struct hash_table* done;
+	struct arena mem;
+};
+
+status_t journal_open(struct journal* j, const char* dst, int resume);
+int journal_done(struct journal* j, const struct kfile* k,
+		 const struct file* f, const struct dirtree* tree);
+status_t journal_add(struct journal* j, const struct kfile* k,
+		     const struct file* f, const struct dirtree* tree);
+status_t journal_close(struct journal* j, int finished);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef FS_SCHED_H
+#define FS_SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "status.h"
+#include "fs/copy.h"
+#include "fs/fs_hash.h"
+
+/* Bytes of file data sched_ahead() keeps asked for ahead of the copy */
+#ifndef SCHED_AHEAD
+#define SCHED_AHEAD (32 << 20)
+#endif
+
+/* Orders sched_build() knows */
+#define SCHED_DISK	0	/* files but directories, by where their data is */
+#define SCHED_DIRS	1	/* every entry, by the directory it's in */
+
+/* A file waiting to be copied */
+struct sched_ent {
+	const struct kfile* key;
+	struct file* f;
+	uint64_t pos;		/* where its data starts on disk, or its
+				 * directory, see sched_build() */
+	uint64_t ahead;		/* bytes asked for by sched_ahead() */
+	int skip;		/* unchanged or copied before: nothing to read */
+};
+
+/* The files of a tree that aren't directories, in the order their data
+ * lies on disk: by device, then by the physical offset of their first
+ * extent, as FIEMAP tells. Where it can't, by inode number, which most
+ * filesystems allocate close to the data. On disks that seek, reading in
+ * that order is close to reading sequentially.
+ *
+ * Or every entry of the tree, directory by directory, see SCHED_DIRS.
+ */
+struct sched {
+	struct sched_ent* ents;
+	size_t n;
+	size_t next;		/* first entry sched_ahead() didn't see */
+	uint64_t inflight;	/* bytes asked for and not copied yet */
+	int order;		/* SCHED_* */
+	int no_fiemap;		/* FIEMAP is unavailable */
+};
+
+status_t sched_build(struct sched* s, struct copier* cp, struct hash_table* files,
+		     int order);
+void sched_ahead(struct sched* s, struct copier* cp, size_t i);
+void sched_free(struct sched* s);
+
+#endif
@@ -1,24 +1,48 @@
 #ifndef FS_STACK_H
 #define FS_STACK_H
 
-#include <dirent.h>
+#include <sys/types.h>
+#include <stdint.h>
 #include <unistd.h>
 
+#include "fs/dents.h"
+#include "fs/dirfds.h"
 #include "status.h"
 
+/* Directories the stack keeps open at most. Older ones are parked (see
+ * dents_park()) past that, and reopened when they're back on top, so
+ * deep trees don't run out of descriptors. RLIMIT_NOFILE may allow for
+ * fewer, see stack_budget().
+ */
+#ifndef STACK_MAX_OPEN
+#define STACK_MAX_OPEN 64
+#endif
+
+/* Descriptors the rest of the program keeps open while a stack is used:
+ * the standard streams, the journal, the file index, and some to spare.
+ * Copiers running alongside need more, see listing().
+ */
+#define STACK_RESERVE 8
+
 struct stackdir {
 	char* name;		/* file name */
-	DIR* dir;		/* this directory */
-	char* dirname;		/* dirname of the current folder */
+	struct dents ds;	/* this directory, ds.fd is -1 while parked */
+	dev_t dev;		/* device this directory lives on */
+	ino_t ino;		/* to tell it's the same one, once reopened */
+	int symlinked;		/* reached through a symbolic link */
+	uint32_t node;		/* its dirtree node */
 	struct stackdir* next;	/* next frame */
 };
 
 struct stack {
 	size_t ndir;		/* this many dirs */
+	size_t nopen;		/* this many not parked */
+	size_t maxopen;		/* and at most this many, see stack_budget() */
 	struct stackdir* top;	/* any directory */
 };
 
-status_t push(struct stack* dirs, int fd, const char* name, int oflags);
+size_t stack_budget(unsigned reserve);
+status_t push(struct stack* dirs, int fd, const char* name, uint32_t node, int oflags);
 status_t pop(struct stack* dirs);
 
 #endif
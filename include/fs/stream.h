@@ -0,0 +1,70 @@
+#ifndef FS_STREAM_H
+#define FS_STREAM_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#include "hash.h"
+#include "status.h"
+#include "fs/copy.h"
+#include "fs/dirtree.h"
+#include "fs/fidx.h"
+#include "fs/fs_hash.h"
+#include "fs/journal.h"
+
+/* Entries the traversal can be ahead of the copy */
+#ifndef STREAM_QUEUE
+#define STREAM_QUEUE 1024
+#endif
+
+struct stream_worker;
+
+/* An entry waiting to be copied, with a copy of its name */
+struct stream_job {
+	struct kfile key;
+	struct file f;
+	char name[NAME_MAX + 1];
+};
+
+/* Copies entries while the traversal is still finding them: the
+ * traversal hands them over through stream_emit() (see travopts.emit),
+ * into a bounded queue that a few copy threads drain. When the queue is
+ * full, the traversal waits.
+ *
+ * The data of files with several links is copied as soon as their first
+ * name is found. Their other names are linked once everything was
+ * copied, by stream_finish().
+ */
+struct stream {
+	struct stream_job* jobs;	/* ring of STREAM_QUEUE jobs */
+	size_t head;			/* oldest job */
+	size_t count;			/* jobs queued */
+	pthread_mutex_t lock;		/* guards everything below */
+	pthread_cond_t nonempty;	/* a job was queued, or no more will be */
+	pthread_cond_t nonfull;		/* a job was taken, or copying failed */
+	int closed;			/* the traversal is over */
+	int failed;
+	status_t ret;			/* first fatal error */
+
+	struct stream_worker* workers;
+	unsigned nworkers;		/* started */
+	unsigned spare;			/* split threads left, see copy_split() */
+};
+
+/* A copy thread */
+struct stream_worker {
+	struct stream* s;
+	struct copier cp;		/* its own buffer and paths */
+	pthread_t tid;
+};
+
+status_t stream_start(struct stream* s, unsigned ncopiers,
+		      const struct dirtree* tree, const struct fidx* prev,
+		      struct journal* journal, const char* src, const char* dst,
+		      int oflags);
+status_t stream_emit(void* arg, const struct kfile* key, const struct file* f);
+status_t stream_finish(struct stream* s, status_t walk, struct hash_table* files,
+		       struct copy_stats* stats);
+
+#endif
@@ -1,13 +1,74 @@
 #ifndef FS_TRAVERSE_H
 #define FS_TRAVERSE_H
 
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "arena.h"
 #include "hash.h"
 #include "status.h"
+#include "fs/dents.h"
+#include "fs/dirtree.h"
+#include "fs/filter.h"
+#include "fs/fs_hash.h"
 
 #ifndef LOAD_FACTOR_DIRS
 #define LOAD_FACTOR_DIRS 0.5
 #endif
 
-status_t traverse(const char* restrict path, struct hash_table** files, int oflags);
+/* Upper bound for ptraverse() workers */
+#ifndef TRAVERSE_MAX_THREADS
+#define TRAVERSE_MAX_THREADS 256
+#endif
+
+/* Metadata the traversal must fill in for every file. Without them,
+ * files whose type the directory entry tells are indexed without being
+ * stat'ed at all: st_ino comes from the entry, st_dev from the directory,
+ * the mode only holds the file type, and the size is FILE_SIZE_UNKNOWN.
+ */
+#define TRAV_NEED_MODE	0x1	/* permission bits */
+#define TRAV_NEED_SIZE	0x2	/* file size */
+#define TRAV_NEED_TIMES	0x4	/* modification and change times, 0 otherwise */
+#define TRAV_NEED_NLINK	0x8	/* link count, 0 otherwise */
+
+/* Called with every new entry, see travopts.emit */
+typedef status_t (*trav_emit_fn)(void* arg, const struct kfile* key,
+				 const struct file* f);
+
+struct travopts {
+	int oflags;		/* flags given to open */
+	unsigned nthreads;	/* ptraverse() workers */
+	unsigned need;		/* TRAV_NEED_* */
+	/* When set, every new entry is handed to emit() as soon as it's
+	 * found, and the table only keeps what could be found again:
+	 * directories, and files with several links. The others are only
+	 * valid during the call. Needs TRAV_NEED_NLINK.
+	 */
+	trav_emit_fn emit;
+	void* emit_arg;
+	/* Entries it skips aren't stat'ed nor indexed, and directories it
+	 * skips aren't searched. NULL keeps everything.
+	 */
+	const struct filter* filter;
+	/* Descriptors to leave to the rest of the program, see
+	 * stack_budget()
+	 */
+	unsigned reserve;
+};
+
+status_t traverse(const char* restrict path, struct hash_table** files,
+		  struct arena* mem, struct dirtree* tree,
+		  const struct travopts* opts);
+status_t ptraverse(const char* restrict path, struct hash_table** files,
+		   struct arena* mem, struct dirtree* tree,
+		   const struct travopts* opts);
+int entry_stat(int dfd, dev_t dev, const struct dent* e,
+	       const struct travopts* opts, struct stat* sb);
+uint32_t dir_live(const struct dirtree* tree, uint32_t node, const struct travopts* opts);
+int entry_keep(const struct travopts* opts, uint32_t live, const char* name, mode_t type,
+	       uint32_t* sub);
+status_t index_entry(struct hash_table** files, pthread_mutex_t* lock,
+		     struct arena* mem, const struct travopts* opts, uint32_t dir,
+		     const char* name, const struct stat* sb, struct file** added);
 
 #endif
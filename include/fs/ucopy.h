@@ -0,0 +1,66 @@
+#ifndef FS_UCOPY_H
+#define FS_UCOPY_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "status.h"
+#include "fs/copy.h"
+#include "fs/fs_hash.h"
+#include "fs/uring.h"
+
+/* Files ucopy_add() has in flight at once */
+#ifndef UCOPY_DEPTH
+#define UCOPY_DEPTH 64
+#endif
+
+/* Largest file ucopy_add() copies itself, read whole in one go. Below
+ * COPY_SPARSE_MIN, so that holes never matter.
+ */
+#ifndef UCOPY_MAX
+#define UCOPY_MAX (COPY_SPARSE_MIN - 1)
+#endif
+
+/* A file on its way, see struct ucopy */
+struct ucopy_slot {
+	const struct kfile* key;	/* NULL if the slot is free */
+	struct file* f;
+	int state;
+	unsigned pending;	/* requests in the ring */
+	int in;			/* source file, -1 if not open */
+	int out;		/* destination file, -1 if not open */
+	int err;		/* first request that failed, its errno */
+	uint32_t mode;		/* as statx said */
+	uint64_t size;
+	uint64_t pos;		/* bytes copied */
+	uint32_t len;		/* bytes read and not written yet */
+	uint32_t wrote;		/* out of `len' */
+	char* buf;		/* UCOPY_MAX + 1 bytes */
+	void* stx;		/* a struct statx */
+	char path[PATH_MAX];
+};
+
+/* Copies small regular files through an io_uring, many at once: every
+ * file goes through the statx and openat of its source, the openat of
+ * its copy, reads and writes, and closing both, each step queued for
+ * up to UCOPY_DEPTH files before a single system call hands them over.
+ *
+ * Whatever is out of the ordinary is handed to copy_entry() instead:
+ * larger files, files with several links, files whose copy can't be
+ * created straight away, and anything that fails before data moved.
+ */
+struct ucopy {
+	struct copier* cp;
+	struct uring ring;
+	struct ucopy_slot* slots;	/* UCOPY_DEPTH of them */
+	unsigned nbusy;		/* slots in use */
+	status_t ret;		/* first fatal error */
+	int failed;		/* `ret' was returned already */
+};
+
+status_t ucopy_init(struct ucopy* u, struct copier* cp);
+status_t ucopy_add(struct ucopy* u, const struct kfile* k, struct file* f);
+status_t ucopy_finish(struct ucopy* u);
+void ucopy_free(struct ucopy* u);
+
+#endif
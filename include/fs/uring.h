@@ -0,0 +1,52 @@
+#ifndef FS_URING_H
+#define FS_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+/* An io_uring, driven through the raw system calls: requests are queued
+ * with uring_sqe(), then handed to the kernel all at once by
+ * uring_enter(), and their results read back with uring_cqe() and
+ * uring_seen(), in whatever order they finish.
+ *
+ * uring_init() fails with ENOSYS where the kernel has no io_uring, or
+ * lacks one of the operations the copy needs (statx, openat, read,
+ * write, close: Linux 5.6), and callers then do without it.
+ */
+struct uring {
+	int fd;
+	unsigned queued;	/* requests uring_enter() didn't hand over yet */
+#ifdef __linux__
+	/* Submission ring */
+	void* sq_map;
+	size_t sq_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	/* Completion ring, in sq_map too if the kernel can */
+	void* cq_map;
+	size_t cq_size;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+#endif
+};
+
+int uring_init(struct uring* r, unsigned entries);
+void uring_free(struct uring* r);
+#ifdef __linux__
+struct io_uring_sqe* uring_sqe(struct uring* r);
+#endif
+int uring_enter(struct uring* r, unsigned wait);
+int uring_cqe(struct uring* r, uint64_t* data, int32_t* res);
+void uring_seen(struct uring* r);
+
+#endif
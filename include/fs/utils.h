@@ -5,6 +5,7 @@
 
 #include "status.h"
 
+status_t open_subdir(int fd, const char* path, int oflags, int* cfd);
 status_t stream_subdir(int fd, const char* path, int oflags, DIR** d);
 char* path_concat(const char* base, const char* name);
 
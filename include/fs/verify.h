@@ -0,0 +1,68 @@
+#ifndef FS_VERIFY_H
+#define FS_VERIFY_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "status.h"
+#include "fs/dirtree.h"
+#include "fs/fs_hash.h"
+
+/* Size of the buffers file data is hashed from, and their alignment */
+#ifndef VERIFY_BUFSZ
+#define VERIFY_BUFSZ (4 << 20)
+#endif
+#define VERIFY_ALIGN 4096
+
+/* Extended attribute a copy's checksum is kept in, see struct verify_sum */
+#define VERIFY_XATTR "user.backup.xxh3"
+
+/* What VERIFY_XATTR holds, in the byte order of the machine that wrote
+ * it: the checksum of the source file, and what it looked like then.
+ * While the source still looks the same, it isn't read again.
+ */
+struct verify_sum {
+	uint64_t hash;		/* xxh3() of the contents */
+	int64_t size;
+	int64_t mtime;		/* in ns */
+	int64_t ctime;
+};
+
+struct verify_stats {
+	uintmax_t nfiles;	/* regular files compared */
+	uintmax_t ndirs;	/* directories found */
+	uintmax_t nsymlinks;	/* symbolic links compared */
+	uintmax_t nlinks;	/* extra hard links found */
+	uintmax_t nbytes;	/* bytes of file data hashed, on both sides */
+	uintmax_t nreused;	/* source checksums taken from VERIFY_XATTR */
+	uintmax_t ndiffer;	/* entries whose copy isn't the same */
+	uintmax_t nmissing;	/* entries with no copy at all */
+};
+
+/* Compares a copy with its source, see verify_tree() */
+struct verifier {
+	const struct dirtree* tree;	/* directories of the files compared */
+	int srcfd;		/* source root */
+	int dstfd;		/* destination root */
+	int oflags;		/* flags given to open, for the source */
+	unsigned nthreads;	/* hashing files at once */
+	int xattr;		/* keep checksums in VERIFY_XATTR */
+	const struct file** ents;	/* what's left to compare */
+	size_t n;
+	pthread_mutex_t lock;	/* guards everything below */
+	size_t next;		/* first entry no thread took yet */
+	int failed;
+	status_t ret;		/* first failure */
+	struct verify_stats stats;
+};
+
+status_t verifier_init(struct verifier* v, const struct dirtree* tree,
+		       const char* src, const char* dst, int oflags, unsigned nthreads,
+		       int xattr);
+void verifier_free(struct verifier* v);
+status_t verify_tree(struct verifier* v, struct hash_table* files);
+
+#endif
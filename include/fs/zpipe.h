@@ -0,0 +1,92 @@
+#ifndef FS_ZPIPE_H
+#define FS_ZPIPE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crypt.h"
+#include "status.h"
+
+/* Blocks each thread can have waiting or being compressed */
+#ifndef ZPIPE_DEPTH
+#define ZPIPE_DEPTH 2
+#endif
+
+/* Entropy, in 1/256 bits per byte, above which the probe says a block
+ * isn't worth compressing: 7.5 bits
+ */
+#ifndef ZPIPE_ENTROPY_MAX
+#define ZPIPE_ENTROPY_MAX (15 * 128)
+#endif
+
+/* What the threads do to each block, see zpipe_start() */
+#define ZPIPE_LZ	0x1	/* compress it */
+#define ZPIPE_PROBE	0x2	/* unless it looks incompressible */
+
+/* A block, as it comes out: compressed if `clen' is below `ulen', as it
+ * went in otherwise. With a key, `data' is encrypted and `tag'
+ * authenticates it.
+ */
+struct zblock {
+	const char* data;
+	size_t ulen;
+	size_t clen;
+	uint64_t sum;		/* xxh3() of the block as it went in */
+	const unsigned char* tag;	/* CRYPT_TAGLEN bytes, NULL without a key */
+};
+
+/* Called with every block, in the order they were handed over. Returns 0
+ * on success, -1 with errno set otherwise.
+ */
+typedef int (*zpipe_out_fn)(void* arg, const struct zblock* b);
+
+struct zslot {
+	char* in;
+	char* out;
+	size_t ulen;
+	size_t clen;
+	uint64_t sum;
+	uint64_t seq;		/* block number, the nonce */
+	unsigned char tag[CRYPT_TAGLEN];
+	int done;
+};
+
+/* Compresses and encrypts blocks on several threads: one thread hands
+ * blocks over, the others work on them, and they come back out in the
+ * same order, on the thread that handed them over. The output doesn't
+ * depend on the number of threads.
+ *
+ * Block n is sealed with the nonce 4 zero bytes then n as 8 bytes, little
+ * endian, and with its ulen and clen, as two uint32_t, as associated
+ * data: see zpipe_nonce().
+ */
+struct zpipe {
+	struct zslot* slots;	/* ring of nslots */
+	unsigned nslots;
+	size_t blocksz;
+	int flags;		/* ZPIPE_* */
+	const unsigned char* key;	/* NULL for none */
+	zpipe_out_fn out;
+	void* arg;
+
+	pthread_mutex_t lock;	/* guards the counters and `done' */
+	pthread_cond_t work;	/* a block was queued, or there won't be more */
+	pthread_cond_t ready;	/* a block is done */
+	uint64_t nin;		/* blocks handed over */
+	uint64_t nwork;		/* blocks taken by a thread */
+	uint64_t nout;		/* blocks given back */
+	int closed;
+
+	pthread_t* tids;
+	unsigned nthreads;	/* started */
+};
+
+status_t zpipe_start(struct zpipe* z, unsigned nthreads, size_t blocksz, int flags,
+		     const unsigned char* key, zpipe_out_fn out, void* arg);
+int zpipe_put(struct zpipe* z, char** buf, size_t len);
+int zpipe_drain(struct zpipe* z);
+void zpipe_stop(struct zpipe* z);
+void zpipe_nonce(uint64_t seq, unsigned char nonce[CRYPT_NONCELEN]);
+
+#endif
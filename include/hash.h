@@ -4,21 +4,37 @@
 #include <stddef.h>		/* size_t */
 #include <stdint.h> 		/* uint64_t */
 
-struct hash_entry {
+/* Bytes of a key kept in its slot: keys no longer than that are hashed
+ * and compared there, without following `key' to wherever it lives.
+ */
+#define HASH_INLINE 16
+
+struct hash_slot {
+	uint64_t k[HASH_INLINE / 8];	/* start of the key, zero-padded */
 	const void* key;
 	void* value;
-	struct hash_entry* next;
+};
+
+/* An array of slots, and their control bytes, see hash.c */
+struct hash_arr {
+	int8_t* ctrl;
+	struct hash_slot* slots;
+	size_t size;		/* slots, always a power of two, 0 if unused */
+	size_t deleted;		/* tombstones */
 };
 
 struct hash_table {
-	struct hash_entry** buckets;
-	size_t size;
-	size_t count;
+	struct hash_arr cur;	/* new entries go here */
+	struct hash_arr old;	/* being moved into `cur' while growing */
+	size_t migrated;	/* slots of `old' moved so far */
+	size_t count;		/* entries, in both arrays */
+	size_t ncur;		/* entries in `cur' */
+	size_t klen;		/* bytes in a key */
 	uint64_t (*hash_fn)(const void* key);
 	int (*cmp_fn)(const void* a, const void* b);
 };
 
-struct hash_table* hash_create(size_t size,
+struct hash_table* hash_create(size_t size, size_t klen,
                          uint64_t (*hash_fn)(const void*),
                          int (*cmp_fn)(const void*, const void*));
 void* hash_lookup(struct hash_table* ht, const void* key);
@@ -30,6 +46,6 @@ size_t hash_foreach(const struct hash_table* ht,
 void hash_destroy(struct hash_table* ht);
 struct hash_table* hash_upsize(struct hash_table* restrict ht);
 struct hash_table* hash_rehash(struct hash_table* ht, size_t new_size);
-size_t hash_chksize(const struct hash_table* ht, int n);
+size_t hash_chksize(const struct hash_table* ht);
 
 #endif
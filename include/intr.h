@@ -3,6 +3,11 @@
 
 #include <signal.h>
 
+/* Set once SIGINT or SIGTERM arrived, see intr_catch(): long loops check
+ * it between two entries, and stop with ST_ERR_INTR.
+ */
 extern volatile sig_atomic_t terminate_wanted;
 
+int intr_catch(void);
+
 #endif
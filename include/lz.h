@@ -0,0 +1,13 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>		/* size_t */
+#include <sys/types.h>		/* ssize_t */
+
+/* Largest distance a match can reach back */
+#define LZ_WINDOW 65535
+
+size_t lz_compress(const void* src, size_t len, void* dst, size_t cap);
+ssize_t lz_decompress(const void* src, size_t len, void* dst, size_t cap);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint32_t, uint64_t */
+
+#define SHA256_LEN 32		/* bytes of a digest */
+
+struct sha256 {
+	uint32_t h[8];		/* state */
+	uint64_t len;		/* bytes hashed so far */
+	unsigned char buf[64];	/* partial block */
+};
+
+void sha256_init(struct sha256* s);
+void sha256_update(struct sha256* s, const void* data, size_t len);
+void sha256_final(struct sha256* s, unsigned char out[SHA256_LEN]);
+void sha256(const void* data, size_t len, unsigned char out[SHA256_LEN]);
+
+#endif
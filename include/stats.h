@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Timed operations: each gets a call count, a total and a latency
+ * histogram.
+ */
+enum stats_op {
+	STATS_STAT,		/* statx, fstatat */
+	STATS_OPEN,		/* open, openat */
+	STATS_GETDENTS,		/* reading directory entries */
+	STATS_READ,		/* read */
+	STATS_WRITE,		/* write */
+	STATS_KCOPY,		/* copy_file_range, sendfile */
+	STATS_RESIZE,		/* starting to grow the files table, hash_rehash */
+	STATS_NOPS
+};
+
+/* Plain counters */
+enum stats_counter {
+	STATS_ENTRIES,		/* directory entries indexed */
+	STATS_BYTES_READ,	/* by read */
+	STATS_BYTES_WRITTEN,	/* by write */
+	STATS_BYTES_KCOPIED,	/* by copy_file_range and sendfile */
+	STATS_SKIPPED,		/* entries the traversal's filter skipped */
+	STATS_NCOUNTERS
+};
+
+/* Histogram buckets: bucket i holds latencies below 2^i ns */
+#define STATS_BUCKETS 40
+
+/* Set once by stats_enable(), before any thread starts: with it unset,
+ * every STATS_* macro below is a load and a branch.
+ */
+extern int stats_on;
+
+#define STATS_START() ((stats_on) ? stats_clock() : 0)
+#define STATS_TIME(op, start) \
+	do { if (stats_on) stats_time((op), (start)); } while (0)
+#define STATS_ADD(c, n) \
+	do { if (stats_on) stats_add((c), (uint64_t)(n)); } while (0)
+
+void stats_enable(void);
+uint64_t stats_clock(void);
+void stats_time(enum stats_op op, uint64_t start);
+void stats_add(enum stats_counter c, uint64_t n);
+void stats_report(FILE* out, int json);
+void stats_free(void);
+
+#endif
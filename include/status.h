@@ -50,6 +50,14 @@ typedef enum {
 	ST_ERR_FILERD,		/* Couldn't read file */
 	ST_ERR_FILERD_MD, 	/* Couldn't read file metadata */
 	ST_ERR_OPEN,
+	ST_ERR_MKDIR,		/* Couldn't create a directory */
+	ST_ERR_FILEWR,		/* Couldn't write file */
+	ST_ERR_COPY,		/* Couldn't copy file data */
+	ST_ERR_THREAD,		/* Couldn't start a thread */
+	ST_ERR_INDEX,		/* Unusable file index */
+	ST_ERR_JOURNAL,		/* Couldn't read or write the journal */
+	ST_ERR_INTR,		/* Stopped by a signal, see intr.h */
+	ST_ERR_VERIFY,		/* A copy isn't the same as its source */
 	ST_ERR_END		/* END of error declaration: easier to use in macros */
 } stcode_t;
 
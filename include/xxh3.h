@@ -0,0 +1,25 @@
+#ifndef XXH3_H
+#define XXH3_H
+
+#include <stddef.h>		/* size_t */
+#include <stdint.h>		/* uint64_t */
+
+/* Pending bytes a struct xxh3 keeps: anything up to 240 bytes is hashed
+ * differently, so it's only known how once more arrived.
+ */
+#define XXH3_BUFLEN 256
+
+struct xxh3 {
+	uint64_t acc[8];	/* state */
+	uint64_t len;		/* bytes hashed so far */
+	unsigned nstripes;	/* 64-byte stripes in the current block */
+	unsigned nbuf;		/* bytes pending, after the previous 64 */
+	unsigned char buf[64 + XXH3_BUFLEN];
+};
+
+void xxh3_init(struct xxh3* s);
+void xxh3_update(struct xxh3* s, const void* data, size_t len);
+uint64_t xxh3_final(const struct xxh3* s);
+uint64_t xxh3(const void* data, size_t len);
+
+#endif
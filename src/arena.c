@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* Whatever malloc aligns for */
+union arena_align {
+	long double ld;
+	uintmax_t um;
+	void* p;
+	void (*fp)(void);
+};
+#define ARENA_ALIGN sizeof(union arena_align)
+
+struct arena_chunk {
+	struct arena_chunk* next;
+	union arena_align data[];	/* the allocations */
+};
+
+/* Allocations past this size get a chunk of their own, so they don't
+ * waste what's left of the current one.
+ */
+#define ARENA_BIG (ARENA_CHUNK / 4)
+
+static void* bump(struct arena* a, size_t size);
+static struct arena_chunk* new_chunk(size_t size);
+
+void arena_init(struct arena* a)
+{
+	a->head = NULL;
+	a->pos = a->end = NULL;
+	a->nchunks = 0;
+}
+
+/* Returns `size' bytes, aligned like malloc, or NULL with errno set
+ * to ENOMEM. The memory lives until the arena is freed.
+ */
+void* arena_alloc(struct arena* a, size_t size)
+{
+	size_t pad = (size_t)(uintptr_t)a->pos % ARENA_ALIGN;
+	if (pad && (size_t)(a->end - a->pos) >= ARENA_ALIGN - pad)
+		a->pos += ARENA_ALIGN - pad;
+	return bump(a, size);
+}
+
+/* Copies the string into the arena. Strings don't need any alignment,
+ * so they're packed back to back.
+ */
+char* arena_strdup(struct arena* a, const char* s)
+{
+	size_t len = strlen(s) + 1;
+	char* copy = bump(a, len);
+	if (copy)
+		memcpy(copy, s, len);
+	return copy;
+}
+
+struct arena_mark arena_save(const struct arena* a)
+{
+	struct arena_mark m = { a->head, a->pos };
+	return m;
+}
+
+/* Gives back what was allocated since `m' was saved, when it's still in
+ * the current chunk. Otherwise the memory stays around until the arena
+ * is freed.
+ */
+void arena_restore(struct arena* a, struct arena_mark m)
+{
+	if (a->head == m.head && m.pos)
+		a->pos = m.pos;
+}
+
+/* Moves every chunk of `src' into `dst', and leaves `src' empty. The
+ * rest of dst's current chunk stays in use; whatever remains of src's
+ * is lost.
+ */
+void arena_merge(struct arena* dst, struct arena* src)
+{
+	struct arena_chunk* c = src->head;
+
+	if (!c)
+		return;
+	if (!dst->head) {
+		*dst = *src;
+		arena_init(src);
+		return;
+	}
+
+	struct arena_chunk* last = c;
+	while (last->next)
+		last = last->next;
+	last->next = dst->head->next;
+	dst->head->next = c;
+	dst->nchunks += src->nchunks;
+	arena_init(src);
+}
+
+/* Releases every allocation at once, in one free per chunk. The arena
+ * can be used again afterwards.
+ */
+void arena_free(struct arena* a)
+{
+	struct arena_chunk* c = a->head;
+	while (c) {
+		struct arena_chunk* next = c->next;
+		free(c);
+		c = next;
+	}
+	arena_init(a);
+}
+
+static void* bump(struct arena* a, size_t size)
+{
+	if (size > ARENA_BIG) {
+		/* Doesn't touch the current chunk, goes right after it */
+		struct arena_chunk* c = new_chunk(size);
+		if (!c)
+			return NULL;
+		if (a->head) {
+			c->next = a->head->next;
+			a->head->next = c;
+		} else {
+			c->next = NULL;
+			a->head = c;
+			a->pos = a->end = (char*)c->data + size;
+		}
+		a->nchunks++;
+		return c->data;
+	}
+
+	if (!a->head || (size_t)(a->end - a->pos) < size) {
+		struct arena_chunk* c = new_chunk(ARENA_CHUNK);
+		if (!c)
+			return NULL;
+		c->next = a->head;
+		a->head = c;
+		a->pos = (char*)c->data;
+		a->end = a->pos + ARENA_CHUNK;
+		a->nchunks++;
+	}
+
+	void* p = a->pos;
+	a->pos += size;
+	return p;
+}
+
+static struct arena_chunk* new_chunk(size_t size)
+{
+	if (size > SIZE_MAX - sizeof(struct arena_chunk)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return malloc(sizeof(struct arena_chunk) + size);
+}
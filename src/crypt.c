@@ -0,0 +1,593 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crypt.h"
+
+/* ChaCha20 and Poly1305, and the AEAD made of them, RFC 8439.
+ *
+ * ChaCha20 works on CHACHA_LANES blocks at once, word i of every block
+ * side by side, and only puts the words back in block order at the end,
+ * see chacha_xor(). That loop is written three times, for AVX2 (all the
+ * blocks in one vector per word), SSE2 (half of them), and none.
+ * Poly1305 takes 44-bit limbs where 128-bit products are at hand, 26-bit
+ * ones otherwise.
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CHACHA_LANES	8
+#define CHACHA_BLOCK	64
+#define CHACHA_CHUNK	(CHACHA_LANES * CHACHA_BLOCK)
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define QR(x, a, b, c, d) \
+	for (unsigned l = 0; l < CHACHA_LANES; ++l) { \
+		x[a][l] += x[b][l]; x[d][l] = ROTL(x[d][l] ^ x[a][l], 16); \
+		x[c][l] += x[d][l]; x[b][l] = ROTL(x[b][l] ^ x[c][l], 12); \
+		x[a][l] += x[b][l]; x[d][l] = ROTL(x[d][l] ^ x[a][l], 8); \
+		x[c][l] += x[d][l]; x[b][l] = ROTL(x[b][l] ^ x[c][l], 7); \
+	}
+
+/* Ten double rounds, of the quarter round QRF */
+#define ROUNDS(QRF, x) \
+	for (int i = 0; i < 10; ++i) { \
+		QRF(x, 0, 4, 8, 12) QRF(x, 1, 5, 9, 13) QRF(x, 2, 6, 10, 14) QRF(x, 3, 7, 11, 15) \
+		QRF(x, 0, 5, 10, 15) QRF(x, 1, 6, 11, 12) QRF(x, 2, 7, 8, 13) QRF(x, 3, 4, 9, 14) \
+	}
+
+/* POLY_HIBIT is the 2^128 added to every whole block */
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 poly_wide;
+typedef uint64_t poly_limb;
+#define POLY_LIMBS	3
+#define POLY_HIBIT	((uint64_t)1 << 40)
+#define M44		0xfffffffffffULL
+#define M42		0x3ffffffffffULL
+#else
+typedef uint32_t poly_limb;
+#define POLY_LIMBS	5
+#define POLY_HIBIT	(1u << 24)
+#endif
+
+struct poly1305 {
+	poly_limb r[POLY_LIMBS];
+	poly_limb h[POLY_LIMBS];
+	uint32_t pad[4];
+	unsigned char buf[16];
+	size_t left;		/* bytes in buf */
+};
+
+static void chacha_init(uint32_t s[16], const unsigned char key[CRYPT_KEYLEN],
+			const unsigned char nonce[CRYPT_NONCELEN], uint32_t counter);
+static void chacha_xor(const uint32_t s[16], const unsigned char* in, unsigned char* out);
+static void poly_init(struct poly1305* p, const unsigned char key[32]);
+static void poly_blocks(struct poly1305* p, const unsigned char* m, size_t len, poly_limb hibit);
+static void poly_update(struct poly1305* p, const void* data, size_t len);
+static void poly_pad(struct poly1305* p);
+static void poly_final(struct poly1305* p, unsigned char tag[CRYPT_TAGLEN]);
+static void aead_mac(const unsigned char key[CRYPT_KEYLEN],
+		     const unsigned char nonce[CRYPT_NONCELEN], const void* ct, size_t len,
+		     const void* ad, size_t adlen, unsigned char tag[CRYPT_TAGLEN]);
+static uint32_t load32(const unsigned char* p);
+#ifdef __SIZEOF_INT128__
+static uint64_t load64(const unsigned char* p);
+#endif
+static void store32(unsigned char* p, uint32_t v);
+static void store64(unsigned char* p, uint64_t v);
+
+/* XORs `len' bytes of `in' with the key stream, starting at block
+ * `counter', into `out'. They may be the same buffer.
+ */
+void chacha20(const unsigned char key[CRYPT_KEYLEN],
+	      const unsigned char nonce[CRYPT_NONCELEN], uint32_t counter,
+	      const void* in, void* out, size_t len)
+{
+	const unsigned char* ip = in;
+	unsigned char* op = out;
+	uint32_t s[16];
+
+	chacha_init(s, key, nonce, counter);
+	for (; len >= CHACHA_CHUNK; len -= CHACHA_CHUNK) {
+		chacha_xor(s, ip, op);
+		ip += CHACHA_CHUNK;
+		op += CHACHA_CHUNK;
+		s[12] += CHACHA_LANES;
+	}
+	/* The rest goes through a chunk of its own */
+	if (len > 0) {
+		unsigned char buf[CHACHA_CHUNK];
+		memcpy(buf, ip, len);
+		chacha_xor(s, buf, buf);
+		memcpy(op, buf, len);
+		crypt_wipe(buf, sizeof(buf));
+	}
+	crypt_wipe(s, sizeof(s));
+}
+
+/* Derives a key of its own from `key' and a random `salt', with
+ * HChaCha20 as XChaCha20 does: nonces then only need to be unique under
+ * one salt.
+ */
+void crypt_subkey(const unsigned char key[CRYPT_KEYLEN],
+		  const unsigned char salt[CRYPT_SALTLEN],
+		  unsigned char out[CRYPT_KEYLEN])
+{
+	uint32_t x[16][CHACHA_LANES];
+	uint32_t s[16];
+
+	/* Only the first lane matters */
+	chacha_init(s, key, salt + 4, load32(salt));
+	for (unsigned i = 0; i < 16; ++i)
+		for (unsigned l = 0; l < CHACHA_LANES; ++l)
+			x[i][l] = s[i];
+	ROUNDS(QR, x)
+	for (unsigned i = 0; i < 4; ++i) {
+		store32(out + 4 * i, x[i][0]);
+		store32(out + 16 + 4 * i, x[12 + i][0]);
+	}
+	crypt_wipe(x, sizeof(x));
+	crypt_wipe(s, sizeof(s));
+}
+
+/* Encrypts the `len' bytes of `buf' in place, and authenticates them
+ * along with `adlen' bytes of `ad' into `tag'. A nonce must never be
+ * used twice with the same key.
+ */
+void crypt_seal(const unsigned char key[CRYPT_KEYLEN],
+		const unsigned char nonce[CRYPT_NONCELEN], void* buf, size_t len,
+		const void* ad, size_t adlen, unsigned char tag[CRYPT_TAGLEN])
+{
+	chacha20(key, nonce, 1, buf, buf, len);
+	aead_mac(key, nonce, buf, len, ad, adlen, tag);
+}
+
+/* Checks `tag', then decrypts the `len' bytes of `buf' in place. Returns
+ * 0 on success, -1 if they, or `ad', were tampered with: `buf' is then
+ * left as it was.
+ */
+int crypt_open(const unsigned char key[CRYPT_KEYLEN],
+	       const unsigned char nonce[CRYPT_NONCELEN], void* buf, size_t len,
+	       const void* ad, size_t adlen, const unsigned char tag[CRYPT_TAGLEN])
+{
+	unsigned char want[CRYPT_TAGLEN];
+	unsigned diff = 0;
+
+	aead_mac(key, nonce, buf, len, ad, adlen, want);
+	/* In constant time */
+	for (size_t i = 0; i < CRYPT_TAGLEN; ++i)
+		diff |= (unsigned)(want[i] ^ tag[i]);
+	if (diff)
+		return -1;
+
+	chacha20(key, nonce, 1, buf, buf, len);
+	return 0;
+}
+
+/* Clears `buf' in a way the compiler can't drop */
+void crypt_wipe(void* buf, size_t len)
+{
+	volatile unsigned char* p = buf;
+	while (len--)
+		*p++ = 0;
+}
+
+static void chacha_init(uint32_t s[16], const unsigned char key[CRYPT_KEYLEN],
+			const unsigned char nonce[CRYPT_NONCELEN], uint32_t counter)
+{
+	/* "expand 32-byte k" */
+	s[0] = 0x61707865;
+	s[1] = 0x3320646e;
+	s[2] = 0x79622d32;
+	s[3] = 0x6b206574;
+	for (unsigned i = 0; i < 8; ++i)
+		s[4 + i] = load32(key + 4 * i);
+	s[12] = counter;
+	for (unsigned i = 0; i < 3; ++i)
+		s[13 + i] = load32(nonce + 4 * i);
+}
+
+/* XORs the CHACHA_CHUNK bytes of `in' with the key stream of the next
+ * CHACHA_LANES blocks, from counter s[12] on, into `out', which may be
+ * `in'. The words of the state are broadcast again at the end, rather
+ * than kept in registers the rounds need.
+ */
+#if defined(__AVX2__)
+#define ROTV(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+/* Rotations by 16 and 8 are byte shuffles */
+#define QRV(x, a, b, c, d) \
+	x[a] = _mm256_add_epi32(x[a], x[b]); \
+	x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot16); \
+	x[c] = _mm256_add_epi32(x[c], x[d]); \
+	x[b] = ROTV(_mm256_xor_si256(x[b], x[c]), 12); \
+	x[a] = _mm256_add_epi32(x[a], x[b]); \
+	x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot8); \
+	x[c] = _mm256_add_epi32(x[c], x[d]); \
+	x[b] = ROTV(_mm256_xor_si256(x[b], x[c]), 7);
+
+static void chacha_xor(const uint32_t s[16], const unsigned char* in, unsigned char* out)
+{
+	const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+					      13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+					     14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+	const __m256i ctr = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i x[16];
+
+	for (unsigned i = 0; i < 16; ++i)
+		x[i] = _mm256_set1_epi32((int)s[i]);
+	x[12] = _mm256_add_epi32(x[12], ctr);
+
+	ROUNDS(QRV, x)
+
+	/* Words 0-7, then 8-15, transposed: row l is half of block l */
+	for (unsigned h = 0; h < 2; ++h) {
+		__m256i* w = x + 8 * h;
+		__m256i t[8], u[8];
+
+		for (unsigned i = 0; i < 8; ++i)
+			w[i] = _mm256_add_epi32(w[i], _mm256_set1_epi32((int)s[8 * h + i]));
+		if (h == 1)
+			w[4] = _mm256_add_epi32(w[4], ctr);
+
+		for (unsigned i = 0; i < 8; i += 2) {
+			t[i] = _mm256_unpacklo_epi32(w[i], w[i + 1]);
+			t[i + 1] = _mm256_unpackhi_epi32(w[i], w[i + 1]);
+		}
+		for (unsigned i = 0; i < 8; i += 4) {
+			u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+			u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+			u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+			u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+		}
+		/* Blocks l and l + 4 share u[l] and u[l + 4] */
+		for (unsigned l = 0; l < 4; ++l) {
+			__m256i lo = _mm256_permute2x128_si256(u[l], u[l + 4], 0x20);
+			__m256i hi = _mm256_permute2x128_si256(u[l], u[l + 4], 0x31);
+			size_t a = l * CHACHA_BLOCK + 32 * h;
+			size_t b = a + 4 * CHACHA_BLOCK;
+			__m256i da = _mm256_loadu_si256((const __m256i*)(const void*)(in + a));
+			__m256i db = _mm256_loadu_si256((const __m256i*)(const void*)(in + b));
+			_mm256_storeu_si256((__m256i*)(void*)(out + a), _mm256_xor_si256(da, lo));
+			_mm256_storeu_si256((__m256i*)(void*)(out + b), _mm256_xor_si256(db, hi));
+		}
+	}
+}
+#elif defined(__SSE2__)
+#define ROTV(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+#define ROTV16(x) _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1)
+
+#define QRV(x, a, b, c, d) \
+	x[a] = _mm_add_epi32(x[a], x[b]); x[d] = ROTV16(_mm_xor_si128(x[d], x[a])); \
+	x[c] = _mm_add_epi32(x[c], x[d]); x[b] = ROTV(_mm_xor_si128(x[b], x[c]), 12); \
+	x[a] = _mm_add_epi32(x[a], x[b]); x[d] = ROTV(_mm_xor_si128(x[d], x[a]), 8); \
+	x[c] = _mm_add_epi32(x[c], x[d]); x[b] = ROTV(_mm_xor_si128(x[b], x[c]), 7);
+
+/* Four blocks at a time, one per lane */
+static void chacha_xor(const uint32_t s[16], const unsigned char* in, unsigned char* out)
+{
+	__m128i x[16];
+
+	for (unsigned half = 0; half < 2; ++half) {
+		const __m128i ctr = _mm_set_epi32((int)(4 * half + 3), (int)(4 * half + 2),
+						  (int)(4 * half + 1), (int)(4 * half));
+		for (unsigned i = 0; i < 16; ++i)
+			x[i] = _mm_set1_epi32((int)s[i]);
+		x[12] = _mm_add_epi32(x[12], ctr);
+
+		ROUNDS(QRV, x)
+
+		/* Words 4q to 4q + 3, transposed: row l is a quarter of block l */
+		for (unsigned q = 0; q < 4; ++q) {
+			__m128i* w = x + 4 * q;
+			__m128i r[4];
+
+			for (unsigned i = 0; i < 4; ++i)
+				w[i] = _mm_add_epi32(w[i], _mm_set1_epi32((int)s[4 * q + i]));
+			if (q == 3)
+				w[0] = _mm_add_epi32(w[0], ctr);
+
+			__m128i t0 = _mm_unpacklo_epi32(w[0], w[1]);
+			__m128i t1 = _mm_unpackhi_epi32(w[0], w[1]);
+			__m128i t2 = _mm_unpacklo_epi32(w[2], w[3]);
+			__m128i t3 = _mm_unpackhi_epi32(w[2], w[3]);
+			r[0] = _mm_unpacklo_epi64(t0, t2);
+			r[1] = _mm_unpackhi_epi64(t0, t2);
+			r[2] = _mm_unpacklo_epi64(t1, t3);
+			r[3] = _mm_unpackhi_epi64(t1, t3);
+			for (unsigned l = 0; l < 4; ++l) {
+				size_t a = (4 * half + l) * CHACHA_BLOCK + 16 * q;
+				__m128i d = _mm_loadu_si128((const __m128i*)(const void*)(in + a));
+				_mm_storeu_si128((__m128i*)(void*)(out + a), _mm_xor_si128(d, r[l]));
+			}
+		}
+	}
+}
+#else
+static void chacha_xor(const uint32_t s[16], const unsigned char* in, unsigned char* out)
+{
+	uint32_t x[16][CHACHA_LANES];
+
+	for (unsigned i = 0; i < 16; ++i)
+		for (unsigned l = 0; l < CHACHA_LANES; ++l)
+			x[i][l] = s[i];
+	for (unsigned l = 0; l < CHACHA_LANES; ++l)
+		x[12][l] += l;
+
+	ROUNDS(QR, x)
+
+	for (unsigned l = 0; l < CHACHA_LANES; ++l) {
+		for (unsigned i = 0; i < 16; ++i) {
+			size_t a = l * CHACHA_BLOCK + 4 * i;
+			store32(out + a, load32(in + a) ^
+				(x[i][l] + s[i] + ((i == 12) ? l : 0)));
+		}
+	}
+}
+#endif
+
+#ifdef __SIZEOF_INT128__
+/* Poly1305 with 44-bit limbs, after poly1305-donna-64 */
+static void poly_init(struct poly1305* p, const unsigned char key[32])
+{
+	uint64_t t0 = load64(key), t1 = load64(key + 8);
+
+	p->r[0] = t0 & 0xffc0fffffffULL;
+	p->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+	p->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+	for (unsigned i = 0; i < 3; ++i)
+		p->h[i] = 0;
+	for (unsigned i = 0; i < 4; ++i)
+		p->pad[i] = load32(key + 16 + 4 * i);
+	p->left = 0;
+}
+
+static void poly_blocks(struct poly1305* p, const unsigned char* m, size_t len, poly_limb hibit)
+{
+	const uint64_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2];
+	const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+	uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+
+	for (; len >= 16; m += 16, len -= 16) {
+		uint64_t t0 = load64(m), t1 = load64(m + 8);
+		h0 += t0 & M44;
+		h1 += ((t0 >> 44) | (t1 << 20)) & M44;
+		h2 += ((t1 >> 24) & M42) | hibit;
+
+		poly_wide d0 = (poly_wide)h0 * r0 + (poly_wide)h1 * s2 + (poly_wide)h2 * s1;
+		poly_wide d1 = (poly_wide)h0 * r1 + (poly_wide)h1 * r0 + (poly_wide)h2 * s2;
+		poly_wide d2 = (poly_wide)h0 * r2 + (poly_wide)h1 * r1 + (poly_wide)h2 * r0;
+
+		uint64_t c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & M44;
+		d1 += c; c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & M44;
+		d2 += c; c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & M42;
+		h0 += c * 5; c = h0 >> 44; h0 &= M44;
+		h1 += c;
+	}
+
+	p->h[0] = h0; p->h[1] = h1; p->h[2] = h2;
+}
+#else
+/* Poly1305 with 26-bit limbs, after poly1305-donna */
+static void poly_init(struct poly1305* p, const unsigned char key[32])
+{
+	p->r[0] = load32(key + 0) & 0x3ffffff;
+	p->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+	p->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+	p->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+	p->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+	for (unsigned i = 0; i < 5; ++i)
+		p->h[i] = 0;
+	for (unsigned i = 0; i < 4; ++i)
+		p->pad[i] = load32(key + 16 + 4 * i);
+	p->left = 0;
+}
+
+static void poly_blocks(struct poly1305* p, const unsigned char* m, size_t len, poly_limb hibit)
+{
+	const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+	const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+
+	for (; len >= 16; m += 16, len -= 16) {
+		h0 += load32(m + 0) & 0x3ffffff;
+		h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+		h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+		h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+		h4 += (load32(m + 12) >> 8) | hibit;
+
+		uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 +
+			      (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+		uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 +
+			      (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+		uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 +
+			      (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+		uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 +
+			      (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+		uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 +
+			      (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+		uint32_t c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+		d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+		d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+		d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+		d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+		h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+		h1 += c;
+	}
+
+	p->h[0] = h0; p->h[1] = h1; p->h[2] = h2; p->h[3] = h3; p->h[4] = h4;
+}
+#endif
+
+static void poly_update(struct poly1305* p, const void* data, size_t len)
+{
+	const unsigned char* m = data;
+
+	if (p->left) {
+		size_t n = 16 - p->left;
+		if (n > len)
+			n = len;
+		memcpy(p->buf + p->left, m, n);
+		p->left += n;
+		m += n;
+		len -= n;
+		if (p->left < 16)
+			return;
+		poly_blocks(p, p->buf, 16, POLY_HIBIT);
+		p->left = 0;
+	}
+
+	size_t whole = len & ~(size_t)15;
+	poly_blocks(p, m, whole, POLY_HIBIT);
+	memcpy(p->buf, m + whole, len - whole);
+	p->left = len - whole;
+}
+
+/* Zeros up to the next 16 bytes, as the AEAD wants between its parts */
+static void poly_pad(struct poly1305* p)
+{
+	static const unsigned char zeros[16];
+	if (p->left)
+		poly_update(p, zeros, 16 - p->left);
+}
+
+static void poly_final(struct poly1305* p, unsigned char tag[CRYPT_TAGLEN])
+{
+	if (p->left) {
+		p->buf[p->left] = 1;
+		memset(p->buf + p->left + 1, 0, 16 - p->left - 1);
+		poly_blocks(p, p->buf, 16, 0);
+	}
+
+#ifdef __SIZEOF_INT128__
+	uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], c;
+	uint64_t g0, g1, g2, mask;
+
+	c = h1 >> 44; h1 &= M44;
+	h2 += c; c = h2 >> 42; h2 &= M42;
+	h0 += c * 5; c = h0 >> 44; h0 &= M44;
+	h1 += c; c = h1 >> 44; h1 &= M44;
+	h2 += c; c = h2 >> 42; h2 &= M42;
+	h0 += c * 5; c = h0 >> 44; h0 &= M44;
+	h1 += c;
+
+	/* h - p, kept if it didn't go below zero */
+	g0 = h0 + 5; c = g0 >> 44; g0 &= M44;
+	g1 = h1 + c; c = g1 >> 44; g1 &= M44;
+	g2 = h2 + c - ((uint64_t)1 << 42);
+
+	mask = (g2 >> 63) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+
+	uint64_t t0 = (uint64_t)p->pad[0] | (uint64_t)p->pad[1] << 32;
+	uint64_t t1 = (uint64_t)p->pad[2] | (uint64_t)p->pad[3] << 32;
+	h0 += t0 & M44; c = h0 >> 44; h0 &= M44;
+	h1 += (((t0 >> 44) | (t1 << 20)) & M44) + c; c = h1 >> 44; h1 &= M44;
+	h2 += ((t1 >> 24) & M42) + c;
+
+	store64(tag, h0 | (h1 << 44));
+	store64(tag + 8, (h1 >> 20) | (h2 << 24));
+#else
+	uint32_t h0, h1, h2, h3, h4, c;
+	uint32_t g0, g1, g2, g3, g4, mask;
+
+	h0 = p->h[0]; h1 = p->h[1]; h2 = p->h[2]; h3 = p->h[3]; h4 = p->h[4];
+	c = h1 >> 26; h1 &= 0x3ffffff;
+	h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+	h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+	h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	/* h - p, kept if it didn't go below zero */
+	g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	g4 = h4 + c - (1u << 26);
+
+	mask = (g4 >> 31) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+	h3 = (h3 & ~mask) | (g3 & mask);
+	h4 = (h4 & ~mask) | (g4 & mask);
+
+	h0 = h0 | (h1 << 26);
+	h1 = (h1 >> 6) | (h2 << 20);
+	h2 = (h2 >> 12) | (h3 << 14);
+	h3 = (h3 >> 18) | (h4 << 8);
+
+	uint64_t f = (uint64_t)h0 + p->pad[0];
+	store32(tag + 0, (uint32_t)f);
+	f = (uint64_t)h1 + p->pad[1] + (f >> 32);
+	store32(tag + 4, (uint32_t)f);
+	f = (uint64_t)h2 + p->pad[2] + (f >> 32);
+	store32(tag + 8, (uint32_t)f);
+	f = (uint64_t)h3 + p->pad[3] + (f >> 32);
+	store32(tag + 12, (uint32_t)f);
+#endif
+
+	crypt_wipe(p, sizeof(*p));
+}
+
+/* The tag of the AEAD over `ad' and the cipher text `ct' */
+static void aead_mac(const unsigned char key[CRYPT_KEYLEN],
+		     const unsigned char nonce[CRYPT_NONCELEN], const void* ct, size_t len,
+		     const void* ad, size_t adlen, unsigned char tag[CRYPT_TAGLEN])
+{
+	unsigned char otk[32] = { 0 };
+	unsigned char lens[16];
+	struct poly1305 p;
+
+	/* The one-time key is the start of block 0 */
+	chacha20(key, nonce, 0, otk, otk, sizeof(otk));
+	poly_init(&p, otk);
+	crypt_wipe(otk, sizeof(otk));
+
+	poly_update(&p, ad, adlen);
+	poly_pad(&p);
+	poly_update(&p, ct, len);
+	poly_pad(&p);
+	store64(lens, (uint64_t)adlen);
+	store64(lens + 8, (uint64_t)len);
+	poly_update(&p, lens, sizeof(lens));
+	poly_final(&p, tag);
+}
+
+static uint32_t load32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	       (uint32_t)p[3] << 24;
+}
+
+#ifdef __SIZEOF_INT128__
+static uint64_t load64(const unsigned char* p)
+{
+	return (uint64_t)load32(p) | (uint64_t)load32(p + 4) << 32;
+}
+#endif
+
+static void store32(unsigned char* p, uint32_t v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+static void store64(unsigned char* p, uint64_t v)
+{
+	store32(p, (uint32_t)v);
+	store32(p + 4, (uint32_t)(v >> 32));
+}
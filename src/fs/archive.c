@@ -0,0 +1,937 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crypt.h"
+#include "hash.h"
+#include "fs.h"
+#include "fs/archive.h"
+#include "intr.h"
+#include "lz.h"
+#include "stats.h"
+#include "status.h"
+#include "xxh3.h"
+
+struct archive_pass {
+	struct archiver* ar;
+	status_t ret;
+};
+
+static int archive_one(const void* key, void* value, void* user_data);
+static status_t archive_entry(struct archiver* ar, const struct file* f);
+static ssize_t entry_path(struct archiver* ar, const struct file* f);
+static status_t put_file(struct archiver* ar, const struct file* f, const char* path);
+static status_t put_symlink(struct archiver* ar, const struct file* f, const char* path);
+static int add_rec(struct archiver* ar, const struct file* who, const struct file* f,
+		   const char* path, uint64_t off, uint64_t size);
+static status_t put_index(struct archiver* ar);
+static int put(struct archiver* ar, const void* data, size_t len);
+static int grow(struct archiver* ar);
+static int put_pad(struct archiver* ar);
+static int put_block(void* arg, const struct zblock* b);
+static int flush(struct archiver* ar);
+static int write_all(struct archiver* ar, const void* data, size_t len);
+static int random_bytes(void* buf, size_t len);
+static void key_check(const unsigned char key[CRYPT_KEYLEN], unsigned char check[16]);
+static void index_nonce(unsigned char nonce[CRYPT_NONCELEN]);
+static int load_block(struct archive* a, uint64_t blk);
+static int archive_valid(const struct archive* a);
+
+/* Opens the source root, and starts the archive `dst'. It's written under
+ * a temporary name, and only renamed to `dst' once complete, by
+ * archive_tree().
+ *
+ * Member data goes through `zthreads' threads, see fs/zpipe.h, to be
+ * compressed if `zflags' has ZPIPE_LZ, and encrypted with `key' if not
+ * NULL, CRYPT_KEYLEN bytes.
+ */
+status_t archive_init(struct archiver* ar, const struct dirtree* tree,
+		      const char* src, const char* dst, int oflags,
+		      unsigned zthreads, int zflags, const unsigned char* key)
+{
+	struct arch_hdr hdr;
+	status_t ret;
+	int blocked = (zflags & ZPIPE_LZ) || key;
+
+	if (!ar || !tree || !src || !dst)
+		return STATUS(ST_INT_ISNULL, EINVAL, "Setting up archive", NULL);
+
+	memset(ar, 0, sizeof(*ar));
+	ar->tree = tree;
+	ar->oflags = oflags;
+	ar->fd = -1;
+	dirfds_init(&ar->dirs, tree, -1, -1, oflags);
+	ar->srcfd = open(src, O_RDONLY | O_DIRECTORY | oflags);
+	if (ar->srcfd < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening source", strdup(src));
+	/* Entries are reached through their directories, never by path */
+	dirfds_init(&ar->dirs, tree, ar->srcfd, -1, oflags);
+
+	size_t len = strlen(dst);
+	ar->dst = strdup(dst);
+	ar->tmp = malloc(len + sizeof(".tmp"));
+	ar->bufsz = (blocked) ? ARCH_BLOCK : ARCH_BUFSZ;
+	ar->buf = malloc(ar->bufsz);
+	if (blocked) {
+		ar->blkcap = 1024;
+		ar->blocks = malloc(ar->blkcap * sizeof(uint64_t));
+	}
+	if (!ar->dst || !ar->tmp || !ar->buf || (blocked && !ar->blocks)) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Setting up archive", NULL);
+		goto err_free;
+	}
+	memcpy(ar->tmp, dst, len);
+	memcpy(ar->tmp + len, ".tmp", sizeof(".tmp"));
+
+	ar->fd = open(ar->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, 0666);
+	if (ar->fd < 0) {
+		ret = STATUS_E(ST_ERR_OPEN, "Creating archive", strdup(ar->tmp));
+		goto err_free;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ARCH_MAGIC, sizeof(hdr.magic));
+	hdr.version = ARCH_VERSION;
+	hdr.order = ARCH_ORDER;
+	if (blocked)
+		hdr.blocksz = ARCH_BLOCK;
+	if (zflags & ZPIPE_LZ)
+		hdr.flags |= ARCH_LZ;
+	if (key) {
+		hdr.flags |= ARCH_CRYPT;
+		ar->crypt = 1;
+		if (random_bytes(hdr.salt, sizeof(hdr.salt)) == -1) {
+			ret = STATUS_E(ST_ERR_FILERD, "Drawing archive salt", strdup("/dev/urandom"));
+			goto err_free;
+		}
+		crypt_subkey(key, hdr.salt, ar->key);
+		key_check(ar->key, hdr.check);
+	}
+	put(ar, &hdr, sizeof(hdr));
+
+	if (blocked) {
+		/* The header isn't compressed */
+		if (flush(ar) == -1) {
+			ret = STATUS_E(ST_ERR_FILEWR, "Writing archive", strdup(ar->tmp));
+			goto err_free;
+		}
+		ret = zpipe_start(&ar->z, zthreads, ARCH_BLOCK, zflags,
+				  (key) ? ar->key : NULL, put_block, ar);
+		if (ret.c != ST_OK)
+			goto err_free;
+		ar->zip = 1;
+	}
+	return STATUS(ST_OK, 0, "Setting up archive", NULL);
+
+err_free:
+	archive_free(ar);
+	return ret;
+}
+
+/* Closes everything. An archive archive_tree() didn't complete is
+ * removed.
+ */
+void archive_free(struct archiver* ar)
+{
+	if (!ar)
+		return;
+
+	if (ar->z.slots)
+		zpipe_stop(&ar->z);
+	if (ar->fd >= 0) {
+		close(ar->fd);
+		unlink(ar->tmp);
+	}
+	dirfds_flush(&ar->dirs);
+	close(ar->srcfd);
+	free(ar->dst);
+	free(ar->tmp);
+	free(ar->buf);
+	free(ar->recs);
+	free(ar->who);
+	free(ar->blocks);
+	free(ar->path);
+	crypt_wipe(ar->key, sizeof(ar->key));
+	memset(ar, 0, sizeof(*ar));
+	ar->fd = -1;
+	ar->srcfd = -1;
+}
+
+/* Writes the data of everything in `files', then the index, and puts the
+ * archive in place once it's on disk.
+ */
+status_t archive_tree(struct archiver* ar, struct hash_table* files)
+{
+	struct archive_pass pass = { .ar = ar };
+	pass.ret = STATUS(ST_OK, 0, "Archiving tree", NULL);
+
+	hash_foreach(files, archive_one, &pass);
+	if (pass.ret.c != ST_OK)
+		return pass.ret;
+
+	status_t ret = put_index(ar);
+	if (ret.c != ST_OK)
+		return ret;
+
+	if (flush(ar) == -1 || fsync(ar->fd) == -1)
+		return STATUS_E(ST_ERR_FILEWR, "Writing archive", strdup(ar->tmp));
+	int r = close(ar->fd);
+	ar->fd = -1;
+	if (r == -1) {
+		ret = STATUS_E(ST_ERR_FILEWR, "Closing archive", strdup(ar->tmp));
+		unlink(ar->tmp);
+		return ret;
+	}
+	if (rename(ar->tmp, ar->dst) == -1) {
+		ret = STATUS_E(ST_ERR_FILEWR, "Renaming archive", strdup(ar->dst));
+		unlink(ar->tmp);
+		return ret;
+	}
+	return STATUS(ST_OK, 0, "Archiving tree", NULL);
+}
+
+static int archive_one(const void* key, void* value, void* user_data)
+{
+	struct archive_pass* pass = user_data;
+	(void)key;
+
+	if (terminate_wanted) {
+		pass->ret = STATUS(ST_ERR_INTR, EINTR, "Archiving tree", NULL);
+		return 1;
+	}
+
+	status_t ret = archive_entry(pass->ar, value);
+	if (ret.c == ST_OK)
+		return 0;
+
+	/* Permission error, rather skip */
+	if (ret.sysc == EACCES) {
+		sterr(ret);
+		status_free(ret);
+		return 0;
+	}
+
+	pass->ret = ret;
+	return 1;
+}
+
+/* Appends the data of `f', if any, and records it under every name it
+ * has. Special files are skipped.
+ */
+static status_t archive_entry(struct archiver* ar, const struct file* f)
+{
+	status_t ret = STATUS(ST_OK, 0, "Archiving entry", NULL);
+	uint64_t off = ar->off;
+
+	if (entry_path(ar, f) == -1)
+		return STATUS_E(ST_ERR_MALLOC, "Building file path", strdup(f->name));
+
+	if (S_ISDIR(f->mode))
+		ar->stats.ndirs++;
+	else if (S_ISREG(f->mode))
+		ret = put_file(ar, f, ar->path);
+	else if (S_ISLNK(f->mode))
+		ret = put_symlink(ar, f, ar->path);
+	else
+		return ret;
+	if (ret.c != ST_OK)
+		return ret;
+
+	uint64_t size = ar->off - off;
+	if (add_rec(ar, f, f, ar->path, off, size) == -1)
+		return STATUS_E(ST_ERR_MALLOC, "Archiving entry", strdup(ar->path));
+
+	for (const struct file* l = f->links; l; l = l->links) {
+		if (entry_path(ar, l) == -1)
+			return STATUS_E(ST_ERR_MALLOC, "Building file path", strdup(l->name));
+		if (add_rec(ar, l, f, ar->path, off, size) == -1)
+			return STATUS_E(ST_ERR_MALLOC, "Archiving entry", strdup(ar->path));
+		ar->stats.nlinks++;
+	}
+	return ret;
+}
+
+/* Writes the path of `f' in ar->path, grown to fit: members can be
+ * deeper than PATH_MAX, since they're read through their directories.
+ * Returns its length, or -1 with errno set if memory ran out.
+ */
+static ssize_t entry_path(struct archiver* ar, const struct file* f)
+{
+	size_t len = file_path_len(ar->tree, f);
+	if (len >= ar->pathcap) {
+		size_t cap = (ar->pathcap) ? ar->pathcap : 256;
+		while (cap <= len)
+			cap *= 2;
+		char* path = realloc(ar->path, cap);
+		if (!path)
+			return -1;
+		ar->path = path;
+		ar->pathcap = cap;
+	}
+	return file_path(ar->tree, f, ar->path, ar->pathcap);
+}
+
+/* Appends the contents of the regular file `f', at `path', as far as the
+ * size it had when opened: a file growing meanwhile doesn't hold the
+ * others up. It's opened by its name in its directory, see fs/dirfds.h.
+ */
+static status_t put_file(struct archiver* ar, const struct file* f, const char* path)
+{
+	status_t ret;
+	struct stat sb;
+	file_t src;
+
+	if (dirfds_at(&ar->dirs, f, &src, NULL) == -1)
+		return STATUS_E(ST_ERR_OPEN, "Opening parent directory", strdup(path));
+	uint64_t t = STATS_START();
+	int in = openat(src.pfd, src.name, O_RDONLY | O_NOCTTY | (ar->oflags & O_NOFOLLOW));
+	STATS_TIME(STATS_OPEN, t);
+	if (in < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening source file", strdup(path));
+	if (fstat(in, &sb) == -1) {
+		ret = STATUS_E(ST_ERR_FILERD_MD, "Reading file metadata", strdup(path));
+		goto out_close;
+	}
+
+	off_t left = sb.st_size;
+	while (left > 0) {
+		if (ar->len == ar->bufsz && flush(ar) == -1) {
+			ret = STATUS_E(ST_ERR_FILEWR, "Writing archive", strdup(ar->tmp));
+			goto out_close;
+		}
+		size_t want = ar->bufsz - ar->len;
+		if ((uintmax_t)want > (uintmax_t)left)
+			want = (size_t)left;
+
+		t = STATS_START();
+		ssize_t n = read(in, ar->buf + ar->len, want);
+		STATS_TIME(STATS_READ, t);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = STATUS_E(ST_ERR_FILERD, "Reading file", strdup(path));
+			goto out_close;
+		}
+		/* Shrunk meanwhile */
+		if (n == 0)
+			break;
+		STATS_ADD(STATS_BYTES_READ, n);
+		ar->len += (size_t)n;
+		ar->off += (uint64_t)n;
+		ar->stats.nbytes += (uintmax_t)n;
+		left -= n;
+	}
+
+	ar->stats.nfiles++;
+	ret = STATUS(ST_OK, 0, "Archiving file", NULL);
+out_close:
+	close(in);
+	return ret;
+}
+
+static status_t put_symlink(struct archiver* ar, const struct file* f, const char* path)
+{
+	char target[PATH_MAX];
+	file_t src;
+
+	if (dirfds_at(&ar->dirs, f, &src, NULL) == -1)
+		return STATUS_E(ST_ERR_OPEN, "Opening parent directory", strdup(path));
+	ssize_t len = readlinkat(src.pfd, src.name, target, sizeof(target));
+	if (len < 0)
+		return STATUS_E(ST_ERR_FILERD, "Reading symbolic link", strdup(path));
+
+	if (put(ar, target, (size_t)len) == -1)
+		return STATUS_E(ST_ERR_FILEWR, "Writing archive", strdup(ar->tmp));
+	ar->stats.nsymlinks++;
+	return STATUS(ST_OK, 0, "Archiving symbolic link", NULL);
+}
+
+/* Records the name `who' at `path', of the file `f' whose data is at
+ * `off'. Returns 0 on success, -1 with errno set otherwise.
+ */
+static int add_rec(struct archiver* ar, const struct file* who, const struct file* f,
+		   const char* path, uint64_t off, uint64_t size)
+{
+	if (ar->nrec == ar->cap) {
+		size_t cap = (ar->cap) ? ar->cap * 2 : 1024;
+		struct arch_rec* recs = realloc(ar->recs, cap * sizeof(*recs));
+		if (!recs)
+			return -1;
+		ar->recs = recs;
+		const struct file** w = realloc(ar->who, cap * sizeof(*w));
+		if (!w)
+			return -1;
+		ar->who = w;
+		ar->cap = cap;
+	}
+
+	struct arch_rec* r = &ar->recs[ar->nrec];
+	memset(r, 0, sizeof(*r));
+	r->off = off;
+	r->size = size;
+	r->mtime = f->mtime;
+	r->mode = (uint32_t)f->mode;
+	r->hash = archive_hash(path);
+	r->path = ar->strlen;
+	ar->who[ar->nrec++] = who;
+	ar->strlen += strlen(path) + 1;
+	return 0;
+}
+
+/* Appends the block offsets, if any, the records, the hash directory,
+ * the paths and the tail. None of it is compressed. With ARCH_CRYPT, it's
+ * gathered in ar->buf up to the tail, and sealed there as one, see
+ * struct arch_hdr.
+ */
+static status_t put_index(struct archiver* ar)
+{
+	struct arch_tail tail;
+	status_t ret;
+
+	if (ar->nrec >= ARCH_EMPTY)
+		return STATUS(ST_ERR_FILEWR, EOVERFLOW, "Writing archive index", strdup(ar->tmp));
+
+	memset(&tail, 0, sizeof(tail));
+	if (ar->zip) {
+		if (flush(ar) == -1 || zpipe_drain(&ar->z) == -1)
+			return STATUS_E(ST_ERR_FILEWR, "Writing archive", strdup(ar->tmp));
+		zpipe_stop(&ar->z);
+		ar->zip = 0;
+		/* put_block() left room for it */
+		ar->blocks[ar->nblocks] = ar->pos;
+
+		if (put_pad(ar) == -1)
+			return STATUS_E(ST_ERR_FILEWR, "Writing archive", strdup(ar->tmp));
+		tail.blkoff = ar->pos + ar->len;
+		if (ar->crypt) {
+			if (flush(ar) == -1)
+				return STATUS_E(ST_ERR_FILEWR, "Writing archive", strdup(ar->tmp));
+			ar->sealing = 1;
+		}
+		tail.nblocks = ar->nblocks;
+		if (put(ar, ar->blocks, (ar->nblocks + 1) * sizeof(uint64_t)) == -1)
+			return STATUS_E(ST_ERR_FILEWR, "Writing archive", strdup(ar->tmp));
+	}
+
+	tail.nrec = ar->nrec;
+	tail.nslots = 16;
+	while (tail.nslots < ar->nrec * 2)
+		tail.nslots *= 2;
+	uint32_t* slots = malloc(tail.nslots * sizeof(uint32_t));
+	if (!slots)
+		return STATUS_E(ST_ERR_MALLOC, "Writing archive index", NULL);
+	memset(slots, 0xff, tail.nslots * sizeof(uint32_t));
+
+	uint64_t mask = tail.nslots - 1;
+	for (size_t i = 0; i < ar->nrec; ++i) {
+		uint64_t pos = ar->recs[i].hash & mask;
+		while (slots[pos] != ARCH_EMPTY)
+			pos = (pos + 1) & mask;
+		slots[pos] = (uint32_t)i;
+	}
+
+	if (put_pad(ar) == -1)
+		goto err_write;
+	tail.recoff = ar->pos + ar->len;
+	if (put(ar, ar->recs, ar->nrec * sizeof(struct arch_rec)) == -1)
+		goto err_write;
+	tail.slotoff = ar->pos + ar->len;
+	if (put(ar, slots, tail.nslots * sizeof(uint32_t)) == -1)
+		goto err_write;
+
+	/* In the same order as the records, which have their offsets */
+	tail.stroff = ar->pos + ar->len;
+	for (size_t i = 0; i < ar->nrec; ++i) {
+		ssize_t len = entry_path(ar, ar->who[i]);
+		if (len == -1) {
+			ret = STATUS_E(ST_ERR_MALLOC, "Building file path", strdup(ar->who[i]->name));
+			goto out_free;
+		}
+		if (put(ar, ar->path, (size_t)len + 1) == -1)
+			goto err_write;
+	}
+	tail.strlen = ar->pos + ar->len - tail.stroff;
+
+	memcpy(tail.magic, ARCH_MAGIC, sizeof(tail.magic));
+	if (put_pad(ar) == -1)
+		goto err_write;
+	if (ar->sealing) {
+		/* Nothing was written since blkoff */
+		unsigned char nonce[CRYPT_NONCELEN], tag[CRYPT_TAGLEN];
+		index_nonce(nonce);
+		crypt_seal(ar->key, nonce, ar->buf, ar->len, &tail, sizeof(tail), tag);
+		memcpy(tail.tag, tag, sizeof(tag));
+		ar->sealing = 0;
+	}
+	if (put(ar, &tail, sizeof(tail)) == -1)
+		goto err_write;
+	ret = STATUS(ST_OK, 0, "Writing archive index", NULL);
+	goto out_free;
+
+err_write:
+	ret = STATUS_E(ST_ERR_FILEWR, "Writing archive index", strdup(ar->tmp));
+out_free:
+	free(slots);
+	return ret;
+}
+
+/* Appends `len' bytes of `data'. Returns 0 on success, -1 with errno set
+ * otherwise.
+ */
+static int put(struct archiver* ar, const void* data, size_t len)
+{
+	const char* p = data;
+
+	while (len > 0) {
+		if (ar->len == ar->bufsz && ((ar->sealing) ? grow(ar) : flush(ar)) == -1)
+			return -1;
+		size_t n = ar->bufsz - ar->len;
+		if (n > len)
+			n = len;
+		memcpy(ar->buf + ar->len, p, n);
+		ar->len += n;
+		ar->off += n;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Doubles the buffer, which has to hold the whole index while it's sealed.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+static int grow(struct archiver* ar)
+{
+	if (ar->bufsz > SIZE_MAX / 2) {
+		errno = ENOMEM;
+		return -1;
+	}
+	char* buf = realloc(ar->buf, ar->bufsz * 2);
+	if (!buf)
+		return -1;
+	ar->buf = buf;
+	ar->bufsz *= 2;
+	return 0;
+}
+
+/* Pads what's written as is to the next multiple of 8 bytes */
+static int put_pad(struct archiver* ar)
+{
+	static const char zeros[8];
+	return put(ar, zeros, (8 - (ar->pos + ar->len) % 8) % 8);
+}
+
+/* A zpipe_out_fn: writes a block, in the order they were cut. */
+static int put_block(void* arg, const struct zblock* b)
+{
+	struct archiver* ar = arg;
+	struct arch_block bh = {
+		.ulen = (uint32_t)b->ulen, .clen = (uint32_t)b->clen, .sum = b->sum
+	};
+
+	/* Always room for where the last one ends */
+	if (ar->nblocks + 1 == ar->blkcap) {
+		uint64_t* blocks = realloc(ar->blocks, ar->blkcap * 2 * sizeof(uint64_t));
+		if (!blocks)
+			return -1;
+		ar->blocks = blocks;
+		ar->blkcap *= 2;
+	}
+	ar->blocks[ar->nblocks++] = ar->pos;
+
+	if (write_all(ar, &bh, sizeof(bh)) == -1 || write_all(ar, b->data, b->clen) == -1 ||
+	    (b->tag && write_all(ar, b->tag, CRYPT_TAGLEN) == -1))
+		return -1;
+	ar->stats.nzbytes += sizeof(bh) + b->clen + ((b->tag) ? CRYPT_TAGLEN : 0);
+	return 0;
+}
+
+/* Hands the buffer to the block threads, or writes it as is */
+static int flush(struct archiver* ar)
+{
+	if (ar->len == 0)
+		return 0;
+	if (ar->zip) {
+		if (zpipe_put(&ar->z, &ar->buf, ar->len) == -1)
+			return -1;
+		ar->len = 0;
+		return 0;
+	}
+
+	if (write_all(ar, ar->buf, ar->len) == -1)
+		return -1;
+	ar->len = 0;
+	return 0;
+}
+
+static int write_all(struct archiver* ar, const void* data, size_t len)
+{
+	const char* p = data;
+	size_t left = len;
+
+	while (left > 0) {
+		uint64_t t = STATS_START();
+		ssize_t n = write(ar->fd, p, left);
+		STATS_TIME(STATS_WRITE, t);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		STATS_ADD(STATS_BYTES_WRITTEN, n);
+		p += n;
+		left -= (size_t)n;
+	}
+	ar->pos += len;
+	return 0;
+}
+
+/* Maps the archive at `path', and checks its index. Members are only
+ * read when used, and need `key', CRYPT_KEYLEN bytes, if the archive is
+ * encrypted: NULL otherwise.
+ */
+status_t archive_open(struct archive* a, const char* path, const unsigned char* key)
+{
+	struct stat sb;
+	status_t ret;
+
+	memset(a, 0, sizeof(*a));
+	int fd = open(path, O_RDONLY | O_NOCTTY);
+	if (fd < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening archive", strdup(path));
+	if (fstat(fd, &sb) == -1) {
+		ret = STATUS_E(ST_ERR_FILERD_MD, "Reading archive metadata", strdup(path));
+		goto out_close;
+	}
+	if ((uintmax_t)sb.st_size < sizeof(struct arch_hdr) + sizeof(struct arch_tail) ||
+	    (uintmax_t)sb.st_size > SIZE_MAX) {
+		ret = STATUS(ST_ERR_FILERD, EINVAL, "Archive is truncated", strdup(path));
+		goto out_close;
+	}
+
+	a->len = (size_t)sb.st_size;
+	a->map = mmap(NULL, a->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (a->map == MAP_FAILED) {
+		a->map = NULL;
+		ret = STATUS_E(ST_ERR_FILERD, "Mapping archive", strdup(path));
+		goto out_close;
+	}
+	close(fd);
+
+	const char* base = a->map;
+	a->hdr = a->map;
+	a->cached = UINT64_MAX;
+	a->tail = (const struct arch_tail*)(const void*)(base + a->len - sizeof(struct arch_tail));
+	if (a->len % 8 || !archive_valid(a)) {
+		archive_close(a);
+		return STATUS(ST_ERR_FILERD, EINVAL, "Archive is damaged", strdup(path));
+	}
+
+	/* Where the index is read from, and its offset in the archive */
+	const char* index = base;
+	uint64_t skip = 0;
+	if (a->hdr->flags & ARCH_CRYPT) {
+		unsigned char check[sizeof(a->hdr->check)];
+		unsigned char nonce[CRYPT_NONCELEN];
+		if (!key) {
+			archive_close(a);
+			return STATUS(ST_ERR_FILERD, EACCES, "Archive is encrypted, it needs a key",
+				      strdup(path));
+		}
+		crypt_subkey(key, a->hdr->salt, a->key);
+		key_check(a->key, check);
+		if (memcmp(check, a->hdr->check, sizeof(check)) != 0) {
+			archive_close(a);
+			return STATUS(ST_ERR_FILERD, EACCES, "Wrong key for archive", strdup(path));
+		}
+
+		/* Decrypted aside: the map is read-only */
+		struct arch_tail ad = *a->tail;
+		size_t len = a->len - sizeof(struct arch_tail) - (size_t)a->tail->blkoff;
+		memset(ad.tag, 0, sizeof(ad.tag));
+		a->index = malloc((len) ? len : 1);
+		if (!a->index) {
+			ret = STATUS_E(ST_ERR_MALLOC, "Reading archive index", NULL);
+			archive_close(a);
+			return ret;
+		}
+		memcpy(a->index, base + a->tail->blkoff, len);
+		index_nonce(nonce);
+		if (crypt_open(a->key, nonce, a->index, len, &ad, sizeof(ad), a->tail->tag) == -1) {
+			archive_close(a);
+			return STATUS(ST_ERR_FILERD, EBADMSG, "Archive index doesn't authenticate",
+				      strdup(path));
+		}
+		index = a->index;
+		skip = a->tail->blkoff;
+	}
+	a->recs = (const struct arch_rec*)(const void*)(index + (a->tail->recoff - skip));
+	a->slots = (const uint32_t*)(const void*)(index + (a->tail->slotoff - skip));
+	a->strs = index + (a->tail->stroff - skip);
+	if (a->hdr->flags & ARCH_BLOCKED)
+		a->blocks = (const uint64_t*)(const void*)(index + (a->tail->blkoff - skip));
+
+	/* Every path ends before the area does */
+	if (a->tail->strlen && a->strs[a->tail->strlen - 1] != '\0') {
+		archive_close(a);
+		return STATUS(ST_ERR_FILERD, EINVAL, "Archive is damaged", strdup(path));
+	}
+	return STATUS(ST_OK, 0, "Opening archive", NULL);
+
+out_close:
+	close(fd);
+	return ret;
+}
+
+void archive_close(struct archive* a)
+{
+	if (a->map)
+		munmap(a->map, a->len);
+	free(a->block);
+	free(a->clear);
+	free(a->index);
+	crypt_wipe(a->key, sizeof(a->key));
+	memset(a, 0, sizeof(*a));
+}
+
+/* Finds the member at `path', relative to the archived root. Returns
+ * NULL if there's none.
+ */
+const struct arch_rec* archive_find(const struct archive* a, const char* path)
+{
+	uint32_t h = archive_hash(path);
+	uint64_t mask = a->tail->nslots - 1;
+	uint64_t pos = h & mask;
+
+	for (uint64_t n = 0; n < a->tail->nslots; ++n) {
+		uint32_t s = a->slots[pos];
+		if (s == ARCH_EMPTY)
+			return NULL;
+		if (s < a->tail->nrec && a->recs[s].hash == h &&
+		    a->recs[s].path < a->tail->strlen &&
+		    strcmp(a->strs + a->recs[s].path, path) == 0)
+			return &a->recs[s];
+		pos = (pos + 1) & mask;
+	}
+	return NULL;
+}
+
+/* Reads up to `len' bytes of the member `r' into `buf', from `pos' on.
+ * Returns how many, 0 past its end, or -1 with errno set: EINVAL if the
+ * archive is damaged.
+ */
+ssize_t archive_read(struct archive* a, const struct arch_rec* r, uint64_t pos,
+		     char* buf, size_t len)
+{
+	const uint64_t start = sizeof(struct arch_hdr);
+
+	if (pos >= r->size)
+		return 0;
+	if (len > r->size - pos)
+		len = (size_t)(r->size - pos);
+	if (len > SSIZE_MAX)
+		len = SSIZE_MAX;
+	if (r->off < start || r->off > UINT64_MAX - r->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	uint64_t off = r->off + pos;
+
+	if (!(a->hdr->flags & ARCH_BLOCKED)) {
+		/* Member data ends where the index starts */
+		if (off > a->tail->recoff || len > a->tail->recoff - off) {
+			errno = EINVAL;
+			return -1;
+		}
+		memcpy(buf, (const char*)a->map + off, len);
+		return (ssize_t)len;
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		uint64_t blk = (off - start) / a->hdr->blocksz;
+		size_t within = (size_t)((off - start) % a->hdr->blocksz);
+		if (load_block(a, blk) == -1)
+			return -1;
+		if (within >= a->blklen) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		size_t n = a->blklen - within;
+		if (n > len - done)
+			n = len - done;
+		memcpy(buf + done, a->block + within, n);
+		done += n;
+		off += n;
+	}
+	return (ssize_t)done;
+}
+
+/* FNV-1a */
+uint32_t archive_hash(const char* path)
+{
+	uint32_t h = 2166136261u;
+	for (const unsigned char* p = (const unsigned char*)path; *p; ++p)
+		h = (h ^ *p) * 16777619u;
+	return h;
+}
+
+/* Reads block `blk' into a->block, unless it's there already: checks and
+ * decrypts it, then decompresses it. Returns 0 on success, -1 with errno
+ * set otherwise: EBADMSG if it doesn't authenticate, or doesn't match its
+ * sum.
+ */
+static int load_block(struct archive* a, uint64_t blk)
+{
+	struct arch_block bh;
+	size_t bs = a->hdr->blocksz;
+	size_t taglen = (a->hdr->flags & ARCH_CRYPT) ? CRYPT_TAGLEN : 0;
+
+	if (blk == a->cached)
+		return 0;
+	if (blk >= a->tail->nblocks) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!a->block && !(a->block = malloc(bs)))
+		return -1;
+	if (taglen && !a->clear && !(a->clear = malloc(bs)))
+		return -1;
+
+	uint64_t from = a->blocks[blk], to = a->blocks[blk + 1];
+	if (from >= to || to > a->tail->blkoff || to - from < sizeof(bh) + taglen) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&bh, (const char*)a->map + from, sizeof(bh));
+	/* Only the last one is short */
+	if (bh.ulen > bs || (bh.ulen != bs && blk + 1 < a->tail->nblocks) ||
+	    bh.clen > bh.ulen || bh.clen != to - from - sizeof(bh) - taglen ||
+	    (bh.clen != bh.ulen && !(a->hdr->flags & ARCH_LZ))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const char* data = (const char*)a->map + from + sizeof(bh);
+	a->cached = UINT64_MAX;
+	if (taglen) {
+		unsigned char nonce[CRYPT_NONCELEN];
+		zpipe_nonce(blk, nonce);
+		/* Where it's decompressed from, or straight where it's read */
+		char* to_buf = (bh.clen == bh.ulen) ? a->block : a->clear;
+		uint32_t ad[2] = { bh.ulen, bh.clen };
+		memcpy(to_buf, data, bh.clen);
+		if (crypt_open(a->key, nonce, to_buf, bh.clen, ad, sizeof(ad),
+			       (const unsigned char*)data + bh.clen) == -1) {
+			errno = EBADMSG;
+			return -1;
+		}
+		data = to_buf;
+	}
+	if (bh.clen == bh.ulen) {
+		if (data != a->block)
+			memcpy(a->block, data, bh.ulen);
+	} else if (lz_decompress(data, bh.clen, a->block, bs) != (ssize_t)bh.ulen) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (xxh3(a->block, bh.ulen) != bh.sum) {
+		errno = EBADMSG;
+		return -1;
+	}
+	a->blklen = bh.ulen;
+	a->cached = blk;
+	return 0;
+}
+
+/* Checks the header and tail, and that every part of the index lies
+ * between them, properly aligned. What's in the index is only checked
+ * once it's decrypted.
+ */
+static int archive_valid(const struct archive* a)
+{
+	const struct arch_hdr* h = a->map;
+	const struct arch_tail* t = a->tail;
+	uint64_t end = a->len - sizeof(struct arch_tail);
+
+	if (memcmp(h->magic, ARCH_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != ARCH_VERSION || h->order != ARCH_ORDER ||
+	    memcmp(t->magic, ARCH_MAGIC, sizeof(t->magic)) != 0 || (h->flags & ~ARCH_BLOCKED))
+		return 0;
+	if (h->flags & ARCH_BLOCKED) {
+		if (h->blocksz == 0 || h->blocksz > (1u << 26) || t->blkoff % sizeof(uint64_t) ||
+		    t->blkoff < sizeof(struct arch_hdr) || t->blkoff > end ||
+		    t->nblocks >= (end - t->blkoff) / sizeof(uint64_t))
+			return 0;
+	}
+	/* A power of two, with at least one free slot */
+	if (t->nslots == 0 || (t->nslots & (t->nslots - 1)) || t->nrec >= t->nslots ||
+	    t->nrec >= ARCH_EMPTY)
+		return 0;
+
+	if (t->recoff % sizeof(uint64_t) || t->slotoff % sizeof(uint32_t))
+		return 0;
+	if (t->recoff < sizeof(struct arch_hdr) || t->recoff > end ||
+	    t->nrec > (end - t->recoff) / sizeof(struct arch_rec))
+		return 0;
+	if (t->slotoff > end || t->nslots > (end - t->slotoff) / sizeof(uint32_t))
+		return 0;
+	if (t->stroff > end || t->strlen > end - t->stroff)
+		return 0;
+	/* All of the index is sealed */
+	if ((h->flags & ARCH_CRYPT) &&
+	    (t->recoff < t->blkoff || t->slotoff < t->blkoff || t->stroff < t->blkoff))
+		return 0;
+	return 1;
+}
+
+/* Fills `buf' from the system's random source. Returns 0 on success, -1
+ * with errno set otherwise.
+ */
+static int random_bytes(void* buf, size_t len)
+{
+	char* p = buf;
+	int fd = open("/dev/urandom", O_RDONLY | O_NOCTTY);
+	if (fd < 0)
+		return -1;
+
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0) errno = EIO;
+			close(fd);
+			return -1;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return close(fd);
+}
+
+/* What tells `key' from another, see struct arch_hdr */
+static void key_check(const unsigned char key[CRYPT_KEYLEN], unsigned char check[16])
+{
+	unsigned char nonce[CRYPT_NONCELEN];
+	memset(nonce, 0xff, sizeof(nonce));
+	memset(check, 0, 16);
+	chacha20(key, nonce, 0, check, check, 16);
+}
+
+/* What the index is sealed with, see struct arch_hdr */
+static void index_nonce(unsigned char nonce[CRYPT_NONCELEN])
+{
+	memset(nonce, 0, CRYPT_NONCELEN);
+	memset(nonce, 0xff, 4);
+}
@@ -0,0 +1,848 @@
+/* renameat(2), linkat(2), fdopen(3), getline(3) and gmtime_r(3) are
+ * POSIX, O_DIRECTORY too; syncfs(2) is not
+ */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "hash.h"
+#include "sha256.h"
+#include "fs.h"
+#include "fs/chunk.h"
+#include "stats.h"
+#include "status.h"
+
+/* FastCDC normalized chunking: a harder mask (15 bits) before CDC_AVG
+ * and an easier one (11 bits) after it pull chunk sizes towards the
+ * average. Bits are spread over the hash, which is a shifted sum and so
+ * carries more of the window in its high bits.
+ */
+#define MASK_S 0x0003590703530000ULL
+#define MASK_L 0x0000d90003530000ULL
+
+/* Random values for every byte, from splitmix64 */
+static const uint64_t gear[256] = {
+	0x35f33fc05fe07753ULL, 0x48d3970c00c474b3ULL, 0x167f24dd7cf668e8ULL, 0x8032884090560eceULL,
+	0x2aaa6ce25403886eULL, 0x6fb54f4e681b7a61ULL, 0xca30d00addf80e6eULL, 0x6bb6e0001c27f752ULL,
+	0x46d5dfc2d7bc9e1bULL, 0xe3e369636e55bd41ULL, 0x1eeba91aceeebc66ULL, 0x9bfffc07703fea64ULL,
+	0x184b55225dd87331ULL, 0xfa691fbf6fc643fdULL, 0x0b2251139cdca45dULL, 0x481511e600aa2997ULL,
+	0x266230047852b0f0ULL, 0x79a4c864bbb3d3f6ULL, 0x85ac16fa8f4717cdULL, 0x152a48d413bcee8cULL,
+	0xf3c0e8da51aac533ULL, 0x2ba87a736bbd355eULL, 0x17e9b95905f0934bULL, 0x3b4fe01ac8f7902aULL,
+	0x90f16b5ab281f2b0ULL, 0x7aa525a860ac346aULL, 0x9eeb1314e4caf7c0ULL, 0xadb3ca0120326e7eULL,
+	0x1f6eb30ea1b6efc3ULL, 0x5fddd54e6095ae43ULL, 0x71529de9187e5b3eULL, 0x1240b02e0a433885ULL,
+	0xcdc1dfd7febf08c4ULL, 0x54fa1af867b5c7f9ULL, 0xb6c4fe3efa638e47ULL, 0xe0cf47039d3d805cULL,
+	0x20e063cfd1e35d7fULL, 0x4cf05472c7d15619ULL, 0x9004353a61f5bfaeULL, 0x1ebff5f15db5786cULL,
+	0x2364fa192b3dfeefULL, 0x0b71cc375c0af26dULL, 0x8786a742e5a43374ULL, 0x0bb9c7fc35135839ULL,
+	0x1a565537f7936aaeULL, 0x424a3f4307d04e9fULL, 0xb7cec60583531ee2ULL, 0x3453185a0965a65fULL,
+	0xd4edf3fcd8e69e98ULL, 0x619916fe9e0e4c77ULL, 0xab239f9f01a5e241ULL, 0xb6c7d63380aee53fULL,
+	0xb932e5b2f0a269ffULL, 0x94d17c173be12875ULL, 0xcd73b441bac02136ULL, 0xa1699ded4a0ac8b0ULL,
+	0xbd3d642d7e948cceULL, 0xe92a102cb51471f1ULL, 0xeed8310c263d868aULL, 0x1c71332be6f49eb3ULL,
+	0x28475877b83cfabeULL, 0x85d41743e0a411c5ULL, 0x238103b4bd42fa73ULL, 0x85b6b8797f295cc2ULL,
+	0x0faf06f529f5194cULL, 0xf3243b94535b472cULL, 0x7a8b56df1a0ee836ULL, 0x256e12f5f2c7cec3ULL,
+	0x7406f8fded30e79aULL, 0xda56022c844e75fcULL, 0xc4b8e4432392725cULL, 0x6079d1a3621940e2ULL,
+	0xf9bd2187857802b9ULL, 0xcae1475e31191a52ULL, 0x94698c6e1eeb31feULL, 0x961bd6c744bb008fULL,
+	0xfec08d2b945207b3ULL, 0xa07df1d2980132f9ULL, 0xff51d3bfe8c3db3bULL, 0xb89281ce3aa5a5d8ULL,
+	0xb2dba047407eb1f5ULL, 0x786334585c5f111cULL, 0x803f7077c9f35887ULL, 0xd5dbe28c080badffULL,
+	0x3817d8c19459ba76ULL, 0xc4b8f5a6b0d96efeULL, 0xd1e8f91f49051a91ULL, 0x177f54f9d368795dULL,
+	0xd7d0768a15cfdfc5ULL, 0xfe663e82ebf70e79ULL, 0xaddf3bd1d4072f9fULL, 0x72c66dc358b00aeaULL,
+	0xf06330293a2df7c2ULL, 0x563c58a53211d9b6ULL, 0x37c54954961c62daULL, 0x801a50cc11f27471ULL,
+	0x10dc16ad236007feULL, 0x78b310c0dc787061ULL, 0xcfbdaf726186a7ddULL, 0x65d13f27828bba38ULL,
+	0x10753c044e85ec20ULL, 0x42210dff1d5a1ca4ULL, 0xf1a3875d80c6a781ULL, 0x45ceb8a66f4078ceULL,
+	0xc9468cc653d67d1bULL, 0x48eba413d0e14f3fULL, 0x681877095966afe1ULL, 0xad3e565bb6ea42bcULL,
+	0x9596edfc3e100037ULL, 0x97adad5ae0e3bce4ULL, 0x66bf48c4b0344a57ULL, 0xddd5fd368ba9e372ULL,
+	0x88ebe18d3cbf0189ULL, 0x7db1dac0730b0f4eULL, 0x92183fd7b3125399ULL, 0x31e81b9f84d05296ULL,
+	0xb838700810306028ULL, 0x707cd7e7c84c73d8ULL, 0x2a605e917307aecbULL, 0x129d76edaa132572ULL,
+	0x8099c4ebc67f47dcULL, 0xcfe788e682d41735ULL, 0x9109791a7d9ac3d0ULL, 0xa59df5d3a3904812ULL,
+	0x5bd758bc63349158ULL, 0x8c6f14ea23737007ULL, 0x94627992e61445baULL, 0x1c05e8d46cfd5234ULL,
+	0x25039d350142fcb3ULL, 0x7fb25cbcf826abd4ULL, 0xf323cd703b6887a1ULL, 0x0af28c74285d8d59ULL,
+	0x0455d495b0e71922ULL, 0x81cb7bddd6c0e8fcULL, 0x2302c4f2f33dc6a4ULL, 0xa209f210386fe739ULL,
+	0x1fadb0c8550cbdc4ULL, 0xc9c4fa551e2a439fULL, 0x57ff3465b4bfe2ceULL, 0xfa0ae61714f7f151ULL,
+	0xb4ec7d88092425c7ULL, 0x7479e4b87546ccefULL, 0xfaba38c82838b85eULL, 0xe16f9e957f017210ULL,
+	0x55038bfffd78fd95ULL, 0x08c56f64012a67c6ULL, 0x749b5a9965ddc4eaULL, 0x02e400430f239964ULL,
+	0x8fa13f3e11780a71ULL, 0x7ee1d8084d1c0033ULL, 0x9419d2275036c781ULL, 0x930b68f5de706adaULL,
+	0xabcf52a6c52478b1ULL, 0xdda0bbae85d59f16ULL, 0xb035c827ed9273e7ULL, 0x6630826d4119e391ULL,
+	0xa0251bfb7a7a5d76ULL, 0xfb7a9958a8e3c9a5ULL, 0xd9e5d8f24d27b760ULL, 0x3246f3c4eab9496dULL,
+	0x1441e74b4cbc6881ULL, 0xded71237b73f64fcULL, 0xa759fe0dcdf431f7ULL, 0x05106c9ff74c0400ULL,
+	0x0e4a504991abcf5eULL, 0xa74b91c22e322902ULL, 0xe85569e14c28bad3ULL, 0x70e025e21982d202ULL,
+	0x2ee2f2353d35cdceULL, 0x8a2360cafeb65413ULL, 0x67ea66e1dffa0fc0ULL, 0xf9bc44d79abf5516ULL,
+	0xfdab1fa10b906b51ULL, 0xae3e6c325378ecadULL, 0x6410e8237e5020beULL, 0x393f8ce288a03334ULL,
+	0x5691daf8cef09333ULL, 0x6dd900404dec85abULL, 0x9ea59dfb8d81dbb6ULL, 0xa02008686b109f72ULL,
+	0x2bbddf62ddda0961ULL, 0xa55ee00d9be17929ULL, 0x6ffe0b18b7f1a3c2ULL, 0xcb55b079b45020f5ULL,
+	0xff72dcf4135e511bULL, 0x9feff59a238ab96cULL, 0xc1372bca40b85496ULL, 0x69ae8b2188660d9eULL,
+	0xa724f78db7087531ULL, 0xf65c85786fd26cc8ULL, 0x3468f33200c2dc4bULL, 0xa886a22038a9ac17ULL,
+	0x23460e3e5f7227e7ULL, 0x6dbacb208c3db598ULL, 0x981453fa64786e51ULL, 0xb371ac6d88398a93ULL,
+	0xdc5da6b2d571bfd1ULL, 0x65004a1f75bcc31fULL, 0xd2219d8023e39f7aULL, 0x8724b59df9ade721ULL,
+	0x3e80ab6f2bcda800ULL, 0xb331c983d0984ee4ULL, 0x0a794270433a2b61ULL, 0xda958a1f86cb33c7ULL,
+	0x8d57b8d1ffeb4e97ULL, 0x0d3ce2909620706bULL, 0xac20fbd9e39bb78fULL, 0x15c8fb7c3f01f551ULL,
+	0x5b603141db53708fULL, 0x2329971c05fde0a4ULL, 0x0257a51ca357f61cULL, 0x84d2f53a20bf9c60ULL,
+	0x5f4662d0068f7aa0ULL, 0x42eaef9b86ed24cdULL, 0x639e596a2183c488ULL, 0x6e7e3e1258e2535bULL,
+	0xbc6b28ae0ecd9cdcULL, 0x2e7072a1f4dddbaaULL, 0x059e74b063ba8bf9ULL, 0xe19e23488b8f966fULL,
+	0x05619621173a790aULL, 0x7bf2e68522ad430aULL, 0x6c07c21d8520578dULL, 0xc2cb995ccbbc0770ULL,
+	0xe65d0f5b49175433ULL, 0xf7ec60fc64bb95e9ULL, 0x513c2cb1ba2e111aULL, 0x3f3b9e8de056bae8ULL,
+	0xb0be10bf4f614282ULL, 0x13804a72993a237dULL, 0x4211a12a1fef72b9ULL, 0x81574e07e500cf69ULL,
+	0xbcf2ec28e3f5447dULL, 0x74399ae5c08845a4ULL, 0x1598317c3994f2dfULL, 0xe9c00e6a1cb752cbULL,
+	0x37c5835932f093bfULL, 0xe29a809af0165d9bULL, 0xa8552ed0179b7753ULL, 0x5159af35f5245488ULL,
+	0xeb7fc01d7a862ddaULL, 0x395331d41f3f2df5ULL, 0x8c916d7848480badULL, 0x207333cc26048b91ULL,
+	0xe849bd53f2c8875eULL, 0x57b1953e25fad8f8ULL, 0xdd12bb4edbe2003bULL, 0x17c2c71e7064890fULL,
+	0x1c17d567de462cd2ULL, 0x8edfab0cfc78307bULL, 0x75caa7b3029d3c97ULL, 0x2333c8da31dbf7bcULL,
+	0x80f5556d33bbe378ULL, 0xa80675a38851de64ULL, 0xe3d2e4d523bcb3ecULL, 0xcfcbf5d90ba707a5ULL,
+};
+
+struct store_pass {
+	struct chunkstore* cs;
+	FILE* fp;		/* manifest, when writing it */
+	status_t ret;
+};
+
+static status_t put_chunk(struct chunkstore* cs, const unsigned char* p, size_t len);
+static int write_all(int fd, const unsigned char* p, size_t len);
+static int store_one(const void* key, void* value, void* user_data);
+static status_t write_manifest(struct chunkstore* cs, struct hash_table* files);
+static int sync_store(int fd);
+static int put_entry(const void* key, void* value, void* user_data);
+static void put_path(FILE* fp, const char* s);
+static void hexdigest(const unsigned char* d, char* hex);
+static char* get_path(char* s);
+static char* field(char* line, int n);
+static status_t put_file(FILE* fp, int chunkfd, size_t nchunks, FILE* out);
+static uint64_t digest_hash(const void* key);
+static int digest_cmp(const void* a, const void* b);
+
+/* Returns the length of the chunk at the start of `p': the first cut
+ * point of the gear hash, CDC_MAX, or `n' if neither comes first. When
+ * `n' is returned and more data follows, the caller should append it
+ * and ask again.
+ *
+ * The gear hash only depends on the last 64 bytes it saw, so the same
+ * content cuts at the same places wherever it sits in a file.
+ */
+size_t cdc_cut(const unsigned char* p, size_t n)
+{
+	uint64_t h = 0;
+	size_t i = CDC_MIN;
+	size_t normal = CDC_AVG;
+	size_t max = CDC_MAX;
+
+	if (n <= CDC_MIN)
+		return n;
+	if (max > n) max = n;
+	if (normal > max) normal = max;
+
+	for (; i < normal; ++i) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & MASK_S))
+			return i + 1;
+	}
+	for (; i < max; ++i) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & MASK_L))
+			return i + 1;
+	}
+	return max;
+}
+
+/* Opens the source root, and the store at `dst', which is created along
+ * with its chunk directories if needed. Chunk lists are allocated from
+ * `mem', and paths rebuilt from `tree'.
+ */
+status_t store_init(struct chunkstore* cs, const struct dirtree* tree, struct arena* mem,
+		    const char* src, const char* dst, int oflags)
+{
+	status_t ret;
+
+	if (!cs || !tree || !mem || !src || !dst)
+		return STATUS(ST_INT_ISNULL, EINVAL, "Setting up chunk store", NULL);
+
+	memset(cs, 0, sizeof(*cs));
+	cs->tree = tree;
+	cs->mem = mem;
+	cs->oflags = oflags;
+	cs->rootfd = cs->chunkfd = -1;
+	dirfds_init(&cs->dirs, tree, -1, -1, oflags);
+
+	cs->srcfd = open(src, O_RDONLY | O_DIRECTORY | oflags);
+	if (cs->srcfd < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening source", strdup(src));
+	/* Entries are reached through their directories, never by path */
+	dirfds_init(&cs->dirs, tree, cs->srcfd, -1, oflags);
+
+	if (mkdir(dst, 0777) == -1 && errno != EEXIST) {
+		ret = STATUS_E(ST_ERR_MKDIR, "Creating chunk store", strdup(dst));
+		goto err_free;
+	}
+	cs->rootfd = open(dst, O_RDONLY | O_DIRECTORY);
+	if (cs->rootfd < 0) {
+		ret = STATUS_E(ST_ERR_OPEN, "Opening chunk store", strdup(dst));
+		goto err_free;
+	}
+	if (mkdirat(cs->rootfd, STORE_CHUNKS, 0777) == -1 && errno != EEXIST) {
+		ret = STATUS_E(ST_ERR_MKDIR, "Creating chunk store", strdup(STORE_CHUNKS));
+		goto err_free;
+	}
+	if (mkdirat(cs->rootfd, STORE_MANIFESTS, 0777) == -1 && errno != EEXIST) {
+		ret = STATUS_E(ST_ERR_MKDIR, "Creating chunk store", strdup(STORE_MANIFESTS));
+		goto err_free;
+	}
+	cs->chunkfd = openat(cs->rootfd, STORE_CHUNKS, O_RDONLY | O_DIRECTORY);
+	if (cs->chunkfd < 0) {
+		ret = STATUS_E(ST_ERR_OPEN, "Opening chunk store", strdup(STORE_CHUNKS));
+		goto err_free;
+	}
+	/* One directory per first byte of the digest */
+	for (int i = 0; i < 256; ++i) {
+		char name[3];
+		snprintf(name, sizeof(name), "%02x", i);
+		if (mkdirat(cs->chunkfd, name, 0777) == -1 && errno != EEXIST) {
+			ret = STATUS_E(ST_ERR_MKDIR, "Creating chunk store", strdup(name));
+			goto err_free;
+		}
+	}
+
+	cs->seen = hash_create(4096, SHA256_LEN, digest_hash, digest_cmp);
+	cs->buf = malloc(STORE_BUFSZ);
+	if (!cs->seen || !cs->buf) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Setting up chunk store", NULL);
+		goto err_free;
+	}
+	return STATUS(ST_OK, 0, "Setting up chunk store", NULL);
+
+err_free:
+	store_free(cs);
+	return ret;
+}
+
+void store_free(struct chunkstore* cs)
+{
+	if (!cs)
+		return;
+
+	dirfds_flush(&cs->dirs);
+	if (cs->srcfd >= 0) close(cs->srcfd);
+	if (cs->rootfd >= 0) close(cs->rootfd);
+	if (cs->chunkfd >= 0) close(cs->chunkfd);
+	cs->srcfd = cs->rootfd = cs->chunkfd = -1;
+	/* Digests live in the arena */
+	hash_destroy(cs->seen);
+	cs->seen = NULL;
+	free(cs->buf);
+	cs->buf = NULL;
+	free(cs->refs);
+	cs->refs = NULL;
+}
+
+/* Cuts a regular file into chunks, stores the new ones, and records the
+ * list in f->chunks.
+ */
+status_t store_file(struct chunkstore* cs, struct file* f)
+{
+	status_t ret;
+	size_t len = 0;
+	int eof = 0;
+	file_t src;
+
+	if (dirfds_at(&cs->dirs, f, &src, NULL) == -1)
+		return STATUS_E(ST_ERR_OPEN, "Opening parent directory",
+				file_strdup(cs->tree, f));
+	uint64_t t = STATS_START();
+	int in = openat(src.pfd, src.name, O_RDONLY | O_NOCTTY | (cs->oflags & O_NOFOLLOW));
+	STATS_TIME(STATS_OPEN, t);
+	if (in < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening source file", file_strdup(cs->tree, f));
+
+	cs->nrefs = 0;
+	for (;;) {
+		/* Fill the buffer, behind what's left of the last one */
+		while (!eof && len < STORE_BUFSZ) {
+			t = STATS_START();
+			ssize_t n = read(in, cs->buf + len, STORE_BUFSZ - len);
+			STATS_TIME(STATS_READ, t);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				ret = STATUS_E(ST_ERR_FILERD, "Reading file", file_strdup(cs->tree, f));
+				goto out_close;
+			}
+			if (n == 0) eof = 1;
+			len += (size_t)n;
+			cs->stats.nbytes += (uintmax_t)n;
+		}
+
+		size_t pos = 0;
+		while (pos < len) {
+			size_t cut = cdc_cut(cs->buf + pos, len - pos);
+			/* The cut point may be in data not read yet */
+			if (cut == len - pos && cut < CDC_MAX && !eof)
+				break;
+			ret = put_chunk(cs, cs->buf + pos, cut);
+			if (ret.c != ST_OK)
+				goto out_close;
+			pos += cut;
+		}
+		memmove(cs->buf, cs->buf + pos, len - pos);
+		len -= pos;
+		if (eof && len == 0)
+			break;
+	}
+
+	struct chunklist* list = arena_alloc(cs->mem, sizeof(struct chunklist) +
+					     cs->nrefs * sizeof(struct chunkref));
+	if (!list) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Recording chunks", NULL);
+		goto out_close;
+	}
+	list->n = cs->nrefs;
+	if (cs->nrefs)
+		memcpy(list->refs, cs->refs, cs->nrefs * sizeof(struct chunkref));
+	f->chunks = list;
+	cs->stats.nfiles++;
+	ret = STATUS(ST_OK, 0, "Storing file", NULL);
+
+out_close:
+	close(in);
+	return ret;
+}
+
+/* Stores every regular file in `files', then writes the manifest of this
+ * run: every directory, file and symbolic link, with the chunks of each
+ * file. Its name is left in cs->manifest.
+ */
+status_t store_tree(struct chunkstore* cs, struct hash_table* files)
+{
+	struct store_pass pass = { .cs = cs, .fp = NULL };
+	pass.ret = STATUS(ST_OK, 0, "Storing tree", NULL);
+
+	hash_foreach(files, store_one, &pass);
+	if (pass.ret.c != ST_OK)
+		return pass.ret;
+
+	return write_manifest(cs, files);
+}
+
+/* Adds a chunk to the list of the current file, and writes it to the
+ * store unless it's already there.
+ */
+static status_t put_chunk(struct chunkstore* cs, const unsigned char* p, size_t len)
+{
+	struct chunkref ref;
+	char hex[2 * SHA256_LEN + 1];
+	char name[2 * SHA256_LEN + 2 + sizeof(".tmp")];
+	struct stat sb;
+
+	sha256(p, len, ref.digest);
+	ref.len = (uint32_t)len;
+
+	if (cs->nrefs == cs->caprefs) {
+		size_t cap = (cs->caprefs) ? cs->caprefs * 2 : 64;
+		struct chunkref* refs = realloc(cs->refs, cap * sizeof(struct chunkref));
+		if (!refs)
+			return STATUS_E(ST_ERR_MALLOC, "Recording chunks", NULL);
+		cs->refs = refs;
+		cs->caprefs = cap;
+	}
+	cs->refs[cs->nrefs++] = ref;
+	cs->stats.nchunks++;
+
+	if (hash_lookup(cs->seen, ref.digest))
+		return STATUS(ST_OK, 0, NULL, NULL);
+
+	/* chunks/ab/cdef... */
+	hexdigest(ref.digest, hex);
+	memcpy(name, hex, 2);
+	name[2] = '/';
+	memcpy(name + 3, hex + 2, sizeof(hex) - 2);
+
+	/* Stored by an earlier run, unless that one crashed before syncing
+	 * and left it short
+	 */
+	int found = fstatat(cs->chunkfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0;
+	if (!found && errno != ENOENT)
+		return STATUS_E(ST_ERR_FILERD_MD, "Looking up chunk", strdup(hex));
+	if (!found || !S_ISREG(sb.st_mode) || sb.st_size != (off_t)len) {
+
+		/* Written aside, and renamed: a chunk is whole or missing */
+		size_t nlen = strlen(name);
+		char final[sizeof(name)];
+		memcpy(final, name, nlen + 1);
+		memcpy(name + nlen, ".tmp", sizeof(".tmp"));
+
+		/* One left by a crash is read-only, and can't be opened again */
+		if (unlinkat(cs->chunkfd, name, 0) == -1 && errno != ENOENT)
+			return STATUS_E(ST_ERR_OPEN, "Removing stale chunk", strdup(hex));
+		int out = openat(cs->chunkfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0444);
+		if (out < 0)
+			return STATUS_E(ST_ERR_OPEN, "Creating chunk", strdup(hex));
+		if (write_all(out, p, len) == -1) {
+			int err = errno;
+			close(out);
+			unlinkat(cs->chunkfd, name, 0);
+			return STATUS(ST_ERR_FILEWR, err, "Writing chunk", strdup(hex));
+		}
+		if (close(out) == -1 || renameat(cs->chunkfd, name, cs->chunkfd, final) == -1) {
+			int err = errno;
+			unlinkat(cs->chunkfd, name, 0);
+			return STATUS(ST_ERR_FILEWR, err, "Writing chunk", strdup(hex));
+		}
+		cs->stats.nstored++;
+		cs->stats.nstbytes += len;
+	}
+
+	unsigned char* key = arena_alloc(cs->mem, SHA256_LEN);
+	if (!key)
+		return STATUS_E(ST_ERR_MALLOC, "Recording chunks", NULL);
+	memcpy(key, ref.digest, SHA256_LEN);
+	if (hash_insert(cs->seen, key, key) < 0)
+		return STATUS_E(ST_ERR_MALLOC, "Recording chunks", NULL);
+	return STATUS(ST_OK, 0, NULL, NULL);
+}
+
+/* Returns 0 once all of `p' is written, -1 with errno set otherwise. */
+static int write_all(int fd, const unsigned char* p, size_t len)
+{
+	while (len > 0) {
+		ssize_t w = write(fd, p, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		len -= (size_t)w;
+	}
+	return 0;
+}
+
+static int store_one(const void* key, void* value, void* user_data)
+{
+	struct store_pass* pass = user_data;
+	struct file* f = value;
+	(void)key;
+
+	if (!S_ISREG(f->mode))
+		return 0;
+
+	status_t ret = store_file(pass->cs, f);
+	if (ret.c == ST_OK)
+		return 0;
+
+	/* Permission error, rather skip */
+	if (ret.sysc == EACCES) {
+		sterr(ret);
+		status_free(ret);
+		return 0;
+	}
+
+	pass->ret = ret;
+	return 1;
+}
+
+/* The manifest is plain text, one entry per line, with backslashes and
+ * newlines in paths escaped:
+ *
+ *	d MODE PATH
+ *	f MODE SIZE NCHUNKS PATH	followed by NCHUNKS lines of
+ *	DIGEST LENGTH			and then, for its other names,
+ *	h PATH
+ *	l MODE PATH			followed by one line of
+ *	TARGET
+ *
+ * It's written aside, and linked in under STORE_MANIFESTS once complete.
+ * Earlier runs keep theirs: a run that ends within the same second as
+ * another one gets a -N suffix.
+ */
+static status_t write_manifest(struct chunkstore* cs, struct hash_table* files)
+{
+	static const char tmp[] = STORE_MANIFESTS "/.tmp";
+	struct store_pass pass = { .cs = cs };
+	pass.ret = STATUS(ST_OK, 0, "Writing manifest", NULL);
+
+	int fd = openat(cs->rootfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0666);
+	if (fd < 0)
+		return STATUS_E(ST_ERR_OPEN, "Creating manifest", strdup(tmp));
+	pass.fp = fdopen(fd, "w");
+	if (!pass.fp) {
+		close(fd);
+		unlinkat(cs->rootfd, tmp, 0);
+		return STATUS_E(ST_ERR_MALLOC, "Creating manifest", NULL);
+	}
+
+	hash_foreach(files, put_entry, &pass);
+	if (pass.ret.c == ST_OK &&
+	    (fflush(pass.fp) == EOF || ferror(pass.fp) || sync_store(fd) == -1))
+		pass.ret = STATUS_E(ST_ERR_FILEWR, "Writing manifest", strdup(tmp));
+	if (fclose(pass.fp) == EOF && pass.ret.c == ST_OK)
+		pass.ret = STATUS_E(ST_ERR_FILEWR, "Writing manifest", strdup(tmp));
+
+	time_t now = time(NULL);
+	struct tm tm;
+	char stamp[sizeof("YYYYmmddTHHMMSSZ")];
+	if (pass.ret.c == ST_OK && !gmtime_r(&now, &tm))
+		pass.ret = STATUS_E(ST_ERR_FILEWR, "Naming manifest", NULL);
+	for (unsigned n = 0; pass.ret.c == ST_OK; ++n) {
+		strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+		if (n)
+			snprintf(cs->manifest, sizeof(cs->manifest), STORE_MANIFESTS "/%s-%u",
+				 stamp, n);
+		else
+			snprintf(cs->manifest, sizeof(cs->manifest), STORE_MANIFESTS "/%s", stamp);
+		if (linkat(cs->rootfd, tmp, cs->rootfd, cs->manifest, 0) == 0)
+			break;
+		if (errno != EEXIST)
+			pass.ret = STATUS_E(ST_ERR_FILEWR, "Adding manifest", strdup(cs->manifest));
+	}
+
+	/* The new name is only there once its directory is synced */
+	if (pass.ret.c == ST_OK) {
+		int dfd = openat(cs->rootfd, STORE_MANIFESTS, O_RDONLY | O_DIRECTORY);
+		if (dfd < 0 || fsync(dfd) == -1)
+			pass.ret = STATUS_E(ST_ERR_FILEWR, "Adding manifest", strdup(cs->manifest));
+		if (dfd >= 0)
+			close(dfd);
+	}
+
+	unlinkat(cs->rootfd, tmp, 0);
+	return pass.ret;
+}
+
+/* Flushes the file at `fd', and with it everything else written to the
+ * store: chunks, and their names in chunks/xx, are on disk before the
+ * manifest that lists them is linked in. Returns -1 with errno set on
+ * failure.
+ */
+static int sync_store(int fd)
+{
+#ifdef __linux__
+	return syncfs(fd);
+#else
+	sync();
+	return fsync(fd);
+#endif
+}
+
+/* Writes the entry of one file, see write_manifest(). Paths are built
+ * as long as they take: one deeper than PATH_MAX is still listed.
+ */
+static int put_entry(const void* key, void* value, void* user_data)
+{
+	struct store_pass* pass = user_data;
+	struct chunkstore* cs = pass->cs;
+	const struct file* f = value;
+	char hex[2 * SHA256_LEN + 1];
+	int stop = 0;
+	(void)key;
+
+	if (!S_ISDIR(f->mode) && !S_ISREG(f->mode) && !S_ISLNK(f->mode))
+		return 0;
+	/* Skipped while storing */
+	if (S_ISREG(f->mode) && !f->chunks)
+		return 0;
+	char* path = file_strdup(cs->tree, f);
+	if (!path) {
+		pass->ret = STATUS_E(ST_ERR_MALLOC, "Writing manifest", NULL);
+		return 1;
+	}
+
+	unsigned mode = (unsigned)(f->mode & 07777);
+	if (S_ISDIR(f->mode)) {
+		fprintf(pass->fp, "d %04o ", mode);
+		put_path(pass->fp, path);
+		putc('\n', pass->fp);
+	} else if (S_ISREG(f->mode)) {
+		uintmax_t size = 0;
+		for (size_t i = 0; i < f->chunks->n; ++i)
+			size += f->chunks->refs[i].len;
+		fprintf(pass->fp, "f %04o %ju %zu ", mode, size, f->chunks->n);
+		put_path(pass->fp, path);
+		putc('\n', pass->fp);
+		for (size_t i = 0; i < f->chunks->n; ++i) {
+			hexdigest(f->chunks->refs[i].digest, hex);
+			fprintf(pass->fp, "%s %lu\n", hex, (unsigned long)f->chunks->refs[i].len);
+		}
+		for (const struct file* l = f->links; l; l = l->links) {
+			char* lpath = file_strdup(cs->tree, l);
+			if (!lpath) {
+				pass->ret = STATUS_E(ST_ERR_MALLOC, "Writing manifest", NULL);
+				stop = 1;
+				break;
+			}
+			fputs("h ", pass->fp);
+			put_path(pass->fp, lpath);
+			putc('\n', pass->fp);
+			free(lpath);
+		}
+	} else {
+		char target[PATH_MAX];
+		file_t src;
+		ssize_t len = (dirfds_at(&cs->dirs, f, &src, NULL) == -1) ? -1 :
+			      readlinkat(src.pfd, src.name, target, sizeof(target) - 1);
+		if (len < 0) {
+			/* The status owns the path now */
+			status_t ret = STATUS_E(ST_ERR_FILERD, "Reading symbolic link", path);
+			/* Permission error, rather skip */
+			if (ret.sysc == EACCES) {
+				sterr(ret);
+				status_free(ret);
+				return 0;
+			}
+			pass->ret = ret;
+			return 1;
+		}
+		target[len] = '\0';
+		fprintf(pass->fp, "l %04o ", mode);
+		put_path(pass->fp, path);
+		putc('\n', pass->fp);
+		put_path(pass->fp, target);
+		putc('\n', pass->fp);
+	}
+	free(path);
+	return stop;
+}
+
+/* Writes the member `member' of the run whose manifest is at `manifest'
+ * out, see write_manifest(). The store is the directory above the one
+ * the manifest is in. Chunks are checked against their digests as they
+ * are read, and a symbolic link comes out as its target.
+ */
+status_t store_extract(const char* manifest, const char* member, FILE* out)
+{
+	status_t ret;
+	char* line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	long chunks = -1;		/* where the chunks of the last file are listed */
+	size_t nchunks = 0;
+	int chunkfd = -1;
+
+	FILE* fp = fopen(manifest, "r");
+	if (!fp)
+		return STATUS_E(ST_ERR_OPEN, "Opening manifest", strdup(manifest));
+
+	/* manifests/../chunks */
+	char dir[PATH_MAX];
+	const char* slash = strrchr(manifest, '/');
+	int n = (slash) ? snprintf(dir, sizeof(dir), "%.*s/../" STORE_CHUNKS,
+				   (int)(slash - manifest), manifest)
+			: snprintf(dir, sizeof(dir), "../" STORE_CHUNKS);
+	if (n < 0 || (size_t)n >= sizeof(dir)) {
+		ret = STATUS(ST_ERR_OPEN, ENAMETOOLONG, "Opening chunk store", strdup(manifest));
+		goto out_close;
+	}
+	chunkfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (chunkfd < 0) {
+		ret = STATUS_E(ST_ERR_OPEN, "Opening chunk store", strdup(dir));
+		goto out_close;
+	}
+
+	ret = STATUS(ST_ERR_OPEN, ENOENT, "Finding stored file", strdup(member));
+	while ((len = getline(&line, &cap, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		char* path;
+		unsigned mode;
+		uintmax_t size;
+		switch (line[0]) {
+		case 'd':
+			path = field(line, 2);
+			if (path && strcmp(get_path(path), member) == 0) {
+				status_free(ret);
+				ret = STATUS(ST_ERR_FILERD, EISDIR, "Reading stored file",
+					     strdup(member));
+				goto out_close;
+			}
+			break;
+		case 'f':
+			path = field(line, 4);
+			if (!path || sscanf(line, "f %o %ju %zu", &mode, &size, &nchunks) != 3)
+				goto err_bad;
+			chunks = ftell(fp);
+			if (strcmp(get_path(path), member) == 0)
+				goto found;
+			for (size_t i = 0; i < nchunks; ++i)
+				if (getline(&line, &cap, fp) <= 0)
+					goto err_bad;
+			break;
+		case 'h':
+			path = field(line, 1);
+			if (path && chunks >= 0 && strcmp(get_path(path), member) == 0) {
+				if (fseek(fp, chunks, SEEK_SET) == -1)
+					goto err_bad;
+				goto found;
+			}
+			break;
+		case 'l':
+			path = field(line, 2);
+			int match = (path && strcmp(get_path(path), member) == 0);
+			if ((len = getline(&line, &cap, fp)) <= 0)
+				goto err_bad;
+			if (match) {
+				if (line[len - 1] == '\n')
+					line[--len] = '\0';
+				status_free(ret);
+				ret = STATUS(ST_OK, 0, "Extracting stored file", NULL);
+				if (fputs(get_path(line), out) == EOF || fflush(out) == EOF)
+					ret = STATUS_E(ST_ERR_FILEWR, "Writing stored file",
+						       strdup(member));
+				goto out_close;
+			}
+			break;
+		default:
+			goto err_bad;
+		}
+	}
+	if (ferror(fp)) {
+		status_free(ret);
+		ret = STATUS_E(ST_ERR_FILERD, "Reading manifest", strdup(manifest));
+	}
+	goto out_close;
+
+found:
+	status_free(ret);
+	ret = put_file(fp, chunkfd, nchunks, out);
+	if (ret.c == ST_OK && fflush(out) == EOF)
+		ret = STATUS_E(ST_ERR_FILEWR, "Writing stored file", strdup(member));
+	goto out_close;
+
+err_bad:
+	status_free(ret);
+	ret = STATUS(ST_ERR_FILERD, EINVAL, "Reading manifest", strdup(manifest));
+out_close:
+	free(line);
+	if (chunkfd >= 0) close(chunkfd);
+	fclose(fp);
+	return ret;
+}
+
+/* Writes out the `nchunks' chunks listed next in the manifest `fp' */
+static status_t put_file(FILE* fp, int chunkfd, size_t nchunks, FILE* out)
+{
+	char hex[2 * SHA256_LEN + 1], got[2 * SHA256_LEN + 1];
+	char name[2 * SHA256_LEN + 2];
+	unsigned char digest[SHA256_LEN];
+	unsigned long len;
+	status_t ret = STATUS(ST_OK, 0, "Extracting stored file", NULL);
+
+	unsigned char* buf = malloc(CDC_MAX);
+	if (!buf)
+		return STATUS_E(ST_ERR_MALLOC, "Extracting stored file", NULL);
+
+	for (size_t i = 0; i < nchunks; ++i) {
+		if (fscanf(fp, "%64s %lu\n", hex, &len) != 2 ||
+		    strlen(hex) != 2 * SHA256_LEN || len > CDC_MAX) {
+			ret = STATUS(ST_ERR_FILERD, EINVAL, "Reading manifest", NULL);
+			break;
+		}
+
+		/* chunks/ab/cdef... */
+		memcpy(name, hex, 2);
+		name[2] = '/';
+		memcpy(name + 3, hex + 2, sizeof(hex) - 2);
+		int in = openat(chunkfd, name, O_RDONLY | O_NOFOLLOW);
+		if (in < 0) {
+			ret = STATUS_E(ST_ERR_OPEN, "Opening chunk", strdup(hex));
+			break;
+		}
+		size_t have = 0;
+		int err = EIO;		/* shorter than listed */
+		while (have < len) {
+			ssize_t r = read(in, buf + have, len - have);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				err = errno;
+			if (r <= 0)
+				break;
+			have += (size_t)r;
+		}
+		close(in);
+		if (have < len) {
+			ret = STATUS(ST_ERR_FILERD, err, "Reading chunk", strdup(hex));
+			break;
+		}
+
+		sha256(buf, len, digest);
+		hexdigest(digest, got);
+		if (strcmp(got, hex) != 0) {
+			ret = STATUS(ST_ERR_FILERD, EIO, "Checking chunk", strdup(hex));
+			break;
+		}
+		if (fwrite(buf, 1, len, out) != len) {
+			ret = STATUS_E(ST_ERR_FILEWR, "Writing stored file", NULL);
+			break;
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+/* The rest of `line' after its `n'th space, NULL if there aren't as many */
+static char* field(char* line, int n)
+{
+	while (n-- > 0) {
+		line = strchr(line, ' ');
+		if (!line)
+			return NULL;
+		line++;
+	}
+	return line;
+}
+
+/* Undoes put_path(), in place */
+static char* get_path(char* s)
+{
+	char* w = s;
+	for (const char* r = s; *r; ++r) {
+		if (*r == '\\' && r[1]) {
+			++r;
+			*w++ = (*r == 'n') ? '\n' : *r;
+		} else {
+			*w++ = *r;
+		}
+	}
+	*w = '\0';
+	return s;
+}
+
+static void put_path(FILE* fp, const char* s)
+{
+	for (; *s; ++s) {
+		if (*s == '\\')
+			fputs("\\\\", fp);
+		else if (*s == '\n')
+			fputs("\\n", fp);
+		else
+			putc(*s, fp);
+	}
+}
+
+static void hexdigest(const unsigned char* d, char* hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	for (int i = 0; i < SHA256_LEN; ++i) {
+		hex[2 * i] = digits[d[i] >> 4];
+		hex[2 * i + 1] = digits[d[i] & 0xf];
+	}
+	hex[2 * SHA256_LEN] = '\0';
+}
+
+/* Digests are already uniformly distributed */
+static uint64_t digest_hash(const void* key)
+{
+	uint64_t h;
+	memcpy(&h, key, sizeof(h));
+	return h;
+}
+
+static int digest_cmp(const void* a, const void* b)
+{
+	return memcmp(a, b, SHA256_LEN) == 0;
+}
@@ -0,0 +1,958 @@
+/* copy_file_range(2) is a GNU extension in glibc and musl */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "hash.h"
+#include "fs.h"
+#include "fs/copy.h"
+#include "fs/sched.h"
+#include "fs/ucopy.h"
+#include "intr.h"
+#include "stats.h"
+#include "status.h"
+
+/* In-kernel copy methods, in the order they are tried */
+enum { COPY_CFR, COPY_SENDFILE };
+
+struct copy_pass {
+	struct copier* cp;
+	int dirs;		/* this pass only handles directories */
+	struct ucopy* u;	/* small files go through it, NULL if none */
+	status_t ret;
+};
+
+/* Directories whose mode copy_tree_modes() puts back */
+struct dir_list {
+	const struct file** dirs;
+	size_t n;
+};
+
+/* A file cut into COPY_RANGE-byte ranges, copied by several threads at
+ * once, see copy_split()
+ */
+struct split {
+	int in;
+	int out;
+	off_t size;
+	size_t nranges;
+	unsigned char* done;	/* per range, set once all of it was copied */
+	pthread_mutex_t lock;	/* guards everything below */
+	size_t next;		/* first range no thread took yet */
+	int failed;
+	status_t ret;		/* first failure */
+	int shrunk;		/* a range met the end of the file early */
+	uintmax_t nbytes;	/* copied so far */
+};
+
+static status_t copy_bytes(struct copier* cp, int in, int out, off_t size, int to_eof);
+static status_t copy_sparse(struct copier* cp, int in, int out, off_t size);
+static int fallback_errno(int err);
+static status_t copy_reg(struct copier* cp, struct file* f, const file_t* src,
+			 const file_t* dst);
+static int open_file(struct copier* cp, uint32_t dir, const file_t* h, int oflags,
+		     mode_t mode);
+static void* split_work(void* arg);
+static unsigned take_spare(unsigned* spare, unsigned want);
+static status_t split_range(struct split* sp, off_t from, off_t len, char** buf,
+			    int* no_cfr, uintmax_t* copied, int* eof);
+static status_t copy_symlink(struct copier* cp, const struct file* f, const file_t* src,
+			     const file_t* dst);
+static status_t copy_dir(struct copier* cp, const struct file* f, const file_t* dst);
+static status_t copy_links(struct copier* cp, const struct file* f);
+static int copied(struct copier* cp, const struct file* f);
+static int copy_one(const void* key, void* value, void* user_data);
+static int link_one(const void* key, void* value, void* user_data);
+static int collect_dir(const void* key, void* value, void* user_data);
+static int deepest_first(const void* a, const void* b);
+#ifdef __linux__
+static ssize_t kcopy(int method, int in, int out, size_t len);
+#endif
+
+/* Opens the source root and creates (if needed) the destination root.
+ * Both stay open for the lifetime of the copier: every entry is then
+ * reached from them, through the directories of `tree', see fs/dirfds.h.
+ */
+status_t copier_init(struct copier* cp, const struct dirtree* tree,
+		     const char* src, const char* dst, int oflags)
+{
+	if (!cp || !tree || !src || !dst)
+		return STATUS(ST_INT_ISNULL, EINVAL, "Setting up copy", NULL);
+
+	memset(cp, 0, sizeof(*cp));
+	cp->tree = tree;
+	cp->oflags = oflags;
+	cp->srcfd = open(src, O_RDONLY | O_DIRECTORY | oflags);
+	if (cp->srcfd < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening source", strdup(src));
+
+	if (mkdir(dst, 0777) == -1 && errno != EEXIST) {
+		close(cp->srcfd);
+		return STATUS_E(ST_ERR_MKDIR, "Creating destination", strdup(dst));
+	}
+	cp->dstfd = open(dst, O_RDONLY | O_DIRECTORY);
+	if (cp->dstfd < 0) {
+		int err = errno;
+		close(cp->srcfd);
+		return STATUS(ST_ERR_OPEN, err, "Opening destination", strdup(dst));
+	}
+	dirfds_init(&cp->dirs, tree, cp->srcfd, cp->dstfd, oflags);
+	/* Directories made on the way to a file are copies too */
+	cp->dirs.ndirs = &cp->stats.ndirs;
+
+	return STATUS(ST_OK, 0, "Setting up copy", NULL);
+}
+
+void copier_free(struct copier* cp)
+{
+	if (!cp)
+		return;
+
+	dirfds_flush(&cp->dirs);
+	close(cp->srcfd);
+	close(cp->dstfd);
+	free(cp->buf);
+	cp->buf = NULL;
+}
+
+/* Moves `size' bytes from `in' to `out', starting at their current offsets.
+ * Tries copy_file_range first, so the data never leaves the kernel (and
+ * reflinks or server-side copies where the filesystem supports them), then
+ * sendfile, and finally a plain read/write loop over a large buffer.
+ *
+ * A method that isn't supported for this pair of files hands over to the
+ * next one; ENOSYS marks it as unavailable for the rest of the run.
+ * The read/write loop goes on until EOF, which also catches files that
+ * report a size of 0 but still have contents (procfs, sysfs).
+ */
+status_t copy_data(struct copier* cp, int in, int out, off_t size)
+{
+	return copy_bytes(cp, in, out, size, 1);
+}
+
+/* Like copy_data(), but never goes past `len' bytes, even in the
+ * read/write loop.
+ */
+status_t copy_range(struct copier* cp, int in, int out, off_t len)
+{
+	return copy_bytes(cp, in, out, len, 0);
+}
+
+/* Copies the data extents of `in' only, found with SEEK_DATA and
+ * SEEK_HOLE. `out' was just truncated, so the ranges it skips over are
+ * holes already, and ftruncate() adds the one at the end, if any.
+ * Falls back to copy_data() where holes can't be looked for.
+ */
+static status_t copy_sparse(struct copier* cp, int in, int out, off_t size)
+{
+#ifdef SEEK_DATA
+	off_t pos = 0;
+
+	while (pos < size) {
+		off_t data = lseek(in, pos, SEEK_DATA);
+		if (data == -1) {
+			/* Nothing but a hole up to the end */
+			if (errno == ENXIO)
+				break;
+			if (pos == 0 && (errno == EINVAL || errno == EOPNOTSUPP))
+				return copy_data(cp, in, out, size);
+			return STATUS_E(ST_ERR_FILERD, "Looking for data", NULL);
+		}
+		off_t hole = lseek(in, data, SEEK_HOLE);
+		if (hole == -1)
+			return STATUS_E(ST_ERR_FILERD, "Looking for holes", NULL);
+		if (hole > size) hole = size;
+
+		cp->stats.nholes += (uintmax_t)(data - pos);
+		if (lseek(in, data, SEEK_SET) == -1 || lseek(out, data, SEEK_SET) == -1)
+			return STATUS_E(ST_ERR_COPY, "Seeking to data", NULL);
+		status_t ret = copy_range(cp, in, out, hole - data);
+		if (ret.c != ST_OK)
+			return ret;
+		pos = hole;
+	}
+
+	if (pos < size)
+		cp->stats.nholes += (uintmax_t)(size - pos);
+	if (ftruncate(out, size) == -1)
+		return STATUS_E(ST_ERR_FILEWR, "Setting file size", NULL);
+	return STATUS(ST_OK, 0, "Copying sparse file", NULL);
+#else
+	return copy_data(cp, in, out, size);
+#endif
+}
+
+static status_t copy_bytes(struct copier* cp, int in, int out, off_t size, int to_eof)
+{
+	off_t left = size;
+	ssize_t n;
+
+#ifdef __linux__
+	for (int m = COPY_CFR; m <= COPY_SENDFILE && left == size && left > 0; m++) {
+		int* unavailable = (m == COPY_CFR) ? &cp->no_cfr : &cp->no_sendfile;
+		if (*unavailable)
+			continue;
+
+		while (left > 0) {
+			size_t len = (left > COPY_CHUNK) ? COPY_CHUNK : (size_t)left;
+			n = kcopy(m, in, out, len);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				/* Nothing moved yet, the next method can take over */
+				if (left == size && fallback_errno(errno)) {
+					if (errno == ENOSYS) *unavailable = 1;
+					break;
+				}
+				return STATUS_E(ST_ERR_COPY, (m == COPY_CFR) ?
+						"copy_file_range" : "sendfile", NULL);
+			}
+			/* EOF: the file shrank, or it lies about its size */
+			if (n == 0) break;
+			left -= n;
+			cp->stats.nbytes += (uintmax_t)n;
+			STATS_ADD(STATS_BYTES_KCOPIED, n);
+		}
+	}
+#endif
+
+	/* The kernel did the job */
+	if (left < size)
+		return STATUS(ST_OK, 0, "Copying data", NULL);
+
+	if (!cp->buf) {
+		cp->buf = malloc(COPY_BUFSZ);
+		if (!cp->buf)
+			return STATUS_E(ST_ERR_MALLOC, "Allocating copy buffer", NULL);
+	}
+
+	for (;;) {
+		size_t want = COPY_BUFSZ;
+		if (!to_eof) {
+			if (left <= 0) break;
+			if ((off_t)want > left) want = (size_t)left;
+		}
+		uint64_t t = STATS_START();
+		n = read(in, cp->buf, want);
+		STATS_TIME(STATS_READ, t);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return STATUS_E(ST_ERR_FILERD, "Reading file", NULL);
+		}
+		if (n == 0) break;
+		left -= n;
+		STATS_ADD(STATS_BYTES_READ, n);
+
+		char* p = cp->buf;
+		while (n > 0) {
+			t = STATS_START();
+			ssize_t w = write(out, p, (size_t)n);
+			STATS_TIME(STATS_WRITE, t);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				return STATUS_E(ST_ERR_FILEWR, "Writing file", NULL);
+			}
+			p += w;
+			n -= w;
+			cp->stats.nbytes += (uintmax_t)w;
+			STATS_ADD(STATS_BYTES_WRITTEN, w);
+		}
+	}
+
+	return STATUS(ST_OK, 0, "Copying data", NULL);
+}
+
+/* Copies the `size' bytes of `in' to `out' on cp->nsplit threads, the
+ * caller's included, or fewer when copiers share cp->spare and others
+ * hold them. The file is cut into COPY_RANGE-byte ranges, each
+ * copied at its own offset, with copy_file_range or pread and pwrite,
+ * once `out' was given its whole size. Both offsets are left alone.
+ *
+ * Succeeds only once every range was copied: a file that shrank
+ * meanwhile is cut to its new size. A run being stopped lets the file
+ * finish, like any other, see intr.h.
+ */
+status_t copy_split(struct copier* cp, int in, int out, off_t size)
+{
+	struct split sp;
+	status_t ret;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.in = in;
+	sp.out = out;
+	sp.size = size;
+	sp.nranges = (size_t)((size + COPY_RANGE - 1) / COPY_RANGE);
+	sp.ret = STATUS(ST_OK, 0, "Copying file ranges", NULL);
+
+#ifdef __linux__
+	/* Fails early if it can't fit, and lays the file out in one go */
+	if (fallocate(out, 0, 0, size) == -1 && errno != EOPNOTSUPP && errno != ENOSYS)
+		return STATUS_E(ST_ERR_FILEWR, "Allocating file", NULL);
+#endif
+	if (ftruncate(out, size) == -1)
+		return STATUS_E(ST_ERR_FILEWR, "Setting file size", NULL);
+
+	unsigned nthreads = cp->nsplit;
+	if (nthreads > sp.nranges) nthreads = (unsigned)sp.nranges;
+	unsigned taken = 0;
+	if (cp->spare && nthreads > 1) {
+		taken = take_spare(cp->spare, nthreads - 1);
+		nthreads = taken + 1;
+	}
+	sp.done = calloc(sp.nranges, 1);
+	pthread_t* tids = malloc(nthreads * sizeof(pthread_t));
+	if (!sp.done || !tids) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Copying file ranges", NULL);
+		goto out_free;
+	}
+	pthread_mutex_init(&sp.lock, NULL);
+
+	/* Whatever fails to start, the others still get through it */
+	unsigned started = 0;
+	while (started + 1 < nthreads &&
+	       pthread_create(&tids[started], NULL, split_work, &sp) == 0)
+		started++;
+	split_work(&sp);
+	for (unsigned i = 0; i < started; ++i)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&sp.lock);
+
+	cp->stats.nbytes += sp.nbytes;
+	ret = sp.ret;
+	if (ret.c != ST_OK)
+		goto out_free;
+	for (size_t i = 0; i < sp.nranges; ++i)
+		if (!sp.done[i]) {
+			ret = STATUS(ST_ERR_COPY, EIO, "Copying file ranges", NULL);
+			goto out_free;
+		}
+
+	struct stat sb;
+	if (sp.shrunk && fstat(in, &sb) == 0 && sb.st_size < size &&
+	    ftruncate(out, sb.st_size) == -1)
+		ret = STATUS_E(ST_ERR_FILEWR, "Setting file size", NULL);
+
+out_free:
+	if (taken)
+		__atomic_add_fetch(cp->spare, taken, __ATOMIC_RELAXED);
+	free(tids);
+	free(sp.done);
+	return ret;
+}
+
+/* Takes up to `want' threads from the budget `spare'.
+ * Returns how many it got.
+ */
+static unsigned take_spare(unsigned* spare, unsigned want)
+{
+	unsigned have = __atomic_load_n(spare, __ATOMIC_RELAXED);
+	unsigned got;
+	do {
+		got = (have < want) ? have : want;
+		if (got == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(spare, &have, have - got, 0,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return got;
+}
+
+/* Takes ranges of a split file until there's none left or something
+ * failed. terminate_wanted isn't checked: a file started is finished.
+ */
+static void* split_work(void* arg)
+{
+	struct split* sp = arg;
+	char* buf = NULL;
+	int no_cfr = 0;
+
+	pthread_mutex_lock(&sp->lock);
+	while (!sp->failed && sp->next < sp->nranges) {
+		size_t r = sp->next++;
+		pthread_mutex_unlock(&sp->lock);
+
+		off_t from = (off_t)r * COPY_RANGE;
+		off_t len = (sp->size - from < COPY_RANGE) ? sp->size - from : COPY_RANGE;
+		uintmax_t copied = 0;
+		int eof = 0;
+		status_t ret = split_range(sp, from, len, &buf, &no_cfr, &copied, &eof);
+
+		pthread_mutex_lock(&sp->lock);
+		sp->nbytes += copied;
+		if (ret.c != ST_OK) {
+			if (!sp->failed) {
+				sp->failed = 1;
+				sp->ret = ret;
+			} else {
+				status_free(ret);
+			}
+			continue;
+		}
+		sp->done[r] = 1;
+		if (eof)
+			sp->shrunk = 1;
+	}
+	pthread_mutex_unlock(&sp->lock);
+	free(buf);
+	return NULL;
+}
+
+/* Copies `len' bytes from `from' on, in both files. copy_file_range
+ * first, unless *no_cfr says it can't be used here, then pread and
+ * pwrite through *buf, allocated on first use. Adds what it copied to
+ * *copied, and sets *eof if the file ended first.
+ */
+static status_t split_range(struct split* sp, off_t from, off_t len, char** buf,
+			    int* no_cfr, uintmax_t* copied, int* eof)
+{
+	off_t pos = from, end = from + len;
+	ssize_t n;
+
+#ifdef __linux__
+	while (!*no_cfr && pos < end) {
+		off64_t off_in = pos, off_out = pos;
+		size_t want = (end - pos > COPY_CHUNK) ? COPY_CHUNK : (size_t)(end - pos);
+		uint64_t t = STATS_START();
+		n = copy_file_range(sp->in, &off_in, sp->out, &off_out, want, 0);
+		STATS_TIME(STATS_KCOPY, t);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Nothing moved yet, pread and pwrite can take over */
+			if (pos == from && fallback_errno(errno)) {
+				*no_cfr = 1;
+				break;
+			}
+			return STATUS_E(ST_ERR_COPY, "copy_file_range", NULL);
+		}
+		if (n == 0) {
+			*eof = 1;
+			return STATUS(ST_OK, 0, "Copying file range", NULL);
+		}
+		pos += n;
+		*copied += (uintmax_t)n;
+		STATS_ADD(STATS_BYTES_KCOPIED, n);
+	}
+#endif
+
+	if (pos < end && !*buf && !(*buf = malloc(COPY_BUFSZ)))
+		return STATUS_E(ST_ERR_MALLOC, "Allocating copy buffer", NULL);
+	while (pos < end) {
+		size_t want = (end - pos > COPY_BUFSZ) ? COPY_BUFSZ : (size_t)(end - pos);
+		uint64_t t = STATS_START();
+		n = pread(sp->in, *buf, want, pos);
+		STATS_TIME(STATS_READ, t);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return STATUS_E(ST_ERR_FILERD, "Reading file", NULL);
+		}
+		if (n == 0) {
+			*eof = 1;
+			break;
+		}
+		STATS_ADD(STATS_BYTES_READ, n);
+
+		char* p = *buf;
+		while (n > 0) {
+			t = STATS_START();
+			ssize_t w = pwrite(sp->out, p, (size_t)n, pos);
+			STATS_TIME(STATS_WRITE, t);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				return STATUS_E(ST_ERR_FILEWR, "Writing file", NULL);
+			}
+			p += w;
+			n -= w;
+			pos += w;
+			*copied += (uintmax_t)w;
+			STATS_ADD(STATS_BYTES_WRITTEN, w);
+		}
+	}
+	return STATUS(ST_OK, 0, "Copying file range", NULL);
+}
+
+/* Copies a single entry of the `files' table to the destination.
+ * Directories are created, regular files copied, symbolic links recreated,
+ * each by its name in its directory, see fs/dirfds.h.
+ * Other file types (devices, sockets, FIFOs) are skipped, and so are
+ * files the previous run's index says are already there, or that the
+ * interrupted run being resumed copied. The data of a file with several
+ * hard links is copied once, and its other names are linked to the copy.
+ *
+ * With a journal, the entry is recorded in it once copied. Either way,
+ * f->done is set, for the next index to hold it, see fidx_write(). The
+ * size, times and mode of a regular file the listing didn't stat are
+ * taken from the file once it's open.
+ */
+status_t copy_entry(struct copier* cp, const struct kfile* k, struct file* f)
+{
+	if (!cp || !f)
+		return STATUS(ST_INT_ISNULL, EINVAL, "Copying entry", NULL);
+
+	if (copy_skip(cp, k, f)) {
+		f->done = 1;
+		return STATUS(ST_OK, 0, "Skipping file", NULL);
+	}
+
+	if (!S_ISDIR(f->mode) && !S_ISREG(f->mode) && !S_ISLNK(f->mode))
+		return STATUS(ST_OK, 0, "Skipping special file", NULL);
+
+	/* A directory is only created: its source isn't needed */
+	file_t src, dst;
+	if (dirfds_at(&cp->dirs, f, (S_ISDIR(f->mode)) ? NULL : &src, &dst) == -1)
+		return STATUS_E(ST_ERR_OPEN, "Opening parent directory",
+				file_strdup(cp->tree, f));
+
+	status_t ret;
+	if (S_ISDIR(f->mode))
+		ret = copy_dir(cp, f, &dst);
+	else if (S_ISREG(f->mode))
+		ret = copy_reg(cp, f, &src, &dst);
+	else
+		ret = copy_symlink(cp, f, &src, &dst);
+
+	if (ret.c == ST_OK && f->links)
+		ret = copy_links(cp, f);
+	if (ret.c == ST_OK && cp->journal)
+		ret = journal_add(cp->journal, k, f, cp->tree);
+	if (ret.c == ST_OK)
+		f->done = 1;
+	return ret;
+}
+
+/* Tells whether `f' is to be left alone: the previous run's index says
+ * it's unchanged, or the interrupted run being resumed copied it, and
+ * its copy is still there, as large as the source. Counts it if so.
+ */
+int copy_skip(struct copier* cp, const struct kfile* k, const struct file* f)
+{
+	int unchanged = cp->prev && fidx_unchanged(cp->prev, k, f, cp->tree);
+	int resumed = !unchanged && cp->journal && journal_done(cp->journal, k, f, cp->tree);
+
+	if ((!unchanged && !resumed) || !copied(cp, f))
+		return 0;
+	if (unchanged)
+		cp->stats.nunchanged++;
+	else
+		cp->stats.nresumed++;
+	return 1;
+}
+
+/* Whether the destination has a copy of `f': an entry of its type and
+ * size, by its name in its directory, and the same entry under each of
+ * its other names. Anything else is copied again, and linked again.
+ */
+static int copied(struct copier* cp, const struct file* f)
+{
+	file_t dst;
+	struct stat sb, lsb;
+
+	if (dirfds_at(&cp->dirs, f, NULL, &dst) == -1 ||
+	    fstatat(dst.pfd, dst.name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+		return 0;
+	if ((sb.st_mode & S_IFMT) != (f->mode & S_IFMT) || sb.st_size != f->size)
+		return 0;
+
+	for (const struct file* l = f->links; l; l = l->links) {
+		if (dirfds_at(&cp->dirs, l, NULL, &dst) == -1 ||
+		    fstatat(dst.pfd, dst.name, &lsb, AT_SYMLINK_NOFOLLOW) == -1 ||
+		    lsb.st_dev != sb.st_dev || lsb.st_ino != sb.st_ino)
+			return 0;
+	}
+	return 1;
+}
+
+/* Copies everything in `files' to the destination, directory by
+ * directory, see sched_build(): directories go first, parents before
+ * their children, then the other files, so that the descriptors of the
+ * directories they're in are at hand, see fs/dirfds.h.
+ *
+ * With cp->disk_order, the other files are copied in the order their
+ * data lies on disk instead, with the next ones read ahead, see
+ * fs/sched.h. With cp->uring, small files are copied many at once
+ * through io_uring, see fs/ucopy.h, or one by one where the kernel
+ * can't. Directories get their mode last, see copy_tree_modes().
+ */
+status_t copy_tree(struct copier* cp, struct hash_table* files)
+{
+	struct copy_pass pass = { .cp = cp, .dirs = 1 };
+	struct sched s;
+	struct ucopy u;
+	status_t ret;
+	pass.ret = STATUS(ST_OK, 0, "Copying tree", NULL);
+
+	ret = sched_build(&s, cp, files, SCHED_DIRS);
+	if (ret.c != ST_OK)
+		return ret;
+	for (size_t i = 0; i < s.n; ++i)
+		if (copy_one(s.ents[i].key, s.ents[i].f, &pass))
+			break;
+	if (pass.ret.c != ST_OK)
+		goto out_free_sched;
+
+	pass.dirs = 0;
+	if (cp->uring) {
+		ret = ucopy_init(&u, cp);
+		if (ret.c == ST_OK)
+			pass.u = &u;
+		status_free(ret);
+	}
+
+	if (cp->disk_order) {
+		sched_free(&s);
+		ret = sched_build(&s, cp, files, SCHED_DISK);
+		if (ret.c != ST_OK) {
+			pass.ret = ret;
+			goto out_finish;
+		}
+	}
+	for (size_t i = 0; i < s.n; ++i) {
+		if (cp->disk_order)
+			sched_ahead(&s, cp, i);
+		if (copy_one(s.ents[i].key, s.ents[i].f, &pass))
+			break;
+	}
+
+out_finish:
+	if (pass.u) {
+		ret = ucopy_finish(&u);
+		ucopy_free(&u);
+		if (pass.ret.c == ST_OK)
+			pass.ret = ret;
+		else
+			status_free(ret);
+	}
+out_free_sched:
+	sched_free(&s);
+	if (pass.ret.c == ST_OK)
+		pass.ret = copy_tree_modes(cp, files);
+	return pass.ret;
+}
+
+static int copy_one(const void* key, void* value, void* user_data)
+{
+	struct copy_pass* pass = user_data;
+	struct file* f = value;
+
+	if ((S_ISDIR(f->mode) != 0) != (pass->dirs != 0))
+		return 0;
+	if (terminate_wanted) {
+		pass->ret = STATUS(ST_ERR_INTR, EINTR, "Copying tree", NULL);
+		return 1;
+	}
+
+	status_t ret = (pass->u) ? ucopy_add(pass->u, key, f) : copy_entry(pass->cp, key, f);
+	if (ret.c == ST_OK)
+		return 0;
+
+	/* Permission error, rather skip */
+	if (ret.sysc == EACCES) {
+		sterr(ret);
+		status_free(ret);
+		return 0;
+	}
+
+	pass->ret = ret;
+	return 1;
+}
+
+/* Recreates the other names of every file in `files' that has some,
+ * for when their data was copied without them, see fs/stream.h.
+ */
+status_t copy_tree_links(struct copier* cp, struct hash_table* files)
+{
+	struct copy_pass pass = { .cp = cp };
+	pass.ret = STATUS(ST_OK, 0, "Creating hard links", NULL);
+
+	hash_foreach(files, link_one, &pass);
+	return pass.ret;
+}
+
+/* Gives the copies of the directories in `files' the mode of their
+ * source, which copy_dir() left writable to its owner for their contents
+ * to be copied. Deepest first: a directory closed to its owner is only
+ * closed once nothing below it needs changing.
+ */
+status_t copy_tree_modes(struct copier* cp, struct hash_table* files)
+{
+	struct dir_list l = { .n = 0 };
+	status_t ret = STATUS(ST_OK, 0, "Setting directory modes", NULL);
+
+	l.dirs = malloc(((files->count) ? files->count : 1) * sizeof(*l.dirs));
+	if (!l.dirs)
+		return STATUS_E(ST_ERR_MALLOC, "Setting directory modes", NULL);
+	hash_foreach(files, collect_dir, &l);
+	qsort(l.dirs, l.n, sizeof(*l.dirs), deepest_first);
+
+	for (size_t i = 0; i < l.n; ++i) {
+		const struct file* f = l.dirs[i];
+		if (terminate_wanted) {
+			ret = STATUS(ST_ERR_INTR, EINTR, "Setting directory modes", NULL);
+			break;
+		}
+		file_t dst;
+		if (dirfds_at(&cp->dirs, f, NULL, &dst) == 0 &&
+		    fchmodat(dst.pfd, dst.name, f->mode & 07777, 0) == 0)
+			continue;
+		int err = errno;
+		ret = STATUS(ST_ERR_MKDIR, err, "Setting directory mode", file_strdup(cp->tree, f));
+		if (err != EACCES)
+			break;
+		sterr(ret);
+		status_free(ret);
+		ret = STATUS(ST_OK, 0, "Setting directory modes", NULL);
+	}
+	free(l.dirs);
+	return ret;
+}
+
+static int collect_dir(const void* key, void* value, void* user_data)
+{
+	struct dir_list* l = user_data;
+	const struct file* f = value;
+	(void)key;
+
+	if (S_ISDIR(f->mode))
+		l->dirs[l->n++] = f;
+	return 0;
+}
+
+/* Directories are numbered as they're found, parents first: the larger
+ * the number of the one a directory is in, the deeper it goes.
+ */
+static int deepest_first(const void* a, const void* b)
+{
+	const struct file* fa = *(const struct file* const*)a;
+	const struct file* fb = *(const struct file* const*)b;
+
+	return (fa->dir < fb->dir) - (fa->dir > fb->dir);
+}
+
+static int link_one(const void* key, void* value, void* user_data)
+{
+	struct copy_pass* pass = user_data;
+	struct copier* cp = pass->cp;
+	const struct file* f = value;
+	(void)key;
+
+	if (!f->links)
+		return 0;
+
+	status_t ret = copy_links(cp, f);
+	if (ret.c == ST_OK)
+		return 0;
+	if (ret.sysc == EACCES) {
+		sterr(ret);
+		status_free(ret);
+		return 0;
+	}
+
+	pass->ret = ret;
+	return 1;
+}
+
+/* Copies the regular file `f' from `src' to `dst'. */
+static status_t copy_reg(struct copier* cp, struct file* f, const file_t* src,
+			 const file_t* dst)
+{
+	status_t ret;
+	uint64_t t = STATS_START();
+	int in = open_file(cp, f->dir, src, O_RDONLY | O_NOCTTY | (cp->oflags & O_NOFOLLOW), 0);
+	STATS_TIME(STATS_OPEN, t);
+	if (in < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening source file", file_strdup(cp->tree, f));
+
+	/* Asking the open file is cheap, and st_blocks tells sparse files */
+	struct stat sb;
+	if (fstat(in, &sb) == -1) {
+		ret = STATUS_E(ST_ERR_FILERD_MD, "Reading file metadata", file_strdup(cp->tree, f));
+		goto err_close_in;
+	}
+	mode_t mode = sb.st_mode & 07777;
+	off_t size = sb.st_size;
+	/* Not listed: what's compared next time comes from here */
+	if (f->size == FILE_SIZE_UNKNOWN)
+		hcstat(f, &sb);
+
+	int oflags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+	t = STATS_START();
+	int out = open_file(cp, f->dir, dst, oflags, mode);
+	STATS_TIME(STATS_OPEN, t);
+	if (out < 0) {
+		ret = STATUS_E(ST_ERR_OPEN, "Opening destination file", file_strdup(cp->tree, f));
+		goto err_close_in;
+	}
+
+	/* Fewer blocks than its size needs: it has holes */
+	if (size >= COPY_SPARSE_MIN && (uintmax_t)sb.st_blocks * 512 < (uintmax_t)size)
+		ret = copy_sparse(cp, in, out, size);
+	else if (size >= COPY_SPLIT_MIN && cp->nsplit > 1)
+		ret = copy_split(cp, in, out, size);
+	else
+		ret = copy_data(cp, in, out, size);
+	if (ret.c != ST_OK) {
+		ret.file_target = file_strdup(cp->tree, f);
+		goto err_close_out;
+	}
+
+	if (close(out) == -1) {
+		ret = STATUS_E(ST_ERR_FILEWR, "Closing destination file", file_strdup(cp->tree, f));
+		goto err_close_in;
+	}
+	close(in);
+	cp->stats.nfiles++;
+	return STATUS(ST_OK, 0, "Copying file", NULL);
+
+err_close_out:
+	close(out);
+err_close_in:
+	close(in);
+	return ret;
+}
+
+/* openat() on the handle `h' of a file in the directory `dir'. Out of
+ * descriptors, the other directories cp->dirs keeps open are closed,
+ * and it's tried again.
+ */
+static int open_file(struct copier* cp, uint32_t dir, const file_t* h, int oflags,
+		     mode_t mode)
+{
+	int fd = openat(h->pfd, h->name, oflags, mode);
+	if (fd < 0 && (errno == EMFILE || errno == ENFILE) && dirfds_shed(&cp->dirs, dir) > 0)
+		fd = openat(h->pfd, h->name, oflags, mode);
+	return fd;
+}
+
+static status_t copy_symlink(struct copier* cp, const struct file* f, const file_t* src,
+			     const file_t* dst)
+{
+	char target[PATH_MAX];
+	ssize_t len = readlinkat(src->pfd, src->name, target, sizeof(target) - 1);
+	if (len < 0)
+		return STATUS_E(ST_ERR_FILERD, "Reading symbolic link", file_strdup(cp->tree, f));
+	target[len] = '\0';
+
+	int r = symlinkat(target, dst->pfd, dst->name);
+	/* Replace whatever was there from a previous run */
+	if (r == -1 && errno == EEXIST && unlinkat(dst->pfd, dst->name, 0) == 0)
+		r = symlinkat(target, dst->pfd, dst->name);
+	if (r == -1)
+		return STATUS_E(ST_ERR_FILEWR, "Creating symbolic link", file_strdup(cp->tree, f));
+
+	cp->stats.nsymlinks++;
+	return STATUS(ST_OK, 0, "Copying symbolic link", NULL);
+}
+
+static status_t copy_dir(struct copier* cp, const struct file* f, const file_t* dst)
+{
+	/* Keep the directory writable for us, or its contents can't be copied:
+	 * copy_tree_modes() puts its mode back at the end
+	 */
+	mode_t mode = (f->mode & 07777) | S_IRWXU;
+
+	int r = mkdirat(dst->pfd, dst->name, mode);
+	if (r == -1 && errno == EEXIST) {
+		/* Possibly created, and counted, on the way to an earlier
+		 * entry, see fs/dirfds.h, or by the last run. Whatever else is
+		 * in the way is replaced.
+		 */
+		struct stat sb;
+		if (fstatat(dst->pfd, dst->name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+			return STATUS_E(ST_ERR_MKDIR, "Creating directory", file_strdup(cp->tree, f));
+		if (S_ISDIR(sb.st_mode)) {
+			if (fchmodat(dst->pfd, dst->name, mode, 0) == -1)
+				return STATUS_E(ST_ERR_MKDIR, "Setting directory mode",
+						file_strdup(cp->tree, f));
+			return STATUS(ST_OK, 0, "Creating directory", NULL);
+		}
+		if (unlinkat(dst->pfd, dst->name, 0) == 0)
+			r = mkdirat(dst->pfd, dst->name, mode);
+	}
+	if (r == -1)
+		return STATUS_E(ST_ERR_MKDIR, "Creating directory", file_strdup(cp->tree, f));
+
+	cp->stats.ndirs++;
+	return STATUS(ST_OK, 0, "Creating directory", NULL);
+}
+
+/* Links every other name of `f' to its copy. Whatever is in the way,
+ * from a previous run, is replaced. The copy is found by its name in a
+ * descriptor of its own directory, since the handle of each name may
+ * push that directory out of cp->dirs.
+ */
+static status_t copy_links(struct copier* cp, const struct file* f)
+{
+	file_t from;
+	int fd = -1;
+
+	if (dirfds_at(&cp->dirs, f, NULL, &from) == 0 &&
+	    (fd = dup(from.pfd)) == -1 && (errno == EMFILE || errno == ENFILE) &&
+	    dirfds_shed(&cp->dirs, f->dir) > 0)
+		fd = dup(from.pfd);
+	if (fd == -1)
+		return STATUS_E(ST_ERR_OPEN, "Opening parent directory", file_strdup(cp->tree, f));
+
+	status_t ret = STATUS(ST_OK, 0, "Creating hard links", NULL);
+	for (const struct file* l = f->links; l; l = l->links) {
+		file_t to;
+		int r = dirfds_at(&cp->dirs, l, NULL, &to);
+		if (r == 0) {
+			r = linkat(fd, f->name, to.pfd, to.name, 0);
+			if (r == -1 && errno == EEXIST && unlinkat(to.pfd, to.name, 0) == 0)
+				r = linkat(fd, f->name, to.pfd, to.name, 0);
+		}
+		if (r == -1) {
+			ret = STATUS_E(ST_ERR_FILEWR, "Creating hard link", file_strdup(cp->tree, l));
+			break;
+		}
+		cp->stats.nlinks++;
+	}
+
+	close(fd);
+	return ret;
+}
+
+/* errno values after which copy_file_range or sendfile can't be used for
+ * this pair of files, but the next method may still work.
+ */
+static int fallback_errno(int err)
+{
+	switch (err) {
+	case ENOSYS:
+	case EINVAL:
+	case EXDEV:
+	case EBADF:
+	case EPERM:
+	case ETXTBSY:
+	case EOPNOTSUPP:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+#ifdef __linux__
+static ssize_t kcopy(int method, int in, int out, size_t len)
+{
+	uint64_t t = STATS_START();
+	ssize_t n = (method == COPY_CFR) ? copy_file_range(in, NULL, out, NULL, len, 0)
+					 : sendfile(out, in, NULL, len);
+	STATS_TIME(STATS_KCOPY, t);
+	return n;
+}
+#endif
@@ -0,0 +1,259 @@
+/* getdents64 and statx are Linux specific */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "fs/dents.h"
+#include "stats.h"
+
+#ifdef __linux__
+/* What getdents64 fills the buffer with, see getdents(2) */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static mode_t dtype_mode(unsigned char type);
+#endif
+static int stat_need(int dfd, const char* name, int flags, unsigned need,
+		     struct stat* sb);
+
+/* Allocates the entry buffer, no directory is attached yet.
+ * Returns -1 on allocation failure, malloc will set errno.
+ */
+int dents_init(struct dents* ds, size_t bufsz)
+{
+	ds->buf = malloc(bufsz);
+	if (!ds->buf)
+		return -1;
+
+	ds->fd = -1;
+	ds->bufsz = bufsz;
+	ds->pos = ds->len = 0;
+	ds->off = 0;
+#ifndef __linux__
+	ds->dir = NULL;
+#endif
+	return 0;
+}
+
+/* Starts reading the directory `fd'. The reader owns `fd' from now on,
+ * even on failure. The buffer is reused from the previous directory.
+ */
+int dents_open(struct dents* ds, int fd)
+{
+	ds->fd = fd;
+	ds->pos = ds->len = 0;
+#ifndef __linux__
+	ds->dir = fdopendir(fd);
+	if (!ds->dir) {
+		int err = errno;
+		close(fd);
+		ds->fd = -1;
+		errno = err;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* Reads the next entry into `e'. Returns 1 when an entry was read,
+ * 0 at the end of the directory, and -1 with errno set on failure.
+ */
+int dents_next(struct dents* ds, struct dent* e)
+{
+#ifdef __linux__
+	if (ds->pos >= ds->len) {
+		uint64_t t = STATS_START();
+		long n = syscall(SYS_getdents64, ds->fd, ds->buf, ds->bufsz);
+		STATS_TIME(STATS_GETDENTS, t);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return 0;
+		ds->len = (size_t)n;
+		ds->pos = 0;
+	}
+
+	const struct linux_dirent64* d = (const void*)(ds->buf + ds->pos);
+	ds->pos += d->d_reclen;
+	e->name = d->d_name;
+	e->ino = d->d_ino;
+	e->type = dtype_mode(d->d_type);
+	return 1;
+#else
+	struct dirent* d;
+	uint64_t t = STATS_START();
+	errno = 0;
+	d = readdir(ds->dir);
+	STATS_TIME(STATS_GETDENTS, t);
+	if (!d)
+		return (errno) ? -1 : 0;
+
+	e->name = d->d_name;
+	e->ino = (uintmax_t)d->d_ino;
+	e->type = 0;
+	return 1;
+#endif
+}
+
+/* Closes the attached directory, the buffer is kept for the next one. */
+void dents_close(struct dents* ds)
+{
+#ifdef __linux__
+	if (ds->fd >= 0)
+		close(ds->fd);
+#else
+	if (ds->dir)
+		closedir(ds->dir);
+	ds->dir = NULL;
+#endif
+	ds->fd = -1;
+}
+
+/* Closes the attached directory, but remembers where reading stopped:
+ * dents_resume() carries on from there, with another descriptor of the
+ * same directory. Only the entries not read yet are kept, in a buffer
+ * shrunk to fit them.
+ *
+ * Returns -1 with errno set on failure, and where directory offsets
+ * can't be relied on (ENOTSUP): the directory is left open then.
+ */
+int dents_park(struct dents* ds)
+{
+#ifdef __linux__
+	/* Where the next getdents64 call would start */
+	off_t off = lseek(ds->fd, 0, SEEK_CUR);
+	if (off == -1)
+		return -1;
+
+	size_t left = ds->len - ds->pos;
+	memmove(ds->buf, ds->buf + ds->pos, left);
+	char* buf = realloc(ds->buf, (left) ? left : 1);
+	if (buf) ds->buf = buf;
+	ds->pos = 0;
+	ds->len = left;
+	ds->off = off;
+
+	close(ds->fd);
+	ds->fd = -1;
+	return 0;
+#else
+	/* telldir() cookies die with the stream */
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/* Carries on reading a parked directory from `fd', which the reader owns
+ * from now on, even on failure.
+ */
+int dents_resume(struct dents* ds, int fd)
+{
+	char* buf = realloc(ds->buf, ds->bufsz);
+	if (!buf || lseek(fd, ds->off, SEEK_SET) == -1) {
+		int err = (buf) ? errno : ENOMEM;
+		if (buf) ds->buf = buf;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	ds->buf = buf;
+	ds->fd = fd;
+	return 0;
+}
+
+void dents_free(struct dents* ds)
+{
+	dents_close(ds);
+	free(ds->buf);
+	ds->buf = NULL;
+}
+
+/* Like fstatat(2), but only asks for what's in `need' (DENT_NEED_*),
+ * which saves the filesystem work on network and FUSE mounts. Fields
+ * that weren't asked for are left unset. Falls back to fstatat where
+ * statx isn't available.
+ */
+int dent_stat(int dfd, const char* name, int flags, unsigned need, struct stat* sb)
+{
+	uint64_t t = STATS_START();
+	int r = stat_need(dfd, name, flags, need, sb);
+	STATS_TIME(STATS_STAT, t);
+	return r;
+}
+
+static int stat_need(int dfd, const char* name, int flags, unsigned need,
+		     struct stat* sb)
+{
+#if defined(__linux__) && defined(STATX_TYPE)
+	/* Shared by the threads of ptraverse() */
+	static int no_statx;
+	struct statx stx;
+	unsigned mask = STATX_TYPE | STATX_INO;
+	/* Sizes and times decide what's unchanged, see fidx_unchanged(): on
+	 * network filesystems, the cached ones may be stale. The rest is
+	 * fine as the client has it.
+	 */
+	int sync = (need & (DENT_NEED_SIZE | DENT_NEED_TIMES)) ? AT_STATX_SYNC_AS_STAT
+							      : AT_STATX_DONT_SYNC;
+
+	if (need & DENT_NEED_MODE) mask |= STATX_MODE;
+	if (need & DENT_NEED_SIZE) mask |= STATX_SIZE;
+	if (need & DENT_NEED_TIMES) mask |= STATX_MTIME | STATX_CTIME;
+	if (need & DENT_NEED_NLINK) mask |= STATX_NLINK;
+
+	if (!__atomic_load_n(&no_statx, __ATOMIC_RELAXED)) {
+		if (statx(dfd, name, flags | sync, mask, &stx) == 0) {
+			sb->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+			sb->st_ino = (ino_t)stx.stx_ino;
+			sb->st_mode = stx.stx_mode;
+			sb->st_nlink = (nlink_t)stx.stx_nlink;
+			sb->st_size = (off_t)stx.stx_size;
+			sb->st_mtim.tv_sec = (time_t)stx.stx_mtime.tv_sec;
+			sb->st_mtim.tv_nsec = (long)stx.stx_mtime.tv_nsec;
+			sb->st_ctim.tv_sec = (time_t)stx.stx_ctime.tv_sec;
+			sb->st_ctim.tv_nsec = (long)stx.stx_ctime.tv_nsec;
+			return 0;
+		}
+		if (errno != ENOSYS)
+			return -1;
+		/* Kernel older than 4.11 */
+		__atomic_store_n(&no_statx, 1, __ATOMIC_RELAXED);
+	}
+#else
+	(void)need;
+#endif
+	return fstatat(dfd, name, sb, flags);
+}
+
+#ifdef __linux__
+static mode_t dtype_mode(unsigned char type)
+{
+	switch (type) {
+	case DT_REG: return S_IFREG;
+	case DT_DIR: return S_IFDIR;
+	case DT_LNK: return S_IFLNK;
+	case DT_FIFO: return S_IFIFO;
+	case DT_SOCK: return S_IFSOCK;
+	case DT_CHR: return S_IFCHR;
+	case DT_BLK: return S_IFBLK;
+	default: return 0;
+	}
+}
+#endif
@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs/deque.h"
+#include "fs/dirtree.h"
+
+static int deque_grow(struct deque* q);
+
+/* Returns 0 on success, -1 with errno set otherwise. */
+int deque_init(struct deque* q)
+{
+	q->items = malloc(DEQUE_INITSZ * sizeof(uint32_t));
+	if (!q->items)
+		return -1;
+
+	int err = pthread_mutex_init(&q->lock, NULL);
+	if (err) {
+		free(q->items);
+		errno = err;
+		return -1;
+	}
+	q->cap = DEQUE_INITSZ;
+	q->top = 0;
+	q->n = 0;
+	return 0;
+}
+
+/* Frees the deque. */
+void deque_destroy(struct deque* q)
+{
+	free(q->items);
+	pthread_mutex_destroy(&q->lock);
+}
+
+/* Pushes at the bottom.
+ * Returns -1 and sets errno to ENOMEM if the deque can't grow.
+ */
+int deque_push(struct deque* q, uint32_t node)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->n == q->cap && deque_grow(q) == -1) {
+		pthread_mutex_unlock(&q->lock);
+		errno = ENOMEM;
+		return -1;
+	}
+	q->items[(q->top + q->n) & (q->cap - 1)] = node;
+	q->n++;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/* Pops the newest item, DIRTREE_NONE if empty. */
+uint32_t deque_pop(struct deque* q)
+{
+	uint32_t node = DIRTREE_NONE;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->n) {
+		q->n--;
+		node = q->items[(q->top + q->n) & (q->cap - 1)];
+	}
+	pthread_mutex_unlock(&q->lock);
+	return node;
+}
+
+/* Takes the oldest item, DIRTREE_NONE if empty. */
+uint32_t deque_steal(struct deque* q)
+{
+	uint32_t node = DIRTREE_NONE;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->n) {
+		node = q->items[q->top];
+		q->top = (q->top + 1) & (q->cap - 1);
+		q->n--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return node;
+}
+
+/* Doubles the ring buffer, unwrapping it in the process. */
+static int deque_grow(struct deque* q)
+{
+	uint32_t* items = malloc(q->cap * 2 * sizeof(uint32_t));
+	if (!items)
+		return -1;
+
+	size_t first = q->cap - q->top; /* items before the wrap */
+	if (first > q->n) first = q->n;
+	memcpy(items, q->items + q->top, first * sizeof(uint32_t));
+	memcpy(items + first, q->items, (q->n - first) * sizeof(uint32_t));
+
+	free(q->items);
+	q->items = items;
+	q->top = 0;
+	q->cap *= 2;
+	return 0;
+}
@@ -0,0 +1,238 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "fs/dirfds.h"
+#include "fs/dirtree.h"
+#include "stats.h"
+
+static int dir_fd(struct dirfds* d, uint32_t node, int dst);
+static int open_dir(struct dirfds* d, int pfd, const char* name, int dst);
+static void drop(struct dirfds* d, int fd);
+static int retry(struct dirfds* d, int tries);
+
+void dirfds_init(struct dirfds* d, const struct dirtree* tree, int srcfd, int dstfd,
+		 int oflags)
+{
+	d->tree = tree;
+	d->srcfd = srcfd;
+	d->dstfd = dstfd;
+	d->oflags = oflags;
+	d->nocreate = 0;
+	d->ndirs = NULL;
+	d->size = DIRFDS_SIZE;
+	d->keep = -1;
+	d->stale = -1;
+	for (unsigned i = 0; i < DIRFDS_SIZE; ++i) {
+		d->dirs[i].node = DIRTREE_NONE;
+		d->dirs[i].src = -1;
+		d->dirs[i].dst = -1;
+	}
+}
+
+/* Keeps no more than `size' directories open on each side, for when
+ * several copiers share the descriptors of the process.
+ */
+void dirfds_limit(struct dirfds* d, unsigned size)
+{
+	dirfds_flush(d);
+	d->size = (size == 0) ? 1 : (size > DIRFDS_SIZE) ? DIRFDS_SIZE : size;
+}
+
+/* Closes every directory kept open. The roots aren't touched. */
+void dirfds_flush(struct dirfds* d)
+{
+	d->keep = -1;
+	for (unsigned i = 0; i < DIRFDS_SIZE; ++i) {
+		drop(d, d->dirs[i].src);
+		drop(d, d->dirs[i].dst);
+		d->dirs[i].node = DIRTREE_NONE;
+		d->dirs[i].src = -1;
+		d->dirs[i].dst = -1;
+	}
+	drop(d, d->stale);
+	d->stale = -1;
+}
+
+/* Closes every directory kept open but `node', for when descriptors
+ * run out. Returns how many were closed.
+ */
+unsigned dirfds_shed(struct dirfds* d, uint32_t node)
+{
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < DIRFDS_SIZE; ++i) {
+		struct dirfd* e = &d->dirs[i];
+		if (e->node == node || e->node == DIRTREE_NONE)
+			continue;
+		n += (e->src >= 0) + (e->dst >= 0);
+		drop(d, e->src);
+		drop(d, e->dst);
+		e->node = DIRTREE_NONE;
+		e->src = -1;
+		e->dst = -1;
+	}
+	return n;
+}
+
+/* Fills `src' and `dst', either of them NULL if not needed, with the
+ * handles of `f' in the source and the destination. They stay valid
+ * until the next call.
+ *
+ * Returns 0 on success, -1 with errno set otherwise. Running out of
+ * descriptors empties the cache, and tries again, with a smaller cache
+ * every time that wasn't enough.
+ */
+int dirfds_at(struct dirfds* d, const struct file* f, file_t* src, file_t* dst)
+{
+	drop(d, d->stale);
+	d->stale = -1;
+
+	for (int tries = 0; ; tries++) {
+		int sfd = -1, dfd = -1;
+		if (src && (sfd = dir_fd(d, f->dir, 0)) == -1)
+			goto fail;
+		/* Its parents may take the slot of `sfd' on the way */
+		d->keep = sfd;
+		if (dst)
+			dfd = dir_fd(d, f->dir, 1);
+		d->keep = -1;
+		if (dst && dfd == -1)
+			goto fail;
+		if (src) {
+			src->pfd = sfd;
+			src->name = f->name;
+		}
+		if (dst) {
+			dst->pfd = dfd;
+			dst->name = f->name;
+		}
+		return 0;
+fail:
+		if (!retry(d, tries))
+			return -1;
+	}
+}
+
+/* Opens the source directory `node' by its name, in its parent from the
+ * cache, for a traversal. The descriptor is the caller's to close, and
+ * isn't cached: only parents are.
+ *
+ * Returns it, or -1 with errno set. Descriptors running out are dealt
+ * with like in dirfds_at().
+ */
+int dirfds_open(struct dirfds* d, uint32_t node)
+{
+	for (int tries = 0; ; tries++) {
+		int fd;
+		if (node == DIRTREE_ROOT) {
+			fd = open_dir(d, d->srcfd, ".", 0);
+		} else {
+			const struct dnode* n = dirtree_node(d->tree, node);
+			int pfd = dir_fd(d, n->parent, 0);
+			fd = (pfd == -1) ? -1 : open_dir(d, pfd, n->name, 0);
+		}
+		if (fd >= 0)
+			return fd;
+		if (!retry(d, tries))
+			return -1;
+	}
+}
+
+/* The descriptor of `node' on one side, opened through its parents if
+ * it isn't in the cache already.
+ */
+static int dir_fd(struct dirfds* d, uint32_t node, int dst)
+{
+	if (node == DIRTREE_ROOT)
+		return (dst) ? d->dstfd : d->srcfd;
+
+	struct dirfd* e = &d->dirs[node % d->size];
+	int* fd = (dst) ? &e->dst : &e->src;
+	if (e->node == node && *fd >= 0)
+		return *fd;
+
+	/* The parent may take this very slot, until it's done with */
+	const struct dnode* n = dirtree_node(d->tree, node);
+	int pfd = dir_fd(d, n->parent, dst);
+	if (pfd == -1)
+		return -1;
+	int nfd = open_dir(d, pfd, n->name, dst);
+	if (nfd == -1)
+		return -1;
+
+	if (e->node != node) {
+		drop(d, e->src);
+		drop(d, e->dst);
+		e->node = node;
+		e->src = -1;
+		e->dst = -1;
+	}
+	*fd = nfd;
+	return nfd;
+}
+
+/* Opens the directory `name' in `pfd'. Symbolic links are only followed
+ * in the source, if the traversal did. In the destination, a missing
+ * directory is created, for its own entry to fix its mode later, unless
+ * d->nocreate is set, and counted in d->ndirs: that entry then finds it
+ * there already.
+ */
+static int open_dir(struct dirfds* d, int pfd, const char* name, int dst)
+{
+	int oflags = O_RDONLY | O_DIRECTORY | O_NOCTTY |
+		     ((dst) ? O_NOFOLLOW : (d->oflags & O_NOFOLLOW));
+
+	uint64_t t = STATS_START();
+	int fd = openat(pfd, name, oflags);
+	STATS_TIME(STATS_OPEN, t);
+	if (fd >= 0 || !dst || errno != ENOENT || d->nocreate)
+		return fd;
+
+	if (mkdirat(pfd, name, 0777) == 0) {
+		if (d->ndirs)
+			(*d->ndirs)++;
+	} else if (errno != EEXIST) {
+		return -1;
+	}
+	t = STATS_START();
+	fd = openat(pfd, name, oflags);
+	STATS_TIME(STATS_OPEN, t);
+	return fd;
+}
+
+/* Whether to try again after the `tries'-th failure, with errno set:
+ * only when descriptors ran out. The cache is emptied then, and from the
+ * second time on halved as well, until it's down to one directory.
+ */
+static int retry(struct dirfds* d, int tries)
+{
+	if (errno != EMFILE && errno != ENFILE)
+		return 0;
+	if (tries > 0) {
+		if (d->size == 1)
+			return 0;
+		d->size /= 2;
+	}
+	dirfds_flush(d);
+	return 1;
+}
+
+/* Closes `fd', a directory leaving the cache, unless it's still handed
+ * out: then it's closed by the next dirfds_at().
+ */
+static void drop(struct dirfds* d, int fd)
+{
+	if (fd < 0)
+		return;
+	if (fd == d->keep)
+		d->stale = fd;
+	else
+		close(fd);
+}
@@ -0,0 +1,248 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs/dirtree.h"
+
+static const struct dnode* node_at(const struct dirtree* t, uint32_t i);
+static size_t path_len(const struct dirtree* t, uint32_t node);
+static void path_fill(const struct dirtree* t, uint32_t node, char* end);
+
+/* Sets up an empty tree, holding only the root.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int dirtree_init(struct dirtree* t)
+{
+	/* Only the chunks in use are ever touched */
+	t->chunks = calloc(DIRTREE_MAXCHUNKS, sizeof(struct dnode*));
+	if (!t->chunks)
+		return -1;
+
+	int err = pthread_mutex_init(&t->lock, NULL);
+	if (err) {
+		free(t->chunks);
+		errno = err;
+		return -1;
+	}
+	t->n = 0;
+
+	if (dirtree_add(t, DIRTREE_NONE, "", 0) == DIRTREE_NONE) {
+		dirtree_free(t);
+		return -1;
+	}
+	return 0;
+}
+
+/* Frees the nodes, but not their names. */
+void dirtree_free(struct dirtree* t)
+{
+	if (!t->chunks)
+		return;
+
+	for (size_t i = 0; i < DIRTREE_MAXCHUNKS && t->chunks[i]; ++i)
+		free(t->chunks[i]);
+	free(t->chunks);
+	t->chunks = NULL;
+	pthread_mutex_destroy(&t->lock);
+}
+
+/* Adds the directory `name' under `parent', with the `filter' steps live
+ * in it. The tree never owns `name', which must outlive it.
+ *
+ * Returns the index of the new node, or DIRTREE_NONE with errno set.
+ */
+uint32_t dirtree_add(struct dirtree* t, uint32_t parent, const char* name,
+		     uint32_t filter)
+{
+	uint32_t i = DIRTREE_NONE;
+
+	pthread_mutex_lock(&t->lock);
+	size_t c = t->n / DIRTREE_CHUNK;
+	if (c >= DIRTREE_MAXCHUNKS || t->n >= DIRTREE_NONE) {
+		errno = EOVERFLOW;
+		goto out_unlock;
+	}
+	if (!t->chunks[c]) {
+		t->chunks[c] = malloc(DIRTREE_CHUNK * sizeof(struct dnode));
+		if (!t->chunks[c])
+			goto out_unlock;
+	}
+
+	struct dnode* d = &t->chunks[c][t->n % DIRTREE_CHUNK];
+	d->name = name;
+	d->parent = parent;
+	d->filter = filter;
+	i = (uint32_t)t->n++;
+out_unlock:
+	pthread_mutex_unlock(&t->lock);
+	return i;
+}
+
+/* The filter steps live in `node', as given to dirtree_add() */
+uint32_t dirtree_filter(const struct dirtree* t, uint32_t node)
+{
+	return node_at(t, node)->filter;
+}
+
+const struct dnode* dirtree_node(const struct dirtree* t, uint32_t node)
+{
+	return node_at(t, node);
+}
+
+/* Writes the path of `node', relative to the root, in `buf'. The root
+ * itself is "". Names are gathered from the node up, so the path is
+ * measured first, and then filled in from its end.
+ *
+ * Returns its length, or -1 with errno set to ENAMETOOLONG if it doesn't
+ * fit in `size' bytes.
+ */
+ssize_t dirtree_path(const struct dirtree* t, uint32_t node, char* buf, size_t size)
+{
+	size_t len = path_len(t, node);
+	if (len >= size || len > SSIZE_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	buf[len] = '\0';
+	path_fill(t, node, buf + len);
+	return (ssize_t)len;
+}
+
+/* Same as dirtree_path(), in a newly allocated string as long as it
+ * takes. Meant for error messages: returns NULL on failure.
+ */
+char* dirtree_strdup(const struct dirtree* t, uint32_t node)
+{
+	size_t len = path_len(t, node);
+	char* buf = malloc(len + 1);
+	if (!buf)
+		return NULL;
+
+	buf[len] = '\0';
+	path_fill(t, node, buf + len);
+	return buf;
+}
+
+/* Writes the path of `f', relative to the root, in `buf'.
+ * Returns its length, or -1 with errno set to ENAMETOOLONG.
+ */
+ssize_t file_path(const struct dirtree* t, const struct file* f, char* buf, size_t size)
+{
+	ssize_t len = dirtree_path(t, f->dir, buf, size);
+	if (len == -1)
+		return -1;
+
+	size_t n = strlen(f->name);
+	size_t at = (size_t)len + (len > 0);
+	if (at + n >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (len > 0)
+		buf[len] = '/';
+	memcpy(buf + at, f->name, n + 1);
+	return (ssize_t)(at + n);
+}
+
+/* Length of the path of `f', without its NUL: what file_path() needs
+ * one more byte than.
+ */
+size_t file_path_len(const struct dirtree* t, const struct file* f)
+{
+	size_t len = path_len(t, f->dir);
+	return len + (len > 0) + strlen(f->name);
+}
+
+/* Same as file_path(), in a newly allocated string as long as it takes.
+ * Returns NULL on failure.
+ */
+char* file_strdup(const struct dirtree* t, const struct file* f)
+{
+	size_t len = path_len(t, f->dir);
+	size_t at = len + (len > 0);
+	size_t n = strlen(f->name);
+	char* buf = malloc(at + n + 1);
+	if (!buf)
+		return NULL;
+
+	memcpy(buf + at, f->name, n + 1);
+	if (len > 0)
+		buf[len] = '/';
+	path_fill(t, f->dir, buf + len);
+	return buf;
+}
+
+/* Tells whether `path' is the path of `f', relative to the root. It's
+ * compared from its end, a name at a time, without building the path of
+ * `f': it may be longer than any buffer.
+ */
+int file_path_is(const struct dirtree* t, const struct file* f, const char* path)
+{
+	size_t len = strlen(path);
+	const char* name = f->name;
+	const struct dnode* d;
+
+	for (uint32_t i = f->dir; ; i = d->parent) {
+		size_t n = strlen(name);
+		if (n > len || memcmp(path + len - n, name, n) != 0)
+			return 0;
+		len -= n;
+		if (i == DIRTREE_ROOT)
+			return len == 0;
+		if (len == 0 || path[--len] != '/')
+			return 0;
+		d = node_at(t, i);
+		name = d->name;
+	}
+}
+
+/* Tells whether `path' is the path of `f' or of one of its other names,
+ * see struct file. Which name of a file with several links is found first
+ * changes from one run to the next with several threads.
+ */
+int file_has_path(const struct dirtree* t, const struct file* f, const char* path)
+{
+	for (const struct file* l = f; l; l = l->links) {
+		if (file_path_is(t, l, path))
+			return 1;
+	}
+	return 0;
+}
+
+/* Length of the path of `node', without its NUL */
+static size_t path_len(const struct dirtree* t, uint32_t node)
+{
+	size_t len = 0;
+	const struct dnode* d;
+
+	for (uint32_t i = node; i != DIRTREE_ROOT; i = d->parent) {
+		d = node_at(t, i);
+		len += strlen(d->name) + (d->parent != DIRTREE_ROOT);
+	}
+	return len;
+}
+
+/* Writes the path of `node' backwards, ending right before `end' */
+static void path_fill(const struct dirtree* t, uint32_t node, char* end)
+{
+	const struct dnode* d;
+
+	for (uint32_t i = node; i != DIRTREE_ROOT; i = d->parent) {
+		d = node_at(t, i);
+		size_t n = strlen(d->name);
+		end -= n;
+		memcpy(end, d->name, n);
+		if (d->parent != DIRTREE_ROOT)
+			*--end = '/';
+	}
+}
+
+static const struct dnode* node_at(const struct dirtree* t, uint32_t i)
+{
+	return &t->chunks[i / DIRTREE_CHUNK][i % DIRTREE_CHUNK];
+}
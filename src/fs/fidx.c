@@ -0,0 +1,323 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "fs.h"
+#include "fs/fidx.h"
+#include "status.h"
+
+/* Buffer of the stream the index is written through */
+#define FIDX_BUFSZ (1 << 20)
+
+struct fidx_pass {
+	FILE* fp;
+	const struct dirtree* tree;
+	uint32_t* slots;
+	uint64_t nslots;
+	uint64_t nrec;		/* records written */
+	uint64_t stroff;	/* bytes of paths so far */
+	int err;		/* errno of the first failure */
+};
+
+static int put_rec(const void* key, void* value, void* user_data);
+static int put_path(const void* key, void* value, void* user_data);
+static int indexed(const struct file* f);
+static int fidx_valid(const struct fidx* idx);
+
+/* Maps the index at `path'. Nothing is read until it's used: opening
+ * only checks the header, and that every part lies within the file.
+ *
+ * On failure, the status carries errno: ENOENT means there's no index
+ * yet, EINVAL that it isn't usable.
+ */
+status_t fidx_open(struct fidx* idx, const char* path)
+{
+	struct stat sb;
+	status_t ret;
+
+	memset(idx, 0, sizeof(*idx));
+	int fd = open(path, O_RDONLY | O_NOCTTY);
+	if (fd < 0)
+		return STATUS_E(ST_ERR_INDEX, "Opening file index", strdup(path));
+	if (fstat(fd, &sb) == -1) {
+		ret = STATUS_E(ST_ERR_INDEX, "Reading file index metadata", strdup(path));
+		goto out_close;
+	}
+	if ((uintmax_t)sb.st_size < sizeof(struct fidx_hdr) ||
+	    (uintmax_t)sb.st_size > SIZE_MAX) {
+		ret = STATUS(ST_ERR_INDEX, EINVAL, "File index is truncated", strdup(path));
+		goto out_close;
+	}
+
+	idx->len = (size_t)sb.st_size;
+	idx->map = mmap(NULL, idx->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (idx->map == MAP_FAILED) {
+		idx->map = NULL;
+		ret = STATUS_E(ST_ERR_INDEX, "Mapping file index", strdup(path));
+		goto out_close;
+	}
+	close(fd);
+
+	idx->hdr = idx->map;
+	if (!fidx_valid(idx)) {
+		fidx_close(idx);
+		return STATUS(ST_ERR_INDEX, EINVAL, "File index is damaged", strdup(path));
+	}
+	const char* base = idx->map;
+	idx->recs = (const struct fidx_rec*)(const void*)(base + idx->hdr->recoff);
+	idx->slots = (const uint32_t*)(const void*)(base + idx->hdr->slotoff);
+	idx->strs = base + idx->hdr->stroff;
+	return STATUS(ST_OK, 0, "Opening file index", NULL);
+
+out_close:
+	close(fd);
+	return ret;
+}
+
+void fidx_close(struct fidx* idx)
+{
+	if (idx->map)
+		munmap(idx->map, idx->len);
+	memset(idx, 0, sizeof(*idx));
+}
+
+/* Finds the record of the file `k', NULL if it isn't there. */
+const struct fidx_rec* fidx_find(const struct fidx* idx, const struct kfile* k)
+{
+	if (!idx->map)
+		return NULL;
+
+	uint64_t mask = idx->hdr->nslots - 1;
+	uint64_t pos = (uint64_t)hash(k) & mask;
+
+	for (uint64_t n = 0; n < idx->hdr->nslots; ++n) {
+		uint32_t s = idx->slots[pos];
+		if (s == FIDX_EMPTY)
+			return NULL;
+		if (s < idx->hdr->nrec && idx->recs[s].dev == k->st_dev &&
+		    idx->recs[s].ino == k->st_ino)
+			return &idx->recs[s];
+		pos = (pos + 1) & mask;
+	}
+	return NULL;
+}
+
+/* Tells whether `f', of the directories in `tree', was copied by the run
+ * that wrote the index and hasn't changed since: same path, size, mode,
+ * and times. A changed ctime catches what a reset mtime would hide. The
+ * path may be any name of `f': copy_skip() checks the others.
+ */
+int fidx_unchanged(const struct fidx* idx, const struct kfile* k,
+		   const struct file* f, const struct dirtree* tree)
+{
+	const struct fidx_rec* r = fidx_find(idx, k);
+
+	if (!r || !indexed(f))
+		return 0;
+	if (r->size != (int64_t)f->size || r->mtime != f->mtime ||
+	    r->ctime != f->ctime || r->mode != (uint32_t)f->mode)
+		return 0;
+	return r->path < idx->hdr->strlen && file_has_path(tree, f, idx->strs + r->path);
+}
+
+/* Writes the index of `files' to `path'. Only files the copy marked done
+ * are in it: one that failed, or was skipped, is copied again next time.
+ * It's written to a temporary file first, and renamed over `path' once
+ * it's on disk: an index that is still mapped stays valid, and a crash
+ * never leaves half of one.
+ *
+ * Records are written in one pass over the table, while the hash
+ * directory is filled in memory, and the paths in a second pass; the
+ * header goes last, once the sizes are known.
+ */
+status_t fidx_write(const char* path, struct hash_table* files,
+		    const struct dirtree* tree)
+{
+	status_t ret;
+	struct fidx_hdr hdr;
+	struct fidx_pass pass;
+
+	if (files->count >= FIDX_EMPTY)
+		return STATUS(ST_ERR_INDEX, EOVERFLOW, "Writing file index", strdup(path));
+
+	size_t len = strlen(path);
+	char* tmp = malloc(len + sizeof(".tmp"));
+	if (!tmp)
+		return STATUS_E(ST_ERR_MALLOC, "Writing file index", NULL);
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+
+	memset(&pass, 0, sizeof(pass));
+	pass.tree = tree;
+	pass.nslots = 16;
+	while (pass.nslots < files->count * 2)
+		pass.nslots *= 2;
+	pass.slots = malloc(pass.nslots * sizeof(uint32_t));
+	if (!pass.slots) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Writing file index", NULL);
+		goto out_free_tmp;
+	}
+	memset(pass.slots, 0xff, pass.nslots * sizeof(uint32_t));
+
+	pass.fp = fopen(tmp, "wb");
+	if (!pass.fp) {
+		ret = STATUS_E(ST_ERR_INDEX, "Creating file index", strdup(tmp));
+		goto out_free_slots;
+	}
+	setvbuf(pass.fp, NULL, _IOFBF, FIDX_BUFSZ);
+
+	/* Filled in at the end */
+	memset(&hdr, 0, sizeof(hdr));
+	if (fwrite(&hdr, sizeof(hdr), 1, pass.fp) != 1)
+		goto err_write;
+
+	hash_foreach(files, put_rec, &pass);
+	if (pass.err)
+		goto err_write;
+	if (fwrite(pass.slots, sizeof(uint32_t), pass.nslots, pass.fp) != pass.nslots)
+		goto err_write;
+	hash_foreach(files, put_path, &pass);
+	if (pass.err)
+		goto err_write;
+
+	memcpy(hdr.magic, FIDX_MAGIC, sizeof(hdr.magic));
+	hdr.version = FIDX_VERSION;
+	hdr.order = FIDX_ORDER;
+	hdr.nrec = pass.nrec;
+	hdr.nslots = pass.nslots;
+	hdr.recoff = sizeof(hdr);
+	hdr.slotoff = hdr.recoff + pass.nrec * sizeof(struct fidx_rec);
+	hdr.stroff = hdr.slotoff + pass.nslots * sizeof(uint32_t);
+	hdr.strlen = pass.stroff;
+	if (fseek(pass.fp, 0, SEEK_SET) == -1 ||
+	    fwrite(&hdr, sizeof(hdr), 1, pass.fp) != 1 ||
+	    fflush(pass.fp) == EOF || fsync(fileno(pass.fp)) == -1)
+		goto err_write;
+	if (fclose(pass.fp) == EOF) {
+		pass.fp = NULL;
+		goto err_write;
+	}
+	pass.fp = NULL;
+
+	if (rename(tmp, path) == -1) {
+		ret = STATUS_E(ST_ERR_INDEX, "Replacing file index", strdup(path));
+		unlink(tmp);
+		goto out_free_slots;
+	}
+	ret = STATUS(ST_OK, 0, "Writing file index", NULL);
+	goto out_free_slots;
+
+err_write:
+	ret = STATUS(ST_ERR_INDEX, pass.err ? pass.err : errno,
+		     "Writing file index", strdup(tmp));
+	if (pass.fp)
+		fclose(pass.fp);
+	unlink(tmp);
+out_free_slots:
+	free(pass.slots);
+out_free_tmp:
+	free(tmp);
+	return ret;
+}
+
+/* Writes the record of one file, and adds it to the hash directory. */
+static int put_rec(const void* key, void* value, void* user_data)
+{
+	struct fidx_pass* pass = user_data;
+	const struct kfile* k = key;
+	const struct file* f = value;
+	struct fidx_rec r;
+
+	if (!f->done || !indexed(f))
+		return 0;
+	size_t len = file_path_len(pass->tree, f);
+
+	memset(&r, 0, sizeof(r));
+	r.dev = k->st_dev;
+	r.ino = k->st_ino;
+	r.size = (int64_t)f->size;
+	r.mtime = f->mtime;
+	r.ctime = f->ctime;
+	r.mode = (uint32_t)f->mode;
+	r.path = pass->stroff;
+	if (fwrite(&r, sizeof(r), 1, pass->fp) != 1) {
+		pass->err = errno;
+		return 1;
+	}
+	pass->stroff += (uint64_t)len + 1;
+
+	uint64_t mask = pass->nslots - 1;
+	uint64_t pos = (uint64_t)hash(k) & mask;
+	while (pass->slots[pos] != FIDX_EMPTY)
+		pos = (pos + 1) & mask;
+	pass->slots[pos] = (uint32_t)pass->nrec++;
+	return 0;
+}
+
+/* Writes the path of one file, in the same order as put_rec(). */
+static int put_path(const void* key, void* value, void* user_data)
+{
+	struct fidx_pass* pass = user_data;
+	const struct file* f = value;
+	(void)key;
+
+	if (!f->done || !indexed(f))
+		return 0;
+	char* path = file_strdup(pass->tree, f);
+	if (!path || fwrite(path, strlen(path) + 1, 1, pass->fp) != 1) {
+		pass->err = errno;
+		free(path);
+		return 1;
+	}
+	free(path);
+	return 0;
+}
+
+/* Directories are always visited by the copy, and files the traversal
+ * didn't stat can't be compared: neither gets a record.
+ */
+static int indexed(const struct file* f)
+{
+	return !S_ISDIR(f->mode) && f->size != FILE_SIZE_UNKNOWN && f->ctime != 0;
+}
+
+/* Checks that the header makes sense, and that every part it describes
+ * lies within the mapping, properly aligned.
+ */
+static int fidx_valid(const struct fidx* idx)
+{
+	const struct fidx_hdr* h = idx->hdr;
+	uint64_t len = idx->len;
+
+	if (memcmp(h->magic, FIDX_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != FIDX_VERSION || h->order != FIDX_ORDER)
+		return 0;
+	/* A power of two, with at least one free slot */
+	if (h->nslots == 0 || (h->nslots & (h->nslots - 1)) || h->nrec >= h->nslots ||
+	    h->nrec >= FIDX_EMPTY)
+		return 0;
+
+	if (h->recoff % sizeof(uint64_t) || h->slotoff % sizeof(uint32_t))
+		return 0;
+	if (h->recoff > len || h->nrec > (len - h->recoff) / sizeof(struct fidx_rec))
+		return 0;
+	if (h->slotoff > len || h->nslots > (len - h->slotoff) / sizeof(uint32_t))
+		return 0;
+	if (h->stroff > len || h->strlen > len - h->stroff)
+		return 0;
+	/* Every path ends before the area does */
+	if (h->strlen &&
+	    ((const char*)idx->map)[h->stroff + h->strlen - 1] != '\0')
+		return 0;
+	return 1;
+}
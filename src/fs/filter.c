@@ -0,0 +1,457 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs/filter.h"
+#include "xxh3.h"
+
+/* Words of a live set filter_test() keeps on the stack */
+#define FILTER_STACK_WORDS 16
+
+#define BIT_TEST(w, i)	((w)[(i) / 32] & ((uint32_t)1 << ((i) % 32)))
+#define BIT_SET(w, i)	((w)[(i) / 32] |= (uint32_t)1 << ((i) % 32))
+
+static int compile(struct filter_step* s, const char* pat, size_t len, int anchored);
+static int step_match(const struct filter_step* s, const char* name, size_t len);
+static int grow_steps(struct filter* f);
+static int sets_reset(struct filter* f);
+static void sets_clear(struct filter_sets* ss);
+static const uint32_t* set_at(const struct filter_sets* ss, uint32_t id);
+static int set_intern(struct filter_sets* ss, const uint32_t* set, uint32_t* id);
+static void closure(const struct filter* f, uint32_t* live);
+
+void filter_init(struct filter* f)
+{
+	memset(f, 0, sizeof(*f));
+}
+
+void filter_free(struct filter* f)
+{
+	for (size_t i = 0; i < f->nrules; ++i)
+		if (!f->rules[i].anchored)
+			free(f->rules[i].step.text);
+	for (unsigned i = 0; i < f->nsteps; ++i)
+		free(f->steps[i].text);
+	free(f->rules);
+	free(f->steps);
+	free(f->deep);
+	free(f->last);
+	if (f->sets) {
+		sets_clear(f->sets);
+		pthread_mutex_destroy(&f->sets->lock);
+		free(f->sets);
+	}
+	memset(f, 0, sizeof(*f));
+}
+
+/* Adds the rule `pattern', see struct filter, after the others: it
+ * skips what it matches, or keeps it with `include'.
+ *
+ * Rules are only added before the filter is used: this starts the live
+ * sets over, with the root's.
+ *
+ * Returns 0 on success, -1 with errno set otherwise: EINVAL for an empty
+ * pattern. Once it fails for want of memory, the filter can only be freed.
+ */
+int filter_add(struct filter* f, const char* pattern, int include)
+{
+	struct filter_rule r;
+	size_t len = strlen(pattern);
+
+	memset(&r, 0, sizeof(r));
+	r.include = include;
+	while (len > 0 && pattern[len - 1] == '/') {
+		r.dironly = 1;
+		len--;
+	}
+	r.anchored = (memchr(pattern, '/', len) != NULL);
+	if (len > 0 && *pattern == '/') {
+		pattern++;
+		len--;
+	}
+	if (len == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (f->nrules == f->cap) {
+		size_t cap = (f->cap) ? f->cap * 2 : 16;
+		struct filter_rule* rules = realloc(f->rules, cap * sizeof(*rules));
+		if (!rules)
+			return -1;
+		f->rules = rules;
+		f->cap = cap;
+	}
+
+	if (!r.anchored) {
+		if (compile(&r.step, pattern, len, 0) == -1)
+			return -1;
+		f->rules[f->nrules++] = r;
+		return sets_reset(f);
+	}
+
+	/* One step per component, empty ones aside */
+	r.first = f->nsteps;
+	for (size_t at = 0; at < len; ) {
+		const char* slash = memchr(pattern + at, '/', len - at);
+		size_t n = (slash) ? (size_t)(slash - (pattern + at)) : len - at;
+		if (n > 0) {
+			if (f->nsteps == f->capsteps && grow_steps(f) == -1)
+				goto err_undo;
+			if (compile(&f->steps[f->nsteps], pattern + at, n, 1) == -1)
+				goto err_undo;
+			if (f->steps[f->nsteps].kind == STEP_DEEP)
+				BIT_SET(f->deep, f->nsteps);
+			f->nsteps++;
+		}
+		at += n + 1;
+	}
+	r.nsteps = f->nsteps - r.first;
+	BIT_SET(f->last, f->nsteps - 1);
+	f->rules[f->nrules++] = r;
+	return sets_reset(f);
+
+err_undo:
+	while (f->nsteps > r.first) {
+		f->nsteps--;
+		free(f->steps[f->nsteps].text);
+		f->deep[f->nsteps / 32] &= ~((uint32_t)1 << (f->nsteps % 32));
+	}
+	return -1;
+}
+
+/* Adds the rules in the file at `path', one per line, like a gitignore
+ * file: blank lines and lines starting with `#' are left out, and a
+ * leading `!' makes a rule include.
+ *
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int filter_load(struct filter* f, const char* path)
+{
+	char* line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int ret = 0;
+
+	FILE* in = fopen(path, "r");
+	if (!in)
+		return -1;
+
+	while ((len = getline(&line, &size, in)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+				   line[len - 1] == ' ' || line[len - 1] == '\t'))
+			line[--len] = '\0';
+		if (len == 0 || *line == '#')
+			continue;
+		if (*line == '!')
+			ret = filter_add(f, line + 1, 1);
+		else
+			ret = filter_add(f, line, 0);
+		if (ret == -1)
+			break;
+	}
+	if (ret == 0 && ferror(in)) {
+		errno = EIO;
+		ret = -1;
+	}
+
+	int err = errno;
+	free(line);
+	fclose(in);
+	errno = err;
+	return ret;
+}
+
+/* The set live in the root of the traversal, interned by filter_add():
+ * the first step of every anchored rule.
+ */
+uint32_t filter_root(const struct filter* f)
+{
+	(void)f;
+	return 0;
+}
+
+/* Tells whether to keep the entry `name', of type `type' (a mode, or
+ * its S_IFMT bits, 0 if unknown), found in a directory where the steps
+ * of the set `live' are. When it's kept and may be a directory, *sub is
+ * set to the set live in it.
+ *
+ * Returns FILTER_KEEP, FILTER_SKIP, or FILTER_UNSURE if only the type
+ * would tell: call again once it's known. Returns FILTER_ERROR with errno
+ * set if the set of a directory can't be stored.
+ */
+int filter_test(const struct filter* f, uint32_t live, const char* name, mode_t type,
+		uint32_t* sub)
+{
+	struct filter_sets* ss = f->sets;
+	const uint32_t* cur = set_at(ss, live);
+	size_t len = strlen(name);
+
+	/* The last match decides */
+	for (size_t i = f->nrules; i-- > 0; ) {
+		const struct filter_rule* r = &f->rules[i];
+		if (r->anchored) {
+			unsigned last = r->first + r->nsteps - 1;
+			if (!BIT_TEST(cur, last) || !step_match(&f->steps[last], name, len))
+				continue;
+		} else if (!step_match(&r->step, name, len)) {
+			continue;
+		}
+
+		if (r->dironly && type == 0)
+			return FILTER_UNSURE;
+		if (r->dironly && !S_ISDIR(type))
+			continue;
+		if (!r->include)
+			return FILTER_SKIP;
+		break;
+	}
+
+	if (type != 0 && !S_ISDIR(type))
+		return FILTER_KEEP;
+
+	uint32_t buf[FILTER_STACK_WORDS];
+	uint32_t* next = buf;
+	if (ss->nwords > FILTER_STACK_WORDS) {
+		next = malloc(ss->nwords * sizeof(*next));
+		if (!next)
+			return FILTER_ERROR;
+	}
+	memset(next, 0, ss->nwords * sizeof(*next));
+
+	/* A step that matches hands over to the next one, and "**" stays */
+	for (size_t w = 0; w < ss->nwords; ++w) {
+		for (uint32_t todo = cur[w]; todo; todo &= todo - 1) {
+			unsigned s = 0;
+			while (!(todo & ((uint32_t)1 << s)))
+				s++;
+			s += (unsigned)w * 32;
+			if (BIT_TEST(f->deep, s))
+				BIT_SET(next, s);
+			else if (!BIT_TEST(f->last, s) && step_match(&f->steps[s], name, len))
+				BIT_SET(next, s + 1);
+		}
+	}
+	closure(f, next);
+
+	int ret = (set_intern(ss, next, sub) == -1) ? FILTER_ERROR : FILTER_KEEP;
+	if (next != buf) {
+		int err = errno;
+		free(next);
+		errno = err;
+	}
+	return ret;
+}
+
+/* Compiles the component of `len' bytes at `pat' into `s'. "**" only
+ * means something to anchored rules, elsewhere it's "*".
+ */
+static int compile(struct filter_step* s, const char* pat, size_t len, int anchored)
+{
+	s->text = malloc(len + 1);
+	if (!s->text)
+		return -1;
+	memcpy(s->text, pat, len);
+	s->text[len] = '\0';
+	s->len = len;
+
+	size_t meta = strcspn(s->text, "*?[\\");
+	if (meta == len) {
+		s->kind = STEP_LITERAL;
+	} else if (strcmp(s->text, "*") == 0) {
+		s->kind = STEP_ANY;
+	} else if (strcmp(s->text, "**") == 0) {
+		s->kind = (anchored) ? STEP_DEEP : STEP_ANY;
+	} else if (meta == len - 1 && s->text[meta] == '*') {
+		s->kind = STEP_PREFIX;
+		s->len = meta;
+	} else if (meta == 0 && *s->text == '*' && strcspn(s->text + 1, "*?[\\") == len - 1) {
+		/* The fixed part only */
+		s->kind = STEP_SUFFIX;
+		memmove(s->text, s->text + 1, len);
+		s->len = len - 1;
+	} else {
+		s->kind = STEP_GLOB;
+	}
+	return 0;
+}
+
+static int step_match(const struct filter_step* s, const char* name, size_t len)
+{
+	switch (s->kind) {
+	case STEP_LITERAL:
+		return len == s->len && memcmp(name, s->text, len) == 0;
+	case STEP_PREFIX:
+		return len >= s->len && memcmp(name, s->text, s->len) == 0;
+	case STEP_SUFFIX:
+		return len >= s->len && memcmp(name + len - s->len, s->text, s->len) == 0;
+	case STEP_ANY:
+	case STEP_DEEP:
+		return 1;
+	case STEP_GLOB:
+		return fnmatch(s->text, name, 0) == 0;
+	}
+	return 0;
+}
+
+/* Doubles the room for steps, and for their bits in `deep' and `last' */
+static int grow_steps(struct filter* f)
+{
+	unsigned cap = (f->capsteps) ? f->capsteps * 2 : 32;
+	size_t oldw = f->capsteps / 32, nw = cap / 32;
+
+	struct filter_step* steps = realloc(f->steps, cap * sizeof(*steps));
+	if (!steps)
+		return -1;
+	f->steps = steps;
+	uint32_t* deep = realloc(f->deep, nw * sizeof(*deep));
+	if (!deep)
+		return -1;
+	f->deep = deep;
+	uint32_t* last = realloc(f->last, nw * sizeof(*last));
+	if (!last)
+		return -1;
+	f->last = last;
+
+	memset(f->deep + oldw, 0, (nw - oldw) * sizeof(*deep));
+	memset(f->last + oldw, 0, (nw - oldw) * sizeof(*last));
+	f->capsteps = cap;
+	return 0;
+}
+
+/* Drops every live set, sizes them for the steps there are now, and
+ * interns the root's as set 0.
+ */
+static int sets_reset(struct filter* f)
+{
+	if (!f->sets) {
+		f->sets = calloc(1, sizeof(*f->sets));
+		if (!f->sets)
+			return -1;
+		int err = pthread_mutex_init(&f->sets->lock, NULL);
+		if (err) {
+			free(f->sets);
+			f->sets = NULL;
+			errno = err;
+			return -1;
+		}
+	}
+	struct filter_sets* ss = f->sets;
+	sets_clear(ss);
+	ss->nwords = (f->nsteps + 31) / 32;
+	if (ss->nwords == 0)
+		ss->nwords = 1;
+
+	uint32_t* root = calloc(ss->nwords, sizeof(*root));
+	if (!root)
+		return -1;
+	for (size_t i = 0; i < f->nrules; ++i)
+		if (f->rules[i].anchored)
+			BIT_SET(root, f->rules[i].first);
+	closure(f, root);
+
+	uint32_t id;
+	int ret = set_intern(ss, root, &id);
+	free(root);
+	return ret;
+}
+
+static void sets_clear(struct filter_sets* ss)
+{
+	for (size_t i = 0; i < FILTER_SET_MAXCHUNKS && ss->chunks[i]; ++i) {
+		free(ss->chunks[i]);
+		ss->chunks[i] = NULL;
+	}
+	free(ss->index);
+	ss->index = NULL;
+	ss->nindex = 0;
+	ss->n = 0;
+}
+
+/* The words of the set `id', which any thread may read once it has `id' */
+static const uint32_t* set_at(const struct filter_sets* ss, uint32_t id)
+{
+	return ss->chunks[id / FILTER_SET_CHUNK] + (size_t)(id % FILTER_SET_CHUNK) * ss->nwords;
+}
+
+/* Sets *id to the number of the set `set', added if it's new.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+static int set_intern(struct filter_sets* ss, const uint32_t* set, uint32_t* id)
+{
+	size_t bytes = ss->nwords * sizeof(*set);
+	uint64_t h = xxh3(set, bytes);
+	int ret = -1;
+
+	pthread_mutex_lock(&ss->lock);
+	size_t mask = ss->nindex - 1;
+	for (size_t i = (ss->nindex) ? h & mask : 0; ss->nindex; i = (i + 1) & mask) {
+		uint32_t s = ss->index[i];
+		if (s == UINT32_MAX)
+			break;
+		if (memcmp(set_at(ss, s), set, bytes) == 0) {
+			*id = s;
+			ret = 0;
+			goto out_unlock;
+		}
+	}
+
+	/* Keep the index at most half full */
+	if ((size_t)(ss->n + 1) * 2 > ss->nindex) {
+		size_t n = (ss->nindex) ? ss->nindex * 2 : 64;
+		uint32_t* index = malloc(n * sizeof(*index));
+		if (!index)
+			goto out_unlock;
+		memset(index, 0xff, n * sizeof(*index));
+		for (uint32_t s = 0; s < ss->n; ++s) {
+			size_t i = xxh3(set_at(ss, s), bytes) & (n - 1);
+			while (index[i] != UINT32_MAX)
+				i = (i + 1) & (n - 1);
+			index[i] = s;
+		}
+		free(ss->index);
+		ss->index = index;
+		ss->nindex = n;
+	}
+
+	size_t c = ss->n / FILTER_SET_CHUNK;
+	if (c >= FILTER_SET_MAXCHUNKS) {
+		errno = EOVERFLOW;
+		goto out_unlock;
+	}
+	if (!ss->chunks[c]) {
+		ss->chunks[c] = malloc((size_t)FILTER_SET_CHUNK * bytes);
+		if (!ss->chunks[c])
+			goto out_unlock;
+	}
+	memcpy(ss->chunks[c] + (size_t)(ss->n % FILTER_SET_CHUNK) * ss->nwords, set, bytes);
+
+	size_t i = h & (ss->nindex - 1);
+	while (ss->index[i] != UINT32_MAX)
+		i = (i + 1) & (ss->nindex - 1);
+	ss->index[i] = ss->n;
+	*id = ss->n++;
+	ret = 0;
+out_unlock:
+	pthread_mutex_unlock(&ss->lock);
+	return ret;
+}
+
+/* Adds to `live' what a live "**" lets through without any directory:
+ * the step after it. Steps of a rule follow each other, so one pass from
+ * the lowest step up catches "**" after "**".
+ */
+static void closure(const struct filter* f, uint32_t* live)
+{
+	for (unsigned s = 0; s + 1 < f->nsteps; ++s)
+		if (BIT_TEST(live, s) && BIT_TEST(f->deep, s) && !BIT_TEST(f->last, s))
+			BIT_SET(live, s + 1);
+}
@@ -9,13 +9,14 @@
 
 #include "hash.h"
 
-/* Will create a kfile struct for use with the `files' hash table.
+/* Will create a kfile struct for use with the `files' hash table,
+ * in the arena `mem'.
  *
- * Returns NULL on allocation failure, malloc will set errno.
+ * Returns NULL on allocation failure, with errno set.
  */
-struct kfile* hcrekey(struct stat* sb)
+struct kfile* hcrekey(struct arena* mem, const struct stat* sb)
 {
-	struct kfile* key = malloc(sizeof(struct kfile));
+	struct kfile* key = arena_alloc(mem, sizeof(struct kfile));
 
 	if (!key) return NULL;
 
@@ -25,51 +26,51 @@ struct kfile* hcrekey(struct stat* sb)
 	return key;
 }
 
-/* Given the relative path of the file, relative to the pfd, this function
- * will create a file struct for use with the hash table.
- * This function internally copies path over.
+/* Creates a file struct for use with the hash table, for `name' found in
+ * the directory `dir', out of its metadata in `sb'. The struct and a copy
+ * of the name both live in the arena `mem'.
  *
- * Returns NULL on allocation failure, malloc will set errno to the corresponding value.
+ * Returns NULL on allocation failure, with errno set.
  */
-void* hcreval(const char* path, mode_t st_mode, off_t st_size)
+struct file* hcreval(struct arena* mem, uint32_t dir, const char* name,
+		     const struct stat* sb)
 {
-	if (!path) return NULL;
-
-	struct file* val = malloc(sizeof(struct file));
+	struct file* val = arena_alloc(mem, sizeof(struct file));
 
 	if (!val) return NULL;
 
-	char* path_copy = strdup(path);
-	if (!path_copy) {
-		free(val);
+	const char* copy = arena_strdup(mem, name);
+	if (!copy)
 		return NULL;
-	}
-	val->path = path_copy;
-	val->mode = st_mode;
-	val->size = st_size;
-	
+	hcfill(val, dir, copy, sb);
+
 	return val;
 }
 
-#ifdef __GNUC__
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wcast-qual"
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#endif
-
-/* The hash table never owns the key and value. */
-/* Free them seperately. */
-int free_hent(const void* key, void* value, void* user_data)
+/* Fills `val' in like hcreval(), without copying anything: `name' must
+ * outlive it.
+ */
+void hcfill(struct file* val, uint32_t dir, const char* name,
+	    const struct stat* sb)
 {
-	free((void*)key);
-	free(((struct file*)value)->path);
-	free(value);
-	return 0;
+	val->name = name;
+	val->dir = dir;
+	val->done = 0;
+	val->chunks = NULL;
+	val->links = NULL;
+	hcstat(val, sb);
 }
 
-#ifdef __GNUC__
-#pragma GCC diagnostic pop
-#endif
+/* Sets the size, times and mode of `val' from `sb', for a file the
+ * traversal didn't stat, see travopts.need.
+ */
+void hcstat(struct file* val, const struct stat* sb)
+{
+	val->mode = sb->st_mode;
+	val->size = sb->st_size;
+	val->mtime = TS_NSEC(sb->st_mtim);
+	val->ctime = TS_NSEC(sb->st_ctim);
+}
 
 /* Uses file inode and device number to create the hash.
  * Uses the Murmur finalizer.
@@ -88,9 +89,9 @@ uintmax_t hash(const void* key)
 
 int hcmpent(const void* a, const void* b)
 {
-	const struct stat* st1 = a;
-	const struct stat* st2 = b;
-	if (st1->st_ino == st2->st_ino && st1->st_dev == st2->st_dev)
+	const struct kfile* k1 = a;
+	const struct kfile* k2 = b;
+	if (k1->st_ino == k2->st_ino && k1->st_dev == k2->st_dev)
 		return 1;
 	return 0;
 }
@@ -0,0 +1,343 @@
+#define _GNU_SOURCE	/* syncfs */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "hash.h"
+#include "fs.h"
+#include "fs/journal.h"
+#include "status.h"
+
+/* What the interrupted run recorded about an entry */
+struct journal_entry {
+	int64_t size;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t mode;
+	const char* path;
+};
+
+static status_t load(struct journal* j, off_t* valid);
+static int insert(struct journal* j, const struct journal_rec* r, const char* path);
+static int flush(struct journal* j);
+static int write_all(int fd, const char* buf, size_t len);
+static uint32_t checksum(const struct journal_rec* r, const char* path);
+static int64_t now(void);
+
+/* Opens the journal of the run copying into `dst', creating `dst' if
+ * needed. When resuming, what the journal already lists is loaded and
+ * kept; otherwise it starts over, empty.
+ */
+status_t journal_open(struct journal* j, const char* dst, int resume)
+{
+	struct journal_hdr hdr;
+	status_t ret;
+	off_t valid = 0;
+
+	memset(j, 0, sizeof(*j));
+	j->fd = -1;
+	arena_init(&j->mem);
+	if (mkdir(dst, 0777) == -1 && errno != EEXIST)
+		return STATUS_E(ST_ERR_MKDIR, "Creating destination", strdup(dst));
+	j->path = path_concat(dst, JOURNAL_NAME);
+	j->buf = malloc(JOURNAL_BUFSZ);
+	if (!j->path || !j->buf) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Opening journal", NULL);
+		goto err_free;
+	}
+
+	j->fd = open(j->path, O_RDWR | O_CREAT | O_NOCTTY | ((resume) ? 0 : O_TRUNC), 0666);
+	if (j->fd < 0) {
+		ret = STATUS_E(ST_ERR_JOURNAL, "Opening journal", strdup(j->path));
+		goto err_free;
+	}
+	if (resume) {
+		ret = load(j, &valid);
+		if (ret.c != ST_OK)
+			goto err_close;
+	}
+
+	/* Drop the torn tail, or start a new journal */
+	if (ftruncate(j->fd, valid) == -1 || lseek(j->fd, valid, SEEK_SET) == -1) {
+		ret = STATUS_E(ST_ERR_JOURNAL, "Opening journal", strdup(j->path));
+		goto err_close;
+	}
+	if (valid == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+		hdr.version = JOURNAL_VERSION;
+		hdr.order = JOURNAL_ORDER;
+		memcpy(j->buf, &hdr, sizeof(hdr));
+		j->len = sizeof(hdr);
+	}
+
+	pthread_mutex_init(&j->lock, NULL);
+	j->synced = now();
+	return STATUS(ST_OK, 0, "Opening journal", NULL);
+
+err_close:
+	close(j->fd);
+err_free:
+	if (j->done)
+		hash_destroy(j->done);
+	arena_free(&j->mem);
+	free(j->buf);
+	free(j->path);
+	memset(j, 0, sizeof(*j));
+	return ret;
+}
+
+/* Tells whether the interrupted run copied `f', of the directories in
+ * `tree', and it hasn't changed since, like fidx_unchanged() does. Only
+ * looks j->done up, which doesn't write to it once journal_open() returned.
+ */
+int journal_done(struct journal* j, const struct kfile* k,
+		 const struct file* f, const struct dirtree* tree)
+{
+	if (!j->done || f->size == FILE_SIZE_UNKNOWN || f->ctime == 0)
+		return 0;
+
+	const struct journal_entry* e = hash_lookup(j->done, k);
+	if (!e)
+		return 0;
+	return e->size == (int64_t)f->size && e->mtime == f->mtime &&
+	       e->ctime == f->ctime && e->mode == (uint32_t)f->mode &&
+	       file_has_path(tree, f, e->path);
+}
+
+/* Records that `f', of the directories in `tree', was copied. It reaches
+ * the disk with the next batch, see JOURNAL_BATCH and JOURNAL_PERIOD.
+ */
+status_t journal_add(struct journal* j, const struct kfile* k,
+		     const struct file* f, const struct dirtree* tree)
+{
+	struct journal_rec r;
+	status_t ret = STATUS(ST_OK, 0, "Writing journal", NULL);
+
+	/* Not comparable when resuming anyway */
+	if (f->size == FILE_SIZE_UNKNOWN || f->ctime == 0)
+		return ret;
+	/* Never fits in the buffer: copied again when resuming */
+	size_t len = file_path_len(tree, f);
+	if (sizeof(r) + len > JOURNAL_BUFSZ)
+		return ret;
+	char* path = file_strdup(tree, f);
+	if (!path)
+		return STATUS_E(ST_ERR_MALLOC, "Writing journal", NULL);
+
+	memset(&r, 0, sizeof(r));
+	r.dev = k->st_dev;
+	r.ino = k->st_ino;
+	r.size = (int64_t)f->size;
+	r.mtime = f->mtime;
+	r.ctime = f->ctime;
+	r.mode = (uint32_t)f->mode;
+	r.len = (uint32_t)len;
+	r.sum = checksum(&r, path);
+
+	pthread_mutex_lock(&j->lock);
+	if (j->len + sizeof(r) + len > JOURNAL_BUFSZ && flush(j) == -1) {
+		ret = STATUS_E(ST_ERR_JOURNAL, "Writing journal", strdup(j->path));
+		goto out_unlock;
+	}
+	memcpy(j->buf + j->len, &r, sizeof(r));
+	memcpy(j->buf + j->len + sizeof(r), path, len);
+	j->len += sizeof(r) + len;
+	j->pending++;
+
+	if ((j->pending >= JOURNAL_BATCH || now() - j->synced >= JOURNAL_PERIOD) &&
+	    flush(j) == -1)
+		ret = STATUS_E(ST_ERR_JOURNAL, "Writing journal", strdup(j->path));
+out_unlock:
+	pthread_mutex_unlock(&j->lock);
+	free(path);
+	return ret;
+}
+
+/* Writes what's still buffered, and closes the journal. A `finished'
+ * run has nothing left to resume, and removes it.
+ */
+status_t journal_close(struct journal* j, int finished)
+{
+	status_t ret = STATUS(ST_OK, 0, "Closing journal", NULL);
+
+	if (finished) {
+		if (unlink(j->path) == -1)
+			ret = STATUS_E(ST_ERR_JOURNAL, "Removing journal", strdup(j->path));
+	} else if (flush(j) == -1) {
+		ret = STATUS_E(ST_ERR_JOURNAL, "Writing journal", strdup(j->path));
+	}
+	if (close(j->fd) == -1 && ret.c == ST_OK && !finished)
+		ret = STATUS_E(ST_ERR_JOURNAL, "Closing journal", strdup(j->path));
+
+	pthread_mutex_destroy(&j->lock);
+	if (j->done)
+		hash_destroy(j->done);
+	arena_free(&j->mem);
+	free(j->buf);
+	free(j->path);
+	memset(j, 0, sizeof(*j));
+	j->fd = -1;
+	return ret;
+}
+
+/* Reads the records of the interrupted run into j->done. `valid' is set
+ * to where the last good one ends, 0 if the header isn't usable.
+ */
+static status_t load(struct journal* j, off_t* valid)
+{
+	struct journal_hdr hdr;
+	struct journal_rec r;
+	struct stat sb;
+	status_t ret;
+
+	*valid = 0;
+	if (fstat(j->fd, &sb) == -1)
+		return STATUS_E(ST_ERR_JOURNAL, "Reading journal metadata", strdup(j->path));
+	if ((uintmax_t)sb.st_size < sizeof(hdr) || (uintmax_t)sb.st_size > SIZE_MAX)
+		return STATUS(ST_OK, 0, "Reading journal", NULL);
+
+	size_t len = (size_t)sb.st_size;
+	const char* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, j->fd, 0);
+	if (map == MAP_FAILED)
+		return STATUS_E(ST_ERR_JOURNAL, "Mapping journal", strdup(j->path));
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if (memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != JOURNAL_VERSION || hdr.order != JOURNAL_ORDER) {
+		ret = STATUS(ST_OK, 0, "Reading journal", NULL);
+		goto out_unmap;
+	}
+
+	j->done = hash_create(4099, sizeof(struct kfile), hash, hcmpent);
+	if (!j->done) {
+		ret = STATUS_E(ST_ERR_HASH_CRE, "Creating hash table", NULL);
+		goto out_unmap;
+	}
+
+	size_t off = sizeof(hdr);
+	while (len - off >= sizeof(r)) {
+		memcpy(&r, map + off, sizeof(r));
+		const char* path = map + off + sizeof(r);
+		if (r.len == 0 || r.len > len - off - sizeof(r) ||
+		    memchr(path, '\0', r.len) || checksum(&r, path) != r.sum)
+			break;
+		if (insert(j, &r, path) == -1) {
+			ret = STATUS_E(ST_ERR_MALLOC, "Reading journal", NULL);
+			goto out_unmap;
+		}
+		off += sizeof(r) + r.len;
+	}
+	/* Done growing: from here on lookups only read the table, and copy
+	 * threads can share it.
+	 */
+	if (!hash_rehash(j->done, j->done->count + 1)) {
+		ret = STATUS_E(ST_ERR_HASH_UPS, "Reading journal", NULL);
+		goto out_unmap;
+	}
+
+	*valid = (off_t)off;
+	ret = STATUS(ST_OK, 0, "Reading journal", NULL);
+out_unmap:
+	munmap((void*)(uintptr_t)map, len);
+	return ret;
+}
+
+/* Adds one record to j->done. A later record of the same file wins. */
+static int insert(struct journal* j, const struct journal_rec* r, const char* path)
+{
+	struct kfile k = { .st_dev = r->dev, .st_ino = r->ino };
+	struct journal_entry* e = hash_lookup(j->done, &k);
+
+	if (!e) {
+		struct kfile* key = arena_alloc(&j->mem, sizeof(*key));
+		e = arena_alloc(&j->mem, sizeof(*e));
+		if (!key || !e)
+			return -1;
+		*key = k;
+		if (hash_insert(j->done, key, e) == -1)
+			return -1;
+	}
+
+	char* p = arena_alloc(&j->mem, r->len + 1);
+	if (!p)
+		return -1;
+	memcpy(p, path, r->len);
+	p[r->len] = '\0';
+
+	e->size = r->size;
+	e->mtime = r->mtime;
+	e->ctime = r->ctime;
+	e->mode = r->mode;
+	e->path = p;
+	return 0;
+}
+
+/* Makes the buffered records durable: the data they vouch for first,
+ * then them. Returns 0 on success, -1 with errno set otherwise.
+ */
+static int flush(struct journal* j)
+{
+	if (j->len == 0)
+		return 0;
+
+#ifdef __linux__
+	if (syncfs(j->fd) == -1)
+		return -1;
+#else
+	sync();
+#endif
+	if (write_all(j->fd, j->buf, j->len) == -1 || fdatasync(j->fd) == -1)
+		return -1;
+
+	j->len = 0;
+	j->pending = 0;
+	j->synced = now();
+	return 0;
+}
+
+static int write_all(int fd, const char* buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static uint32_t checksum(const struct journal_rec* r, const char* path)
+{
+	struct journal_rec c = *r;
+	uint32_t h = 2166136261u;
+
+	c.sum = 0;
+	for (size_t i = 0; i < sizeof(c); ++i)
+		h = (h ^ ((const unsigned char*)&c)[i]) * 16777619u;
+	for (size_t i = 0; i < r->len; ++i)
+		h = (h ^ (unsigned char)path[i]) * 16777619u;
+	return h;
+}
+
+/* Seconds on a clock that never goes back */
+static int64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec;
+}
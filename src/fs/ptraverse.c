@@ -0,0 +1,372 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "fs.h"
+#include "fs/deque.h"
+#include "fs/dirfds.h"
+#include "status.h"
+
+struct worker;
+
+/* State shared by every worker of one parallel traversal */
+struct walker {
+	int rootfd;			/* root of the traversal */
+	const struct travopts* opts;
+	struct hash_table** files;
+	pthread_mutex_t files_lock;	/* guards *files */
+	struct dirtree* tree;
+
+	pthread_mutex_t lock;		/* guards everything below */
+	pthread_cond_t wake;		/* new work, failure, or the end */
+	size_t pending;			/* directories queued or being searched */
+	unsigned long pushes;		/* bumped on every push, see wait_work() */
+	unsigned nidle;			/* workers sleeping on `wake' */
+	int failed;
+	status_t ret;			/* first fatal error */
+
+	struct worker* workers;
+	unsigned nworkers;
+};
+
+struct worker {
+	struct walker* w;
+	struct deque q;			/* this worker's directories */
+	struct dents ds;		/* reads them, one at a time */
+	struct arena mem;		/* what this worker indexes */
+	struct dirfds dirs;		/* parents of the directories it opens */
+	pthread_t tid;
+	uint64_t seed;			/* picks steal victims */
+};
+
+static void* work(void* arg);
+static status_t scan(struct worker* self, uint32_t node);
+static int enqueue(struct worker* self, uint32_t node);
+static uint32_t steal(struct worker* self);
+static int wait_work(struct worker* self, unsigned long seen);
+static void done_one(struct walker* w);
+static void fail(struct walker* w, status_t ret);
+
+/* Like traverse(), but searches directories with `nthreads' workers.
+ * Every worker keeps a deque of directories it found; when it runs dry,
+ * it steals from the others. A directory is opened by its name in its
+ * parent, which the worker keeps open for the next of its
+ * subdirectories, see dirfds_open(): never by its whole path. Fills
+ * `files' with the same entries as traverse(): when a file has several
+ * names, which one is recorded depends on scheduling.
+ *
+ * Every worker allocates from an arena of its own, which are all moved
+ * into `mem' at the end, even on failure.
+ */
+status_t ptraverse(const char* restrict path, struct hash_table** files,
+		   struct arena* mem, struct dirtree* tree,
+		   const struct travopts* opts)
+{
+	status_t ret;
+	struct walker w;
+	unsigned i, started = 0;
+	unsigned nthreads = opts->nthreads;
+
+	if (!(*files))
+		return STATUS(ST_INT_ISNULL, EINVAL, "No hash table", NULL);
+	if (nthreads == 0) nthreads = 1;
+	if (nthreads > TRAVERSE_MAX_THREADS) nthreads = TRAVERSE_MAX_THREADS;
+
+	memset(&w, 0, sizeof(w));
+	w.opts = opts;
+	w.files = files;
+	w.tree = tree;
+	w.nworkers = nthreads;
+	w.ret = STATUS(ST_OK, 0, "Indexed directory", NULL);
+
+	w.rootfd = open(path, opts->oflags | O_DIRECTORY | O_RDONLY);
+	if (w.rootfd < 0) {
+		ret = STATUS_E(ST_ERR_OPEN, "Opening directory", strdup(path));
+		goto out_return;
+	}
+
+	w.workers = calloc(nthreads, sizeof(struct worker));
+	if (!w.workers) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Creating workers", NULL);
+		goto out_close;
+	}
+	pthread_mutex_init(&w.files_lock, NULL);
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.wake, NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		w.workers[i].w = &w;
+		w.workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		arena_init(&w.workers[i].mem);
+		/* No more open between them than a single one keeps */
+		dirfds_init(&w.workers[i].dirs, tree, w.rootfd, -1, opts->oflags);
+		dirfds_limit(&w.workers[i].dirs, DIRFDS_SIZE / nthreads);
+		if (dents_init(&w.workers[i].ds, DENTS_BUFSZ) == -1) {
+			ret = STATUS_E(ST_ERR_MALLOC, "Creating workers", NULL);
+			goto out_destroy;
+		}
+		if (deque_init(&w.workers[i].q) == -1) {
+			ret = STATUS_E(ST_ERR_MALLOC, "Creating workers", NULL);
+			dents_free(&w.workers[i].ds);
+			goto out_destroy;
+		}
+	}
+
+	/* The root is the first piece of work */
+	if (enqueue(&w.workers[0], DIRTREE_ROOT) == -1) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Pushing directory", NULL);
+		goto out_destroy;
+	}
+
+	for (started = 0; started < nthreads; ++started) {
+		int err = pthread_create(&w.workers[started].tid, NULL,
+					 work, &w.workers[started]);
+		if (err) {
+			fail(&w, STATUS(ST_ERR_THREAD, err, "Starting workers", NULL));
+			break;
+		}
+	}
+	for (unsigned j = 0; j < started; ++j)
+		pthread_join(w.workers[j].tid, NULL);
+
+	ret = w.ret;
+	i = nthreads;
+out_destroy:
+	while (i--) {
+		deque_destroy(&w.workers[i].q);
+		dents_free(&w.workers[i].ds);
+		dirfds_flush(&w.workers[i].dirs);
+		arena_merge(mem, &w.workers[i].mem);
+	}
+	pthread_cond_destroy(&w.wake);
+	pthread_mutex_destroy(&w.lock);
+	pthread_mutex_destroy(&w.files_lock);
+	free(w.workers);
+out_close:
+	close(w.rootfd);
+out_return:
+	return ret;
+}
+
+static void* work(void* arg)
+{
+	struct worker* self = arg;
+	struct walker* w = self->w;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		unsigned long seen = w->pushes;
+		int failed = w->failed;
+		pthread_mutex_unlock(&w->lock);
+		if (failed)
+			break;
+
+		uint32_t node = deque_pop(&self->q);
+		if (node == DIRTREE_NONE) node = steal(self);
+		if (node == DIRTREE_NONE) {
+			if (wait_work(self, seen))
+				break;
+			continue;
+		}
+
+		status_t ret = scan(self, node);
+		if (ret.c != ST_OK) {
+			/* Permission error, rather skip */
+			if (ret.sysc == EACCES) {
+				sterr(ret);
+				status_free(ret);
+			} else {
+				fail(w, ret);
+			}
+		}
+		done_one(w);
+	}
+
+	return NULL;
+}
+
+/* Reads a whole directory, indexing every entry and queueing every new
+ * subdirectory on this worker's deque.
+ */
+static status_t scan(struct worker* self, uint32_t node)
+{
+	struct walker* w = self->w;
+	status_t ret;
+	struct dent entry;
+	struct stat sb;
+	int r;
+
+	int fd = dirfds_open(&self->dirs, node);
+	if (fd < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening directory", dirtree_strdup(w->tree, node));
+	if (fstat(fd, &sb) == -1) {
+		ret = STATUS_E(ST_ERR_FILERD_MD, "Reading directory metadata",
+			       dirtree_strdup(w->tree, node));
+		close(fd);
+		return ret;
+	}
+	dev_t dev = sb.st_dev;
+	if (dents_open(&self->ds, fd) == -1)
+		return STATUS_E(ST_ERR_OPEN, "Opening directory", dirtree_strdup(w->tree, node));
+	uint32_t live = dir_live(w->tree, node, w->opts);
+
+	while ((r = dents_next(&self->ds, &entry)) > 0) {
+		/* Skip the current and previous directory */
+		if (strcmp(entry.name, ".") == 0 ||
+		    strcmp(entry.name, "..") == 0) continue;
+
+		/* Before it costs a stat, if its type is known */
+		uint32_t sub = 0;
+		int keep = entry_keep(w->opts, live, entry.name, entry.type, &sub);
+		if (keep == FILTER_SKIP)
+			continue;
+		if (keep == FILTER_ERROR)
+			goto err_filter;
+
+		if (entry_stat(fd, dev, &entry, w->opts, &sb) == -1) {
+			ret = STATUS_E(ST_ERR_FILERD_MD,
+				       "Reading file metadata", strdup(entry.name));
+			if (ret.sysc == EACCES) {
+				sterr(ret);
+				status_free(ret);
+				continue;
+			}
+			goto out_close;
+		}
+		if (keep == FILTER_UNSURE) {
+			keep = entry_keep(w->opts, live, entry.name, sb.st_mode, &sub);
+			if (keep == FILTER_SKIP)
+				continue;
+			if (keep == FILTER_ERROR)
+				goto err_filter;
+		}
+
+		struct file* added;
+		ret = index_entry(w->files, &w->files_lock, &self->mem, w->opts,
+				  node, entry.name, &sb, &added);
+		if (ret.c != ST_OK)
+			goto out_close;
+
+		if (added && S_ISDIR(sb.st_mode)) {
+			uint32_t subdir = dirtree_add(w->tree, node, added->name, sub);
+			if (subdir == DIRTREE_NONE || enqueue(self, subdir) == -1) {
+				ret = STATUS_E(ST_ERR_PUSH_DIR, "Pushing directory", NULL);
+				goto out_close;
+			}
+		}
+	}
+	if (r < 0)
+		ret = STATUS_E(ST_ERR_FILERD, "Reading directory", dirtree_strdup(w->tree, node));
+	else
+		ret = STATUS(ST_OK, 0, NULL, NULL);
+	goto out_close;
+
+err_filter:
+	ret = STATUS_E(ST_ERR_MALLOC, "Filtering directory", strdup(entry.name));
+out_close:
+	dents_close(&self->ds);
+	return ret;
+}
+
+/* Queues a directory on this worker's deque and wakes a sleeping worker,
+ * if any, to steal it.
+ */
+static int enqueue(struct worker* self, uint32_t node)
+{
+	struct walker* w = self->w;
+
+	/* Counted before it's visible, so nobody thinks the walk is over */
+	pthread_mutex_lock(&w->lock);
+	w->pending++;
+	pthread_mutex_unlock(&w->lock);
+
+	if (deque_push(&self->q, node) == -1) {
+		done_one(w);
+		return -1;
+	}
+
+	/* Bumped after it's visible, see wait_work() */
+	pthread_mutex_lock(&w->lock);
+	w->pushes++;
+	if (w->nidle)
+		pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+/* Tries every other worker once, starting from a random one. */
+static uint32_t steal(struct worker* self)
+{
+	struct walker* w = self->w;
+	unsigned n = w->nworkers;
+
+	/* xorshift64 */
+	self->seed ^= self->seed << 13;
+	self->seed ^= self->seed >> 7;
+	self->seed ^= self->seed << 17;
+
+	unsigned start = (unsigned)(self->seed % n);
+	for (unsigned i = 0; i < n; ++i) {
+		struct worker* victim = &w->workers[(start + i) % n];
+		if (victim == self)
+			continue;
+		uint32_t node = deque_steal(&victim->q);
+		if (node != DIRTREE_NONE)
+			return node;
+	}
+	return DIRTREE_NONE;
+}
+
+/* Sleeps until new work may be available. `seen' is the push count read
+ * before the deques were found empty: if anything was pushed since, it
+ * might have been missed, so look again instead of sleeping.
+ *
+ * Returns 1 when the traversal is over, 0 when it's worth looking again.
+ */
+static int wait_work(struct worker* self, unsigned long seen)
+{
+	struct walker* w = self->w;
+	int over;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->pending && !w->failed && w->pushes == seen) {
+		w->nidle++;
+		pthread_cond_wait(&w->wake, &w->lock);
+		w->nidle--;
+	}
+	over = (w->pending == 0 || w->failed);
+	pthread_mutex_unlock(&w->lock);
+	return over;
+}
+
+/* A directory was searched: when it was the last one, everyone's done. */
+static void done_one(struct walker* w)
+{
+	pthread_mutex_lock(&w->lock);
+	if (--w->pending == 0)
+		pthread_cond_broadcast(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Records the first fatal error, and stops every worker. */
+static void fail(struct walker* w, status_t ret)
+{
+	pthread_mutex_lock(&w->lock);
+	if (!w->failed) {
+		w->failed = 1;
+		w->ret = ret;
+	} else {
+		status_free(ret);
+	}
+	pthread_cond_broadcast(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+}
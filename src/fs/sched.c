@@ -0,0 +1,206 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
+
+#include "hash.h"
+#include "fs.h"
+#include "fs/sched.h"
+#include "stats.h"
+#include "status.h"
+
+struct sched_pass {
+	struct sched* s;
+	struct copier* cp;
+};
+
+static int add_one(const void* key, void* value, void* user_data);
+static uint64_t first_extent(struct sched* s, struct copier* cp, const char* path);
+static int by_pos(const void* a, const void* b);
+static int by_dir(const void* a, const void* b);
+
+/* Lists the files in `files' that aren't directories, with where their
+ * data starts, and sorts them. Regular files are opened to ask FIEMAP,
+ * unless the previous run's index or the journal say they won't be
+ * copied. Once FIEMAP turns out to be unavailable, every file is placed
+ * by its inode number instead.
+ *
+ * With SCHED_DIRS as the `order', lists every entry instead, sorted by
+ * the dirtree node of its directory, then by inode number. Nodes are
+ * numbered in the order the traversal found them, so parents come
+ * before their children.
+ */
+status_t sched_build(struct sched* s, struct copier* cp, struct hash_table* files,
+		     int order)
+{
+	struct sched_pass pass = { .s = s, .cp = cp };
+
+	memset(s, 0, sizeof(*s));
+	s->order = order;
+	s->ents = malloc(((files->count) ? files->count : 1) * sizeof(struct sched_ent));
+	if (!s->ents)
+		return STATUS_E(ST_ERR_MALLOC, "Ordering files", NULL);
+
+	hash_foreach(files, add_one, &pass);
+	if (order == SCHED_DIRS) {
+		qsort(s->ents, s->n, sizeof(struct sched_ent), by_dir);
+		return STATUS(ST_OK, 0, "Ordering files", NULL);
+	}
+	if (s->no_fiemap)
+		for (size_t i = 0; i < s->n; ++i)
+			s->ents[i].pos = (uint64_t)s->ents[i].key->st_ino;
+	qsort(s->ents, s->n, sizeof(struct sched_ent), by_pos);
+	return STATUS(ST_OK, 0, "Ordering files", NULL);
+}
+
+/* Asks the kernel to start reading the files after entry `i', the next
+ * one to be copied, so that about SCHED_AHEAD bytes are on their way at
+ * any time. The requests go out in disk order too, and the elevator can
+ * merge them.
+ */
+void sched_ahead(struct sched* s, struct copier* cp, size_t i)
+{
+	/* The one before was copied */
+	if (i > 0) {
+		s->inflight -= s->ents[i - 1].ahead;
+		s->ents[i - 1].ahead = 0;
+	}
+
+	while (s->next < s->n && (s->next <= i || s->inflight < SCHED_AHEAD)) {
+		struct sched_ent* e = &s->ents[s->next++];
+		file_t src;
+		if (e->skip || !S_ISREG(e->f->mode) || e->f->size <= 0)
+			continue;
+		/* Close to the file being copied, its directory is at hand */
+		if (dirfds_at(&cp->dirs, e->f, &src, NULL) == -1)
+			continue;
+
+		uint64_t t = STATS_START();
+		int fd = openat(src.pfd, src.name, O_RDONLY | O_NOCTTY |
+				(cp->oflags & O_NOFOLLOW));
+		STATS_TIME(STATS_OPEN, t);
+		if (fd < 0)
+			continue;
+		off_t len = (e->f->size < SCHED_AHEAD) ? e->f->size : SCHED_AHEAD;
+		if (posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED) == 0) {
+			e->ahead = (uint64_t)len;
+			s->inflight += e->ahead;
+		}
+		close(fd);
+	}
+}
+
+void sched_free(struct sched* s)
+{
+	free(s->ents);
+	memset(s, 0, sizeof(*s));
+}
+
+static int add_one(const void* key, void* value, void* user_data)
+{
+	struct sched_pass* pass = user_data;
+	struct sched* s = pass->s;
+	struct copier* cp = pass->cp;
+	struct file* f = value;
+
+	if (S_ISDIR(f->mode) && s->order != SCHED_DIRS)
+		return 0;
+
+	struct sched_ent* e = &s->ents[s->n++];
+	e->key = key;
+	e->f = f;
+	e->pos = 0;
+	e->ahead = 0;
+	e->skip = 0;
+	if (s->order == SCHED_DIRS) {
+		e->pos = f->dir;
+		return 0;
+	}
+	if (!S_ISREG(f->mode))
+		return 0;
+
+	if ((cp->prev && fidx_unchanged(cp->prev, key, f, cp->tree)) ||
+	    (cp->journal && journal_done(cp->journal, key, f, cp->tree)))
+		e->skip = 1;
+	/* Too long a path only loses its place: failures show once it's copied */
+	else if (!s->no_fiemap && file_path(cp->tree, f, cp->path, sizeof(cp->path)) != -1)
+		e->pos = first_extent(s, cp, cp->path);
+	return 0;
+}
+
+/* The physical offset of the first extent of the file at `path', 0 if it
+ * has none or can't be opened. Sets s->no_fiemap if FIEMAP isn't there.
+ * Files come in no order here: the path costs less than opening their
+ * directories one by one.
+ */
+static uint64_t first_extent(struct sched* s, struct copier* cp, const char* path)
+{
+#ifdef FS_IOC_FIEMAP
+	/* Room for one extent after the header */
+	uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+	struct fiemap* fm = (struct fiemap*)(void*)buf;
+	uint64_t pos = 0;
+
+	uint64_t t = STATS_START();
+	int fd = openat(cp->srcfd, path, O_RDONLY | O_NOCTTY | (cp->oflags & O_NOFOLLOW));
+	STATS_TIME(STATS_OPEN, t);
+	if (fd < 0)
+		return 0;
+
+	memset(buf, 0, sizeof(buf));
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, fm) == -1) {
+		if (errno == ENOTTY || errno == EOPNOTSUPP || errno == ENOSYS)
+			s->no_fiemap = 1;
+	} else if (fm->fm_mapped_extents > 0) {
+		pos = fm->fm_extents[0].fe_physical;
+	}
+	close(fd);
+	return pos;
+#else
+	(void)cp;
+	(void)path;
+	s->no_fiemap = 1;
+	return 0;
+#endif
+}
+
+/* By device, then position */
+static int by_pos(const void* a, const void* b)
+{
+	const struct sched_ent* x = a;
+	const struct sched_ent* y = b;
+
+	if (x->key->st_dev != y->key->st_dev)
+		return (x->key->st_dev < y->key->st_dev) ? -1 : 1;
+	if (x->pos != y->pos)
+		return (x->pos < y->pos) ? -1 : 1;
+	if (x->key->st_ino != y->key->st_ino)
+		return (x->key->st_ino < y->key->st_ino) ? -1 : 1;
+	return 0;
+}
+
+/* By directory, then inode */
+static int by_dir(const void* a, const void* b)
+{
+	const struct sched_ent* x = a;
+	const struct sched_ent* y = b;
+
+	if (x->pos != y->pos)
+		return (x->pos < y->pos) ? -1 : 1;
+	if (x->key->st_ino != y->key->st_ino)
+		return (x->key->st_ino < y->key->st_ino) ? -1 : 1;
+	return 0;
+}
@@ -1,5 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
 
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -12,14 +14,24 @@
 
 #include "hash.h"
 #include "fs.h"
+#include "stats.h"
 #include "status.h"
 
+static void make_room(struct stack* dirs);
+static int park_one(struct stack* dirs);
+static status_t reopen(struct stack* dirs, struct stackdir* dir, int childfd);
 
 /* Stack owns stackdir, therefore each of its members too.
- * push will handle allocation.
- * pop will free everything in stackdir, including DIR* d.
+ * push will handle allocation. `node' is the directory in the traversal's
+ * dirtree, errors only name it by `name'.
+ * pop will free everything in stackdir, including the directory reader.
+ *
+ * At most dirs->maxopen directories are open at once, as far as it can
+ * be helped: push parks older ones, and pop reopens them, through the
+ * ".." of the directory it pops. When the process runs out of descriptors
+ * anyway, another one is parked, and the budget shrinks to what's left.
  */
-status_t push(struct stack* dirs, int fd, const char* name, int oflags)
+status_t push(struct stack* dirs, int fd, const char* name, uint32_t node, int oflags)
 {
 	status_t ret;
 	ret = STATUS(ST_INT_ISNULL, 0, "Pushing directory", NULL);
@@ -33,29 +45,50 @@ status_t push(struct stack* dirs, int fd, const char* name, int oflags)
 	dir->name = strdup(name); /* Store name in a seperate buffer */
 	if (!dir->name) goto err_free_dir;
 
-	const char* parent_path = (!dirs->top) ? "" : dirs->top->dirname;
-
-	/* Bind d stream to fd */
-	DIR* d;  /* current directory's stream */
-	ret = stream_subdir(fd, name, oflags, &d);
-	dir->dirname = path_concat(parent_path, name);
-	if (!dir->dirname) {
-		ret = STATUS(ST_ERR_MALLOC, errno, "Building file path", NULL);
+	make_room(dirs);
+	int cfd;  /* current directory */
+	while ((ret = open_subdir(fd, name, oflags, &cfd)).sysc == EMFILE &&
+	       park_one(dirs) == 0)
+		dirs->maxopen = dirs->nopen;
+	if (ret.c != ST_OK) {
+		ret.file_target = strdup(name);
 		goto err_free_dir_name;
 	}
+	dir->node = node;
 
-	if (ret.c != ST_OK) {
-		ret.file_target = strdup(dir->dirname);
-		goto err_free_dir_dirname;
+	struct stat sb;
+	if (fstat(cfd, &sb) == -1) {
+		ret = STATUS_E(ST_ERR_FILERD_MD, "Reading directory metadata",
+			       strdup(name));
+		goto err_close_cfd;
+	}
+	dir->dev = sb.st_dev;
+	dir->ino = sb.st_ino;
+
+	/* Its ".." isn't where it was found then, assume the worst */
+	struct stat lsb;
+	dir->symlinked = 0;
+	if (!(oflags & O_NOFOLLOW))
+		dir->symlinked = fstatat((fd < 0) ? AT_FDCWD : fd, name, &lsb,
+					 AT_SYMLINK_NOFOLLOW) == -1 || S_ISLNK(lsb.st_mode);
+
+	if (dents_init(&dir->ds, DENTS_BUFSZ) == -1) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Pushing directory", NULL);
+		goto err_close_cfd;
+	}
+	if (dents_open(&dir->ds, cfd) == -1) {
+		ret = STATUS_E(ST_ERR_OPEN, "Opening directory", strdup(name));
+		dents_free(&dir->ds);
+		goto err_free_dir_name;
 	}
-	dir->dir = d;
 	dir->next = dirs->top;
 	dirs->top = dir;
 	dirs->ndir++;
+	dirs->nopen++;
 	return STATUS(ST_OK, 0, "Pushing directory", NULL);
 
-err_free_dir_dirname:
-	free(dir->dirname);
+err_close_cfd:
+	close(cfd);
 err_free_dir_name:
 	free(dir->name);
 err_free_dir:
@@ -77,14 +110,102 @@ status_t pop(struct stack* dirs)
 	/* Remove from top */
 	dirs->top = dir->next;
 
+	status_t ret = STATUS(ST_OK, 0, "Popping directory", NULL);
+	if (dirs->top && dirs->top->ds.fd < 0)
+		ret = reopen(dirs, dirs->top, dir->ds.fd);
+
 	/* Free memory */
-	free(dir->dirname);
+	if (dir->ds.fd >= 0)
+		dirs->nopen--;
 	free(dir->name);
-	closedir(dir->dir);
+	dents_free(&dir->ds);
 	free(dir);
 
 	/* one directory removed */
 	dirs->ndir--;
 
-	return STATUS(ST_OK, 0, "Popping directory", NULL);
+	return ret;
+}
+
+/* How many directories a stack can keep open: what RLIMIT_NOFILE allows
+ * once `reserve' descriptors are left to the rest of the program, up to
+ * STACK_MAX_OPEN. It's at least 2, so the top and its parent still are.
+ */
+size_t stack_budget(unsigned reserve)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY ||
+	    rl.rlim_cur >= (rlim_t)reserve + STACK_MAX_OPEN)
+		return STACK_MAX_OPEN;
+	if (rl.rlim_cur < (rlim_t)reserve + 2)
+		return 2;
+	return (size_t)(rl.rlim_cur - reserve);
+}
+
+/* Parks the oldest open directories until one more fits in the budget.
+ * If nothing can be parked, the budget is exceeded.
+ */
+static void make_room(struct stack* dirs)
+{
+	while (dirs->nopen >= dirs->maxopen && park_one(dirs) == 0)
+		;
+}
+
+/* Parks the oldest open directory. The top one is never parked, as it's
+ * being read, and neither is one whose child was reached through a
+ * symbolic link: it couldn't be reopened from there. Returns -1 if none
+ * could be.
+ */
+static int park_one(struct stack* dirs)
+{
+	struct stackdir* victim = NULL;
+	struct stackdir* child = NULL;
+	size_t seen = 0;
+
+	for (struct stackdir* d = dirs->top; d && seen < dirs->nopen;
+	     child = d, d = d->next) {
+		if (d->ds.fd < 0)
+			continue;
+		seen++;
+		if (child && !child->symlinked)
+			victim = d;
+	}
+	if (!victim || dents_park(&victim->ds) == -1)
+		return -1;
+	dirs->nopen--;
+	return 0;
+}
+
+/* Reopens the parked `dir' as the ".." of its child `childfd', and makes
+ * sure it's still the same directory.
+ */
+static status_t reopen(struct stack* dirs, struct stackdir* dir, int childfd)
+{
+	struct stat sb;
+
+	uint64_t t = STATS_START();
+	int fd;
+	while ((fd = openat(childfd, "..", O_RDONLY | O_DIRECTORY)) < 0 && errno == EMFILE &&
+	       park_one(dirs) == 0)
+		dirs->maxopen = dirs->nopen;
+	STATS_TIME(STATS_OPEN, t);
+	if (fd < 0)
+		return STATUS_E(ST_ERR_OPEN, "Reopening directory", strdup(dir->name));
+	if (fstat(fd, &sb) == -1) {
+		status_t ret = STATUS_E(ST_ERR_FILERD_MD, "Reading directory metadata",
+					strdup(dir->name));
+		close(fd);
+		return ret;
+	}
+	if (sb.st_dev != dir->dev || sb.st_ino != dir->ino) {
+		close(fd);
+		return STATUS(ST_ERR_OPEN, ENOENT, "Directory moved while being read",
+			      strdup(dir->name));
+	}
+
+	if (dents_resume(&dir->ds, fd) == -1)
+		return STATUS_E(ST_ERR_OPEN, "Reopening directory", strdup(dir->name));
+	dirs->nopen++;
+	return STATUS(ST_OK, 0, "Reopening directory", NULL);
 }
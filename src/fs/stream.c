@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+#include "fs/stream.h"
+#include "intr.h"
+#include "status.h"
+
+static void* drain(void* arg);
+static int take(struct stream* s, struct stream_job* job);
+static void fail(struct stream* s, status_t ret);
+static void add_stats(struct copy_stats* to, const struct copy_stats* from);
+static void stream_free(struct stream* s, unsigned ncopiers);
+
+/* Sets up the queue, and starts `ncopiers' copy threads on it, each with
+ * a copier of its own from `src' to `dst'. Skips what `prev' says is
+ * unchanged, if not NULL, and records what was copied in `journal', if
+ * not NULL. `tree' is read while the traversal adds to it.
+ * Whatever happens next, stream_finish() must be called.
+ */
+status_t stream_start(struct stream* s, unsigned ncopiers,
+		      const struct dirtree* tree, const struct fidx* prev,
+		      struct journal* journal, const char* src, const char* dst,
+		      int oflags)
+{
+	status_t ret;
+	unsigned i;
+
+	if (ncopiers == 0) ncopiers = 1;
+	memset(s, 0, sizeof(*s));
+	s->ret = STATUS(ST_OK, 0, "Copying stream", NULL);
+
+	s->jobs = malloc(STREAM_QUEUE * sizeof(struct stream_job));
+	s->workers = calloc(ncopiers, sizeof(struct stream_worker));
+	if (!s->jobs || !s->workers) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Creating copy queue", NULL);
+		free(s->jobs);
+		free(s->workers);
+		return ret;
+	}
+
+	for (i = 0; i < ncopiers; ++i) {
+		ret = copier_init(&s->workers[i].cp, tree, src, dst, oflags);
+		if (ret.c != ST_OK) {
+			stream_free(s, i);
+			return ret;
+		}
+		s->workers[i].cp.prev = prev;
+		s->workers[i].cp.journal = journal;
+		/* Large files are shared out too, on one budget of threads: a
+		 * file alone gets all of them, and many get no more together
+		 */
+		s->workers[i].cp.nsplit = ncopiers;
+		s->workers[i].cp.spare = &s->spare;
+		/* So that all of them open no more directories than one would */
+		dirfds_limit(&s->workers[i].cp.dirs, DIRFDS_SIZE / ncopiers);
+		s->workers[i].s = s;
+	}
+
+	s->spare = ncopiers - 1;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->nonempty, NULL);
+	pthread_cond_init(&s->nonfull, NULL);
+
+	for (i = 0; i < ncopiers; ++i) {
+		int err = pthread_create(&s->workers[i].tid, NULL, drain, &s->workers[i]);
+		if (err) {
+			/* Copy with the ones that started */
+			if (i > 0)
+				break;
+			pthread_cond_destroy(&s->nonfull);
+			pthread_cond_destroy(&s->nonempty);
+			pthread_mutex_destroy(&s->lock);
+			stream_free(s, ncopiers);
+			return STATUS(ST_ERR_THREAD, err, "Starting copy threads", NULL);
+		}
+	}
+	s->nworkers = i;
+	/* The rest of the copiers only copy hard links, see stream_finish() */
+	while (i < ncopiers) copier_free(&s->workers[i++].cp);
+
+	return STATUS(ST_OK, 0, "Copying stream", NULL);
+}
+
+/* A trav_emit_fn, for a stream in `arg': queues the entry, waiting for
+ * room if needed. Fails once copying failed, so the traversal stops too.
+ */
+status_t stream_emit(void* arg, const struct kfile* key, const struct file* f)
+{
+	struct stream* s = arg;
+	size_t len = strlen(f->name);
+
+	if (len > NAME_MAX)
+		return STATUS(ST_ERR_OPEN, ENAMETOOLONG, "Queueing entry", strdup(f->name));
+
+	pthread_mutex_lock(&s->lock);
+	while (s->count == STREAM_QUEUE && !s->failed)
+		pthread_cond_wait(&s->nonfull, &s->lock);
+	if (s->failed) {
+		pthread_mutex_unlock(&s->lock);
+		return STATUS(ST_ERR_COPY, ECANCELED, "Queueing entry", NULL);
+	}
+
+	struct stream_job* job = &s->jobs[(s->head + s->count) % STREAM_QUEUE];
+	job->key = *key;
+	/* Not the links: other threads may add to them */
+	job->f.dir = f->dir;
+	job->f.mode = f->mode;
+	job->f.size = f->size;
+	job->f.mtime = f->mtime;
+	job->f.ctime = f->ctime;
+	job->f.done = 0;
+	job->f.chunks = NULL;
+	job->f.links = NULL;
+	memcpy(job->name, f->name, len + 1);
+	s->count++;
+
+	pthread_cond_signal(&s->nonempty);
+	pthread_mutex_unlock(&s->lock);
+	return STATUS(ST_OK, 0, "Queueing entry", NULL);
+}
+
+/* Waits for the copy threads to empty the queue once the traversal is
+ * over, with `walk' as its result, then links the other names of the
+ * files in `files', and gives directories their mode. Frees the stream,
+ * and adds up what every thread copied in `stats'.
+ *
+ * Returns the first error of either the traversal or the copy.
+ */
+status_t stream_finish(struct stream* s, status_t walk, struct hash_table* files,
+		       struct copy_stats* stats)
+{
+	status_t ret;
+
+	if (walk.c != ST_OK)
+		fail(s, walk);
+
+	pthread_mutex_lock(&s->lock);
+	s->closed = 1;
+	pthread_cond_broadcast(&s->nonempty);
+	pthread_mutex_unlock(&s->lock);
+
+	for (unsigned i = 0; i < s->nworkers; ++i)
+		pthread_join(s->workers[i].tid, NULL);
+
+	ret = s->ret;
+	if (ret.c == ST_OK)
+		ret = copy_tree_links(&s->workers[0].cp, files);
+	if (ret.c == ST_OK)
+		ret = copy_tree_modes(&s->workers[0].cp, files);
+
+	memset(stats, 0, sizeof(*stats));
+	for (unsigned i = 0; i < s->nworkers; ++i)
+		add_stats(stats, &s->workers[i].cp.stats);
+
+	pthread_cond_destroy(&s->nonfull);
+	pthread_cond_destroy(&s->nonempty);
+	pthread_mutex_destroy(&s->lock);
+	stream_free(s, s->nworkers);
+	return ret;
+}
+
+static void* drain(void* arg)
+{
+	struct stream_worker* self = arg;
+	struct stream_job job;
+
+	while (take(self->s, &job)) {
+		/* Leave the rest of the queue for a resumed run */
+		if (terminate_wanted) {
+			fail(self->s, STATUS(ST_ERR_INTR, EINTR, "Copying stream", NULL));
+			break;
+		}
+		job.f.name = job.name;
+		status_t ret = copy_entry(&self->cp, &job.key, &job.f);
+		if (ret.c == ST_OK)
+			continue;
+
+		/* Permission error, rather skip */
+		if (ret.sysc == EACCES) {
+			sterr(ret);
+			status_free(ret);
+		} else {
+			fail(self->s, ret);
+		}
+	}
+
+	return NULL;
+}
+
+/* Takes the oldest job into `job'. Returns 0 when there's none left,
+ * or copying failed.
+ */
+static int take(struct stream* s, struct stream_job* job)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->count == 0 && !s->closed && !s->failed)
+		pthread_cond_wait(&s->nonempty, &s->lock);
+	if (s->count == 0 || s->failed) {
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+
+	*job = s->jobs[s->head];
+	s->head = (s->head + 1) % STREAM_QUEUE;
+	s->count--;
+
+	pthread_cond_signal(&s->nonfull);
+	pthread_mutex_unlock(&s->lock);
+	return 1;
+}
+
+/* Records the first fatal error, and stops both sides. */
+static void fail(struct stream* s, status_t ret)
+{
+	pthread_mutex_lock(&s->lock);
+	if (!s->failed) {
+		s->failed = 1;
+		s->ret = ret;
+	} else {
+		status_free(ret);
+	}
+	pthread_cond_broadcast(&s->nonempty);
+	pthread_cond_broadcast(&s->nonfull);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void add_stats(struct copy_stats* to, const struct copy_stats* from)
+{
+	to->nfiles += from->nfiles;
+	to->ndirs += from->ndirs;
+	to->nsymlinks += from->nsymlinks;
+	to->nlinks += from->nlinks;
+	to->nbytes += from->nbytes;
+	to->nholes += from->nholes;
+	to->nunchanged += from->nunchanged;
+	to->nresumed += from->nresumed;
+}
+
+/* Frees the queue, and the first `ncopiers' copiers */
+static void stream_free(struct stream* s, unsigned ncopiers)
+{
+	for (unsigned i = 0; i < ncopiers; ++i)
+		copier_free(&s->workers[i].cp);
+	free(s->workers);
+	free(s->jobs);
+	s->workers = NULL;
+	s->jobs = NULL;
+}
@@ -1,7 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <sys/types.h>
-#include <dirent.h>
+#include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
@@ -14,30 +14,38 @@
 
 #include "hash.h"
 #include "fs.h"
+#include "intr.h"
+#include "stats.h"
 #include "status.h"
 
-static status_t searchdir(struct stack* dirs, struct hash_table** files, int oflags);
+static status_t searchdir(struct stack* dirs, struct hash_table** files,
+			  struct arena* mem, struct dirtree* tree,
+			  const struct travopts* opts);
 
 /* Goes through a directory recursively, and each file it founds
  * adds it to the given hash table. Will resize the hash table appropriately,
  * however, never owns it. Will never take the responsibility to free it.
+ * Keys and values are allocated from `mem', and freed along with it.
+ * Directories are added to `tree', which must only hold its root.
  */
-status_t traverse(const char* restrict path, struct hash_table** files, int oflags)
+status_t traverse(const char* restrict path, struct hash_table** files,
+		  struct arena* mem, struct dirtree* tree,
+		  const struct travopts* opts)
 {
 	status_t ret;
-	struct stack dirs = { .top = NULL, .ndir = 0 };
-	oflags |= O_DIRECTORY;
+	struct stack dirs = { .top = NULL, .ndir = 0, .nopen = 0,
+			      .maxopen = stack_budget(opts->reserve) };
 
 	/* the hash table is a must for safety */
 	if (!(*files)) {
 		ret = STATUS(ST_INT_ISNULL, EINVAL, "No hash table", NULL);
 		goto err_return;
 	}
-	ret = push(&dirs, -2, path, oflags);
+	ret = push(&dirs, -2, path, DIRTREE_ROOT, opts->oflags);
 	if (ret.c != ST_OK) goto err_return;
 
 	while(dirs.top) {
-		ret = searchdir(&dirs, files, oflags);
+		ret = searchdir(&dirs, files, mem, tree, opts);
 		if (ret.c != ST_OK) {
 			/* Permission error, rather skip */
 			if (ret.sysc == EACCES) {
@@ -52,71 +60,238 @@ status_t traverse(const char* restrict path, struct hash_table** files, int ofla
 	return STATUS(ST_OK, 0, "Indexed directory", NULL);
 
 err_free_stack:
-	while(dirs.top) pop(&dirs);
+	while(dirs.top) status_free(pop(&dirs));
 err_return:
 	return ret;
 }
 
-static status_t searchdir(struct stack* dirs, struct hash_table** files, int oflags)
+static status_t searchdir(struct stack* dirs, struct hash_table** files,
+			  struct arena* mem, struct dirtree* tree,
+			  const struct travopts* opts)
 {
 	status_t ret;
-	/* To hold the readdir entry, and fstatat stat struct. */
-	struct dirent* entry;
+	/* To hold the directory entry, and its stat struct. */
+	struct dent entry;
 	struct stat sb;
-	/* the directory stream at the top of the stack */
-	DIR* d = dirs->top->dir;
-	/* dynamically choose fstatat flags */
-	int statflags = 0;
-	if (oflags & O_NOFOLLOW) statflags = AT_SYMLINK_NOFOLLOW;
+	/* the directory at the top of the stack */
+	struct stackdir* top = dirs->top;
+	uint32_t live = dir_live(tree, top->node, opts);
+	int r;
 
-	while((entry = readdir(d)) != NULL) {
+	while((r = dents_next(&top->ds, &entry)) > 0) {
 		/* Skip the current and previous directory */
-		if ((strcmp(entry->d_name, ".")) == 0 ||
-		    strcmp(entry->d_name, "..") == 0) continue;
-		errno = 0;
-		*files = hash_upsize(*files);
-		if (errno != 0)
-			return STATUS_E(ST_ERR_HASH_UPS, "Resizing table", NULL);
-
-		if (fstatat(dirfd(d), entry->d_name, &sb, statflags) == -1) {
+		if ((strcmp(entry.name, ".")) == 0 ||
+		    strcmp(entry.name, "..") == 0) continue;
+
+		/* Before it costs a stat, if its type is known */
+		uint32_t sub = 0;
+		int keep = entry_keep(opts, live, entry.name, entry.type, &sub);
+		if (keep == FILTER_SKIP)
+			continue;
+		if (keep == FILTER_ERROR)
+			goto err_filter;
+
+		if (entry_stat(top->ds.fd, top->dev, &entry, opts, &sb) == -1) {
 			if (errno == EACCES) {
-				sterr(STATUS_E(ST_ERR_FILERD_MD,
-					       "Reading file metadata", entry->d_name));
+				ret = STATUS_E(ST_ERR_FILERD_MD,
+					       "Reading file metadata", strdup(entry.name));
+				sterr(ret);
+				status_free(ret);
 				continue;
 			}
-			return STATUS_E(ST_ERR_FILERD_MD,
-					"Reading file metadata", strdup(entry->d_name));
-		}
-
-		struct kfile* key = hcrekey(&sb);
-		if (!key) {
-			/* couldn't allocate key */
-			ret = STATUS_E(ST_ERR_MALLOC, "Inserting hash entries", NULL);
-			goto err_return;
+			ret = STATUS_E(ST_ERR_FILERD_MD,
+				       "Reading file metadata", strdup(entry.name));
+			goto err_pop;
 		}
-		if (hash_lookup(*files, key)) {
-			/* seen this file already */
-			free(key);
-			continue;
+		if (keep == FILTER_UNSURE) {
+			keep = entry_keep(opts, live, entry.name, sb.st_mode, &sub);
+			if (keep == FILTER_SKIP)
+				continue;
+			if (keep == FILTER_ERROR)
+				goto err_filter;
 		}
 
-		char* full = path_concat(dirs->top->dirname, entry->d_name);
-		struct file* val = hcreval(full, sb.st_mode, sb.st_size);
-		free(full);
-		if (!val || hash_insert(*files, key, val) < 0) {
-			ret = STATUS_E(ST_ERR_MALLOC, "Inserting hash entries", NULL);
-			free(val);
+		struct file* added;
+		ret = index_entry(files, NULL, mem, opts, top->node, entry.name,
+				  &sb, &added);
+		if (ret.c != ST_OK)
 			goto err_pop;
+
+		if (added && S_ISDIR(sb.st_mode)) {
+			uint32_t node = dirtree_add(tree, top->node, added->name, sub);
+			if (node == DIRTREE_NONE) {
+				ret = STATUS_E(ST_ERR_PUSH_DIR, "Pushing directory", NULL);
+				goto err_pop;
+			}
+			ret = push(dirs, top->ds.fd, entry.name, node, opts->oflags);
+			if (ret.c != ST_OK) {
+				/* Name it by its whole path */
+				free(ret.file_target);
+				ret.file_target = dirtree_strdup(tree, node);
+			}
+			return ret;
 		}
+	}
+	if (r < 0) {
+		ret = STATUS_E(ST_ERR_FILERD, "Reading directory",
+			       dirtree_strdup(tree, top->node));
+		goto err_pop;
+	}
+	/* Reopens the parent, if it was parked */
+	return pop(dirs);
+err_filter:
+	ret = STATUS_E(ST_ERR_MALLOC, "Filtering directory", strdup(entry.name));
+err_pop:
+	status_free(pop(dirs));
+	return ret;
+}
+
+/* Fills the parts of `sb' the traversal needs for the entry `e' of the
+ * directory `dfd', which lives on `dev'. Only stats the entry when it has
+ * to: for the metadata asked in opts->need, to find out what the entry is,
+ * or for directories, which can be mount points and so have their own
+ * st_dev.
+ *
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int entry_stat(int dfd, dev_t dev, const struct dent* e,
+	       const struct travopts* opts, struct stat* sb)
+{
+	/* The mode comes with the file type anyway */
+	unsigned need = DENT_NEED_MODE;
+
+	if (!opts->need && e->type && e->type != S_IFDIR) {
+		sb->st_dev = dev;
+		sb->st_ino = (ino_t)e->ino;
+		sb->st_mode = e->type;
+		sb->st_size = FILE_SIZE_UNKNOWN;
+		sb->st_nlink = 0;
+		memset(&sb->st_mtim, 0, sizeof(sb->st_mtim));
+		memset(&sb->st_ctim, 0, sizeof(sb->st_ctim));
+		return 0;
+	}
+
+	if (opts->need & TRAV_NEED_SIZE) need |= DENT_NEED_SIZE;
+	if (opts->need & TRAV_NEED_TIMES) need |= DENT_NEED_TIMES;
+	if (opts->need & TRAV_NEED_NLINK) need |= DENT_NEED_NLINK;
+	if (dent_stat(dfd, e->name, (opts->oflags & O_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0,
+		      need, sb) == -1)
+		return -1;
+
+	if (!(opts->need & TRAV_NEED_SIZE))
+		sb->st_size = FILE_SIZE_UNKNOWN;
+	if (!(opts->need & TRAV_NEED_NLINK))
+		sb->st_nlink = 0;
+	if (!(opts->need & TRAV_NEED_TIMES)) {
+		memset(&sb->st_mtim, 0, sizeof(sb->st_mtim));
+		memset(&sb->st_ctim, 0, sizeof(sb->st_ctim));
+	}
+	return 0;
+}
+
+/* The set of filter steps live in the directory `node', see fs/filter.h */
+uint32_t dir_live(const struct dirtree* tree, uint32_t node, const struct travopts* opts)
+{
+	if (!opts->filter)
+		return 0;
+	return (node == DIRTREE_ROOT) ? filter_root(opts->filter) : dirtree_filter(tree, node);
+}
+
+/* Runs the entry `name', of type `type' (0 if unknown), found in a
+ * directory where the set of filter steps `live' is, through
+ * opts->filter: see filter_test(), which sets *sub for directories.
+ * Counts the entries skipped.
+ */
+int entry_keep(const struct travopts* opts, uint32_t live, const char* name, mode_t type,
+	       uint32_t* sub)
+{
+	if (!opts->filter)
+		return FILTER_KEEP;
+	int keep = filter_test(opts->filter, live, name, type, sub);
+	if (keep == FILTER_SKIP)
+		STATS_ADD(STATS_SKIPPED, 1);
+	return keep;
+}
+
+/* Adds `name', found in the directory `dir', to the files table.
+ * Its key and value are allocated from `mem', which must not be shared
+ * with other threads. `lock' serializes access to the table when several
+ * threads index into it at once, and can be NULL otherwise. Allocations
+ * happen before the table is locked, so the critical section stays short.
+ *
+ * *added is set to the new entry if the file is new, and to NULL if it
+ * has already been seen under another name. Another name of a file that
+ * isn't a directory is a hard link, and is added to the entry's links;
+ * directories seen twice are bind mounts or loops, and are dropped.
+ *
+ * With opts->emit set, new entries are also handed to it. Files with a
+ * single link can't be seen again, so they skip the table altogether,
+ * and *added stays NULL for them.
+ *
+ * Fails with ST_ERR_INTR once terminate_wanted is set.
+ */
+status_t index_entry(struct hash_table** files, pthread_mutex_t* lock,
+		     struct arena* mem, const struct travopts* opts, uint32_t dir,
+		     const char* name, const struct stat* sb, struct file** added)
+{
+	status_t ret;
+	*added = NULL;
+	STATS_ADD(STATS_ENTRIES, 1);
+	if (terminate_wanted)
+		return STATUS(ST_ERR_INTR, EINTR, "Listing directory", NULL);
 
-		if (S_ISDIR(sb.st_mode)) {
-			return push(dirs, dirfd(d), entry->d_name, oflags);
+	if (opts->emit && !S_ISDIR(sb->st_mode) && sb->st_nlink == 1) {
+		struct kfile k = { .st_dev = (uintmax_t)sb->st_dev,
+				   .st_ino = (uintmax_t)sb->st_ino };
+		struct file f;
+		hcfill(&f, dir, name, sb);
+		return opts->emit(opts->emit_arg, &k, &f);
+	}
+
+	/* Duplicates give their memory back */
+	struct arena_mark m = arena_save(mem);
+	struct kfile* key = hcrekey(mem, sb);
+	struct file* val = (key) ? hcreval(mem, dir, name, sb) : NULL;
+	if (!val) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Inserting hash entries", NULL);
+		goto err_restore;
+	}
+
+	if (lock) pthread_mutex_lock(lock);
+	errno = 0;
+	*files = hash_upsize(*files);
+	if (errno != 0) {
+		ret = STATUS_E(ST_ERR_HASH_UPS, "Resizing table", NULL);
+		goto err_unlock;
+	}
+
+	struct file* first = hash_lookup(*files, key);
+	if (first) {
+		/* seen this file already */
+		if (!S_ISDIR(first->mode)) {
+			val->links = first->links;
+			first->links = val;
 		}
+		if (lock) pthread_mutex_unlock(lock);
+		if (S_ISDIR(first->mode))
+			arena_restore(mem, m);
+		return STATUS(ST_OK, 0, NULL, NULL);
 	}
-	pop(dirs);
+
+	if (hash_insert(*files, key, val) < 0) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Inserting hash entries", NULL);
+		goto err_unlock;
+	}
+	if (lock) pthread_mutex_unlock(lock);
+
+	*added = val;
+	if (opts->emit)
+		return opts->emit(opts->emit_arg, key, val);
 	return STATUS(ST_OK, 0, NULL, NULL);
-err_pop:
-	pop(dirs);
-err_return:
+
+err_unlock:
+	if (lock) pthread_mutex_unlock(lock);
+err_restore:
+	arena_restore(mem, m);
 	return ret;
 }
@@ -0,0 +1,393 @@
+/* statx(2) and its flags are Linux specific */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "fs/ucopy.h"
+#include "fs/uring.h"
+#include "stats.h"
+#include "status.h"
+
+/* Where a file is at, see struct ucopy */
+enum { UC_OPEN, UC_CREATE, UC_READ, UC_WRITE, UC_CLOSE };
+
+/* What a request was, in the low bits of its user_data, the slot above */
+enum { REQ_STATX, REQ_OPEN, REQ_CREATE, REQ_READ, REQ_WRITE, REQ_CLOSE_IN, REQ_CLOSE_OUT };
+#define REQ_BITS 3
+
+#if defined(__linux__) && defined(STATX_TYPE)
+static status_t reap(struct ucopy* u, unsigned wait);
+static void step(struct ucopy* u, struct ucopy_slot* s, unsigned req, int32_t res);
+static void queue(struct ucopy* u, struct ucopy_slot* s, unsigned req);
+static void fallback(struct ucopy* u, struct ucopy_slot* s);
+static void fail(struct ucopy* u, struct ucopy_slot* s, int code, int err, const char* msg);
+static void done(struct ucopy* u, struct ucopy_slot* s, status_t ret);
+#endif
+
+/* Sets up the ring and UCOPY_DEPTH slots. Fails with ENOSYS where
+ * io_uring can't do the job: the caller copies without it.
+ */
+status_t ucopy_init(struct ucopy* u, struct copier* cp)
+{
+	memset(u, 0, sizeof(*u));
+	u->cp = cp;
+	u->ret = STATUS(ST_OK, 0, "Copying small files", NULL);
+#if defined(__linux__) && defined(STATX_TYPE)
+	/* Two requests at most per file: statx and open, or both closes */
+	if (uring_init(&u->ring, 2 * UCOPY_DEPTH) == -1)
+		return STATUS_E(ST_ERR_COPY, "Setting up io_uring", NULL);
+
+	u->slots = calloc(UCOPY_DEPTH, sizeof(struct ucopy_slot));
+	char* bufs = malloc((size_t)UCOPY_DEPTH * (UCOPY_MAX + 1));
+	struct statx* stx = calloc(UCOPY_DEPTH, sizeof(struct statx));
+	if (!u->slots || !bufs || !stx) {
+		free(u->slots);
+		free(bufs);
+		free(stx);
+		uring_free(&u->ring);
+		return STATUS_E(ST_ERR_MALLOC, "Setting up io_uring", NULL);
+	}
+	for (unsigned i = 0; i < UCOPY_DEPTH; ++i) {
+		u->slots[i].buf = bufs + (size_t)i * (UCOPY_MAX + 1);
+		u->slots[i].stx = &stx[i];
+		u->slots[i].in = -1;
+		u->slots[i].out = -1;
+	}
+	return u->ret;
+#else
+	return STATUS(ST_ERR_COPY, ENOSYS, "Setting up io_uring", NULL);
+#endif
+}
+
+void ucopy_free(struct ucopy* u)
+{
+	if (!u->slots)
+		return;
+	free(u->slots[0].buf);
+	free(u->slots[0].stx);
+	free(u->slots);
+	u->slots = NULL;
+	uring_free(&u->ring);
+}
+
+/* Copies the entry `k' of the files table, like copy_entry(), or queues
+ * it if it's a small regular file. Waits for a slot when all are busy.
+ *
+ * Returns what copy_entry() said when it was handed the entry, or else
+ * the first fatal error met by a file queued before, once. Permission
+ * errors of queued files are reported and skipped, like copy_tree() does.
+ */
+status_t ucopy_add(struct ucopy* u, const struct kfile* k, struct file* f)
+{
+#if defined(__linux__) && defined(STATX_TYPE)
+	struct copier* cp = u->cp;
+
+	/* Sizes not listed are told by statx */
+	if (!S_ISREG(f->mode) || f->links || f->size > UCOPY_MAX)
+		return copy_entry(cp, k, f);
+	if (copy_skip(cp, k, f)) {
+		f->done = 1;
+		return STATUS(ST_OK, 0, "Skipping file", NULL);
+	}
+
+	while (u->nbusy == UCOPY_DEPTH && u->ret.c == ST_OK) {
+		status_t ret = reap(u, 1);
+		if (ret.c != ST_OK)
+			return ret;
+	}
+	if (u->ret.c != ST_OK) {
+		status_t ret = u->ret;
+		u->ret = STATUS(ST_OK, 0, "Copying small files", NULL);
+		u->failed = 1;
+		return ret;
+	}
+
+	struct ucopy_slot* s = u->slots;
+	while (s->key)
+		s++;
+	/* Too deep to be named from the roots: by its directory, then */
+	if (file_path(cp->tree, f, s->path, sizeof(s->path)) == -1)
+		return copy_entry(cp, k, f);
+
+	s->key = k;
+	s->f = f;
+	s->state = UC_OPEN;
+	s->pending = 2;
+	s->err = 0;
+	s->pos = 0;
+	u->nbusy++;
+	queue(u, s, REQ_STATX);
+	queue(u, s, REQ_OPEN);
+	return STATUS(ST_OK, 0, "Copying small files", NULL);
+#else
+	return copy_entry(u->cp, k, f);
+#endif
+}
+
+/* Waits for every file queued. Returns the first fatal error ucopy_add()
+ * didn't return yet, if any.
+ */
+status_t ucopy_finish(struct ucopy* u)
+{
+#if defined(__linux__) && defined(STATX_TYPE)
+	while (u->nbusy > 0) {
+		status_t ret = reap(u, 1);
+		if (ret.c != ST_OK) {
+			status_free(u->ret);
+			return ret;
+		}
+	}
+#endif
+	status_t ret = u->ret;
+	u->ret = STATUS(ST_OK, 0, "Copying small files", NULL);
+	return ret;
+}
+
+#if defined(__linux__) && defined(STATX_TYPE)
+/* Hands what was queued to the kernel, waits for `wait' requests, and
+ * moves every file whose request finished to its next step. Fails only
+ * if the ring itself does, leaving files in flight: the caller gives up.
+ */
+static status_t reap(struct ucopy* u, unsigned wait)
+{
+	uint64_t data;
+	int32_t res;
+
+	if (uring_enter(&u->ring, wait) == -1)
+		return STATUS_E(ST_ERR_COPY, "Submitting to io_uring", NULL);
+	while (uring_cqe(&u->ring, &data, &res) == 0) {
+		uring_seen(&u->ring);
+		step(u, &u->slots[data >> REQ_BITS], (unsigned)(data & ((1 << REQ_BITS) - 1)), res);
+	}
+	return STATUS(ST_OK, 0, "Copying small files", NULL);
+}
+
+static void step(struct ucopy* u, struct ucopy_slot* s, unsigned req, int32_t res)
+{
+	struct copier* cp = u->cp;
+	const struct statx* stx = s->stx;
+
+	/* Regular files don't, but the kernel may say so */
+	if ((res == -EINTR || res == -EAGAIN) && req >= REQ_READ && req <= REQ_WRITE) {
+		queue(u, s, req);
+		return;
+	}
+
+	switch (s->state) {
+	case UC_OPEN:
+		if (res < 0 && !s->err)
+			s->err = -res;
+		else if (req == REQ_OPEN && res >= 0)
+			s->in = res;
+		if (--s->pending > 0)
+			return;
+		/* Changed since it was listed, or unreadable: the slow way tells */
+		if (s->err || !S_ISREG(stx->stx_mode) || stx->stx_size > UCOPY_MAX) {
+			fallback(u, s);
+			return;
+		}
+		s->mode = stx->stx_mode & 07777;
+		s->size = stx->stx_size;
+		/* Not listed: what's compared next time comes from here */
+		if (s->f->size == FILE_SIZE_UNKNOWN) {
+			s->f->mode = stx->stx_mode;
+			s->f->size = (off_t)stx->stx_size;
+			s->f->mtime = TS_NSEC(stx->stx_mtime);
+			s->f->ctime = TS_NSEC(stx->stx_ctime);
+		}
+		s->state = UC_CREATE;
+		queue(u, s, REQ_CREATE);
+		return;
+
+	case UC_CREATE:
+		/* No parent yet, or something in the way */
+		if (res < 0) {
+			fallback(u, s);
+			return;
+		}
+		s->out = res;
+		s->state = UC_READ;
+		queue(u, s, REQ_READ);
+		return;
+
+	case UC_READ:
+		if (res < 0) {
+			fail(u, s, ST_ERR_FILERD, -res, "Reading file");
+			return;
+		}
+		if (res == 0) {
+			s->state = UC_CLOSE;
+			s->pending = 2;
+			queue(u, s, REQ_CLOSE_IN);
+			queue(u, s, REQ_CLOSE_OUT);
+			return;
+		}
+		STATS_ADD(STATS_BYTES_READ, res);
+		s->len = (uint32_t)res;
+		s->wrote = 0;
+		s->state = UC_WRITE;
+		queue(u, s, REQ_WRITE);
+		return;
+
+	case UC_WRITE:
+		if (res < 0) {
+			fail(u, s, ST_ERR_FILEWR, -res, "Writing file");
+			return;
+		}
+		STATS_ADD(STATS_BYTES_WRITTEN, res);
+		cp->stats.nbytes += (uintmax_t)res;
+		s->wrote += (uint32_t)res;
+		if (s->wrote < s->len) {
+			queue(u, s, REQ_WRITE);
+			return;
+		}
+		s->pos += s->len;
+		/* A short read up to the size statx gave is the end, no need
+		 * for another read to say so
+		 */
+		if (s->len <= UCOPY_MAX && s->pos >= s->size) {
+			s->state = UC_CLOSE;
+			s->pending = 2;
+			queue(u, s, REQ_CLOSE_IN);
+			queue(u, s, REQ_CLOSE_OUT);
+		} else {
+			s->state = UC_READ;
+			queue(u, s, REQ_READ);
+		}
+		return;
+
+	case UC_CLOSE:
+		if (req == REQ_CLOSE_IN)
+			s->in = -1;
+		else
+			s->out = -1;
+		if (req == REQ_CLOSE_OUT && res < 0)
+			s->err = -res;
+		if (--s->pending > 0)
+			return;
+		if (s->err) {
+			fail(u, s, ST_ERR_FILEWR, s->err, "Closing destination file");
+			return;
+		}
+		cp->stats.nfiles++;
+		if (cp->journal)
+			done(u, s, journal_add(cp->journal, s->key, s->f, cp->tree));
+		else
+			done(u, s, STATUS(ST_OK, 0, "Copying file", NULL));
+		return;
+	}
+}
+
+/* Queues the request `req' of `s', making room in the ring if needed.
+ * Files are named by their paths from the roots: a directory of cp->dirs
+ * may be closed before the kernel gets to the request.
+ */
+static void queue(struct ucopy* u, struct ucopy_slot* s, unsigned req)
+{
+	struct copier* cp = u->cp;
+	struct io_uring_sqe* sqe;
+
+	/* Can't happen with two requests per slot at most, but cheap */
+	while (!(sqe = uring_sqe(&u->ring)))
+		uring_enter(&u->ring, 0);
+	sqe->user_data = ((uint64_t)(s - u->slots) << REQ_BITS) | req;
+
+	switch (req) {
+	case REQ_STATX:
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = cp->srcfd;
+		sqe->addr = (uintptr_t)s->path;
+		sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_CTIME;
+		sqe->off = (uintptr_t)s->stx;
+		/* The size it gives is what gets copied: no cached one */
+		sqe->statx_flags = AT_STATX_SYNC_AS_STAT |
+				   ((cp->oflags & O_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0);
+		break;
+	case REQ_OPEN:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = cp->srcfd;
+		sqe->addr = (uintptr_t)s->path;
+		sqe->open_flags = O_RDONLY | O_NOCTTY | (cp->oflags & O_NOFOLLOW);
+		break;
+	case REQ_CREATE:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = cp->dstfd;
+		sqe->addr = (uintptr_t)s->path;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+		sqe->len = s->mode;
+		break;
+	case REQ_READ:
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = s->in;
+		sqe->addr = (uintptr_t)s->buf;
+		sqe->len = UCOPY_MAX + 1;
+		sqe->off = s->pos;
+		break;
+	case REQ_WRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = s->out;
+		sqe->addr = (uintptr_t)(s->buf + s->wrote);
+		sqe->len = s->len - s->wrote;
+		sqe->off = s->pos + s->wrote;
+		break;
+	case REQ_CLOSE_IN:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = s->in;
+		break;
+	case REQ_CLOSE_OUT:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = s->out;
+		break;
+	}
+}
+
+/* Gives `s' up to copy_entry(), before anything was written */
+static void fallback(struct ucopy* u, struct ucopy_slot* s)
+{
+	if (s->in >= 0)
+		close(s->in);
+	s->in = -1;
+	done(u, s, copy_entry(u->cp, s->key, s->f));
+}
+
+static void fail(struct ucopy* u, struct ucopy_slot* s, int code, int err, const char* msg)
+{
+	if (s->in >= 0)
+		close(s->in);
+	if (s->out >= 0)
+		close(s->out);
+	s->in = -1;
+	s->out = -1;
+	done(u, s, STATUS(code, err, msg, strdup(s->path)));
+}
+
+/* Frees the slot of a file that went through with `ret' */
+static void done(struct ucopy* u, struct ucopy_slot* s, status_t ret)
+{
+	s->key = NULL;
+	u->nbusy--;
+	if (ret.c == ST_OK) {
+		s->f->done = 1;
+		return;
+	}
+
+	/* Permission error, rather skip */
+	if (ret.sysc == EACCES) {
+		sterr(ret);
+		status_free(ret);
+		return;
+	}
+	if (u->ret.c == ST_OK && !u->failed)
+		u->ret = ret;
+	else
+		status_free(ret);
+}
+#endif
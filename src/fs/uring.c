@@ -0,0 +1,223 @@
+/* io_uring has no libc wrapper, syscall(2) needs _GNU_SOURCE */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "fs/uring.h"
+
+#ifdef __linux__
+/* What the copy needs the ring to do */
+static const unsigned char uring_ops[] = {
+	IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE,
+	IORING_OP_CLOSE
+};
+
+static int probe(int fd);
+#endif
+
+/* Sets up a ring with room for `entries' requests queued at once, and
+ * twice as many finished ones. Returns 0 on success, -1 with errno set
+ * otherwise.
+ */
+int uring_init(struct uring* r, unsigned entries)
+{
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP;
+
+	long fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -1;
+	r->fd = (int)fd;
+	if (probe(r->fd) == -1)
+		goto err_close;
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_size > r->sq_size)
+		r->sq_size = r->cq_size;
+	r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto err_close;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED)
+			goto err_unmap_sq;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	char* sq = r->sq_map;
+	r->sq_head = (unsigned*)(void*)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned*)(void*)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned*)(void*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)(void*)(sq + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	char* cq = r->cq_map;
+	r->cq_head = (unsigned*)(void*)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned*)(void*)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned*)(void*)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(void*)(cq + p.cq_off.cqes);
+	return 0;
+
+err_unmap_cq:
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_size);
+err_unmap_sq:
+	munmap(r->sq_map, r->sq_size);
+err_close:;
+	int err = errno;
+	close(r->fd);
+	r->fd = -1;
+	errno = err;
+	return -1;
+#else
+	(void)entries;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void uring_free(struct uring* r)
+{
+	if (r->fd < 0)
+		return;
+#ifdef __linux__
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_size);
+	munmap(r->sq_map, r->sq_size);
+#endif
+	close(r->fd);
+	r->fd = -1;
+}
+
+#ifdef __linux__
+/* A cleared request at the tail of the submission ring, NULL if it's
+ * full: uring_enter() makes room.
+ */
+struct io_uring_sqe* uring_sqe(struct uring* r)
+{
+	unsigned tail = *r->sq_tail;
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+		return NULL;
+
+	unsigned i = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+	return sqe;
+}
+#endif
+
+/* Hands the queued requests over, and waits for at least `wait' of them
+ * to finish. Returns 0 on success, -1 with errno set otherwise.
+ */
+int uring_enter(struct uring* r, unsigned wait)
+{
+#if defined(__linux__) && defined(__NR_io_uring_enter)
+	while (r->queued > 0 || wait > 0) {
+		long n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait,
+				 (wait) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Too many finished: they're there to read first */
+			if (errno == EBUSY)
+				return 0;
+			return -1;
+		}
+		r->queued -= (unsigned)n;
+		wait = 0;
+	}
+	return 0;
+#else
+	(void)r;
+	(void)wait;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* The oldest finished request not seen yet: its user_data and result,
+ * -errno on failure. Returns 0 if there's one, -1 otherwise.
+ */
+int uring_cqe(struct uring* r, uint64_t* data, int32_t* res)
+{
+#ifdef __linux__
+	unsigned head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return -1;
+
+	const struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+	return 0;
+#else
+	(void)r;
+	(void)data;
+	(void)res;
+	return -1;
+#endif
+}
+
+/* Lets the kernel reuse the entry uring_cqe() returned */
+void uring_seen(struct uring* r)
+{
+#ifdef __linux__
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+#else
+	(void)r;
+#endif
+}
+
+#ifdef __linux__
+/* Fails with ENOSYS unless the kernel knows every operation in uring_ops */
+static int probe(int fd)
+{
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* p = calloc(1, size);
+	if (!p)
+		return -1;
+
+	/* Before 5.6, there's no probing, and not enough operations anyway */
+	int ret = 0;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p, 256) < 0) {
+		ret = -1;
+		errno = ENOSYS;
+		goto out_free;
+	}
+	for (size_t i = 0; i < sizeof(uring_ops); ++i) {
+		unsigned op = uring_ops[i];
+		if (op > p->last_op || !(p->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			ret = -1;
+			errno = ENOSYS;
+			break;
+		}
+	}
+
+out_free:
+	free(p);
+	return ret;
+}
+#endif
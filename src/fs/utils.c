@@ -3,33 +3,49 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "fs.h"
+#include "stats.h"
 
 char* path_concat(const char* base, const char* name);
 
-/* stream_subdir will open the path, and then create a stream to it.
+/* open_subdir will open the path as a directory, and store its
+ * descriptor in *cfd.
  * If the path is relative, and fd is -1, the path is assumed to be
  * relative to the current working directory of the program,
  * if fd is larger than -1, the path is assumed to be relative to fd.
  * Otherwise, if the path is absolute, the path will be opened as is.
  */
-status_t stream_subdir(int fd, const char* path, int oflags, DIR** d)
+status_t open_subdir(int fd, const char* path, int oflags, int* cfd)
 {
 	if (!path)
 		return STATUS(ST_INT_ISNULL, 0, "Opening directory", NULL);
 
 	int dir_fd = (fd < 0) ? AT_FDCWD : fd; /* given fd */
-	int cfd = -2;  /* the current file descriptor */
 
-	/* openat() will set cfd to -1 if there's an error, we prefer values
-	 * below -1.
-	 */
-	cfd = openat(dir_fd, path, oflags);
+	/* openat() will set cfd to -1 if there's an error */
+	uint64_t t = STATS_START();
+	*cfd = openat(dir_fd, path, oflags | O_DIRECTORY);
+	STATS_TIME(STATS_OPEN, t);
 
-	if (cfd < 0)
+	if (*cfd < 0)
 		return STATUS(ST_ERR_OPEN, errno, "Opening directory", NULL);
 
+	return STATUS(ST_OK, 0, "Opening directory", NULL);
+}
+
+/* stream_subdir will open the path like open_subdir, and then create
+ * a stream to it.
+ */
+status_t stream_subdir(int fd, const char* path, int oflags, DIR** d)
+{
+	int cfd = -2;  /* the current file descriptor */
+
+	status_t ret = open_subdir(fd, path, oflags, &cfd);
+	if (ret.c != ST_OK)
+		return ret;
+
 	*d = fdopendir(cfd);
 	if (*d == NULL) {
 		int err = errno;
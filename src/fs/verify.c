@@ -0,0 +1,532 @@
+/* fgetxattr(2) and fsetxattr(2) are only declared with _GNU_SOURCE in musl */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+
+#include "hash.h"
+#include "intr.h"
+#include "stats.h"
+#include "status.h"
+#include "xxh3.h"
+#include "fs/dirfds.h"
+#include "fs/dirtree.h"
+#include "fs/fs_hash.h"
+#include "fs/verify.h"
+
+/* A thread of verify_tree(), and what it keeps to itself */
+struct verify_worker {
+	struct verifier* v;
+	unsigned char* buf;	/* VERIFY_BUFSZ bytes, lazily allocated */
+	struct verify_stats stats;
+	struct dirfds dirs;	/* directories open on both sides */
+};
+
+static int collect(const void* key, void* value, void* user_data);
+static int by_size(const void* a, const void* b);
+static void* verify_work(void* arg);
+static status_t verify_entry(struct verify_worker* w, const struct file* f);
+static status_t verify_dir(struct verify_worker* w, const struct file* f, const file_t* dst);
+static status_t verify_reg(struct verify_worker* w, const struct file* f,
+			   const file_t* srch, const file_t* dsth);
+static status_t verify_symlink(struct verify_worker* w, const struct file* f,
+			       const file_t* src, const file_t* dst);
+static status_t verify_links(struct verify_worker* w, const struct file* f);
+static void report(struct verify_worker* w, const char* what, const struct file* f);
+static int hash_fd(struct verify_worker* w, int fd, uint64_t* h);
+static int same_sum(const struct verify_sum* a, const struct verify_sum* b);
+static int get_sum(int fd, struct verify_sum* sum);
+static int put_sum(int fd, const struct verify_sum* sum);
+static void fill_sum(struct verify_sum* sum, const struct stat* sb);
+static void add_stats(struct verify_stats* to, const struct verify_stats* from);
+
+/* Opens both roots, read-only: a copy is never written to, but for its
+ * checksums with `xattr'. `nthreads' files are compared at once.
+ */
+status_t verifier_init(struct verifier* v, const struct dirtree* tree,
+		       const char* src, const char* dst, int oflags, unsigned nthreads,
+		       int xattr)
+{
+	if (!v || !tree || !src || !dst)
+		return STATUS(ST_INT_ISNULL, EINVAL, "Setting up verification", NULL);
+
+	memset(v, 0, sizeof(*v));
+	v->tree = tree;
+	v->oflags = oflags;
+	v->nthreads = (nthreads) ? nthreads : 1;
+	v->xattr = xattr;
+	v->srcfd = open(src, O_RDONLY | O_DIRECTORY | oflags);
+	if (v->srcfd < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening source", strdup(src));
+	v->dstfd = open(dst, O_RDONLY | O_DIRECTORY);
+	if (v->dstfd < 0) {
+		int err = errno;
+		close(v->srcfd);
+		return STATUS(ST_ERR_OPEN, err, "Opening destination", strdup(dst));
+	}
+	return STATUS(ST_OK, 0, "Setting up verification", NULL);
+}
+
+void verifier_free(struct verifier* v)
+{
+	if (!v)
+		return;
+
+	close(v->srcfd);
+	close(v->dstfd);
+	free(v->ents);
+	v->ents = NULL;
+}
+
+/* Compares every entry of `files' with its copy: regular files by the
+ * xxh3() of their contents, symbolic links by their targets, and the
+ * other names of a file by whether they're links to the same copy.
+ * Directories only have to be there. Entries only in the copy aren't
+ * looked for, and special files aren't copied, so they're left out.
+ *
+ * Files are shared out between the threads largest first, so that the
+ * last one to start isn't a large one. Each is hashed on one thread,
+ * from a buffer read sequentially: a mapping would fault, rather than
+ * fail, on a file that shrank meanwhile.
+ *
+ * With v->xattr, the checksum of a source file is kept on its copy,
+ * see struct verify_sum, and taken from there while the source looks
+ * unchanged: only the copy is read then.
+ *
+ * Differences are printed, and counted in v->stats: only what prevents
+ * comparing at all makes it fail.
+ */
+status_t verify_tree(struct verifier* v, struct hash_table* files)
+{
+	status_t ret;
+
+	v->ents = malloc(((files->count) ? files->count : 1) * sizeof(*v->ents));
+	if (!v->ents)
+		return STATUS_E(ST_ERR_MALLOC, "Listing files to verify", NULL);
+	v->n = 0;
+	hash_foreach(files, collect, v);
+	qsort(v->ents, v->n, sizeof(*v->ents), by_size);
+
+	unsigned nthreads = v->nthreads;
+	if (nthreads > v->n) nthreads = (v->n) ? (unsigned)v->n : 1;
+	struct verify_worker* workers = calloc(nthreads, sizeof(*workers));
+	pthread_t* tids = malloc(nthreads * sizeof(pthread_t));
+	if (!workers || !tids) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Starting verification", NULL);
+		goto out_free;
+	}
+	v->next = 0;
+	v->failed = 0;
+	v->ret = STATUS(ST_OK, 0, "Verifying tree", NULL);
+	pthread_mutex_init(&v->lock, NULL);
+
+	/* Whatever fails to start, the others still get through it */
+	for (unsigned i = 0; i < nthreads; ++i) {
+		workers[i].v = v;
+		dirfds_init(&workers[i].dirs, v->tree, v->srcfd, v->dstfd, v->oflags);
+		workers[i].dirs.nocreate = 1;
+		/* So that all of them open no more directories than one would */
+		dirfds_limit(&workers[i].dirs, DIRFDS_SIZE / nthreads);
+	}
+	unsigned started = 0;
+	while (started + 1 < nthreads &&
+	       pthread_create(&tids[started], NULL, verify_work, &workers[started + 1]) == 0)
+		started++;
+	verify_work(&workers[0]);
+	for (unsigned i = 0; i < started; ++i)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&v->lock);
+
+	for (unsigned i = 0; i < nthreads; ++i)
+		dirfds_flush(&workers[i].dirs);
+	for (unsigned i = 0; i <= started; ++i) {
+		add_stats(&v->stats, &workers[i].stats);
+		free(workers[i].buf);
+	}
+	ret = v->ret;
+
+out_free:
+	free(tids);
+	free(workers);
+	return ret;
+}
+
+static int collect(const void* key, void* value, void* user_data)
+{
+	struct verifier* v = user_data;
+	(void)key;
+
+	v->ents[v->n++] = value;
+	return 0;
+}
+
+static int by_size(const void* a, const void* b)
+{
+	const struct file* fa = *(const struct file* const*)a;
+	const struct file* fb = *(const struct file* const*)b;
+
+	return (fa->size < fb->size) - (fa->size > fb->size);
+}
+
+/* Takes entries until there's none left, something failed, or the run
+ * is being stopped. Permission errors only skip the entry.
+ */
+static void* verify_work(void* arg)
+{
+	struct verify_worker* w = arg;
+	struct verifier* v = w->v;
+
+	pthread_mutex_lock(&v->lock);
+	while (!v->failed && v->next < v->n && !terminate_wanted) {
+		const struct file* f = v->ents[v->next++];
+		pthread_mutex_unlock(&v->lock);
+
+		status_t ret = verify_entry(w, f);
+		if (ret.c != ST_OK && ret.sysc == EACCES) {
+			sterr(ret);
+			status_free(ret);
+			ret = STATUS(ST_OK, 0, "Verifying entry", NULL);
+		} else if (ret.c != ST_OK && ret.sysc == EINTR && terminate_wanted) {
+			status_free(ret);
+			ret = STATUS(ST_ERR_INTR, EINTR, "Verifying tree", NULL);
+		}
+
+		pthread_mutex_lock(&v->lock);
+		if (ret.c != ST_OK) {
+			if (!v->failed) {
+				v->failed = 1;
+				v->ret = ret;
+			} else {
+				status_free(ret);
+			}
+		}
+	}
+	/* Stopped before the end: what's left wasn't compared */
+	if (terminate_wanted && !v->failed) {
+		v->failed = 1;
+		v->ret = STATUS(ST_ERR_INTR, EINTR, "Verifying tree", NULL);
+	}
+	pthread_mutex_unlock(&v->lock);
+	return NULL;
+}
+
+/* Entries are reached by name in their directories, on both sides, never
+ * by path: one deeper than PATH_MAX is compared too, see fs/dirfds.h.
+ */
+static status_t verify_entry(struct verify_worker* w, const struct file* f)
+{
+	file_t src, dst;
+	status_t ret;
+
+	if (!S_ISDIR(f->mode) && !S_ISREG(f->mode) && !S_ISLNK(f->mode))
+		return STATUS(ST_OK, 0, "Skipping special file", NULL);
+
+	if (dirfds_at(&w->dirs, f, &src, &dst) == -1) {
+		if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP)
+			return STATUS_E(ST_ERR_OPEN, "Opening parent directory",
+					file_strdup(w->v->tree, f));
+		/* Gone since the traversal: nothing to compare with */
+		if (dirfds_at(&w->dirs, f, &src, NULL) == -1)
+			return (errno == ENOENT || errno == ENOTDIR) ?
+			       STATUS(ST_OK, 0, "Verifying entry", NULL) :
+			       STATUS_E(ST_ERR_OPEN, "Opening parent directory",
+					file_strdup(w->v->tree, f));
+		/* Or the directory of its copy is missing, or not one */
+		report(w, "Missing", f);
+		w->stats.nmissing++;
+		if (S_ISDIR(f->mode))
+			w->stats.ndirs++;
+		else if (S_ISLNK(f->mode))
+			w->stats.nsymlinks++;
+		return STATUS(ST_OK, 0, "Verifying entry", NULL);
+	}
+
+	if (S_ISDIR(f->mode))
+		ret = verify_dir(w, f, &dst);
+	else if (S_ISREG(f->mode))
+		ret = verify_reg(w, f, &src, &dst);
+	else
+		ret = verify_symlink(w, f, &src, &dst);
+
+	if (ret.c == ST_OK && f->links)
+		ret = verify_links(w, f);
+	return ret;
+}
+
+static status_t verify_dir(struct verify_worker* w, const struct file* f, const file_t* dst)
+{
+	struct stat sb;
+
+	if (fstatat(dst->pfd, dst->name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+		if (errno != ENOENT && errno != ENOTDIR)
+			return STATUS_E(ST_ERR_FILERD_MD, "Reading directory metadata",
+					file_strdup(w->v->tree, f));
+		report(w, "Missing", f);
+		w->stats.nmissing++;
+	} else if (!S_ISDIR(sb.st_mode)) {
+		report(w, "Differs", f);
+		w->stats.ndiffer++;
+	}
+	w->stats.ndirs++;
+	return STATUS(ST_OK, 0, "Verifying directory", NULL);
+}
+
+/* Files of different sizes differ: their contents are only hashed if
+ * they're the same size.
+ */
+static status_t verify_reg(struct verify_worker* w, const struct file* f,
+			   const file_t* srch, const file_t* dsth)
+{
+	struct verifier* v = w->v;
+	struct verify_sum src, dst, kept;
+	struct stat sb;
+	status_t ret;
+
+	int in = openat(srch->pfd, srch->name, O_RDONLY | O_NOCTTY | v->oflags);
+	if (in < 0) {
+		/* Gone since the traversal: nothing to compare with */
+		if (errno == ENOENT)
+			return STATUS(ST_OK, 0, "Verifying file", NULL);
+		return STATUS_E(ST_ERR_OPEN, "Opening source file", file_strdup(v->tree, f));
+	}
+	int out = openat(dsth->pfd, dsth->name, O_RDONLY | O_NOCTTY | O_NOFOLLOW);
+	if (out < 0) {
+		ret = STATUS(ST_OK, 0, "Verifying file", NULL);
+		if (errno == ENOENT || errno == ENOTDIR) {
+			report(w, "Missing", f);
+			w->stats.nmissing++;
+		} else if (errno == ELOOP) {
+			report(w, "Differs", f);
+			w->stats.ndiffer++;
+		} else {
+			ret = STATUS_E(ST_ERR_OPEN, "Opening copy", file_strdup(v->tree, f));
+		}
+		goto out_close_in;
+	}
+
+	if (fstat(in, &sb) == -1) {
+		ret = STATUS_E(ST_ERR_FILERD_MD, "Reading file metadata", file_strdup(v->tree, f));
+		goto out_close_out;
+	}
+	fill_sum(&src, &sb);
+	if (fstat(out, &sb) == -1) {
+		ret = STATUS_E(ST_ERR_FILERD_MD, "Reading copy metadata", file_strdup(v->tree, f));
+		goto out_close_out;
+	}
+	ret = STATUS(ST_OK, 0, "Verifying file", NULL);
+	w->stats.nfiles++;
+	if (!S_ISREG(sb.st_mode) || sb.st_size != src.size)
+		goto out_differ;
+
+	int reused = v->xattr && get_sum(out, &kept) == 0 && same_sum(&kept, &src);
+	if (reused) {
+		src.hash = kept.hash;
+		w->stats.nreused++;
+	} else if (hash_fd(w, in, &src.hash) == -1) {
+		ret = STATUS_E(ST_ERR_FILERD, "Reading file", file_strdup(v->tree, f));
+		goto out_close_out;
+	}
+	if (hash_fd(w, out, &dst.hash) == -1) {
+		ret = STATUS_E(ST_ERR_FILERD, "Reading copy", file_strdup(v->tree, f));
+		goto out_close_out;
+	}
+
+	/* Only kept if the source didn't change while it was read */
+	if (v->xattr && !reused && fstat(in, &sb) == 0) {
+		fill_sum(&kept, &sb);
+		kept.hash = src.hash;
+		if (same_sum(&kept, &src))
+			put_sum(out, &kept);
+	}
+	if (src.hash == dst.hash)
+		goto out_close_out;
+
+out_differ:
+	report(w, "Differs", f);
+	w->stats.ndiffer++;
+out_close_out:
+	close(out);
+out_close_in:
+	close(in);
+	return ret;
+}
+
+static status_t verify_symlink(struct verify_worker* w, const struct file* f,
+			       const file_t* src, const file_t* dst)
+{
+	char target[PATH_MAX], copy[PATH_MAX];
+
+	ssize_t len = readlinkat(src->pfd, src->name, target, sizeof(target));
+	if (len < 0) {
+		if (errno == ENOENT)
+			return STATUS(ST_OK, 0, "Verifying symbolic link", NULL);
+		return STATUS_E(ST_ERR_FILERD, "Reading symbolic link",
+				file_strdup(w->v->tree, f));
+	}
+	ssize_t clen = readlinkat(dst->pfd, dst->name, copy, sizeof(copy));
+	if (clen < 0 && errno != ENOENT && errno != ENOTDIR && errno != EINVAL)
+		return STATUS_E(ST_ERR_FILERD, "Reading symbolic link",
+				file_strdup(w->v->tree, f));
+
+	if (clen < 0 && errno != EINVAL) {
+		report(w, "Missing", f);
+		w->stats.nmissing++;
+	} else if (clen != len || memcmp(target, copy, (size_t)len) != 0) {
+		report(w, "Differs", f);
+		w->stats.ndiffer++;
+	}
+	w->stats.nsymlinks++;
+	return STATUS(ST_OK, 0, "Verifying symbolic link", NULL);
+}
+
+/* Every other name of `f' has to be the same file as its copy */
+static status_t verify_links(struct verify_worker* w, const struct file* f)
+{
+	struct stat sb, lsb;
+	file_t dst;
+
+	if (dirfds_at(&w->dirs, f, NULL, &dst) == -1 ||
+	    fstatat(dst.pfd, dst.name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+		/* Counted already */
+		if (errno == ENOENT || errno == ENOTDIR)
+			return STATUS(ST_OK, 0, "Verifying hard links", NULL);
+		return STATUS_E(ST_ERR_FILERD_MD, "Reading copy metadata",
+				file_strdup(w->v->tree, f));
+	}
+
+	for (const struct file* l = f->links; l; l = l->links) {
+		if (dirfds_at(&w->dirs, l, NULL, &dst) == -1 ||
+		    fstatat(dst.pfd, dst.name, &lsb, AT_SYMLINK_NOFOLLOW) == -1) {
+			if (errno != ENOENT && errno != ENOTDIR)
+				return STATUS_E(ST_ERR_FILERD_MD, "Reading copy metadata",
+						file_strdup(w->v->tree, l));
+			report(w, "Missing", l);
+			w->stats.nmissing++;
+		} else if (lsb.st_dev != sb.st_dev || lsb.st_ino != sb.st_ino) {
+			report(w, "Differs", l);
+			w->stats.ndiffer++;
+		}
+		w->stats.nlinks++;
+	}
+	return STATUS(ST_OK, 0, "Verifying hard links", NULL);
+}
+
+/* Prints what's wrong with the copy of `f', by its whole path */
+static void report(struct verify_worker* w, const char* what, const struct file* f)
+{
+	char* path = file_strdup(w->v->tree, f);
+	printf("%s: %s\n", what, (path) ? path : f->name);
+	free(path);
+}
+
+/* Hashes `fd' from its current offset to its end, into *h. Returns 0 on
+ * success, -1 with errno set otherwise, EINTR if the run is being
+ * stopped.
+ */
+static int hash_fd(struct verify_worker* w, int fd, uint64_t* h)
+{
+	struct xxh3 s;
+
+	if (!w->buf) {
+		void* p;
+		int err = posix_memalign(&p, VERIFY_ALIGN, VERIFY_BUFSZ);
+		if (err) {
+			errno = err;
+			return -1;
+		}
+		w->buf = p;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	xxh3_init(&s);
+	for (;;) {
+		if (terminate_wanted) {
+			errno = EINTR;
+			return -1;
+		}
+		uint64_t t = STATS_START();
+		ssize_t n = read(fd, w->buf, VERIFY_BUFSZ);
+		STATS_TIME(STATS_READ, t);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		STATS_ADD(STATS_BYTES_READ, n);
+		w->stats.nbytes += (uintmax_t)n;
+		xxh3_update(&s, w->buf, (size_t)n);
+	}
+	*h = xxh3_final(&s);
+	return 0;
+}
+
+/* Whether the file `a' was taken from still looks like `b' */
+static int same_sum(const struct verify_sum* a, const struct verify_sum* b)
+{
+	return a->size == b->size && a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+/* Reads the checksum kept on `fd'. Returns 0 if there's a valid one,
+ * -1 otherwise.
+ */
+static int get_sum(int fd, struct verify_sum* sum)
+{
+#ifdef __linux__
+	ssize_t n = fgetxattr(fd, VERIFY_XATTR, sum, sizeof(*sum));
+	return (n == (ssize_t)sizeof(*sum)) ? 0 : -1;
+#else
+	(void)fd;
+	(void)sum;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/* Keeps `sum' on `fd'. Failing only costs hashing the source next time,
+ * on filesystems without user attributes, say.
+ */
+static int put_sum(int fd, const struct verify_sum* sum)
+{
+#ifdef __linux__
+	return fsetxattr(fd, VERIFY_XATTR, sum, sizeof(*sum), 0);
+#else
+	(void)fd;
+	(void)sum;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+static void fill_sum(struct verify_sum* sum, const struct stat* sb)
+{
+	sum->hash = 0;
+	sum->size = (int64_t)sb->st_size;
+	sum->mtime = TS_NSEC(sb->st_mtim);
+	sum->ctime = TS_NSEC(sb->st_ctim);
+}
+
+static void add_stats(struct verify_stats* to, const struct verify_stats* from)
+{
+	to->nfiles += from->nfiles;
+	to->ndirs += from->ndirs;
+	to->nsymlinks += from->nsymlinks;
+	to->nlinks += from->nlinks;
+	to->nbytes += from->nbytes;
+	to->nreused += from->nreused;
+	to->ndiffer += from->ndiffer;
+	to->nmissing += from->nmissing;
+}
@@ -0,0 +1,259 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crypt.h"
+#include "fs/zpipe.h"
+#include "lz.h"
+#include "status.h"
+#include "xxh3.h"
+
+static void* work(void* arg);
+static int give_back(struct zpipe* z, int wait);
+static unsigned entropy(const unsigned char* buf, size_t len);
+static unsigned log2_fix(uint32_t n);
+
+/* Starts `nthreads' threads, for blocks of up to `blocksz' bytes, which
+ * are then handed to `out' with `arg'. With ZPIPE_LZ in `flags', they're
+ * compressed, and with ZPIPE_PROBE, blocks that look incompressible
+ * aren't even tried. With a `key', CRYPT_KEYLEN bytes that must outlive
+ * the pipe, they're encrypted.
+ */
+status_t zpipe_start(struct zpipe* z, unsigned nthreads, size_t blocksz, int flags,
+		     const unsigned char* key, zpipe_out_fn out, void* arg)
+{
+	unsigned i;
+
+	if (nthreads == 0) nthreads = 1;
+	memset(z, 0, sizeof(*z));
+	z->nslots = nthreads * ZPIPE_DEPTH;
+	z->blocksz = blocksz;
+	z->flags = flags;
+	z->key = key;
+	z->out = out;
+	z->arg = arg;
+
+	z->slots = calloc(z->nslots, sizeof(struct zslot));
+	z->tids = calloc(nthreads, sizeof(pthread_t));
+	if (!z->slots || !z->tids)
+		goto err_malloc;
+	for (i = 0; i < z->nslots; ++i) {
+		z->slots[i].in = malloc(blocksz);
+		z->slots[i].out = (flags & ZPIPE_LZ) ? malloc(blocksz) : NULL;
+		if (!z->slots[i].in || (flags & ZPIPE_LZ && !z->slots[i].out))
+			goto err_malloc;
+	}
+
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->work, NULL);
+	pthread_cond_init(&z->ready, NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		int err = pthread_create(&z->tids[i], NULL, work, z);
+		if (err) {
+			/* Carry on with the ones that started */
+			if (i > 0)
+				break;
+			z->nthreads = 0;
+			zpipe_stop(z);
+			return STATUS(ST_ERR_THREAD, err, "Starting block threads", NULL);
+		}
+	}
+	z->nthreads = i;
+	return STATUS(ST_OK, 0, "Starting block threads", NULL);
+
+err_malloc:
+	if (z->slots)
+		for (i = 0; i < z->nslots; ++i) {
+			free(z->slots[i].in);
+			free(z->slots[i].out);
+		}
+	free(z->slots);
+	free(z->tids);
+	memset(z, 0, sizeof(*z));
+	return STATUS_E(ST_ERR_MALLOC, "Starting block threads", NULL);
+}
+
+/* Hands over the block of `len' bytes in *buf, a buffer of blocksz bytes,
+ * and puts a free one in its place. Blocks compressed meanwhile are given
+ * to `out' first, waiting for the oldest one if every slot is taken.
+ *
+ * Returns 0 on success, -1 with errno set if `out' failed.
+ */
+int zpipe_put(struct zpipe* z, char** buf, size_t len)
+{
+	if (z->nin - z->nout == z->nslots && give_back(z, 1) == -1)
+		return -1;
+
+	struct zslot* s = &z->slots[z->nin % z->nslots];
+	char* free_buf = s->in;
+	s->in = *buf;
+	s->ulen = len;
+	s->seq = z->nin;
+	*buf = free_buf;
+
+	pthread_mutex_lock(&z->lock);
+	s->done = 0;
+	z->nin++;
+	pthread_cond_signal(&z->work);
+	pthread_mutex_unlock(&z->lock);
+
+	/* Whatever is ready already */
+	return give_back(z, 0);
+}
+
+/* Waits for every block handed over, and gives them to `out'. Returns 0
+ * on success, -1 with errno set if `out' failed.
+ */
+int zpipe_drain(struct zpipe* z)
+{
+	while (z->nout < z->nin)
+		if (give_back(z, 1) == -1)
+			return -1;
+	return 0;
+}
+
+/* Stops the threads, dropping blocks that weren't given back, and frees
+ * everything.
+ */
+void zpipe_stop(struct zpipe* z)
+{
+	pthread_mutex_lock(&z->lock);
+	z->closed = 1;
+	pthread_cond_broadcast(&z->work);
+	pthread_mutex_unlock(&z->lock);
+	for (unsigned i = 0; i < z->nthreads; ++i)
+		pthread_join(z->tids[i], NULL);
+
+	pthread_cond_destroy(&z->ready);
+	pthread_cond_destroy(&z->work);
+	pthread_mutex_destroy(&z->lock);
+	for (unsigned i = 0; i < z->nslots; ++i) {
+		free(z->slots[i].in);
+		free(z->slots[i].out);
+	}
+	free(z->slots);
+	free(z->tids);
+	memset(z, 0, sizeof(*z));
+}
+
+/* Block `seq''s nonce */
+void zpipe_nonce(uint64_t seq, unsigned char nonce[CRYPT_NONCELEN])
+{
+	memset(nonce, 0, 4);
+	for (unsigned i = 0; i < 8; ++i)
+		nonce[4 + i] = (unsigned char)(seq >> (8 * i));
+}
+
+static void* work(void* arg)
+{
+	struct zpipe* z = arg;
+
+	pthread_mutex_lock(&z->lock);
+	for (;;) {
+		while (z->nwork == z->nin && !z->closed)
+			pthread_cond_wait(&z->work, &z->lock);
+		if (z->closed)
+			break;
+		struct zslot* s = &z->slots[z->nwork++ % z->nslots];
+		pthread_mutex_unlock(&z->lock);
+
+		s->sum = xxh3(s->in, s->ulen);
+		s->clen = s->ulen;
+		if ((z->flags & ZPIPE_LZ) && (!(z->flags & ZPIPE_PROBE) ||
+		    entropy((const unsigned char*)s->in, s->ulen) <= ZPIPE_ENTROPY_MAX)) {
+			/* Only kept if smaller */
+			size_t clen = lz_compress(s->in, s->ulen, s->out, s->ulen - 1);
+			if (clen)
+				s->clen = clen;
+		}
+		if (z->key) {
+			unsigned char nonce[CRYPT_NONCELEN];
+			uint32_t ad[2] = { (uint32_t)s->ulen, (uint32_t)s->clen };
+			zpipe_nonce(s->seq, nonce);
+			crypt_seal(z->key, nonce, (s->clen < s->ulen) ? s->out : s->in,
+				   s->clen, ad, sizeof(ad), s->tag);
+		}
+
+		pthread_mutex_lock(&z->lock);
+		s->done = 1;
+		pthread_cond_broadcast(&z->ready);
+	}
+	pthread_mutex_unlock(&z->lock);
+	return NULL;
+}
+
+/* Gives the blocks that are done to `out', oldest first, up to the first
+ * one that isn't. With `wait', waits for the oldest one first.
+ */
+static int give_back(struct zpipe* z, int wait)
+{
+	while (z->nout < z->nin) {
+		struct zslot* s = &z->slots[z->nout % z->nslots];
+
+		pthread_mutex_lock(&z->lock);
+		while (wait && !s->done)
+			pthread_cond_wait(&z->ready, &z->lock);
+		int done = s->done;
+		pthread_mutex_unlock(&z->lock);
+		if (!done)
+			return 0;
+
+		struct zblock b = { .ulen = s->ulen, .clen = s->clen, .sum = s->sum };
+		b.data = (s->clen < s->ulen) ? s->out : s->in;
+		b.tag = (z->key) ? s->tag : NULL;
+		if (z->out(z->arg, &b) == -1)
+			return -1;
+		z->nout++;
+		wait = 0;
+	}
+	return 0;
+}
+
+/* Shannon entropy of a sample of `buf', in 1/256 bits per byte: a few
+ * runs spread over the block, so text keeps its structure.
+ */
+static unsigned entropy(const unsigned char* buf, size_t len)
+{
+	enum { RUNS = 16, RUN = 256 };
+	uint32_t count[256] = { 0 };
+	uint32_t n = 0;
+
+	if (len <= RUNS * RUN) {
+		for (size_t i = 0; i < len; ++i)
+			count[buf[i]]++;
+		n = (uint32_t)len;
+	} else {
+		size_t step = len / RUNS;
+		for (size_t r = 0; r < RUNS; ++r)
+			for (size_t i = 0; i < RUN; ++i)
+				count[buf[r * step + i]]++;
+		n = RUNS * RUN;
+	}
+	if (n == 0)
+		return 0;
+
+	/* log2(n) - sum(c * log2(c)) / n */
+	uint64_t sum = 0;
+	for (unsigned i = 0; i < 256; ++i)
+		if (count[i])
+			sum += (uint64_t)count[i] * log2_fix(count[i]);
+	return log2_fix(n) - (unsigned)(sum / n);
+}
+
+/* log2(n) in 1/256ths, for n > 0, interpolated linearly between powers
+ * of two: off by less than 0.09.
+ */
+static unsigned log2_fix(uint32_t n)
+{
+	unsigned b = 0;
+	while (n >> (b + 1))
+		b++;
+	/* The mantissa, in 1/256ths above 1 */
+	unsigned frac = (unsigned)(((uint64_t)n << 8) >> b) - 256;
+	return b * 256 + frac;
+}
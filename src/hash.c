@@ -4,41 +4,121 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "hash.h"
+#include "stats.h"
 
-#ifndef LOAD_FACTOR
-#define LOAD_FACTOR 0.5
+/* An open-addressing table in the style of Abseil's Swiss tables.
+ *
+ * Every slot has a control byte next to it, in a separate array: either
+ * CTRL_EMPTY, CTRL_DELETED, or the 7 low bits of the key's hash (h2) when
+ * the slot is full. A lookup starts at the slot picked by the remaining
+ * hash bits (h1), and compares a whole group of control bytes against h2
+ * at once, so keys are only compared on slots that are almost certainly
+ * a hit. The first group with an empty slot ends the search.
+ *
+ * Slots carry the first HASH_INLINE bytes of their key. Keys that fit,
+ * like struct kfile, are compared and rehashed from the slot alone, so a
+ * probe never touches the memory the key was allocated in. Longer keys
+ * are only handed to cmp_fn when their first bytes match.
+ *
+ * The control array is HASH_GROUP bytes longer than the table, and those
+ * bytes mirror the first group, so a group can be loaded at any position
+ * without wrapping around.
+ *
+ * Growing is incremental: the new slot array (`cur') is allocated next to
+ * the old one, and every insert, lookup and removal moves a bounded number
+ * of old slots over, until the old array is drained and freed. Lookups
+ * check both arrays in the meantime. No single call ever pays for moving
+ * the whole table. Lookups do write to the table then, so they can't run
+ * concurrently with anything, not even other lookups, unless no resize is
+ * pending: see hash_rehash(), which finishes one.
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HASH_GROUP 32
+typedef uint32_t gmask_t;
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define HASH_GROUP 16
+typedef uint32_t gmask_t;
+#else
+#define HASH_GROUP 8
+typedef uint64_t gmask_t;
 #endif
 
-static int chkprime(size_t n);
-static size_t findprime(size_t n, int nth);
+#define CTRL_EMPTY   ((int8_t)-128)	/* 0b10000000 */
+#define CTRL_DELETED ((int8_t)-2)	/* 0b11111110 */
 
-/* Creates a hash_table struct of size `size` and initializes its state.
- * hash_fn and cmp_fn are user-provided functions for hashing and comparing
- * keys, respectively.
+/* Most full and deleted slots an array of `n' slots holds: 7/8 */
+#define MAX_LOAD(n) ((n) - (n) / 8)
+
+/* Old slots moved over by every operation while growing. While an array
+ * of S slots drains, the new one (of at least 2S) takes at most S/64 new
+ * entries, well within its load factor.
+ */
+#ifndef HASH_MIGRATE
+#define HASH_MIGRATE 64
+#endif
+
+/* Slot counts the table goes through. Small tables grow fourfold, so
+ * they go through fewer resizes; past a million slots, doubling keeps
+ * the memory overhead in check. Beyond the end of the table, sizes
+ * keep doubling.
+ */
+static const size_t growth[] = {
+	64, 256, 1024, 4096, 16384, 65536, 262144, 1048576,
+	2097152, 4194304, 8388608, 16777216, 33554432, 67108864,
+	134217728, 268435456, 536870912, 1073741824, 2147483648U,
+};
+#define NGROWTH (sizeof(growth) / sizeof(growth[0]))
+
+static gmask_t match_h2(const int8_t* g, int8_t h2);
+static gmask_t match_empty(const int8_t* g);
+static gmask_t match_free(const int8_t* g);
+static unsigned next_bit(gmask_t* m);
+static size_t arr_find(const struct hash_table* ht, const struct hash_arr* a,
+		       const void* key, const uint64_t* k, uint64_t h);
+static void key_inline(const struct hash_table* ht, const void* key, uint64_t* k);
+static size_t arr_free_slot(const struct hash_arr* a, uint64_t h);
+static void arr_set(struct hash_arr* a, size_t i, int8_t c);
+static int arr_alloc(struct hash_arr* a, size_t size);
+static void arr_free(struct hash_arr* a);
+static void migrate(struct hash_table* ht, size_t n);
+static int start_resize(struct hash_table* ht, size_t size);
+static size_t round_size(size_t n);
+
+/* Creates a hash_table struct with room for about `size' entries and
+ * initializes its state. Keys are `klen' bytes long; hash_fn and cmp_fn
+ * are user-provided functions for hashing and comparing keys, respectively.
+ * Keys of up to HASH_INLINE bytes are compared bytewise instead, and hashed
+ * from a copy, so they must have no padding.
  *
- * If `size` is 0, the behavior is implementation-defined by your libc.
- * The caller should not assume valid behavior from
- * the returned pointer in that case.
+ * The slot count is rounded up to a power of two, and is at least one
+ * group of control bytes.
  *
  * On success, a pointer to the allocated hash table is returned; on failure,
  * NULL is returned. The caller should ensure to not access the hash table
  * or its members if NULL is returned.
  */
-struct hash_table* hash_create(size_t size, uint64_t (*hash_fn)(const void* key),
+struct hash_table* hash_create(size_t size, size_t klen,
+			       uint64_t (*hash_fn)(const void* key),
 			       int (*cmp_fn)(const void* a, const void* b))
 {
 	struct hash_table* ht = malloc(sizeof(struct hash_table));
 	if (!ht)
 		goto err_return;
 
-	ht->buckets = calloc(size, sizeof(struct hash_entry*));
-	if (!ht->buckets)
+	if (arr_alloc(&ht->cur, round_size(size)) == -1)
 		goto err_free_ht;
 
-	ht->size = size;
+	memset(&ht->old, 0, sizeof(ht->old));
+	ht->migrated = 0;
 	ht->count = 0;
+	ht->ncur = 0;
+	ht->klen = klen;
 	ht->hash_fn = hash_fn;
 	ht->cmp_fn = cmp_fn;
 
@@ -50,6 +130,8 @@ err_return:
 }
 
 /* Look for the key given, if found, return the value that's associated.
+ * Moves a few slots along if the table is growing, so it writes to the
+ * table then, see the top of this file.
  *
  * `ht' cannot be NULL. On NULL, the assertion will fail, causing the
  * program to terminate. Key can be NULL: in such cases, hash_lookup
@@ -57,7 +139,7 @@ err_return:
  */
 void* hash_lookup(struct hash_table* restrict ht, const void* key)
 {
-	struct hash_entry* tp;
+	size_t i;
 
 	/* Must have a valid hash table */
 	assert(ht);
@@ -66,13 +148,21 @@ void* hash_lookup(struct hash_table* restrict ht, const void* key)
 		/* Return NULL on NULL */
 		return NULL;
 
-	for (tp = ht->buckets[ht->hash_fn(key) % ht->size]; tp != NULL; tp = tp->next)
-		if (ht->cmp_fn(tp->key, key))
-			return tp->value; /* Found the entry */
-	return NULL;		   /* Couldn't find the entry */
+	if (ht->old.size)
+		migrate(ht, HASH_MIGRATE);
+
+	uint64_t k[HASH_INLINE / 8];
+	key_inline(ht, key, k);
+	uint64_t h = ht->hash_fn(key);
+	if ((i = arr_find(ht, &ht->cur, key, k, h)) != SIZE_MAX)
+		return ht->cur.slots[i].value; /* Found the entry */
+	if (ht->old.size && (i = arr_find(ht, &ht->old, key, k, h)) != SIZE_MAX)
+		return ht->old.slots[i].value;
+	return NULL;			/* Couldn't find the entry */
 }
 
-/* Insert the taken key and value into the hash table.
+/* Insert the taken key and value into the hash table. Grows the table
+ * on its own when it gets too full, incrementally, like hash_upsize().
  *
  * Never takes ownership. Use hash_foreach later to free
  * each key and value seperately. If cannot allocate memory,
@@ -80,43 +170,68 @@ void* hash_lookup(struct hash_table* restrict ht, const void* key)
  */
 int hash_insert(struct hash_table* ht, const void* key, void* value)
 {
-	struct hash_entry* tp;
-	uint64_t h;
-
-	if ((tp = hash_lookup(ht, key)) == NULL) {
-		tp = malloc(sizeof(struct hash_entry));
-		if (!tp) {
+	if (hash_lookup(ht, key))
+		return 1; 	/* Already here */
+
+	if (ht->ncur + ht->cur.deleted >= MAX_LOAD(ht->cur.size)) {
+		/* Mostly tombstones: moving leaves them behind, otherwise grow */
+		size_t size = (ht->count >= MAX_LOAD(ht->cur.size) / 2) ?
+			hash_chksize(ht) : ht->cur.size;
+		if (size == SIZE_MAX) {
+			errno = ENOMEM;
+			return -1; /* Couldn't acquire memory */
+		}
+		uint64_t t = STATS_START();
+		/* Can't be draining still, see HASH_MIGRATE, but cheap */
+		if (ht->old.size)
+			migrate(ht, SIZE_MAX);
+		int r = start_resize(ht, size);
+		STATS_TIME(STATS_RESIZE, t);
+		if (r == -1) {
 			errno = ENOMEM;
 			return -1; /* Couldn't acquire memory */
 		}
-		h = ht->hash_fn(key) % ht->size;
-		tp->key = key;
-		tp->value = value;
-		tp->next = ht->buckets[h];
-		ht->buckets[h] = tp;
-		ht->count++;
-		return 0; 	/* Done */
 	}
 
-	return 1; 		/* Already here */
+	uint64_t h = ht->hash_fn(key);
+	size_t i = arr_free_slot(&ht->cur, h);
+	if (ht->cur.ctrl[i] == CTRL_DELETED)
+		ht->cur.deleted--;
+	arr_set(&ht->cur, i, (int8_t)(h & 0x7f));
+	key_inline(ht, key, ht->cur.slots[i].k);
+	ht->cur.slots[i].key = key;
+	ht->cur.slots[i].value = value;
+	ht->count++;
+	ht->ncur++;
+	return 0; 		/* Done */
 }
 
+/* Leaves a tombstone behind, so probe sequences that went through the
+ * slot still find what's after it. Tombstones are dropped on resize.
+ */
 int hash_remove(struct hash_table* ht, const void* key)
 {
-	uint64_t h = ht->hash_fn(key) % ht->size;
-	struct hash_entry* prev = NULL;
-        struct hash_entry *tp = ht->buckets[h];
-
-        while (tp) {
-		if (ht->cmp_fn(tp->key, key)) {
-			if (prev) prev->next = tp->next;
-			else ht->buckets[h] = tp->next;
-			free(tp);
-			return 0; /* found */
-		}
-		prev = tp;
-		tp = tp->next;
-        }
+	size_t i;
+
+	if (ht->old.size)
+		migrate(ht, HASH_MIGRATE);
+
+	uint64_t k[HASH_INLINE / 8];
+	key_inline(ht, key, k);
+	uint64_t h = ht->hash_fn(key);
+	if ((i = arr_find(ht, &ht->cur, key, k, h)) != SIZE_MAX) {
+		arr_set(&ht->cur, i, CTRL_DELETED);
+		ht->cur.deleted++;
+		ht->ncur--;
+		ht->count--;
+		return 0; 	/* found */
+	}
+	if (ht->old.size && (i = arr_find(ht, &ht->old, key, k, h)) != SIZE_MAX) {
+		arr_set(&ht->old, i, CTRL_DELETED);
+		ht->old.deleted++;
+		ht->count--;
+		return 0;
+	}
 	return 1; 		/* not found */
 }
 
@@ -129,14 +244,16 @@ size_t hash_foreach(const struct hash_table* ht,
 		return 0;
 
 	size_t seen = 0;
-	size_t size = ht->size;
-	for (size_t i = 0; i < size; ++i) {
-		struct hash_entry* tp = ht->buckets[i];
-		while(tp) {
-			if (func(tp->key, tp->value, user_data))
+	const struct hash_arr* arrs[2] = { &ht->cur, &ht->old };
+	for (int a = 0; a < 2; ++a) {
+		const struct hash_arr* arr = arrs[a];
+		for (size_t i = 0; i < arr->size; ++i) {
+			/* Full slots have the sign bit clear */
+			if (arr->ctrl[i] < 0)
+				continue;
+			if (func(arr->slots[i].key, arr->slots[i].value, user_data))
 				/* early exit */
 				return seen;
-			tp = tp->next;
 			seen++;
 		}
 	}
@@ -144,11 +261,11 @@ size_t hash_foreach(const struct hash_table* ht,
 	return seen;
 }
 
-/* Recursively free each hash_entry in the given hash_table struct.
+/* Frees the given hash_table struct, and its slots.
  *
  * Technical notes:
  * This function will free the given pointer, `ht', too.
- * This function does not free the elements of hash_entry, namely, `key' and `value'.
+ * This function does not free the keys and values.
  * Free them yourself using the hash_foreach function.
  */
 void hash_destroy(struct hash_table* ht)
@@ -157,140 +274,330 @@ void hash_destroy(struct hash_table* ht)
 	if (!ht)
 		return;
 
-	size_t size = ht->size;
-
-	for (size_t i = 0; i < size; ++i) {
-		struct hash_entry* tp = ht->buckets[i]; /* going through the linked list*/
-		while (tp) {
-			/* copy the next pointer before freeing */
-			struct hash_entry* next = tp->next;
-			free(tp);
-			tp = next;
-		}
-	}
-
-	free(ht->buckets);
+	arr_free(&ht->cur);
+	arr_free(&ht->old);
 	free(ht);
 }
 
-/* Create a new table of size `new_size', and then rehash all entries.
- * It is assumed that your hash is sized by primes. This function will
- * use the next 10th prime as `new_size'.
+/* Starts growing the table if it's over its load factor. Entries are then
+ * moved over a few at a time by later calls, see the top of this file.
  *
  * If resizing fails, or is not needed, the old pointer will be returned.
  * Set errno to 0 before this function to check for errors.
  */
 struct hash_table* hash_upsize(struct hash_table* restrict ht)
 {
-	size_t new_size = hash_chksize(ht, 10);
-	if (new_size <= ht->size)
+	size_t new_size = hash_chksize(ht);
+	if (new_size <= ht->cur.size)
 		return ht;
 
-	if (new_size == SIZE_MAX)
+	if (new_size == SIZE_MAX) {
+		errno = EOVERFLOW;
 		return ht;
+	}
 
-	struct hash_table* nht = hash_rehash(ht, new_size);
-	if (!nht)
-		return ht;
+	/* Still draining the previous resize: finish it first */
+	uint64_t t = STATS_START();
+	if (ht->old.size)
+		migrate(ht, SIZE_MAX);
 
-	return nht;
+	if (start_resize(ht, new_size) == -1)
+		errno = ENOMEM;
+	STATS_TIME(STATS_RESIZE, t);
+	return ht;
 }
 
-/* Rehashes all entries into a new hash_table of `new_size'.
- * Existing entries are moved, not copied.
- * Safe for both growth and shrink, but shrink will increase collisions.
+/* Rehashes all entries into `new_size' slots, rounded up to a power of
+ * two and to what the entries need, all at once. Existing entries are
+ * moved, not copied, and tombstones are dropped.
  *
- * NOTE: Will free the old table and its buckets array, and return the new table.
+ * The table is resized in place, and returned. On allocation failure,
+ * NULL is returned and the table is left as it was.
  * Does not duplicate or free individual entries.
- * Use only for reallocation, not for copying or merging tables.
  */
 struct hash_table* hash_rehash(struct hash_table* ht, size_t new_size)
 {
-	struct hash_table* nht;
-	uint64_t h;
-
 	if (!ht || new_size == 0)
 		return NULL;
 
-	nht = hash_create(new_size, ht->hash_fn, ht->cmp_fn);
-	/* Couldn't allocate */
-	if (!nht)
+	/* Every entry needs room, within the load factor */
+	while (MAX_LOAD(round_size(new_size)) <= ht->count)
+		new_size *= 2;
+
+	uint64_t t = STATS_START();
+	if (ht->old.size)
+		migrate(ht, SIZE_MAX);
+	if (start_resize(ht, new_size) == -1)
 		return NULL;
+	/* Resizing done */
+	migrate(ht, SIZE_MAX);
+	STATS_TIME(STATS_RESIZE, t);
+	return ht;
+}
 
-	nht->count = ht->count;
-	nht->hash_fn = ht->hash_fn;
-	nht->cmp_fn = ht->cmp_fn;
-
-	for (size_t i = 0; i < ht->size; ++i) {
-		struct hash_entry* tp = ht->buckets[i];
-		while (tp) {
-			struct hash_entry* next = tp->next;
-			h = nht->hash_fn(tp->key) % nht->size;
-			tp->next = nht->buckets[h];
-			nht->buckets[h] = tp;
-			tp = next;
-		}
+/* Returns the size the table should grow to, or 0 if it's fine as is.
+ * SIZE_MAX is returned when growing would overflow.
+ */
+size_t hash_chksize(const struct hash_table* restrict ht)
+{
+	size_t size = ht->cur.size;
+
+	if (ht->ncur + ht->cur.deleted + 1 < MAX_LOAD(size))
+		return 0;
+
+	for (size_t i = 0; i < NGROWTH; ++i)
+		if (growth[i] > size)
+			return growth[i];
+
+	if (size > SIZE_MAX / 2 / sizeof(struct hash_slot))
+		/* next overflowed */
+		return SIZE_MAX;
+
+	return size * 2;
+}
+
+/* Allocates the new slot array, and makes the current one the old one. */
+static int start_resize(struct hash_table* ht, size_t size)
+{
+	struct hash_arr arr;
+
+	if (arr_alloc(&arr, round_size(size)) == -1)
+		return -1;
+
+	ht->old = ht->cur;
+	ht->cur = arr;
+	ht->migrated = 0;
+	ht->ncur = 0;
+	return 0;
+}
+
+/* Moves up to `n' slots of the old array into the current one, and frees
+ * the old array once it's drained.
+ */
+static void migrate(struct hash_table* ht, size_t n)
+{
+	struct hash_arr* old = &ht->old;
+	size_t end = (n > old->size - ht->migrated) ? old->size : ht->migrated + n;
+
+	for (size_t i = ht->migrated; i < end; ++i) {
+		if (old->ctrl[i] < 0)
+			continue;
+		const struct hash_slot* s = &old->slots[i];
+		size_t j = arr_free_slot(&ht->cur,
+					 ht->hash_fn((ht->klen <= HASH_INLINE) ? (const void*)s->k
+										: s->key));
+		arr_set(&ht->cur, j, old->ctrl[i]);
+		ht->cur.slots[j] = old->slots[i];
+		ht->ncur++;
+		/* Not there anymore, but lookups must still probe past it */
+		arr_set(old, i, CTRL_DELETED);
+	}
+	ht->migrated = end;
+
+	if (ht->migrated == old->size) {
+		arr_free(old);
+		ht->migrated = 0;
 	}
-	/* Resizing done */
-	free(ht->buckets);
-	free(ht);
-	return nht;
 }
 
-size_t hash_chksize(const struct hash_table* restrict ht, int n)
+/* Copies the start of `key' into `k', see HASH_INLINE */
+static void key_inline(const struct hash_table* ht, const void* key, uint64_t* k)
+{
+	size_t n = (ht->klen < HASH_INLINE) ? ht->klen : HASH_INLINE;
+	memset(k, 0, HASH_INLINE);
+	memcpy(k, key, n);
+}
+
+/* Index of `key' in the array, SIZE_MAX if it isn't there. `k' holds its
+ * first bytes, as key_inline() put them.
+ */
+static size_t arr_find(const struct hash_table* ht, const struct hash_arr* a,
+		       const void* key, const uint64_t* k, uint64_t h)
 {
-	if (((double)ht->count / (double)ht->size) >= LOAD_FACTOR) {
-		size_t next = findprime(ht->size * 2, n);
-		if (next == 0)
-			/* next overflowed */
+	int8_t h2 = (int8_t)(h & 0x7f);
+	size_t mask = a->size - 1;
+	size_t pos = (size_t)(h >> 7) & mask;
+
+	for (size_t stride = HASH_GROUP;; stride += HASH_GROUP) {
+		const int8_t* g = a->ctrl + pos;
+		gmask_t m = match_h2(g, h2);
+		while (m) {
+			size_t i = (pos + next_bit(&m)) & mask;
+			const struct hash_slot* s = &a->slots[i];
+			if (s->k[0] != k[0] || s->k[1] != k[1])
+				continue;
+			if (ht->klen <= HASH_INLINE || ht->cmp_fn(s->key, key))
+				return i;
+		}
+		if (match_empty(g))
 			return SIZE_MAX;
+		pos = (pos + stride) & mask;
+	}
+}
 
-		return next;
+/* First empty or deleted slot in the probe sequence of `h'. The array
+ * always has a free slot, thanks to the load factor.
+ */
+static size_t arr_free_slot(const struct hash_arr* a, uint64_t h)
+{
+	size_t mask = a->size - 1;
+	size_t pos = (size_t)(h >> 7) & mask;
+
+	for (size_t stride = HASH_GROUP;; stride += HASH_GROUP) {
+		gmask_t m = match_free(a->ctrl + pos);
+		if (m)
+			return (pos + next_bit(&m)) & mask;
+		pos = (pos + stride) & mask;
 	}
+}
+
+/* Sets a control byte, and its mirror past the end of the array */
+static void arr_set(struct hash_arr* a, size_t i, int8_t c)
+{
+	a->ctrl[i] = c;
+	if (i < HASH_GROUP)
+		a->ctrl[a->size + i] = c;
+}
+
+/* Allocates `size' empty slots. Leaves `a' alone on failure,
+ * and returns -1.
+ */
+static int arr_alloc(struct hash_arr* a, size_t size)
+{
+	int8_t* ctrl = malloc(size + HASH_GROUP);
+	if (!ctrl)
+		return -1;
+
+	struct hash_slot* slots = malloc(size * sizeof(struct hash_slot));
+	if (!slots) {
+		free(ctrl);
+		return -1;
+	}
+
+	memset(ctrl, CTRL_EMPTY, size + HASH_GROUP);
+	a->ctrl = ctrl;
+	a->slots = slots;
+	a->size = size;
+	a->deleted = 0;
 	return 0;
 }
 
-int chkprime(size_t n)
+static void arr_free(struct hash_arr* a)
 {
-	/* Found this online */
-	/* is n 1 or 0 */
-	if (n <= 1)
-		return 0;
-	/* is 2 or 3 */
-	if (n == 2 || n == 3)
-		return 1;
-	/* is it divisible by 2 or 3 */
-	if (n % 3 == 0 || n % 2 == 0)
-		return 0;
-	/* Check from 5 to square root of n */
-	/* Iterate i by (i+6) */
-	for (size_t i = 5; i*i<=n; i = i + 6)
-		if (n % i == 0 || n % (i + 2) == 0)
-			return 0;
-	/* return true */
-	return 1;
+	free(a->ctrl);
+	free(a->slots);
+	memset(a, 0, sizeof(*a));
 }
 
-size_t findprime(size_t n, int nth)
+/* Next power of two, and at least one group */
+static size_t round_size(size_t n)
 {
-	/* Base case */
-	if (n <= 1)
-		return 2;
+	size_t size = HASH_GROUP;
+	while (size < n && size <= SIZE_MAX / 2)
+		size *= 2;
+	return size;
+}
 
-	size_t cn = n;
-	int i = 0;
+/* Index of the lowest set bit of the mask, which is then cleared */
+static unsigned next_bit(gmask_t* m)
+{
+	unsigned i;
+#ifdef __GNUC__
+	i = (sizeof(gmask_t) == 8) ? (unsigned)__builtin_ctzll((unsigned long long)*m)
+				   : (unsigned)__builtin_ctz((unsigned)*m);
+#else
+	gmask_t t = *m;
+	for (i = 0; !(t & 1); ++i)
+		t >>= 1;
+#endif
+	*m &= *m - 1;
+#if HASH_GROUP == 8
+	/* One bit per byte, at the top of each */
+	i /= 8;
+#endif
+	return i;
+}
 
-	/* Until chkprime returns true */
-	while (cn < SIZE_MAX) {
-		cn++;
+#if defined(__AVX2__)
 
-		if (chkprime(cn))
-			i++;
+static gmask_t match_h2(const int8_t* g, int8_t h2)
+{
+	__m256i ctrl = _mm256_loadu_si256((const __m256i*)(const void*)g);
+	return (gmask_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl));
+}
 
-		if (i == nth)
-			return cn;
-	}
+static gmask_t match_empty(const int8_t* g)
+{
+	__m256i ctrl = _mm256_loadu_si256((const __m256i*)(const void*)g);
+	return (gmask_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(CTRL_EMPTY), ctrl));
+}
 
-	errno = EOVERFLOW;
-	return 0;
+/* Empty and deleted are the only negative control bytes */
+static gmask_t match_free(const int8_t* g)
+{
+	__m256i ctrl = _mm256_loadu_si256((const __m256i*)(const void*)g);
+	return (gmask_t)_mm256_movemask_epi8(ctrl);
 }
+
+#elif defined(__SSE2__)
+
+static gmask_t match_h2(const int8_t* g, int8_t h2)
+{
+	__m128i ctrl = _mm_loadu_si128((const __m128i*)(const void*)g);
+	return (gmask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl));
+}
+
+static gmask_t match_empty(const int8_t* g)
+{
+	__m128i ctrl = _mm_loadu_si128((const __m128i*)(const void*)g);
+	return (gmask_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(CTRL_EMPTY), ctrl));
+}
+
+/* Empty and deleted are the only negative control bytes */
+static gmask_t match_free(const int8_t* g)
+{
+	__m128i ctrl = _mm_loadu_si128((const __m128i*)(const void*)g);
+	return (gmask_t)_mm_movemask_epi8(ctrl);
+}
+
+#else
+
+/* Portable fallback: 8 control bytes in a word, bit 7 of each byte
+ * of the result set when the byte matches.
+ */
+#define LSBS 0x0101010101010101ULL
+#define MSBS 0x8080808080808080ULL
+
+static uint64_t load_group(const int8_t* g)
+{
+	uint64_t w;
+	memcpy(&w, g, sizeof(w));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	/* next_bit() counts from the first byte */
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+/* May report false positives next to a real match: arr_find() compares
+ * the inline key anyway, and sorts them out
+ */
+static gmask_t match_h2(const int8_t* g, int8_t h2)
+{
+	uint64_t x = load_group(g) ^ (LSBS * (uint8_t)h2);
+	return (x - LSBS) & ~x & MSBS;
+}
+
+/* Bit 7 set, bit 1 clear: only empty */
+static gmask_t match_empty(const int8_t* g)
+{
+	uint64_t w = load_group(g);
+	return w & ~(w << 6) & MSBS;
+}
+
+static gmask_t match_free(const int8_t* g)
+{
+	return load_group(g) & MSBS;
+}
+
+#endif
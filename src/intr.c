@@ -0,0 +1,33 @@
+#define _XOPEN_SOURCE 700	/* SA_RESTART, SA_RESETHAND */
+
+#include <signal.h>
+#include <string.h>
+
+#include "intr.h"
+
+volatile sig_atomic_t terminate_wanted;
+
+static void on_terminate(int sig)
+{
+	(void)sig;
+	terminate_wanted = 1;
+}
+
+/* Asks SIGINT and SIGTERM to set terminate_wanted, so the entry being
+ * copied is finished before stopping. System calls carry on where they
+ * were. The same signal a second time isn't caught, and kills right away.
+ *
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int intr_catch(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_terminate;
+	sa.sa_flags = SA_RESTART | SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1)
+		return -1;
+	return 0;
+}
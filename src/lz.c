@@ -0,0 +1,208 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* A byte-oriented LZ77, in the spirit of LZ4: fast rather than tight.
+ * The input is a series of sequences, each made of
+ *
+ *	token		literal count in the high nibble, match length
+ *			minus LZ_MINMATCH in the low one; 15 means more
+ *			follows, in bytes of 255 and a last one below
+ *	literals
+ *	offset		2 bytes, little-endian, back from the current end
+ *	match length	the rest of it, if the token said 15
+ *
+ * and the last sequence stops after its literals. Matches are found
+ * through a hash table of 4-byte sequences, keeping only the latest
+ * position of each.
+ */
+
+#define LZ_MINMATCH	4
+#define LZ_HASH_LOG	14
+/* No match starts within this many bytes of the end... */
+#define LZ_MFLIMIT	12
+/* ...nor ends within these */
+#define LZ_LASTLITS	5
+
+static uint32_t read32(const unsigned char* p);
+static int put_len(unsigned char** op, const unsigned char* oend, size_t n);
+static int get_len(const unsigned char** ip, const unsigned char* iend, size_t* n);
+static int put_seq(unsigned char** op, const unsigned char* oend,
+		   const unsigned char* lit, size_t nlit, size_t off, size_t mlen);
+
+/* Compresses `len' bytes of `src' into `dst'. Returns the compressed
+ * size, or 0 if it doesn't fit in `cap' bytes: giving a `cap' below
+ * `len' only keeps the outputs that are worth it.
+ */
+size_t lz_compress(const void* src, size_t len, void* dst, size_t cap)
+{
+	const unsigned char* in = src;
+	const unsigned char* ip = in;
+	const unsigned char* anchor = in;	/* first literal not written yet */
+	const unsigned char* end = in + len;
+	unsigned char* op = dst;
+	const unsigned char* oend = op + cap;
+	uint32_t table[1 << LZ_HASH_LOG];
+
+	if (len > UINT32_MAX)
+		return 0;
+	memset(table, 0, sizeof(table));
+
+	if (len > LZ_MFLIMIT) {
+		const unsigned char* limit = end - LZ_MFLIMIT;
+		while (ip < limit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_LOG);
+			const unsigned char* ref = in + table[h];
+			table[h] = (uint32_t)(ip - in);
+
+			if (ref >= ip || ip - ref > LZ_WINDOW || read32(ref) != seq) {
+				/* Move faster through what doesn't match */
+				ip += 1 + ((size_t)(ip - anchor) >> 6);
+				continue;
+			}
+
+			const unsigned char* mp = ip + LZ_MINMATCH;
+			const unsigned char* rp = ref + LZ_MINMATCH;
+			while (mp < end - LZ_LASTLITS && *mp == *rp)
+				mp++, rp++;
+			if (put_seq(&op, oend, anchor, (size_t)(ip - anchor),
+				    (size_t)(ip - ref), (size_t)(mp - ip)) == -1)
+				return 0;
+			ip = anchor = mp;
+		}
+	}
+
+	/* The rest, as literals */
+	size_t nlit = (size_t)(end - anchor);
+	if (op >= oend)
+		return 0;
+	*op++ = (unsigned char)(((nlit < 15) ? nlit : 15) << 4);
+	if (nlit >= 15 && put_len(&op, oend, nlit - 15) == -1)
+		return 0;
+	if (nlit > (size_t)(oend - op))
+		return 0;
+	memcpy(op, anchor, nlit);
+	op += nlit;
+	return (size_t)(op - (unsigned char*)dst);
+}
+
+/* Decompresses the `len' bytes at `src' into `dst'. Returns the size of
+ * the output, or -1 if it's damaged or doesn't fit in `cap' bytes.
+ * Never reads or writes out of either buffer, whatever the input.
+ */
+ssize_t lz_decompress(const void* src, size_t len, void* dst, size_t cap)
+{
+	const unsigned char* ip = src;
+	const unsigned char* iend = ip + len;
+	unsigned char* op = dst;
+	unsigned char* oend = op + cap;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+
+		size_t nlit = token >> 4;
+		if (nlit == 15 && get_len(&ip, iend, &nlit) == -1)
+			return -1;
+		if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		/* The last sequence */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - (unsigned char*)dst))
+			return -1;
+
+		size_t mlen = token & 15;
+		if (mlen == 15 && get_len(&ip, iend, &mlen) == -1)
+			return -1;
+		mlen += LZ_MINMATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+
+		const unsigned char* ref = op - off;
+		if (off >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			/* Overlapping: repeats the last `off' bytes */
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+	return (ssize_t)(op - (unsigned char*)dst);
+}
+
+static uint32_t read32(const unsigned char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Writes what's left of a length past its nibble's 15. Returns 0 on
+ * success, -1 if it doesn't fit.
+ */
+static int put_len(unsigned char** op, const unsigned char* oend, size_t n)
+{
+	unsigned char* p = *op;
+
+	if ((size_t)(oend - p) < n / 255 + 1)
+		return -1;
+	for (; n >= 255; n -= 255)
+		*p++ = 255;
+	*p++ = (unsigned char)n;
+	*op = p;
+	return 0;
+}
+
+/* Adds the bytes after a nibble's 15 to `n'. Returns 0 on success, -1 if
+ * the input ends first.
+ */
+static int get_len(const unsigned char** ip, const unsigned char* iend, size_t* n)
+{
+	const unsigned char* p = *ip;
+	unsigned b;
+
+	do {
+		if (p == iend)
+			return -1;
+		b = *p++;
+		*n += b;
+	} while (b == 255);
+	*ip = p;
+	return 0;
+}
+
+static int put_seq(unsigned char** op, const unsigned char* oend,
+		   const unsigned char* lit, size_t nlit, size_t off, size_t mlen)
+{
+	unsigned char* p = *op;
+	size_t m = mlen - LZ_MINMATCH;
+
+	if (p >= oend)
+		return -1;
+	*p++ = (unsigned char)((((nlit < 15) ? nlit : 15) << 4) | ((m < 15) ? m : 15));
+	if (nlit >= 15 && put_len(&p, oend, nlit - 15) == -1)
+		return -1;
+	if ((size_t)(oend - p) < nlit + 2)
+		return -1;
+	memcpy(p, lit, nlit);
+	p += nlit;
+	*p++ = (unsigned char)(off & 0xff);
+	*p++ = (unsigned char)(off >> 8);
+	if (m >= 15 && put_len(&p, oend, m - 15) == -1)
+		return -1;
+	*op = p;
+	return 0;
+}
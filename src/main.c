@@ -1,70 +1,744 @@
 /* A cp clone: copies files from one place to another */
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE	/* getopt_long */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
+#include "crypt.h"
 #include "fs.h"
 #include "hash.h"
+#include "intr.h"
+#include "stats.h"
 #include "status.h"
 
-status_t listing(int follow, const char* src);
-int list(const void* key, void* val, void* user_data);
+/* Long options without a short one */
+enum {
+	OPT_STATS = 256, OPT_RESUME, OPT_PROBE, OPT_EXCLUDE, OPT_INCLUDE,
+	OPT_EXCLUDE_FROM, OPT_DISK_ORDER, OPT_IO_URING, OPT_VERIFY
+};
+
+/* What the command line asked for */
+struct options {
+	int follow;		/* follow symbolic links */
+	unsigned nthreads;	/* traversal workers */
+	const char* index;	/* file index, NULL for DESTINATION/FIDX_NAME */
+	int store;		/* DESTINATION is a chunk store */
+	int stream;		/* copy while traversing */
+	int archive;		/* DESTINATION is an archive file */
+	int extract;		/* write a member of an archive out */
+	int compress;		/* compress the archive */
+	int probe;		/* skip what looks incompressible */
+	const char* keyfile;	/* encrypt the archive with the key in it */
+	int stats;		/* report what was measured, see stats.h */
+	int stats_json;		/* as JSON */
+	int resume;		/* carry on with what the journal lists */
+	struct filter filter;	/* what the traversal skips */
+	int disk_order;		/* copy files in the order of their data on disk */
+	int uring;		/* copy small files through io_uring */
+	int verify;		/* compare DESTINATION with SOURCE, copy nothing */
+	int verify_xattr;	/* keep checksums in the copies' attributes */
+};
+
+status_t listing(const struct options* o, unsigned need, const char* src,
+		 struct hash_table** files, struct arena* mem, struct dirtree* tree,
+		 struct stream* stream);
+status_t backup(const struct options* o, const char* src, const char* dst);
+status_t backup_stream(const struct options* o, const char* src, const char* dst);
+status_t backup_store(const struct options* o, const char* src, const char* dst);
+status_t backup_archive(const struct options* o, const char* src, const char* dst);
+status_t extract(const char* path, const char* member, const char* keyfile);
+status_t verify(const struct options* o, const char* src, const char* dst);
+static void usage(void);
+static void report(const struct copy_stats* st);
+static status_t close_journal(struct journal* j, status_t ret);
+static char* index_path(const struct options* o, const char* dst, struct fidx* prev);
+static unsigned copy_need(const struct options* o, const struct fidx* prev);
+static status_t read_key(const char* path, unsigned char key[CRYPT_KEYLEN]);
+static int hex_digit(int c);
 
 int main(int argc, char* argv[])
 {
-	if (argc < 3) {
-		fprintf(stderr, "Usage: backup SOURCE DESTINATION\n");
+	struct options o = { .follow = 0, .nthreads = 1, .index = NULL, .store = 0,
+			     .stream = 0, .archive = 0, .extract = 0, .compress = 0,
+			     .probe = 0, .keyfile = NULL, .stats = 0, .stats_json = 0,
+			     .resume = 0 };
+	static const struct option longopts[] = {
+		{ "stats", optional_argument, NULL, OPT_STATS },
+		{ "resume", no_argument, NULL, OPT_RESUME },
+		{ "probe", no_argument, NULL, OPT_PROBE },
+		{ "exclude", required_argument, NULL, OPT_EXCLUDE },
+		{ "include", required_argument, NULL, OPT_INCLUDE },
+		{ "exclude-from", required_argument, NULL, OPT_EXCLUDE_FROM },
+		{ "disk-order", no_argument, NULL, OPT_DISK_ORDER },
+		{ "io-uring", no_argument, NULL, OPT_IO_URING },
+		{ "verify", optional_argument, NULL, OPT_VERIFY },
+		{ NULL, 0, NULL, 0 }
+	};
+	char* end;
+	int opt;
+
+	filter_init(&o.filter);
+	while ((opt = getopt_long(argc, argv, "ai:j:k:psxz", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			o.archive = 1;
+			break;
+		case 'i':
+			o.index = optarg;
+			break;
+		case 'j':
+			errno = 0;
+			unsigned long n = strtoul(optarg, &end, 10);
+			if (errno || *end || n == 0 || n > TRAVERSE_MAX_THREADS) {
+				fprintf(stderr, "backup: -j takes a number between 1 and %d\n",
+					TRAVERSE_MAX_THREADS);
+				return 1;
+			}
+			o.nthreads = (unsigned)n;
+			break;
+		case 'k':
+			o.keyfile = optarg;
+			break;
+		case 'p':
+			o.stream = 1;
+			break;
+		case 's':
+			o.store = 1;
+			break;
+		case 'x':
+			o.extract = 1;
+			break;
+		case 'z':
+			o.compress = 1;
+			break;
+		case OPT_PROBE:
+			o.probe = 1;
+			break;
+		case OPT_STATS:
+			if (optarg && strcmp(optarg, "json") != 0) {
+				fprintf(stderr, "backup: --stats takes no value but json\n");
+				return 1;
+			}
+			o.stats = 1;
+			o.stats_json = (optarg != NULL);
+			break;
+		case OPT_RESUME:
+			o.resume = 1;
+			break;
+		case OPT_EXCLUDE:
+		case OPT_INCLUDE:
+			if (filter_add(&o.filter, optarg, opt == OPT_INCLUDE) == -1) {
+				fprintf(stderr, "backup: bad pattern %s: %s\n", optarg,
+					strerror(errno));
+				return 1;
+			}
+			break;
+		case OPT_DISK_ORDER:
+			o.disk_order = 1;
+			break;
+		case OPT_IO_URING:
+			o.uring = 1;
+			break;
+		case OPT_VERIFY:
+			if (optarg && strcmp(optarg, "xattr") != 0) {
+				fprintf(stderr, "backup: --verify takes no value but xattr\n");
+				return 1;
+			}
+			o.verify = 1;
+			o.verify_xattr = (optarg != NULL);
+			break;
+		case OPT_EXCLUDE_FROM:
+			if (filter_load(&o.filter, optarg) == -1) {
+				fprintf(stderr, "backup: reading rules from %s: %s\n", optarg,
+					strerror(errno));
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	/* One way to write DESTINATION, or to check it; -x with -s reads from
+	 * a chunk store instead of an archive. Only copies keep a journal:
+	 * chunks already stored aren't written twice anyway, and an archive
+	 * is written whole or not at all.
+	 */
+	if (argc - optind < 2 ||
+	    o.store + o.stream + o.archive + o.extract + o.verify > 1 + (o.store && o.extract) ||
+	    ((o.store || o.archive || o.extract || o.verify) && o.resume) ||
+	    (o.compress && !o.archive) || (o.probe && !o.compress) ||
+	    (o.keyfile && ((!o.archive && !o.extract) || o.store)) ||
+	    (o.extract && o.filter.nrules) ||
+	    ((o.disk_order || o.uring) &&
+	     (o.store || o.stream || o.archive || o.extract || o.verify))) {
+		usage();
 		return 1;
 	}
 
-	const char* src = argv[1];
+	const char* src = argv[optind];
+	const char* dst = argv[optind + 1];
+
+	status_t ret;
+	if (o.extract) {
+		ret = (o.store) ? store_extract(src, dst, stdout) : extract(src, dst, o.keyfile);
+		if (ret.c != ST_OK) {
+			sterr(ret);
+			status_free(ret);
+			return -1;
+		}
+		return 0;
+	}
+
+	/* Before any thread starts */
+	if (o.stats)
+		stats_enable();
+	if (intr_catch() == -1)
+		perror("backup: catching signals");
 
-	status_t ret = listing(0, src);
+	if (o.store)
+		ret = backup_store(&o, src, dst);
+	else if (o.archive)
+		ret = backup_archive(&o, src, dst);
+	else if (o.stream)
+		ret = backup_stream(&o, src, dst);
+	else if (o.verify)
+		ret = verify(&o, src, dst);
+	else
+		ret = backup(&o, src, dst);
+	filter_free(&o.filter);
+	if (o.stats) {
+		stats_report(stderr, o.stats_json);
+		stats_free();
+	}
+	if (ret.c == ST_ERR_VERIFY) {
+		/* Every difference was listed already, on the standard output */
+		fflush(stdout);
+		fprintf(stderr, "backup: %s\n", stmsg(ret.c));
+		status_free(ret);
+		return -1;
+	}
 	if (ret.c != ST_OK) {
 		sterr(ret);
+		if (ret.c == ST_ERR_INTR && !o.store && !o.archive && !o.verify)
+			fprintf(stderr, "backup: stopped, run again with --resume to carry on\n");
 		status_free(ret);
 		return -1;
 	}
 	return 0;
 }
 
-status_t listing(int follow, const char* src)
+static void usage(void)
 {
-	struct hash_table* files = hash_create(4099, hash, hcmpent);
-	if (!files)
+	fprintf(stderr, "Usage: backup [-j N] [-i INDEX]"
+		" [[--disk-order] [--io-uring] | -p | -s | -a [-z [--probe]] [-k KEYFILE]]"
+		" [--resume]\n"
+		"              [--stats[=json]] [--exclude PATTERN] [--include PATTERN] [--exclude-from FILE]"
+		" SOURCE DESTINATION\n"
+		"       backup -x [-k KEYFILE] ARCHIVE PATH\n"
+		"       backup -s -x STORE/" STORE_MANIFESTS "/RUN PATH\n"
+		"       backup --verify[=xattr] [-j N] [--stats[=json]] [--exclude PATTERN]"
+		" [--include PATTERN] [--exclude-from FILE] SOURCE DESTINATION\n");
+}
+
+/* Indexes `src' into a newly created `files' table, with the metadata
+ * in `need' (TRAV_NEED_*). Its entries are allocated from `mem', and its
+ * directories added to `tree', which the caller frees either way. On
+ * failure the table is freed, and *files is left untouched.
+ *
+ * With a `stream', entries are queued to it as they're found, and the
+ * table only keeps what travopts.emit says.
+ */
+status_t listing(const struct options* o, unsigned need, const char* src,
+		 struct hash_table** files, struct arena* mem, struct dirtree* tree,
+		 struct stream* stream)
+{
+	struct hash_table* ht = hash_create(4099, sizeof(struct kfile), hash, hcmpent);
+	if (!ht)
 		return STATUS_E(ST_ERR_HASH_CRE, "Creating hash table", NULL);
 
-	int oflags = O_NOFOLLOW; /* flags given to open */
+	struct travopts opts = {
+		.oflags = O_NOFOLLOW,	/* flags given to open */
+		.nthreads = o->nthreads,
+		.need = need,
+		.filter = (o->filter.nrules) ? &o->filter : NULL,
+		/* Copiers run alongside a stream: 4 each for their roots and
+		 * the files they copy, and the directory handles they share
+		 */
+		.reserve = STACK_RESERVE + ((stream) ? 2 * DIRFDS_SIZE + 4 * o->nthreads : 0),
+	};
+	if (stream) {
+		opts.need |= TRAV_NEED_NLINK;
+		opts.emit = stream_emit;
+		opts.emit_arg = stream;
+	}
 
 	/* Don't follow symlinks */
-	if (follow) oflags &= ~O_NOFOLLOW;
+	if (o->follow) opts.oflags &= ~O_NOFOLLOW;
+
+	status_t ret = (o->nthreads > 1) ? ptraverse(src, &ht, mem, tree, &opts)
+					 : traverse(src, &ht, mem, tree, &opts);
+	if (ret.c != ST_OK) {
+		hash_destroy(ht);
+		return ret;
+	}
+
+	*files = ht;
+	return STATUS(ST_OK, 0, "Listing of a directory", NULL);
+}
+
+/* Copies `src' to `dst'. Files the index of the previous run says are
+ * unchanged are skipped, and a new index is written once everything
+ * was copied. Until then, the journal keeps track of what was, for
+ * --resume.
+ */
+status_t backup(const struct options* o, const char* src, const char* dst)
+{
+	struct hash_table* files;
+	struct arena mem;
+	struct dirtree tree;
+	struct fidx prev;
+	struct copier cp;
+	struct journal journal;
+	status_t ret;
+
+	char* index = index_path(o, dst, &prev);
+	if (!index)
+		return STATUS_E(ST_ERR_MALLOC, "Building file path", NULL);
+
+	if (dirtree_init(&tree) == -1) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Creating directory tree", NULL);
+		goto out_close_prev;
+	}
+	arena_init(&mem);
+	ret = listing(o, copy_need(o, &prev), src, &files, &mem, &tree, NULL);
+	if (ret.c != ST_OK)
+		goto out_free_mem;
+
+	ret = copier_init(&cp, &tree, src, dst, o->follow ? 0 : O_NOFOLLOW);
+	if (ret.c != ST_OK)
+		goto out_free_files;
+	if (prev.map)
+		cp.prev = &prev;
+	cp.disk_order = o->disk_order;
+	cp.uring = o->uring;
+	cp.nsplit = o->nthreads;
+	ret = journal_open(&journal, dst, o->resume);
+	if (ret.c != ST_OK)
+		goto out_free_copier;
+	cp.journal = &journal;
+
+	ret = copy_tree(&cp, files);
+	if (ret.c == ST_OK) {
+		report(&cp.stats);
+		ret = fidx_write(index, files, &tree);
+	}
+	ret = close_journal(&journal, ret);
+out_free_copier:
+	copier_free(&cp);
+
+out_free_files:
+	hash_destroy(files);
+out_free_mem:
+	/* Every key, value and name at once */
+	arena_free(&mem);
+	dirtree_free(&tree);
+out_close_prev:
+	fidx_close(&prev);
+	free(index);
+	return ret;
+}
 
-	status_t ret = traverse(src, &files, oflags);
+/* Like backup(), but copies while the traversal goes, see fs/stream.h.
+ * Only directories and files with several links are kept in memory,
+ * which isn't enough to write a new index: the previous one, if any, is
+ * still used to skip unchanged files, and left as it is.
+ */
+status_t backup_stream(const struct options* o, const char* src, const char* dst)
+{
+	struct hash_table* files = NULL;
+	struct arena mem;
+	struct dirtree tree;
+	struct fidx prev;
+	struct stream s;
+	struct copy_stats stats;
+	struct journal journal;
+	status_t ret;
+
+	char* index = index_path(o, dst, &prev);
+	if (!index)
+		return STATUS_E(ST_ERR_MALLOC, "Building file path", NULL);
+
+	if (dirtree_init(&tree) == -1) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Creating directory tree", NULL);
+		goto out_close_prev;
+	}
+	arena_init(&mem);
+	ret = journal_open(&journal, dst, o->resume);
+	if (ret.c != ST_OK)
+		goto out_free_mem;
+
+	ret = stream_start(&s, o->nthreads, &tree, (prev.map) ? &prev : NULL,
+			   &journal, src, dst, o->follow ? 0 : O_NOFOLLOW);
 	if (ret.c != ST_OK) {
-		hash_foreach(files, free_hent, NULL);
+		ret = close_journal(&journal, ret);
+		goto out_free_mem;
+	}
+
+	ret = listing(o, copy_need(o, &prev), src, &files, &mem, &tree, &s);
+	ret = stream_finish(&s, ret, files, &stats);
+	if (ret.c == ST_OK)
+		report(&stats);
+	ret = close_journal(&journal, ret);
+
+	if (files)
 		hash_destroy(files);
+out_free_mem:
+	arena_free(&mem);
+	dirtree_free(&tree);
+out_close_prev:
+	fidx_close(&prev);
+	free(index);
+	return ret;
+}
+
+/* What a copy needs listed: sizes and times, to compare files against
+ * the previous index or the journal being resumed, and to read files
+ * ahead in disk order. Otherwise nothing, so that only directories are
+ * stat'ed: the copy takes what the next index needs from the files it
+ * opens anyway, see copy_entry().
+ */
+static unsigned copy_need(const struct options* o, const struct fidx* prev)
+{
+	if (prev->map || o->resume || o->disk_order)
+		return TRAV_NEED_SIZE | TRAV_NEED_TIMES;
+	return 0;
+}
+
+/* Returns where the file index is, and opens what the previous run left
+ * there into `prev'. Without one, everything is copied.
+ *
+ * Returns NULL if memory ran out.
+ */
+static char* index_path(const struct options* o, const char* dst, struct fidx* prev)
+{
+	char* index = (o->index) ? strdup(o->index) : path_concat(dst, FIDX_NAME);
+	if (!index)
+		return NULL;
+
+	status_t ret = fidx_open(prev, index);
+	if (ret.c != ST_OK) {
+		if (ret.sysc != ENOENT)
+			sterr(ret);
+		status_free(ret);
+	}
+	return index;
+}
+
+static void report(const struct copy_stats* st)
+{
+	printf("Copied %" PRIuMAX " files (%" PRIuMAX " bytes, "
+	       "%" PRIuMAX " in holes skipped), "
+	       "%" PRIuMAX " directories, %" PRIuMAX " symbolic links, "
+	       "%" PRIuMAX " hard links, %" PRIuMAX " unchanged\n",
+	       st->nfiles, st->nbytes, st->nholes, st->ndirs,
+	       st->nsymlinks, st->nlinks, st->nunchanged);
+	if (st->nresumed)
+		printf("Skipped %" PRIuMAX " entries copied before the interruption\n",
+		       st->nresumed);
+}
+
+/* Closes the journal of a run that ended with `ret': it's removed if the
+ * run went through, and kept for --resume otherwise. Returns `ret', or
+ * what went wrong with the journal if nothing else did.
+ */
+static status_t close_journal(struct journal* j, status_t ret)
+{
+	status_t jret = journal_close(j, ret.c == ST_OK);
+	if (ret.c == ST_OK)
+		return jret;
+	if (jret.c != ST_OK) {
+		sterr(jret);
+		status_free(jret);
+	}
+	return ret;
+}
+
+/* Backs `src' up into the chunk store `dst': file contents are cut into
+ * chunks, each stored once, and a manifest of this run's own lists what
+ * every file is made of. `backup -s -x' reads files back from it.
+ */
+status_t backup_store(const struct options* o, const char* src, const char* dst)
+{
+	struct hash_table* files;
+	struct arena mem;
+	struct dirtree tree;
+	struct chunkstore cs;
+	status_t ret;
+
+	if (dirtree_init(&tree) == -1)
+		return STATUS_E(ST_ERR_MALLOC, "Creating directory tree", NULL);
+	arena_init(&mem);
+	/* Modes go to the manifest */
+	ret = listing(o, TRAV_NEED_MODE, src, &files, &mem, &tree, NULL);
+	if (ret.c != ST_OK)
+		goto out_free_mem;
+
+	ret = store_init(&cs, &tree, &mem, src, dst, o->follow ? 0 : O_NOFOLLOW);
+	if (ret.c != ST_OK)
+		goto out_free_files;
+
+	ret = store_tree(&cs, files);
+	if (ret.c == ST_OK)
+		printf("Stored %" PRIuMAX " files (%" PRIuMAX " bytes) in %" PRIuMAX
+		       " chunks, %" PRIuMAX " new (%" PRIuMAX " bytes)\n",
+		       cs.stats.nfiles, cs.stats.nbytes, cs.stats.nchunks,
+		       cs.stats.nstored, cs.stats.nstbytes);
+	if (ret.c == ST_OK)
+		printf("Listed in %s/%s\n", dst, cs.manifest);
+	store_free(&cs);
+
+out_free_files:
+	hash_destroy(files);
+out_free_mem:
+	arena_free(&mem);
+	dirtree_free(&tree);
+	return ret;
+}
+
+/* Writes all of `src' into the single archive file `dst', see
+ * fs/archive.h. It's always written whole: there's no index of the
+ * previous run to skip files with. Compressed or encrypted, it takes as
+ * many threads as the traversal.
+ */
+status_t backup_archive(const struct options* o, const char* src, const char* dst)
+{
+	struct hash_table* files;
+	struct arena mem;
+	struct dirtree tree;
+	struct archiver ar;
+	unsigned char key[CRYPT_KEYLEN];
+	status_t ret;
+
+	if (o->keyfile) {
+		ret = read_key(o->keyfile, key);
+		if (ret.c != ST_OK)
+			return ret;
+	} else {
+		fprintf(stderr, "backup: %s, see -k\n", stmsg(ST_WARN_NO_CRYPT));
+	}
+
+	if (dirtree_init(&tree) == -1) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Creating directory tree", NULL);
+		crypt_wipe(key, sizeof(key));
 		return ret;
 	}
+	arena_init(&mem);
+	/* Modes and times go to the index */
+	ret = listing(o, TRAV_NEED_MODE | TRAV_NEED_TIMES, src, &files, &mem, &tree, NULL);
+	if (ret.c != ST_OK)
+		goto out_free_mem;
+
+	int zflags = ((o->compress) ? ZPIPE_LZ : 0) | ((o->probe) ? ZPIPE_PROBE : 0);
+	ret = archive_init(&ar, &tree, src, dst, o->follow ? 0 : O_NOFOLLOW, o->nthreads,
+			   zflags, (o->keyfile) ? key : NULL);
+	if (ret.c != ST_OK)
+		goto out_free_files;
 
-	size_t n = 0;
-	hash_foreach(files, list, &n);
-	printf("Listed this many files: %zu\n", n);
-	hash_foreach(files, free_hent, NULL);
+	ret = archive_tree(&ar, files);
+	if (ret.c == ST_OK) {
+		printf("Archived %" PRIuMAX " files (%" PRIuMAX " bytes), "
+		       "%" PRIuMAX " directories, %" PRIuMAX " symbolic links, "
+		       "%" PRIuMAX " hard links\n",
+		       ar.stats.nfiles, ar.stats.nbytes, ar.stats.ndirs,
+		       ar.stats.nsymlinks, ar.stats.nlinks);
+		if (o->compress)
+			printf("Compressed to %" PRIuMAX " bytes\n", ar.stats.nzbytes);
+	}
+	archive_free(&ar);
+
+out_free_files:
 	hash_destroy(files);
+out_free_mem:
+	arena_free(&mem);
+	dirtree_free(&tree);
+	crypt_wipe(key, sizeof(key));
+	return ret;
+}
 
-	return STATUS(ST_OK, 0, "Listing of a directory", NULL);
+/* Compares the copy `dst' with `src', hashing as many files at once as
+ * the traversal has threads, see verify_tree(). Fails with
+ * ST_ERR_VERIFY if anything differs, once all of it was listed.
+ */
+status_t verify(const struct options* o, const char* src, const char* dst)
+{
+	struct hash_table* files;
+	struct arena mem;
+	struct dirtree tree;
+	struct verifier v;
+	status_t ret;
+
+	if (dirtree_init(&tree) == -1)
+		return STATUS_E(ST_ERR_MALLOC, "Creating directory tree", NULL);
+	arena_init(&mem);
+	/* Sizes share the files out between threads */
+	ret = listing(o, TRAV_NEED_SIZE, src, &files, &mem, &tree, NULL);
+	if (ret.c != ST_OK)
+		goto out_free_mem;
+
+	ret = verifier_init(&v, &tree, src, dst, o->follow ? 0 : O_NOFOLLOW, o->nthreads,
+			    o->verify_xattr);
+	if (ret.c != ST_OK)
+		goto out_free_files;
+
+	ret = verify_tree(&v, files);
+	if (ret.c == ST_OK) {
+		const struct verify_stats* st = &v.stats;
+		printf("Verified %" PRIuMAX " files (%" PRIuMAX " bytes hashed, "
+		       "%" PRIuMAX " checksums reused), "
+		       "%" PRIuMAX " directories, %" PRIuMAX " symbolic links, "
+		       "%" PRIuMAX " hard links\n",
+		       st->nfiles, st->nbytes, st->nreused, st->ndirs,
+		       st->nsymlinks, st->nlinks);
+		if (st->ndiffer || st->nmissing) {
+			printf("%" PRIuMAX " differ, %" PRIuMAX " missing\n",
+			       st->ndiffer, st->nmissing);
+			ret = STATUS(ST_ERR_VERIFY, 0, "Verifying copy", NULL);
+		}
+	}
+	verifier_free(&v);
+
+out_free_files:
+	hash_destroy(files);
+out_free_mem:
+	arena_free(&mem);
+	dirtree_free(&tree);
+	return ret;
 }
 
-int list(const void* key, void* val, void* user_data)
+/* Writes the data of `member' of the archive at `path' to the standard
+ * output: the contents of a file, the target of a symbolic link. An
+ * encrypted archive needs the key in `keyfile'.
+ */
+status_t extract(const char* path, const char* member, const char* keyfile)
 {
-	const struct kfile* k = key;
-	struct file* f = val;
-	size_t* nfiles = user_data;
-	(*nfiles)++;
-	printf("File name: %s, mode: %o, size: %zu, st_dev: %" PRIuMAX ", st_ino: %" PRIuMAX "\n",
-	       f->path, (f->mode & 0777), f->size, k->st_dev, k->st_ino);
+	unsigned char key[CRYPT_KEYLEN];
+	struct archive a;
+	status_t ret;
 
-	return 0;
+	if (keyfile) {
+		ret = read_key(keyfile, key);
+		if (ret.c != ST_OK)
+			return ret;
+	}
+	ret = archive_open(&a, path, (keyfile) ? key : NULL);
+	crypt_wipe(key, sizeof(key));
+	if (ret.c != ST_OK)
+		return ret;
+
+	const struct arch_rec* r = archive_find(&a, member);
+	if (!r) {
+		ret = STATUS(ST_ERR_OPEN, ENOENT, "Finding archive member", strdup(member));
+		goto out_close;
+	}
+	if (S_ISDIR(r->mode)) {
+		ret = STATUS(ST_ERR_FILERD, EISDIR, "Reading archive member", strdup(member));
+		goto out_close;
+	}
+
+	char* buf = malloc(ARCH_BUFSZ);
+	if (!buf) {
+		ret = STATUS_E(ST_ERR_MALLOC, "Extracting archive member", NULL);
+		goto out_close;
+	}
+	ret = STATUS(ST_OK, 0, "Extracting archive member", NULL);
+	for (uint64_t pos = 0; pos < r->size; ) {
+		ssize_t n = archive_read(&a, r, pos, buf, ARCH_BUFSZ);
+		if (n <= 0) {
+			ret = STATUS_E(ST_ERR_FILERD, "Reading archive member", strdup(member));
+			break;
+		}
+		if (fwrite(buf, 1, (size_t)n, stdout) != (size_t)n) {
+			ret = STATUS_E(ST_ERR_FILEWR, "Writing archive member", strdup(member));
+			break;
+		}
+		pos += (uint64_t)n;
+	}
+	if (ret.c == ST_OK && fflush(stdout) == EOF)
+		ret = STATUS_E(ST_ERR_FILEWR, "Writing archive member", strdup(member));
+	free(buf);
+
+out_close:
+	archive_close(&a);
+	return ret;
+}
+
+/* Reads the key in the file at `path': CRYPT_KEYLEN bytes as they are,
+ * or twice as many hex digits, with maybe a newline after them.
+ */
+static status_t read_key(const char* path, unsigned char key[CRYPT_KEYLEN])
+{
+	unsigned char buf[2 * CRYPT_KEYLEN + 2];
+	size_t len = 0;
+	status_t ret;
+
+	int fd = open(path, O_RDONLY | O_NOCTTY);
+	if (fd < 0)
+		return STATUS_E(ST_ERR_OPEN, "Opening key file", strdup(path));
+	while (len < sizeof(buf)) {
+		ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			ret = STATUS_E(ST_ERR_FILERD, "Reading key file", strdup(path));
+			goto out_close;
+		}
+		if (n == 0)
+			break;
+		len += (size_t)n;
+	}
+
+	ret = STATUS(ST_OK, 0, "Reading key file", NULL);
+	if (len == CRYPT_KEYLEN) {
+		memcpy(key, buf, CRYPT_KEYLEN);
+		goto out_close;
+	}
+	if (len > 0 && buf[len - 1] == '\n')
+		len--;
+	if (len == 2 * CRYPT_KEYLEN) {
+		size_t i;
+		for (i = 0; i < CRYPT_KEYLEN; ++i) {
+			int hi = hex_digit(buf[2 * i]), lo = hex_digit(buf[2 * i + 1]);
+			if (hi < 0 || lo < 0)
+				break;
+			key[i] = (unsigned char)(hi << 4 | lo);
+		}
+		if (i == CRYPT_KEYLEN)
+			goto out_close;
+	}
+	ret = STATUS(ST_ERR_FILERD, EINVAL, "Key file holds no key", strdup(path));
+
+out_close:
+	close(fd);
+	crypt_wipe(buf, sizeof(buf));
+	return ret;
+}
+
+static int hex_digit(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
 }
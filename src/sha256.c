@@ -0,0 +1,201 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "sha256.h"
+
+/* SHA-256, FIPS 180-4. Blocks are hashed with the SHA extensions where
+ * the compiler targets them, which do two rounds an instruction, and one
+ * at a time by portable code elsewhere.
+ */
+
+#if defined(__SHA__) && defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void blocks(uint32_t h[8], const unsigned char* p, size_t n);
+
+void sha256_init(struct sha256* s)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(s->h, iv, sizeof(iv));
+	s->len = 0;
+}
+
+void sha256_update(struct sha256* s, const void* data, size_t len)
+{
+	const unsigned char* p = data;
+	size_t used = (size_t)(s->len % 64);
+
+	s->len += len;
+	if (used) {
+		size_t n = 64 - used;
+		if (n > len) n = len;
+		memcpy(s->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		blocks(s->h, s->buf, 1);
+	}
+	blocks(s->h, p, len / 64);
+	p += len & ~(size_t)63;
+	memcpy(s->buf, p, len % 64);
+}
+
+void sha256_final(struct sha256* s, unsigned char out[SHA256_LEN])
+{
+	uint64_t bits = s->len * 8;
+	size_t used = (size_t)(s->len % 64);
+
+	s->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(s->buf + used, 0, 64 - used);
+		blocks(s->h, s->buf, 1);
+		used = 0;
+	}
+	memset(s->buf + used, 0, 56 - used);
+	for (int i = 0; i < 8; ++i)
+		s->buf[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+	blocks(s->h, s->buf, 1);
+
+	for (int i = 0; i < 8; ++i) {
+		out[4 * i] = (unsigned char)(s->h[i] >> 24);
+		out[4 * i + 1] = (unsigned char)(s->h[i] >> 16);
+		out[4 * i + 2] = (unsigned char)(s->h[i] >> 8);
+		out[4 * i + 3] = (unsigned char)s->h[i];
+	}
+}
+
+/* Hashes `len' bytes at once */
+void sha256(const void* data, size_t len, unsigned char out[SHA256_LEN])
+{
+	struct sha256 s;
+	sha256_init(&s);
+	sha256_update(&s, data, len);
+	sha256_final(&s, out);
+}
+
+#if defined(__SHA__) && defined(__SSE4_1__)
+/* The state is kept as ABEF and CDGH, the order sha256rnds2 takes it
+ * in. Each step does four rounds, two per sha256rnds2, with the words of
+ * `cur', and finishes the schedule of the ones after it: sha256msg1 and
+ * sha256msg2 each do half of the recurrence for four words.
+ */
+#define RNDS(i, cur)							\
+	do {								\
+		msg = _mm_add_epi32(cur, _mm_loadu_si128(		\
+			(const __m128i*)(const void*)&K[4 * (i)]));	\
+		st1 = _mm_sha256rnds2_epu32(st1, st0, msg);		\
+		msg = _mm_shuffle_epi32(msg, 0x0e);			\
+		st0 = _mm_sha256rnds2_epu32(st0, st1, msg);		\
+	} while (0)
+#define MSG1(prev, cur) (prev = _mm_sha256msg1_epu32(prev, cur))
+#define MSG2(cur, next, prev)						\
+	do {								\
+		next = _mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4)); \
+		next = _mm_sha256msg2_epu32(next, cur);			\
+	} while (0)
+#define STEP(i, cur, next, prev)					\
+	do {								\
+		RNDS(i, cur);						\
+		MSG2(cur, next, prev);					\
+		MSG1(prev, cur);					\
+	} while (0)
+
+static void blocks(uint32_t h[8], const unsigned char* p, size_t n)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+	__m128i msg, m0, m1, m2, m3;
+
+	__m128i dcba = _mm_loadu_si128((const __m128i*)(const void*)&h[0]);
+	__m128i hgfe = _mm_loadu_si128((const __m128i*)(const void*)&h[4]);
+	__m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+	__m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+	__m128i st0 = _mm_alignr_epi8(cdab, efgh, 8);		/* ABEF */
+	__m128i st1 = _mm_blend_epi16(efgh, cdab, 0xf0);	/* CDGH */
+
+	for (; n > 0; --n, p += 64) {
+		__m128i abef = st0, cdgh = st1;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(const void*)p), bswap);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(const void*)(p + 16)), bswap);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(const void*)(p + 32)), bswap);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(const void*)(p + 48)), bswap);
+
+		RNDS(0, m0);
+		RNDS(1, m1);
+		MSG1(m0, m1);
+		RNDS(2, m2);
+		MSG1(m1, m2);
+		STEP(3, m3, m0, m2);
+		STEP(4, m0, m1, m3);
+		STEP(5, m1, m2, m0);
+		STEP(6, m2, m3, m1);
+		STEP(7, m3, m0, m2);
+		STEP(8, m0, m1, m3);
+		STEP(9, m1, m2, m0);
+		STEP(10, m2, m3, m1);
+		STEP(11, m3, m0, m2);
+		STEP(12, m0, m1, m3);
+		RNDS(13, m1);
+		MSG2(m1, m2, m0);
+		RNDS(14, m2);
+		MSG2(m2, m3, m1);
+		RNDS(15, m3);
+
+		st0 = _mm_add_epi32(st0, abef);
+		st1 = _mm_add_epi32(st1, cdgh);
+	}
+
+	__m128i feba = _mm_shuffle_epi32(st0, 0x1b);
+	__m128i dchg = _mm_shuffle_epi32(st1, 0xb1);
+	_mm_storeu_si128((__m128i*)(void*)&h[0], _mm_blend_epi16(feba, dchg, 0xf0));
+	_mm_storeu_si128((__m128i*)(void*)&h[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+#else
+static void blocks(uint32_t h[8], const unsigned char* p, size_t n)
+{
+	for (; n > 0; --n, p += 64) {
+		uint32_t w[64];
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+		uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+
+		for (int i = 0; i < 16; ++i)
+			w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+			       (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+		for (int i = 16; i < 64; ++i) {
+			uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		for (int i = 0; i < 64; ++i) {
+			uint32_t t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+				      ((e & f) ^ (~e & g)) + K[i] + w[i];
+			uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+				      ((a & b) ^ (a & c) ^ (b & c));
+			k = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+	}
+}
+#endif
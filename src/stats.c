@@ -0,0 +1,230 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct op_stats {
+	uint64_t count;
+	uint64_t ns;		/* in total */
+	uint64_t max;		/* slowest call, in ns */
+	uint64_t hist[STATS_BUCKETS];
+};
+
+/* What one thread measured. Only that thread writes to it, the report
+ * reads it once every thread was joined.
+ */
+struct stats_thread {
+	struct op_stats ops[STATS_NOPS];
+	uint64_t counters[STATS_NCOUNTERS];
+	struct stats_thread* next;
+};
+
+int stats_on;
+
+static __thread struct stats_thread* mine;
+static struct stats_thread* all;	/* every thread's, newest first */
+static pthread_mutex_t all_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* const op_names[STATS_NOPS] = {
+	"stat", "open", "getdents", "read", "write", "kcopy", "resize"
+};
+static const char* const counter_names[STATS_NCOUNTERS] = {
+	"entries", "bytes_read", "bytes_written", "bytes_kcopied", "skipped"
+};
+
+static struct stats_thread* self(void);
+static unsigned bucket(uint64_t ns);
+static uint64_t percentile(const struct op_stats* o, unsigned pct);
+static void sum(struct stats_thread* total, unsigned* nthreads);
+static void report_human(FILE* out, const struct stats_thread* t, unsigned nthreads);
+static void report_json(FILE* out, const struct stats_thread* t, unsigned nthreads);
+
+void stats_enable(void)
+{
+	stats_on = 1;
+}
+
+/* Nanoseconds on a clock that never goes back */
+uint64_t stats_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Records a call to `op' that started at `start', see stats_clock().
+ * Like stats_add(), leaves errno alone: it's called right after the
+ * system calls it measures.
+ */
+void stats_time(enum stats_op op, uint64_t start)
+{
+	uint64_t ns = stats_clock() - start;
+	struct stats_thread* t = self();
+	if (!t)
+		return;
+
+	struct op_stats* o = &t->ops[op];
+	o->count++;
+	o->ns += ns;
+	if (ns > o->max) o->max = ns;
+	o->hist[bucket(ns)]++;
+}
+
+void stats_add(enum stats_counter c, uint64_t n)
+{
+	struct stats_thread* t = self();
+	if (t)
+		t->counters[c] += n;
+}
+
+/* Adds up what every thread measured, and writes it to `out', as JSON
+ * or for humans. Call it once no thread measures anymore.
+ */
+void stats_report(FILE* out, int json)
+{
+	struct stats_thread total = { 0 };
+	unsigned nthreads;
+
+	sum(&total, &nthreads);
+	if (json)
+		report_json(out, &total, nthreads);
+	else
+		report_human(out, &total, nthreads);
+}
+
+void stats_free(void)
+{
+	pthread_mutex_lock(&all_lock);
+	while (all) {
+		struct stats_thread* next = all->next;
+		free(all);
+		all = next;
+	}
+	pthread_mutex_unlock(&all_lock);
+	mine = NULL;
+}
+
+/* This thread's measures, allocated on first use. Measures are dropped
+ * if that fails.
+ */
+static struct stats_thread* self(void)
+{
+	if (mine)
+		return mine;
+
+	int err = errno;
+	mine = calloc(1, sizeof(struct stats_thread));
+	errno = err;
+	if (!mine)
+		return NULL;
+	pthread_mutex_lock(&all_lock);
+	mine->next = all;
+	all = mine;
+	pthread_mutex_unlock(&all_lock);
+	return mine;
+}
+
+/* The first bucket `ns' is below the bound of */
+static unsigned bucket(uint64_t ns)
+{
+	unsigned b = 0;
+	while (b < STATS_BUCKETS - 1 && (ns >> b))
+		b++;
+	return b;
+}
+
+/* The `pct'th percentile, in ns. Bucket b holds [2^(b-1), 2^b), so the
+ * value is interpolated within its bucket, as if times were spread evenly
+ * there, and never goes past the slowest time seen.
+ */
+static uint64_t percentile(const struct op_stats* o, unsigned pct)
+{
+	uint64_t want = (o->count * pct + 99) / 100, seen = 0;
+
+	for (unsigned b = 0; b < STATS_BUCKETS; ++b) {
+		if (!o->hist[b] || seen + o->hist[b] < want) {
+			seen += o->hist[b];
+			continue;
+		}
+		uint64_t lo = (b) ? (uint64_t)1 << (b - 1) : 0;
+		uint64_t hi = (uint64_t)1 << b;
+		if (hi > o->max)
+			hi = o->max;
+		if (hi <= lo)
+			return hi;
+		return lo + (uint64_t)((double)(hi - lo) * (double)(want - seen) /
+				       (double)o->hist[b]);
+	}
+	return 0;
+}
+
+static void sum(struct stats_thread* total, unsigned* nthreads)
+{
+	*nthreads = 0;
+	pthread_mutex_lock(&all_lock);
+	for (const struct stats_thread* t = all; t; t = t->next) {
+		for (unsigned i = 0; i < STATS_NOPS; ++i) {
+			const struct op_stats* o = &t->ops[i];
+			struct op_stats* to = &total->ops[i];
+			to->count += o->count;
+			to->ns += o->ns;
+			if (o->max > to->max) to->max = o->max;
+			for (unsigned b = 0; b < STATS_BUCKETS; ++b)
+				to->hist[b] += o->hist[b];
+		}
+		for (unsigned i = 0; i < STATS_NCOUNTERS; ++i)
+			total->counters[i] += t->counters[i];
+		(*nthreads)++;
+	}
+	pthread_mutex_unlock(&all_lock);
+}
+
+static void report_human(FILE* out, const struct stats_thread* t, unsigned nthreads)
+{
+	fprintf(out, "%-10s %10s %12s %10s %10s %10s %10s\n", "operation", "calls",
+		"total ms", "mean us", "p50 us", "p99 us", "max us");
+	for (unsigned i = 0; i < STATS_NOPS; ++i) {
+		const struct op_stats* o = &t->ops[i];
+		if (!o->count)
+			continue;
+		fprintf(out, "%-10s %10" PRIu64 " %12.3f %10.2f %10.2f %10.2f %10.2f\n",
+			op_names[i], o->count, (double)o->ns / 1e6,
+			(double)o->ns / 1e3 / (double)o->count,
+			(double)percentile(o, 50) / 1e3,
+			(double)percentile(o, 99) / 1e3, (double)o->max / 1e3);
+	}
+	for (unsigned i = 0; i < STATS_NCOUNTERS; ++i)
+		fprintf(out, "%s: %" PRIu64 "\n", counter_names[i], t->counters[i]);
+	fprintf(out, "threads: %u\n", nthreads);
+}
+
+static void report_json(FILE* out, const struct stats_thread* t, unsigned nthreads)
+{
+	fprintf(out, "{\"threads\": %u, \"counters\": {", nthreads);
+	for (unsigned i = 0; i < STATS_NCOUNTERS; ++i)
+		fprintf(out, "%s\"%s\": %" PRIu64, (i) ? ", " : "",
+			counter_names[i], t->counters[i]);
+	fprintf(out, "}, \"ops\": {");
+	for (unsigned i = 0; i < STATS_NOPS; ++i) {
+		const struct op_stats* o = &t->ops[i];
+		fprintf(out, "%s\"%s\": {\"calls\": %" PRIu64 ", \"total_ns\": %" PRIu64
+			", \"max_ns\": %" PRIu64 ", \"p50_ns\": %" PRIu64
+			", \"p99_ns\": %" PRIu64 ", \"histogram\": [",
+			(i) ? ", " : "", op_names[i], o->count, o->ns, o->max,
+			percentile(o, 50), percentile(o, 99));
+		/* Trailing empty buckets say nothing */
+		unsigned n = STATS_BUCKETS;
+		while (n > 0 && !o->hist[n - 1]) n--;
+		for (unsigned b = 0; b < n; ++b)
+			fprintf(out, "%s%" PRIu64, (b) ? ", " : "", o->hist[b]);
+		fprintf(out, "]}");
+	}
+	fprintf(out, "}}\n");
+}
@@ -16,6 +16,14 @@ const char* stmsg(stcode_t c)
 	case ST_ERR_HASH_UPS: return "Couldn't resize the hash table";
 	case ST_ERR_FILERD: return "Failed to read file or directory";
 	case ST_ERR_FILERD_MD: return "Couldn't read file metadata";
+	case ST_ERR_MKDIR: return "Couldn't create directory";
+	case ST_ERR_FILEWR: return "Failed to write file";
+	case ST_ERR_COPY: return "Failed to copy file data";
+	case ST_ERR_THREAD: return "Couldn't start a thread";
+	case ST_ERR_INDEX: return "Unusable file index";
+	case ST_ERR_JOURNAL: return "Couldn't read or write the journal";
+	case ST_ERR_INTR: return "Interrupted";
+	case ST_ERR_VERIFY: return "Copy differs from its source";
 	default: return "Unknown status";
 	}
 }
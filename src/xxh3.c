@@ -0,0 +1,363 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "xxh3.h"
+
+/* XXH3, 64-bit, with no seed and the default secret: the output is the
+ * one of XXH3_64bits() in the reference xxHash, from 0.8.0 on.
+ *
+ * Inputs of up to 240 bytes go through a few multiplications. Longer
+ * ones are cut into 64-byte stripes, each mixed into eight accumulators
+ * with the secret at an offset that moves 8 bytes a stripe, and blocks
+ * of 16 stripes end with a scramble of the accumulators. The very last
+ * stripe is always the last 64 bytes of the input, and never counts as
+ * part of a block: xxh3_update() holds back what could be it.
+ *
+ * The stripe loop is written three times, for AVX2, SSE2, and none.
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define STRIPE 64
+#define SECRET_LEN 192
+#define BLOCK_STRIPES ((SECRET_LEN - STRIPE) / 8)	/* 16 */
+#define SHORT_MAX 240
+
+static const unsigned char secret[SECRET_LEN] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static uint64_t short_hash(const unsigned char* p, size_t len);
+static uint64_t mid_hash(const unsigned char* p, size_t len);
+static void stripe(uint64_t acc[8], const unsigned char* p, const unsigned char* key);
+static void scramble(uint64_t acc[8], const unsigned char* key);
+static void consume(struct xxh3* s, uint64_t acc[8], const unsigned char* p);
+static uint64_t mix16(const unsigned char* p, const unsigned char* key);
+static uint64_t fold64(uint64_t a, uint64_t b);
+static uint64_t avalanche(uint64_t h);
+static uint64_t avalanche64(uint64_t h);
+static uint64_t rrmxmx(uint64_t h, uint64_t len);
+static uint64_t rd64(const unsigned char* p);
+static uint32_t rd32(const unsigned char* p);
+
+void xxh3_init(struct xxh3* s)
+{
+	static const uint64_t iv[8] = {
+		PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+		PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1,
+	};
+	memcpy(s->acc, iv, sizeof(iv));
+	s->len = 0;
+	s->nstripes = 0;
+	s->nbuf = 0;
+}
+
+/* The buffer starts with the last 64 bytes consumed, followed by the
+ * `nbuf' pending ones: at the end, the last stripe is read across both.
+ * Nothing is consumed until more than XXH3_BUFLEN bytes came, so short
+ * inputs are still whole in the buffer.
+ */
+void xxh3_update(struct xxh3* s, const void* data, size_t len)
+{
+	const unsigned char* p = data;
+	unsigned char* pend = s->buf + STRIPE;
+
+	s->len += len;
+	if (s->nbuf + len <= XXH3_BUFLEN) {
+		memcpy(pend + s->nbuf, p, len);
+		s->nbuf += (unsigned)len;
+		return;
+	}
+
+	/* More follows the buffer, so all of it goes */
+	if (s->nbuf) {
+		size_t n = XXH3_BUFLEN - s->nbuf;
+		memcpy(pend + s->nbuf, p, n);
+		p += n;
+		len -= n;
+		for (unsigned i = 0; i < XXH3_BUFLEN; i += STRIPE)
+			consume(s, s->acc, pend + i);
+		memcpy(s->buf, pend + XXH3_BUFLEN - STRIPE, STRIPE);
+		s->nbuf = 0;
+	}
+	if (len > STRIPE) {
+		for (; len > STRIPE; p += STRIPE, len -= STRIPE)
+			consume(s, s->acc, p);
+		memcpy(s->buf, p - STRIPE, STRIPE);
+	}
+	memcpy(pend, p, len);
+	s->nbuf = (unsigned)len;
+}
+
+/* The hash of what went through xxh3_update(). `s' is left as it is. */
+uint64_t xxh3_final(const struct xxh3* s)
+{
+	const unsigned char* pend = s->buf + STRIPE;
+
+	if (s->len <= SHORT_MAX)
+		return short_hash(pend, (size_t)s->len);
+
+	struct xxh3 t;
+	t.nstripes = s->nstripes;
+	memcpy(t.acc, s->acc, sizeof(t.acc));
+	unsigned n = s->nbuf;
+	for (; n > STRIPE; pend += STRIPE, n -= STRIPE)
+		consume(&t, t.acc, pend);
+	stripe(t.acc, pend + n - STRIPE, secret + SECRET_LEN - STRIPE - 7);
+
+	uint64_t h = s->len * PRIME64_1;
+	for (int i = 0; i < 4; ++i)
+		h += fold64(t.acc[2 * i] ^ rd64(secret + 11 + 16 * i),
+			    t.acc[2 * i + 1] ^ rd64(secret + 11 + 16 * i + 8));
+	return avalanche(h);
+}
+
+/* Hashes `len' bytes at once */
+uint64_t xxh3(const void* data, size_t len)
+{
+	struct xxh3 s;
+
+	if (len <= SHORT_MAX)
+		return short_hash(data, len);
+	xxh3_init(&s);
+	xxh3_update(&s, data, len);
+	return xxh3_final(&s);
+}
+
+static uint64_t short_hash(const unsigned char* p, size_t len)
+{
+	if (len > 128)
+		return mid_hash(p, len);
+
+	if (len > 16) {
+		uint64_t acc = len * PRIME64_1;
+		if (len > 32) {
+			if (len > 64) {
+				if (len > 96) {
+					acc += mix16(p + 48, secret + 96);
+					acc += mix16(p + len - 64, secret + 112);
+				}
+				acc += mix16(p + 32, secret + 64);
+				acc += mix16(p + len - 48, secret + 80);
+			}
+			acc += mix16(p + 16, secret + 32);
+			acc += mix16(p + len - 32, secret + 48);
+		}
+		acc += mix16(p, secret);
+		acc += mix16(p + len - 16, secret + 16);
+		return avalanche(acc);
+	}
+	if (len > 8) {
+		uint64_t lo = rd64(p) ^ (rd64(secret + 24) ^ rd64(secret + 32));
+		uint64_t hi = rd64(p + len - 8) ^ (rd64(secret + 40) ^ rd64(secret + 48));
+		uint64_t swapped = (lo >> 56) | ((lo >> 40) & 0xff00) | ((lo >> 24) & 0xff0000) |
+				   ((lo >> 8) & 0xff000000) | ((lo & 0xff000000) << 8) |
+				   ((lo & 0xff0000) << 24) | ((lo & 0xff00) << 40) | (lo << 56);
+		return avalanche(len + swapped + hi + fold64(lo, hi));
+	}
+	if (len >= 4) {
+		uint64_t v = rd32(p + len - 4) + ((uint64_t)rd32(p) << 32);
+		return rrmxmx(v ^ (rd64(secret + 8) ^ rd64(secret + 16)), len);
+	}
+	if (len > 0) {
+		uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[len >> 1] << 24 |
+			     (uint32_t)p[len - 1] | (uint32_t)len << 8;
+		return avalanche64(v ^ (uint64_t)(rd32(secret) ^ rd32(secret + 4)));
+	}
+	return avalanche64(rd64(secret + 56) ^ rd64(secret + 64));
+}
+
+/* 129 to 240 bytes: 16 at a time, the last 16 on their own */
+static uint64_t mid_hash(const unsigned char* p, size_t len)
+{
+	uint64_t acc = len * PRIME64_1;
+	unsigned n = (unsigned)len / 16;
+
+	for (unsigned i = 0; i < 8; ++i)
+		acc += mix16(p + 16 * i, secret + 16 * i);
+	acc = avalanche(acc);
+
+	uint64_t end = mix16(p + len - 16, secret + 136 - 17);
+	for (unsigned i = 8; i < n; ++i)
+		end += mix16(p + 16 * i, secret + 16 * (i - 8) + 3);
+	return avalanche(acc + end);
+}
+
+/* Mixes a stripe that isn't the last into `acc', and scrambles it at the
+ * end of a block. `acc' is the one of `s', or a copy for xxh3_final().
+ */
+static void consume(struct xxh3* s, uint64_t acc[8], const unsigned char* p)
+{
+	stripe(acc, p, secret + 8 * s->nstripes);
+	if (++s->nstripes == BLOCK_STRIPES) {
+		scramble(acc, secret + SECRET_LEN - STRIPE);
+		s->nstripes = 0;
+	}
+}
+
+#if defined(__AVX2__)
+static void stripe(uint64_t acc[8], const unsigned char* p, const unsigned char* key)
+{
+	for (int i = 0; i < 2; ++i) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(const void*)(acc + 4 * i));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(const void*)(p + 32 * i));
+		__m256i k = _mm256_loadu_si256((const __m256i*)(const void*)(key + 32 * i));
+		__m256i dk = _mm256_xor_si256(d, k);
+		__m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+		/* Each lane gets the data of its neighbour */
+		__m256i swap = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+		a = _mm256_add_epi64(prod, _mm256_add_epi64(a, swap));
+		_mm256_storeu_si256((__m256i*)(void*)(acc + 4 * i), a);
+	}
+}
+
+static void scramble(uint64_t acc[8], const unsigned char* key)
+{
+	const __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+
+	for (int i = 0; i < 2; ++i) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(const void*)(acc + 4 * i));
+		__m256i k = _mm256_loadu_si256((const __m256i*)(const void*)(key + 32 * i));
+		a = _mm256_xor_si256(_mm256_xor_si256(a, _mm256_srli_epi64(a, 47)), k);
+		__m256i hi = _mm256_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1));
+		__m256i lo_prod = _mm256_mul_epu32(a, prime);
+		__m256i hi_prod = _mm256_mul_epu32(hi, prime);
+		a = _mm256_add_epi64(lo_prod, _mm256_slli_epi64(hi_prod, 32));
+		_mm256_storeu_si256((__m256i*)(void*)(acc + 4 * i), a);
+	}
+}
+#elif defined(__SSE2__)
+static void stripe(uint64_t acc[8], const unsigned char* p, const unsigned char* key)
+{
+	for (int i = 0; i < 4; ++i) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(const void*)(acc + 2 * i));
+		__m128i d = _mm_loadu_si128((const __m128i*)(const void*)(p + 16 * i));
+		__m128i k = _mm_loadu_si128((const __m128i*)(const void*)(key + 16 * i));
+		__m128i dk = _mm_xor_si128(d, k);
+		__m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+		__m128i swap = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+		a = _mm_add_epi64(prod, _mm_add_epi64(a, swap));
+		_mm_storeu_si128((__m128i*)(void*)(acc + 2 * i), a);
+	}
+}
+
+static void scramble(uint64_t acc[8], const unsigned char* key)
+{
+	const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+
+	for (int i = 0; i < 4; ++i) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(const void*)(acc + 2 * i));
+		__m128i k = _mm_loadu_si128((const __m128i*)(const void*)(key + 16 * i));
+		a = _mm_xor_si128(_mm_xor_si128(a, _mm_srli_epi64(a, 47)), k);
+		__m128i hi = _mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1));
+		__m128i lo_prod = _mm_mul_epu32(a, prime);
+		__m128i hi_prod = _mm_mul_epu32(hi, prime);
+		a = _mm_add_epi64(lo_prod, _mm_slli_epi64(hi_prod, 32));
+		_mm_storeu_si128((__m128i*)(void*)(acc + 2 * i), a);
+	}
+}
+#else
+static void stripe(uint64_t acc[8], const unsigned char* p, const unsigned char* key)
+{
+	for (int i = 0; i < 8; ++i) {
+		uint64_t d = rd64(p + 8 * i);
+		uint64_t dk = d ^ rd64(key + 8 * i);
+		acc[i ^ 1] += d;
+		acc[i] += (dk & 0xffffffff) * (dk >> 32);
+	}
+}
+
+static void scramble(uint64_t acc[8], const unsigned char* key)
+{
+	for (int i = 0; i < 8; ++i) {
+		uint64_t a = acc[i];
+		a ^= a >> 47;
+		a ^= rd64(key + 8 * i);
+		acc[i] = a * PRIME32_1;
+	}
+}
+#endif
+
+static uint64_t mix16(const unsigned char* p, const unsigned char* key)
+{
+	return fold64(rd64(p) ^ rd64(key), rd64(p + 8) ^ rd64(key + 8));
+}
+
+/* The 128-bit product of `a' and `b', its halves xored together */
+static uint64_t fold64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__extension__ unsigned __int128 r = (unsigned __int128)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	uint64_t al = a & 0xffffffff, ah = a >> 32, bl = b & 0xffffffff, bh = b >> 32;
+	uint64_t ll = al * bl, hl = ah * bl, lh = al * bh, hh = ah * bh;
+	uint64_t cross = (ll >> 32) + (hl & 0xffffffff) + lh;
+	uint64_t hi = (hl >> 32) + (cross >> 32) + hh;
+	uint64_t lo = (cross << 32) | (ll & 0xffffffff);
+	return lo ^ hi;
+#endif
+}
+
+static uint64_t avalanche(uint64_t h)
+{
+	h ^= h >> 37;
+	h *= PRIME_MX1;
+	return h ^ (h >> 32);
+}
+
+/* The one of XXH64 */
+static uint64_t avalanche64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	return h ^ (h >> 32);
+}
+
+static uint64_t rrmxmx(uint64_t h, uint64_t len)
+{
+	h ^= ((h << 49) | (h >> 15)) ^ ((h << 24) | (h >> 40));
+	h *= PRIME_MX2;
+	h ^= (h >> 35) + len;
+	h *= PRIME_MX2;
+	return h ^ (h >> 28);
+}
+
+static uint64_t rd64(const unsigned char* p)
+{
+	return (uint64_t)rd32(p) | (uint64_t)rd32(p + 4) << 32;
+}
+
+static uint32_t rd32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	       (uint32_t)p[3] << 24;
+}
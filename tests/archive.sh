@@ -0,0 +1,43 @@
+#!/bin/sh
+# Every member comes back out of an archive, one whose path is longer
+# than PATH_MAX too, compressed or not.
+#
+# Usage: archive.sh BACKUP
+
+backup=${1:-bin/backup}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir "$tmp/src"
+echo top > "$tmp/src/top"
+
+# 25 levels of 200-byte names, built one at a time since the whole path
+# is too long for mkdir
+name=$(printf 'd%.0s' $(seq 1 200))
+deep=""
+(
+	cd "$tmp/src" || exit 1
+	for i in $(seq 1 25); do
+		mkdir "$name" && cd -P "$name" || exit 1
+	done
+	echo deep > file
+	ln file other
+) || exit 1
+for i in $(seq 1 25); do
+	deep="$deep$name/"
+done
+
+for z in "" -z; do
+	"$backup" -a $z "$tmp/src" "$tmp/arc" > /dev/null 2>&1 || exit 1
+	for member in top "${deep}file" "${deep}other"; do
+		case $member in
+		top)	want=top ;;
+		*)	want=deep ;;
+		esac
+		if [ "$("$backup" -x "$tmp/arc" "$member")" != "$want" ]; then
+			echo "archive.sh: $member came back wrong with '$z'" >&2
+			exit 1
+		fi
+	done
+	rm -f "$tmp/arc"
+done
@@ -0,0 +1,123 @@
+/* Known answers for ChaCha20, the ChaCha20-Poly1305 AEAD (RFC 8439,
+ * 2.3.2 and 2.8.2), and HChaCha20 (draft-irtf-cfrg-xchacha, 2.2.1), and
+ * a long key stream against the same blocks taken one at a time
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crypt.h"
+
+/* Several chunks of blocks, and some, see chacha20() */
+#define LONG_LEN (3 * 512 + 5 * 64 + 7)
+
+static int hex(const char* s, unsigned char* out, size_t len);
+static int same(const char* what, const unsigned char* got, const char* want);
+
+/* RFC 8439, 2.3.2: the block for counter 1 */
+static const char block_want[] =
+	"10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+	"d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e";
+
+/* RFC 8439, 2.8.2 */
+static const char aead_pt[] =
+	"Ladies and Gentlemen of the class of '99: If I could offer you only "
+	"one tip for the future, sunscreen would be it.";
+static const char aead_ct[] =
+	"d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+	"3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+	"92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+	"3ff4def08e4b7a9de576d26586cec64b6116";
+static const char aead_tag[] = "1ae10b594f09e26a7e902ecbd0600691";
+
+/* draft-irtf-cfrg-xchacha, 2.2.1 */
+static const char hchacha_want[] =
+	"82413b4227b27bfed30e42508a877d73a0f9e4d58a74a853c12ec41326d3ecdc";
+
+int main(void)
+{
+	unsigned char key[CRYPT_KEYLEN];
+	unsigned char nonce[CRYPT_NONCELEN];
+	unsigned char salt[CRYPT_SALTLEN];
+	unsigned char sub[CRYPT_KEYLEN];
+	unsigned char ad[12];
+	unsigned char buf[sizeof(aead_pt) - 1];
+	unsigned char tag[CRYPT_TAGLEN];
+	unsigned char block[64] = { 0 };
+	unsigned char stream[LONG_LEN] = { 0 };
+	unsigned char one[LONG_LEN] = { 0 };
+	int fails = 0;
+
+	for (unsigned i = 0; i < CRYPT_KEYLEN; ++i)
+		key[i] = (unsigned char)i;
+	hex("000000090000004a00000000", nonce, sizeof(nonce));
+	chacha20(key, nonce, 1, block, block, sizeof(block));
+	fails += !same("ChaCha20 block", block, block_want);
+
+	/* Every block in its place, the counter wrapping on the way */
+	chacha20(key, nonce, UINT32_MAX - 9, stream, stream, sizeof(stream));
+	for (size_t off = 0; off < sizeof(one); off += 64) {
+		size_t n = (sizeof(one) - off < 64) ? sizeof(one) - off : 64;
+		chacha20(key, nonce, (uint32_t)(UINT32_MAX - 9 + off / 64), one + off, one + off, n);
+	}
+	if (memcmp(stream, one, sizeof(stream))) {
+		fprintf(stderr, "crypt: long key stream differs from its blocks\n");
+		fails++;
+	}
+
+	hex("000000090000004a0000000031415927", salt, sizeof(salt));
+	crypt_subkey(key, salt, sub);
+	fails += !same("HChaCha20", sub, hchacha_want);
+
+	for (unsigned i = 0; i < CRYPT_KEYLEN; ++i)
+		key[i] = (unsigned char)(0x80 + i);
+	hex("070000004041424344454647", nonce, sizeof(nonce));
+	hex("50515253c0c1c2c3c4c5c6c7", ad, sizeof(ad));
+	memcpy(buf, aead_pt, sizeof(buf));
+	crypt_seal(key, nonce, buf, sizeof(buf), ad, sizeof(ad), tag);
+	fails += !same("AEAD ciphertext", buf, aead_ct);
+	fails += !same("AEAD tag", tag, aead_tag);
+
+	if (crypt_open(key, nonce, buf, sizeof(buf), ad, sizeof(ad), tag) == -1 ||
+	    memcmp(buf, aead_pt, sizeof(buf))) {
+		fprintf(stderr, "crypt: AEAD doesn't open its own output\n");
+		fails++;
+	}
+	crypt_seal(key, nonce, buf, sizeof(buf), ad, sizeof(ad), tag);
+	buf[sizeof(buf) / 2] ^= 1;
+	if (crypt_open(key, nonce, buf, sizeof(buf), ad, sizeof(ad), tag) != -1) {
+		fprintf(stderr, "crypt: AEAD opens a damaged message\n");
+		fails++;
+	}
+	return fails != 0;
+}
+
+/* Parses `len' bytes' worth of hex digits */
+static int hex(const char* s, unsigned char* out, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		unsigned v;
+		if (sscanf(s + 2 * i, "%2x", &v) != 1)
+			return -1;
+		out[i] = (unsigned char)v;
+	}
+	return 0;
+}
+
+/* Says what differs, if anything */
+static int same(const char* what, const unsigned char* got, const char* want)
+{
+	unsigned char w[128];
+	size_t len = strlen(want) / 2;
+
+	hex(want, w, len);
+	if (!memcmp(got, w, len))
+		return 1;
+	fprintf(stderr, "crypt: %s: got ", what);
+	for (size_t i = 0; i < len; ++i)
+		fprintf(stderr, "%02x", got[i]);
+	fprintf(stderr, "\n");
+	return 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Anchored rules, more than the 32 steps a word of live steps held, each
+# skip their own directory and nothing else, with one thread or several.
+#
+# Usage: filter.sh BACKUP
+
+backup=${1:-bin/backup}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+for i in $(seq 1 40); do
+	mkdir -p "$tmp/src/web$i/node_modules/x" "$tmp/src/web$i/keep"
+	echo skip > "$tmp/src/web$i/node_modules/x/file"
+	echo keep > "$tmp/src/web$i/keep/file"
+	echo "/web$i/node_modules/" >> "$tmp/exclude"
+done
+mkdir -p "$tmp/src/a/b/node_modules"
+echo skip > "$tmp/src/a/b/node_modules/file"
+echo "/a/**/node_modules/" >> "$tmp/exclude"
+
+for jobs in 1 4; do
+	rm -rf "$tmp/dst"
+	"$backup" -j $jobs --exclude-from "$tmp/exclude" "$tmp/src" "$tmp/dst" \
+		> /dev/null || exit 1
+	if [ -n "$(find "$tmp/dst" -name node_modules)" ]; then
+		echo "filter.sh: -j $jobs copied a node_modules" >&2
+		exit 1
+	fi
+	if [ "$(find "$tmp/dst" -name file | wc -l)" -ne 40 ]; then
+		echo "filter.sh: -j $jobs skipped a kept file" >&2
+		exit 1
+	fi
+done
@@ -0,0 +1,34 @@
+#!/bin/sh
+# An extra name of a hard-linked file, deleted from the copy, comes back
+# with the next run: the file isn't taken for unchanged without it.
+#
+# Usage: links.sh BACKUP
+
+backup=${1:-bin/backup}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir -p "$tmp/src/a" "$tmp/src/b"
+echo data > "$tmp/src/a/file"
+ln "$tmp/src/a/file" "$tmp/src/a/rand"
+ln "$tmp/src/a/file" "$tmp/src/b/other"
+
+"$backup" "$tmp/src" "$tmp/dst" > /dev/null || exit 1
+rm "$tmp/dst/a/rand"
+"$backup" "$tmp/src" "$tmp/dst" > /dev/null || exit 1
+
+for name in a/rand b/other; do
+	if [ ! "$tmp/dst/$name" -ef "$tmp/dst/a/file" ]; then
+		echo "links.sh: $name isn't a link to a/file" >&2
+		exit 1
+	fi
+done
+
+# Whichever name a run with several threads finds first, the file is
+# unchanged
+for run in 1 2 3; do
+	if ! "$backup" -j 4 "$tmp/src" "$tmp/dst" | grep -q '^Copied 0 files'; then
+		echo "links.sh: an unchanged file was copied again by -j 4" >&2
+		exit 1
+	fi
+done
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Every file stored comes back out of the store, one whose path is longer
+# than PATH_MAX too.
+#
+# Usage: store.sh BACKUP
+
+backup=${1:-bin/backup}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir "$tmp/src"
+echo top > "$tmp/src/top"
+ln -s top "$tmp/src/link"
+
+# 25 levels of 200-byte names, built one at a time since the whole path
+# is too long for mkdir
+name=$(printf 'd%.0s' $(seq 1 200))
+deep=""
+(
+	cd "$tmp/src" || exit 1
+	for i in $(seq 1 25); do
+		mkdir "$name" && cd -P "$name" || exit 1
+	done
+	echo deep > file
+) || exit 1
+for i in $(seq 1 25); do
+	deep="$deep$name/"
+done
+
+"$backup" -s "$tmp/src" "$tmp/store" > /dev/null || exit 1
+run=$(ls "$tmp/store/manifests")
+
+if [ "$(grep -c '^[dfl] ' "$tmp/store/manifests/$run")" -ne 28 ]; then
+	echo "store.sh: the manifest misses entries" >&2
+	exit 1
+fi
+for member in top link "${deep}file"; do
+	"$backup" -s -x "$tmp/store/manifests/$run" "$member" > "$tmp/out" || exit 1
+	case $member in
+	top)	want=top ;;
+	link)	want=top ;;
+	*)	want=deep ;;
+	esac
+	if [ "$(cat "$tmp/out")" != "$want" ]; then
+		echo "store.sh: $member came back wrong" >&2
+		exit 1
+	fi
+done
@@ -0,0 +1,44 @@
+#!/bin/sh
+# A copy is verified entry by entry, one whose path is longer than
+# PATH_MAX too: what's missing deep down is listed, and the rest still
+# compared.
+#
+# Usage: verify.sh BACKUP
+
+backup=${1:-bin/backup}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# 25 levels of 200-byte names, built one at a time since the whole path
+# is too long for mkdir
+mkdir "$tmp/src"
+echo top > "$tmp/src/top"
+name=$(printf 'd%.0s' $(seq 1 200))
+(
+	cd "$tmp/src" || exit 1
+	for i in $(seq 1 25); do
+		mkdir "$name" && cd -P "$name" || exit 1
+	done
+	echo deep > file
+	ln -s file link
+) || exit 1
+
+"$backup" "$tmp/src" "$tmp/dst" > /dev/null || exit 1
+if ! "$backup" --verify -j 4 "$tmp/src" "$tmp/dst" > "$tmp/out"; then
+	echo "verify.sh: an intact copy didn't verify" >&2
+	exit 1
+fi
+
+(
+	cd "$tmp/dst" || exit 1
+	for i in $(seq 1 24); do
+		cd -P "$name" || exit 1
+	done
+	rm -r "$name"
+) || exit 1
+"$backup" --verify -j 4 "$tmp/src" "$tmp/dst" > "$tmp/out" 2> /dev/null
+if [ $? -eq 0 ] || [ "$(grep -c '^Missing: ' "$tmp/out")" -ne 3 ] ||
+   ! grep -q '^Verified 1 files' "$tmp/out"; then
+	echo "verify.sh: the deepest directory wasn't found missing" >&2
+	exit 1
+fi
@@ -0,0 +1,26 @@
+#!/bin/sh
+# A byte flipped in a compressed archive's member data fails extraction,
+# even with no key to authenticate it.
+#
+# Usage: zsum.sh BACKUP
+
+backup=${1:-bin/backup}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir "$tmp/src"
+seq 1 100000 > "$tmp/src/file"
+
+"$backup" -a -z "$tmp/src" "$tmp/arc" > /dev/null 2>&1 || exit 1
+"$backup" -x "$tmp/arc" file 2> /dev/null | cmp -s - "$tmp/src/file" || {
+	echo "zsum.sh: file doesn't extract intact" >&2
+	exit 1
+}
+
+b=$(dd if="$tmp/arc" bs=1 skip=1000 count=1 2> /dev/null | od -An -tu1 | tr -d ' ')
+printf "\\$(printf %o $((b ^ 1)))" |
+	dd of="$tmp/arc" bs=1 seek=1000 count=1 conv=notrunc 2> /dev/null
+if "$backup" -x "$tmp/arc" file > /dev/null 2>&1; then
+	echo "zsum.sh: a damaged block extracted" >&2
+	exit 1
+fi